@@ -37,51 +37,232 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
-
 /*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
+ * The table is split into stripes by the low bits of the hash, at least as
+ * many as there are item locks, so one item lock covers all of a stripe.
+ * Each stripe says which table its buckets are in and how big that table
+ * is. A lookup, holding the item lock, reads its stripe and then one
+ * bucket of one table.
+ *
+ * To resize, the maintenance thread makes the new table, then one stripe at
+ * a time takes its item lock, moves the stripe's items across and points
+ * the stripe at the new table. Nobody waits longer than one stripe's move,
+ * and once every stripe has moved nobody can be looking at the old table,
+ * so it can go.
+ *
+ * assoc_prefetch_item() reads a bucket without the item lock. seq is odd
+ * while a stripe is being pointed at a new table, so it can tell a torn
+ * read of table and power, and the old table is only freed once no
+ * item_prefetch() could still be reading it.
  */
-static item** old_hashtable = 0;
-
-/* Flag: Are we in the middle of expanding now? */
-static bool expanding = false;
+#define STRIPE_POWER_MAX 15
+struct assoc_stripe {
+    void *table;            /* item ** or, with hash_buckets, assoc_bucket * */
+    unsigned int power;
+    unsigned int seq;       /* bumped before and after table and power change */
+};
+static struct assoc_stripe *stripes = NULL;
+static unsigned int stripe_power;
+
+/* the table every stripe is in, except while resizing */
+static void *table = NULL;
+static void *table_mem = NULL;      /* what to free() it with */
+
+/* Flag: has the maintenance thread been asked to resize? */
 static bool started_expanding = false;
+/* and to what power */
+static unsigned int resize_power;
+
+/* never shrink below the size we started at */
+static unsigned int hashpower_min;
+/* Shrink once there have been fewer than an eighth of the items that would
+ * make us grow for this many seconds running. Far enough from the growing
+ * point, and for long enough, that a table doesn't flap about at the edge
+ * or drop its size between two bursts of sets. */
+#define SHRINK_DELAY 10
+static unsigned int shrink_wait = 0;
 
 /*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * -o hash_buckets: instead of a pointer per bucket leading to a chain of
+ * items, each bucket is a cache line holding up to BUCKET_SLOTS item
+ * pointers, each with an 8 bit tag from the key's hash. A lookup compares
+ * all the tags at once and only goes to items whose tag matches, so it
+ * usually touches one line of the table and the one item it wants. Items
+ * that don't fit are chained off the bucket through h_next as before.
+ *
+ * A bucket never lends slots to its neighbours: everything for a key stays
+ * in the bucket hv picks, so the item lock for hv still covers it, and
+ * resizing can move a stripe's buckets without touching any others.
  */
-static unsigned int expand_bucket = 0;
+#define BUCKET_SLOTS 6
+/* expand when there are this many items per bucket */
+#define BUCKET_LOAD 5
+
+typedef struct {
+    uint8_t tags[8];            /* 0 is empty; the last two are never used */
+    item *slots[BUCKET_SLOTS];
+    item *overflow;             /* h_next chain of the ones that didn't fit */
+} assoc_bucket;
+
+#define BUCKET_TAG(hv) ((uint8_t)((hv) >> 24) ? (uint8_t)((hv) >> 24) : 1)
+
+#define TABLE_ENTRY_SIZE \
+    (settings.hash_buckets ? sizeof(assoc_bucket) : sizeof(item *))
+
+/* A zeroed table of 2^power buckets, lined up with cache lines. */
+static void *table_alloc(const unsigned int power, void **mem) {
+    char *p = calloc(hashsize(power) + 1, TABLE_ENTRY_SIZE);
+    *mem = p;
+    if (p == NULL || !settings.hash_buckets)
+        return p;
+    return (void *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+}
+
+static inline struct assoc_stripe *stripe_for(const uint32_t hv) {
+    return &stripes[hv & hashmask(stripe_power)];
+}
+
+static inline item **chain_for(const uint32_t hv) {
+    struct assoc_stripe *s = stripe_for(hv);
+    return &((item **)s->table)[hv & hashmask(s->power)];
+}
+
+static inline assoc_bucket *bucket_for(const uint32_t hv) {
+    struct assoc_stripe *s = stripe_for(hv);
+    return &((assoc_bucket *)s->table)[hv & hashmask(s->power)];
+}
+
+/* Bitmask with bit 8*i+7 set for each slot i whose tag may be tag: all the
+ * real matches, and occasionally a slot past one, which the key check
+ * sorts out. */
+static inline uint64_t bucket_match(const assoc_bucket *b, const uint8_t tag) {
+#ifdef ENDIAN_LITTLE
+    uint64_t w, x;
+    memcpy(&w, b->tags, sizeof(w));
+    x = w ^ (0x0101010101010101ULL * tag);
+    return (x - 0x0101010101010101ULL) & ~x & 0x0000808080808080ULL;
+#else
+    uint64_t m = 0;
+    int i;
+    for (i = 0; i < BUCKET_SLOTS; i++) {
+        if (b->tags[i] == tag)
+            m |= 0x80ULL << (i * 8);
+    }
+    return m;
+#endif
+}
+
+static item *bucket_find(const char *key, const size_t nkey, const uint32_t hv) {
+    assoc_bucket *b = bucket_for(hv);
+    uint64_t m = bucket_match(b, BUCKET_TAG(hv));
+    item *it;
+    int depth = 0;
+
+    while (m) {
+        int i = __builtin_ctzll(m) / 8;
+        it = b->slots[i];
+        if (b->tags[i] != 0 && nkey == it->nkey &&
+                memcmp(key, ITEM_key(it), nkey) == 0) {
+            MEMCACHED_ASSOC_FIND(key, nkey, depth);
+            return it;
+        }
+        m &= m - 1;
+    }
+    for (it = b->overflow; it != NULL; it = it->h_next) {
+        ++depth;
+        if (nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0)
+            break;
+    }
+    MEMCACHED_ASSOC_FIND(key, nkey, depth);
+    return it;
+}
+
+static void bucket_insert(assoc_bucket *b, item *it, const uint32_t hv) {
+    int i;
+
+    for (i = 0; i < BUCKET_SLOTS; i++) {
+        if (b->tags[i] == 0) {
+            b->slots[i] = it;
+            b->tags[i] = BUCKET_TAG(hv);
+            return;
+        }
+    }
+    it->h_next = b->overflow;
+    b->overflow = it;
+}
+
+static void bucket_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    assoc_bucket *b = bucket_for(hv);
+    uint64_t m = bucket_match(b, BUCKET_TAG(hv));
+    item **pos;
+
+    while (m) {
+        int i = __builtin_ctzll(m) / 8;
+        item *it = b->slots[i];
+        if (b->tags[i] != 0 && nkey == it->nkey &&
+                memcmp(key, ITEM_key(it), nkey) == 0) {
+            MEMCACHED_ASSOC_DELETE(key, nkey);
+            /* pull one off the chain into the free slot */
+            if ((it = b->overflow) != NULL) {
+                b->overflow = it->h_next;
+                it->h_next = 0;
+                b->slots[i] = it;
+                b->tags[i] = BUCKET_TAG(hash(ITEM_key(it), it->nkey));
+            } else {
+                b->slots[i] = NULL;
+                b->tags[i] = 0;
+            }
+            return;
+        }
+        m &= m - 1;
+    }
+    for (pos = &b->overflow; *pos; pos = &(*pos)->h_next) {
+        if (nkey == (*pos)->nkey && memcmp(key, ITEM_key(*pos), nkey) == 0) {
+            item *nxt = (*pos)->h_next;
+            MEMCACHED_ASSOC_DELETE(key, nkey);
+            (*pos)->h_next = 0;
+            *pos = nxt;
+            return;
+        }
+    }
+    /* as below, callers don't delete things they can't find */
+    assert(0);
+}
 
 void assoc_init(const int hashtable_init) {
+    unsigned int i;
+
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
+    hashpower_min = hashpower;
+    /* never more stripes than the smallest the table can be, which is
+     * still more than the item locks */
+    stripe_power = hashpower < STRIPE_POWER_MAX ? hashpower : STRIPE_POWER_MAX;
+    stripes = calloc(hashsize(stripe_power), sizeof(struct assoc_stripe));
+    table = table_alloc(hashpower, &table_mem);
+    if (! table || ! stripes) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
+    for (i = 0; i < hashsize(stripe_power); i++) {
+        stripes[i].table = table;
+        stripes[i].power = hashpower;
+    }
     STATS_LOCK();
     stats_state.hash_power_level = hashpower;
-    stats_state.hash_bytes = hashsize(hashpower) * sizeof(void *);
+    stats_state.hash_bytes = hashsize(hashpower) * TABLE_ENTRY_SIZE +
+        hashsize(stripe_power) * sizeof(struct assoc_stripe);
     STATS_UNLOCK();
 }
 
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
-    unsigned int oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
-    }
+    if (settings.hash_buckets)
+        return bucket_find(key, nkey, hv);
+
+    it = *chain_for(hv);
 
     item *ret = NULL;
     int depth = 0;
@@ -97,20 +278,52 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+/* Starts pulling in the bucket hv falls in, for a lookup that's coming
+ * shortly. Takes no lock: a resize can change the stripe under us, but it's
+ * only read to make an address, and prefetching a stale one is harmless. */
+void assoc_prefetch(const uint32_t hv) {
+    struct assoc_stripe *s = stripe_for(hv);
+    char *t = s->table;
 
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    unsigned int oldbucket;
+    __builtin_prefetch(t + (hv & hashmask(s->power)) * TABLE_ENTRY_SIZE);
+}
+
+/* Starts pulling in the first item hv's bucket has for it, which a lookup
+ * will compare keys with. Takes no lock, so it must be called from
+ * item_prefetch(), which keeps the table from being freed under us. The
+ * bucket may be changing as we read it, but the item is only prefetched,
+ * never looked at, so a stale pointer does no harm. */
+void assoc_prefetch_item(const uint32_t hv) {
+    struct assoc_stripe *s = stripe_for(hv);
+    unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    char *t;
+    ub4 b;
+    item *it;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
+    if (seq & 1)
+        return;
+    t = __atomic_load_n(&s->table, __ATOMIC_RELAXED);
+    b = hv & hashmask(__atomic_load_n(&s->power, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+        return;
+
+    if (settings.hash_buckets) {
+        assoc_bucket *bk = (assoc_bucket *)t + b;
+        uint64_t m = bucket_match(bk, BUCKET_TAG(hv));
+        it = m ? bk->slots[__builtin_ctzll(m) / 8] : bk->overflow;
     } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
+        it = ((item **)t)[b];
     }
+    if (it != NULL)
+        __builtin_prefetch(it);
+}
+
+/* returns the address of the item pointer before the key.  if *item == 0,
+   the item wasn't found */
+
+static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
+    item **pos = chain_for(hv);
 
     while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
         pos = &(*pos)->h_next;
@@ -118,53 +331,153 @@ static item** _hashitem_before (const char *key, const size_t nkey, const uint32
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
-
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
-        if (settings.verbose > 1)
-            fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
-        expanding = true;
-        expand_bucket = 0;
-        STATS_LOCK();
-        stats_state.hash_power_level = hashpower;
-        stats_state.hash_bytes += hashsize(hashpower) * sizeof(void *);
-        stats_state.hash_is_expanding = true;
-        STATS_UNLOCK();
-    } else {
-        primary_hashtable = old_hashtable;
+/* Moves stripe s's items into new_table, of 2^power buckets. The caller
+ * holds the stripe's item lock. */
+static void stripe_move(const unsigned int s, void *new_table,
+                        const unsigned int power) {
+    struct assoc_stripe *st = &stripes[s];
+    ub4 b;
+
+    for (b = s; b < hashsize(st->power); b += hashsize(stripe_power)) {
+        item *it, *next;
+        uint32_t hv;
+        if (settings.hash_buckets) {
+            assoc_bucket *ob = &((assoc_bucket *)st->table)[b];
+            int i;
+            for (i = 0; i < BUCKET_SLOTS; i++) {
+                if (ob->tags[i] == 0)
+                    continue;
+                it = ob->slots[i];
+                hv = hash(ITEM_key(it), it->nkey);
+                bucket_insert(&((assoc_bucket *)new_table)[hv & hashmask(power)],
+                              it, hv);
+            }
+            for (it = ob->overflow; it != NULL; it = next) {
+                next = it->h_next;
+                hv = hash(ITEM_key(it), it->nkey);
+                bucket_insert(&((assoc_bucket *)new_table)[hv & hashmask(power)],
+                              it, hv);
+            }
+        } else {
+            for (it = ((item **)st->table)[b]; it != NULL; it = next) {
+                item **nb;
+                next = it->h_next;
+                hv = hash(ITEM_key(it), it->nkey);
+                nb = &((item **)new_table)[hv & hashmask(power)];
+                it->h_next = *nb;
+                *nb = it;
+            }
+        }
+    }
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&st->table, new_table, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->power, power, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+static volatile int do_run_maintenance_thread = 1;
+
+/* Moves every stripe into a new table of 2^power buckets. Returns false if
+ * it couldn't be had, or we were stopped partway (leaving the stripes
+ * split across both tables, which is fine for lookups). */
+static bool assoc_resize(const unsigned int power) {
+    void *new_mem;
+    void *new_table = table_alloc(power, &new_mem);
+    unsigned int s;
+
+    if (new_table == NULL) {
         /* Bad news, but we can keep running. */
+        return false;
+    }
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table resize to %u starting\n", power);
+    STATS_LOCK();
+    stats_state.hash_power_level = power;
+    stats_state.hash_bytes += hashsize(power) * TABLE_ENTRY_SIZE;
+    stats_state.hash_is_expanding = true;
+    STATS_UNLOCK();
+
+    for (s = 0; s < hashsize(stripe_power); s++) {
+        if (!do_run_maintenance_thread)
+            return false;
+        /* the stripe's buckets all share the low bits of s, and the item
+         * locks use fewer low bits than that */
+        item_lock(s);
+        stripe_move(s, new_table, power);
+        item_unlock(s);
+    }
+
+    item_prefetch_wait();
+    free(table_mem);
+    STATS_LOCK();
+    stats_state.hash_bytes -= hashsize(hashpower) * TABLE_ENTRY_SIZE;
+    stats_state.hash_is_expanding = false;
+    if (power < hashpower) {
+        stats.hash_bytes_reclaimed +=
+            (hashsize(hashpower) - hashsize(power)) * TABLE_ENTRY_SIZE;
     }
+    STATS_UNLOCK();
+    table = new_table;
+    table_mem = new_mem;
+    hashpower = power;
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table resize done\n");
+    return true;
+}
+
+/* How many items 2^power buckets hold before we grow them. */
+static uint64_t grow_at(const unsigned int power) {
+    return settings.hash_buckets ? (uint64_t)hashsize(power) * BUCKET_LOAD
+        : ((uint64_t)hashsize(power) * 3) / 2;
 }
 
-void assoc_start_expand(uint64_t curr_items) {
+/* Called every second from the clock. Asks the maintenance thread to grow
+ * the table if it's too full, or shrink it if it's been nearly empty for a
+ * while. Shrinking goes straight to the smallest size that is no more than
+ * half full, so a table that grew for a backfill gives its memory back in
+ * one pass once the items are gone. Never waits on the maintenance thread. */
+void assoc_start_resize(uint64_t curr_items) {
+    unsigned int power = hashpower;
+
     if (started_expanding)
         return;
 
-    if (curr_items > (hashsize(hashpower) * 3) / 2 &&
-          hashpower < HASHPOWER_MAX) {
-        started_expanding = true;
-        pthread_cond_signal(&maintenance_cond);
+    if (curr_items > grow_at(hashpower)) {
+        shrink_wait = 0;
+        if (hashpower >= HASHPOWER_MAX)
+            return;
+        power = hashpower + 1;
+    } else if (settings.hash_shrink && hashpower > hashpower_min &&
+               curr_items < grow_at(hashpower) / 8) {
+        if (++shrink_wait < SHRINK_DELAY)
+            return;
+        while (power > hashpower_min && curr_items < grow_at(power - 1) / 2)
+            power--;
+    } else {
+        shrink_wait = 0;
+        return;
     }
+
+    if (pthread_mutex_trylock(&maintenance_lock) != 0)
+        return;
+    shrink_wait = 0;
+    resize_power = power;
+    started_expanding = true;
+    pthread_cond_signal(&maintenance_cond);
+    mutex_unlock(&maintenance_lock);
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
-    unsigned int oldbucket;
-
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
+    if (settings.hash_buckets) {
+        bucket_insert(bucket_for(hv), it, hv);
     } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
+        item **chain = chain_for(hv);
+        it->h_next = *chain;
+        *chain = it;
     }
 
     MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey);
@@ -172,7 +485,13 @@ int assoc_insert(item *it, const uint32_t hv) {
 }
 
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
-    item **before = _hashitem_before(key, nkey, hv);
+    item **before;
+
+    if (settings.hash_buckets) {
+        bucket_delete(key, nkey, hv);
+        return;
+    }
+    before = _hashitem_before(key, nkey, hv);
 
     if (*before) {
         item *nxt;
@@ -190,76 +509,79 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
     assert(*before != 0);
 }
 
+/* "stats hash": how full the table is, and how many buckets have how many
+ * items in them. Walks the whole table a stripe at a time, holding each
+ * stripe's item lock while it counts, so it costs a good deal on a big
+ * table. */
+#define CHAIN_HIST 32
+void assoc_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+    uint64_t hist[CHAIN_HIST] = {0};
+    uint64_t buckets = 0, items = 0;
+    unsigned int max_chain = 0;
+    unsigned int s, i;
+
+    for (s = 0; s < hashsize(stripe_power); s++) {
+        struct assoc_stripe *st = &stripes[s];
+        ub4 b;
+        item_lock(s);
+        for (b = s; b < hashsize(st->power); b += hashsize(stripe_power)) {
+            unsigned int len = 0;
+            item *it;
+            if (settings.hash_buckets) {
+                assoc_bucket *ab = &((assoc_bucket *)st->table)[b];
+                for (i = 0; i < BUCKET_SLOTS; i++) {
+                    if (ab->tags[i] != 0)
+                        len++;
+                }
+                it = ab->overflow;
+            } else {
+                it = ((item **)st->table)[b];
+            }
+            for (; it != NULL; it = it->h_next)
+                len++;
+            hist[len < CHAIN_HIST ? len : CHAIN_HIST - 1]++;
+            if (len > max_chain)
+                max_chain = len;
+            items += len;
+            buckets++;
+        }
+        item_unlock(s);
+    }
 
-static volatile int do_run_maintenance_thread = 1;
-
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+    APPEND_STAT("buckets", "%llu", (unsigned long long)buckets);
+    APPEND_STAT("items", "%llu", (unsigned long long)items);
+    APPEND_STAT("load_factor", "%.2f", (double)items / buckets);
+    APPEND_STAT("max_chain", "%u", max_chain);
+    for (i = 0; i < CHAIN_HIST; i++) {
+        if (hist[i] == 0)
+            continue;
+        klen = snprintf(key_str, STAT_KEY_LEN,
+                        i < CHAIN_HIST - 1 ? "chain_%u" : "chain_%u+", i);
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%llu",
+                        (unsigned long long)hist[i]);
+        add_stats(key_str, klen, val_str, vlen, c);
+    }
+}
 
 static void *assoc_maintenance_thread(void *arg) {
 
     mutex_lock(&maintenance_lock);
     while (do_run_maintenance_thread) {
-        int ii = 0;
-
-        /* There is only one expansion thread, so no need to global lock. */
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            unsigned int bucket;
-            void *item_lock = NULL;
-
-            /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
-             * is the lowest N bits of the hv, and the bucket of item_locks is
-             *  also the lowest M bits of hv, and N is greater than M.
-             *  So we can process expanding with only one item_lock. cool! */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
-                    }
-
-                    old_hashtable[expand_bucket] = NULL;
-
-                    expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
-                        expanding = false;
-                        free(old_hashtable);
-                        STATS_LOCK();
-                        stats_state.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                        stats_state.hash_is_expanding = false;
-                        STATS_UNLOCK();
-                        if (settings.verbose > 1)
-                            fprintf(stderr, "Hash table expansion done\n");
-                    }
-
-            } else {
-                usleep(10*1000);
-            }
-
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
-            }
-        }
-
-        if (!expanding) {
-            /* We are done expanding.. just wait for next invocation */
-            started_expanding = false;
-            pthread_cond_wait(&maintenance_cond, &maintenance_lock);
-            /* assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold any references related to the hash
-             * table while this happens.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times.
-             */
-            pause_threads(PAUSE_ALL_THREADS);
-            assoc_expand();
-            pause_threads(RESUME_ALL_THREADS);
-        }
+        /* We are done resizing.. just wait for next invocation */
+        started_expanding = false;
+        pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+        if (!do_run_maintenance_thread)
+            break;
+        /* Workers carry on throughout; see assoc_resize(). Let go of the
+         * lock so stop_assoc_maintenance_thread() can cut it short. */
+        mutex_unlock(&maintenance_lock);
+        assoc_resize(resize_power);
+        mutex_lock(&maintenance_lock);
     }
+    mutex_unlock(&maintenance_lock);
     return NULL;
 }
 
@@ -267,13 +589,6 @@ static pthread_t maintenance_tid;
 
 int start_assoc_maintenance_thread() {
     int ret;
-    char *env = getenv("MEMCACHED_HASH_BULK_MOVE");
-    if (env != NULL) {
-        hash_bulk_move = atoi(env);
-        if (hash_bulk_move == 0) {
-            hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
-        }
-    }
     pthread_mutex_init(&maintenance_lock, NULL);
     if ((ret = pthread_create(&maintenance_tid, NULL,
                               assoc_maintenance_thread, NULL)) != 0) {
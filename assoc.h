@@ -1,11 +1,14 @@
 /* associative array */
 void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+void assoc_prefetch(const uint32_t hv);
+void assoc_prefetch_item(const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
 void do_assoc_move_next_bucket(void);
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
-void assoc_start_expand(uint64_t curr_items);
+void assoc_start_resize(uint64_t curr_items);
+void assoc_stats(ADD_STAT add_stats, void *c);
 extern unsigned int hashpower;
 extern unsigned int item_lock_hashpower;
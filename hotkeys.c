@@ -0,0 +1,434 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * -o hotkeys: which keys are being fetched the most, right now.
+ *
+ * Each worker counts the keys its gets ask for with a Space-Saving summary:
+ * a fixed number of counters, and a key that has none takes over the one
+ * with the lowest count, starting from that count plus one. Any key fetched
+ * more often than 1/size of the time is sure to hold a counter, and counts
+ * are never under the truth. Workers keep HOTKEYS_SLACK times as many
+ * counters as keys asked for, so the top of the list is rarely overcounted.
+ * The counters sit in a min-heap so the one to take over is always at the
+ * top, and a small hash table finds a key's.
+ *
+ * Every window a background thread takes each worker's counts, resetting
+ * them, adds up the ones for the same key and keeps the top of the list for
+ * "stats hotkeys". Workers only ever trylock their own summary, so a get
+ * never waits on the merge; one that arrives during it isn't counted.
+ *
+ * With -o hotkeys_cache the merge also publishes a bitmap of the top keys'
+ * hashes, and a worker that fetches a key in it keeps a reference to the
+ * item, and a copy of it in memory of its own, for a second or so. Later
+ * gets of the key on that worker are answered from the copy, skipping the
+ * item lock and the hash chain, and the references they take are on the
+ * copy's cache line, which no other worker writes. The stored item is only
+ * read, to check it is still linked, so a set, delete or eviction is seen
+ * at once; holding it also stops anyone changing it in place, since incr
+ * and append only do that to an item no one else holds.
+ */
+#include "memcached.h"
+#include "hotkeys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct hotkey {
+    uint32_t hv;
+    uint8_t nkey;
+    uint64_t count;
+    uint64_t bytes;
+    char key[KEY_MAX_LENGTH + 1];
+};
+
+struct hotkeys {
+    pthread_mutex_t lock;
+    struct hotkeys *next;   /* all workers', for the merge */
+    int size;
+    int used;
+    uint64_t gets;          /* every get counted, tracked or not */
+    struct hotkey *slots;
+    int *heap;              /* slot numbers, lowest count first */
+    int *pos;               /* where each slot is in heap */
+    int *index;             /* hv -> slot, linear probing, -1 if empty */
+    unsigned int mask;
+    /* the worker's hot items, by hv; touched only by the worker itself */
+    struct {
+        item *it;           /* the stored item, which we hold a reference to */
+        item *copy;         /* what gets are answered with */
+        uint32_t hv;
+        rel_time_t until;
+    } cache[HOTCACHE_SIZE];
+};
+
+static struct hotkeys *hotkeys_all = NULL;
+static pthread_mutex_t hotkeys_all_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the last window's top keys, busiest first */
+static struct hotkey *top = NULL;
+static int ntop = 0;
+static uint64_t top_gets = 0;
+static pthread_mutex_t top_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t hotkeys_tid;
+
+/* hashes of the last window's top keys, read by workers without a lock */
+static uint64_t hot_bits[HOTKEYS_BITS / 64];
+#define HOT_BIT(hv) ((hv) & (HOTKEYS_BITS - 1))
+
+struct hotkeys *hotkeys_new(int size) {
+    struct hotkeys *hk = calloc(1, sizeof(*hk));
+    unsigned int isize = 1;
+
+    if (hk == NULL)
+        return NULL;
+    size *= HOTKEYS_SLACK;
+    while (isize < (unsigned int)size * 2)
+        isize <<= 1;
+    hk->size = size;
+    hk->mask = isize - 1;
+    hk->slots = calloc(size, sizeof(struct hotkey));
+    hk->heap = calloc(size, sizeof(int));
+    hk->pos = calloc(size, sizeof(int));
+    hk->index = malloc(isize * sizeof(int));
+    if (hk->slots == NULL || hk->heap == NULL || hk->pos == NULL ||
+            hk->index == NULL) {
+        free(hk->slots);
+        free(hk->heap);
+        free(hk->pos);
+        free(hk->index);
+        free(hk);
+        return NULL;
+    }
+    memset(hk->index, -1, isize * sizeof(int));
+    pthread_mutex_init(&hk->lock, NULL);
+
+    pthread_mutex_lock(&hotkeys_all_lock);
+    hk->next = hotkeys_all;
+    hotkeys_all = hk;
+    pthread_mutex_unlock(&hotkeys_all_lock);
+    return hk;
+}
+
+static inline void heap_swap(struct hotkeys *hk, const int a, const int b) {
+    int t = hk->heap[a];
+    hk->heap[a] = hk->heap[b];
+    hk->heap[b] = t;
+    hk->pos[hk->heap[a]] = a;
+    hk->pos[hk->heap[b]] = b;
+}
+
+#define HEAP_COUNT(hk, i) ((hk)->slots[(hk)->heap[i]].count)
+
+static void heap_down(struct hotkeys *hk, int i) {
+    for (;;) {
+        int l = i * 2 + 1, r = l + 1, min = i;
+        if (l < hk->used && HEAP_COUNT(hk, l) < HEAP_COUNT(hk, min))
+            min = l;
+        if (r < hk->used && HEAP_COUNT(hk, r) < HEAP_COUNT(hk, min))
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(hk, i, min);
+        i = min;
+    }
+}
+
+static void heap_up(struct hotkeys *hk, int i) {
+    while (i > 0 && HEAP_COUNT(hk, i) < HEAP_COUNT(hk, (i - 1) / 2)) {
+        heap_swap(hk, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void index_insert(struct hotkeys *hk, const int s) {
+    unsigned int i = hk->slots[s].hv & hk->mask;
+    while (hk->index[i] != -1)
+        i = (i + 1) & hk->mask;
+    hk->index[i] = s;
+}
+
+/* Takes slot s out of the index, shifting back the entries after it that
+ * would otherwise no longer be found. */
+static void index_delete(struct hotkeys *hk, const int s) {
+    unsigned int i = hk->slots[s].hv & hk->mask, j, k;
+    while (hk->index[i] != s)
+        i = (i + 1) & hk->mask;
+    for (j = i;;) {
+        j = (j + 1) & hk->mask;
+        if (hk->index[j] == -1)
+            break;
+        k = hk->slots[hk->index[j]].hv & hk->mask;
+        /* move it if its home isn't cyclically in (i, j] */
+        if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            hk->index[i] = hk->index[j];
+            i = j;
+        }
+    }
+    hk->index[i] = -1;
+}
+
+void hotkeys_record(struct hotkeys *hk, const char *key, const size_t nkey,
+                    const uint32_t hv, const int bytes) {
+    unsigned int i;
+    struct hotkey *h;
+    int s;
+
+    if (pthread_mutex_trylock(&hk->lock) != 0)
+        return;
+    hk->gets++;
+    for (i = hv & hk->mask; (s = hk->index[i]) != -1; i = (i + 1) & hk->mask) {
+        h = &hk->slots[s];
+        if (h->hv == hv && h->nkey == nkey && memcmp(h->key, key, nkey) == 0) {
+            h->count++;
+            h->bytes += bytes;
+            heap_down(hk, hk->pos[s]);
+            pthread_mutex_unlock(&hk->lock);
+            return;
+        }
+    }
+
+    if (hk->used < hk->size) {
+        s = hk->used++;
+        h = &hk->slots[s];
+        h->count = 1;
+        hk->heap[hk->used - 1] = s;
+        hk->pos[s] = hk->used - 1;
+    } else {
+        /* take over the least counted key's slot */
+        s = hk->heap[0];
+        h = &hk->slots[s];
+        index_delete(hk, s);
+        h->count++;
+    }
+    h->hv = hv;
+    h->nkey = nkey;
+    memcpy(h->key, key, nkey);
+    h->key[nkey] = '\0';
+    h->bytes = bytes;
+    index_insert(hk, s);
+    if (h->count == 1) {
+        heap_up(hk, hk->pos[s]);
+    } else {
+        heap_down(hk, hk->pos[s]);
+    }
+    pthread_mutex_unlock(&hk->lock);
+}
+
+static int hotkey_cmp_key(const void *a, const void *b) {
+    const struct hotkey *x = a, *y = b;
+    if (x->hv != y->hv)
+        return x->hv < y->hv ? -1 : 1;
+    if (x->nkey != y->nkey)
+        return x->nkey - y->nkey;
+    return memcmp(x->key, y->key, x->nkey);
+}
+
+static int hotkey_cmp_count(const void *a, const void *b) {
+    const struct hotkey *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return 0;
+}
+
+/* Gathers and resets every worker's counts, and makes the new top list. */
+static void hotkeys_merge(struct hotkey *all, const int nall) {
+    struct hotkeys *hk;
+    uint64_t gets = 0;
+    int n = 0, i, j;
+
+    pthread_mutex_lock(&hotkeys_all_lock);
+    for (hk = hotkeys_all; hk != NULL; hk = hk->next) {
+        pthread_mutex_lock(&hk->lock);
+        for (i = 0; i < hk->used && n < nall; i++) {
+            all[n++] = hk->slots[i];
+        }
+        gets += hk->gets;
+        hk->gets = 0;
+        hk->used = 0;
+        memset(hk->index, -1, (hk->mask + 1) * sizeof(int));
+        pthread_mutex_unlock(&hk->lock);
+    }
+    pthread_mutex_unlock(&hotkeys_all_lock);
+
+    /* the same key may be hot on several workers */
+    qsort(all, n, sizeof(struct hotkey), hotkey_cmp_key);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && hotkey_cmp_key(&all[j - 1], &all[i]) == 0) {
+            all[j - 1].count += all[i].count;
+            all[j - 1].bytes += all[i].bytes;
+        } else {
+            all[j++] = all[i];
+        }
+    }
+    n = j;
+    qsort(all, n, sizeof(struct hotkey), hotkey_cmp_count);
+    if (n > settings.hotkeys)
+        n = settings.hotkeys;
+
+    pthread_mutex_lock(&top_lock);
+    memcpy(top, all, n * sizeof(struct hotkey));
+    ntop = n;
+    top_gets = gets;
+    pthread_mutex_unlock(&top_lock);
+
+    if (settings.hotkeys_cache) {
+        /* a worker seeing half old, half new bits only caches a little
+         * more or less for a moment */
+        uint64_t bits[HOTKEYS_BITS / 64];
+        memset(bits, 0, sizeof(bits));
+        for (i = 0; i < n; i++) {
+            bits[HOT_BIT(all[i].hv) / 64] |= 1ULL << (HOT_BIT(all[i].hv) % 64);
+        }
+        for (i = 0; i < HOTKEYS_BITS / 64; i++) {
+            __atomic_store_n(&hot_bits[i], bits[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *hotkeys_thread(void *arg) {
+    int nall = settings.hotkeys * HOTKEYS_SLACK * settings.num_threads;
+    struct hotkey *all = malloc(nall * sizeof(struct hotkey));
+
+    if (all == NULL) {
+        fprintf(stderr, "Failed to allocate hot key merge space\n");
+        return NULL;
+    }
+    for (;;) {
+        sleep(settings.hotkeys_window);
+        hotkeys_merge(all, nall);
+    }
+    return NULL;
+}
+
+static void hotcache_drop(struct hotkeys *hk, const int e) {
+    item_remove(hk->cache[e].copy);
+    item_remove(hk->cache[e].it);
+    hk->cache[e].it = NULL;
+    hk->cache[e].copy = NULL;
+}
+
+item *hotcache_get(struct hotkeys *hk, const char *key, const size_t nkey,
+                   const uint32_t hv) {
+    int e = hv & (HOTCACHE_SIZE - 1);
+    item *it = hk->cache[e].it;
+    item *copy = hk->cache[e].copy;
+
+    if (it == NULL || hk->cache[e].hv != hv)
+        return NULL;
+    if (copy->nkey != nkey || memcmp(ITEM_key(copy), key, nkey) != 0)
+        return NULL;
+    /* our reference keeps the memory valid, so all of this is safe to
+     * check unlocked; anything that changes the value unlinks the item */
+    if (current_time < hk->cache[e].until
+            && (it->it_flags & ITEM_LINKED)
+            && (it->exptime == 0 || it->exptime > current_time)
+            && copy->refcount < IT_REFCOUNT_LIMIT
+            && !item_is_flushed(it)) {
+        refcount_incr(copy);
+        return copy;
+    }
+    hotcache_drop(hk, e);
+    return NULL;
+}
+
+/* Takes a reference to a just fetched item, and a copy of it, if its key
+ * is hot. */
+void hotcache_fill(struct hotkeys *hk, item *it, const uint32_t hv) {
+    int e = hv & (HOTCACHE_SIZE - 1);
+    uint64_t bits;
+    size_t ntotal;
+    item *copy;
+
+    if (!settings.hotkeys_cache)
+        return;
+    bits = __atomic_load_n(&hot_bits[HOT_BIT(hv) / 64], __ATOMIC_RELAXED);
+    if ((bits & (1ULL << (HOT_BIT(hv) % 64))) == 0)
+        return;
+    /* only items that can be sent as they are, all in one piece */
+#ifdef EXTSTORE
+    if ((it->it_flags & (ITEM_LINKED|ITEM_CHUNKED|ITEM_HDR|ITEM_COMPRESSED))
+            != ITEM_LINKED)
+#else
+    if ((it->it_flags & (ITEM_LINKED|ITEM_CHUNKED|ITEM_COMPRESSED))
+            != ITEM_LINKED)
+#endif
+        return;
+    ntotal = ITEM_ntotal(it);
+    if (ntotal > HOTCACHE_ITEM_MAX)
+        return;
+    /* the value can't change while the caller holds it, so it's safe to
+     * copy; the header's LRU fields may, but the copy doesn't use them */
+    if ((copy = malloc(ntotal)) == NULL)
+        return;
+    memcpy(copy, it, ntotal);
+    copy->next = copy->prev = copy->h_next = NULL;
+    copy->it_flags = (it->it_flags & ITEM_CAS) | ITEM_HOTCOPY;
+    copy->refcount = 1;
+
+    if (hk->cache[e].it != NULL) {
+        hotcache_drop(hk, e);
+    }
+    /* the caller's reference lets this one be taken without the lock */
+    refcount_incr(it);
+    hk->cache[e].it = it;
+    hk->cache[e].copy = copy;
+    hk->cache[e].hv = hv;
+    hk->cache[e].until = current_time + HOTCACHE_TTL;
+}
+
+/* Lets go of a reference to a copy, from item_remove(). Usually the last
+ * one is the cache's own, but a response still being sent can outlive it. */
+void hotcache_release(item *it) {
+    if (refcount_decr(it) == 0) {
+        free(it);
+    }
+}
+
+/* Lets go of items held past their time, so they can be freed or moved. */
+void hotcache_expire(struct hotkeys *hk) {
+    int e;
+
+    for (e = 0; e < HOTCACHE_SIZE; e++) {
+        item *it = hk->cache[e].it;
+        if (it != NULL && (current_time >= hk->cache[e].until
+                    || (it->it_flags & ITEM_LINKED) == 0)) {
+            hotcache_drop(hk, e);
+        }
+    }
+}
+
+int start_hotkeys_thread(void) {
+    int ret;
+
+    top = calloc(settings.hotkeys, sizeof(struct hotkey));
+    if (top == NULL)
+        return -1;
+    if ((ret = pthread_create(&hotkeys_tid, NULL, hotkeys_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create hot keys thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void hotkeys_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+    int i;
+
+    pthread_mutex_lock(&top_lock);
+    APPEND_STAT("window", "%d", settings.hotkeys_window);
+    APPEND_STAT("gets_per_sec", "%llu",
+                (unsigned long long)top_gets / settings.hotkeys_window);
+    for (i = 0; i < ntop; i++) {
+        /* keys can be longer than STAT_VAL_LEN */
+        klen = snprintf(key_str, STAT_KEY_LEN, "%d:key", i + 1);
+        add_stats(key_str, klen, top[i].key, top[i].nkey, c);
+        APPEND_NUM_STAT(i + 1, "gets_per_sec", "%llu",
+                (unsigned long long)top[i].count / settings.hotkeys_window);
+        APPEND_NUM_STAT(i + 1, "bytes_per_sec", "%llu",
+                (unsigned long long)top[i].bytes / settings.hotkeys_window);
+    }
+    pthread_mutex_unlock(&top_lock);
+}
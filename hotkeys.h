@@ -0,0 +1,29 @@
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+/* most keys -o hotkeys can be asked to track */
+#define HOTKEYS_MAX 1024
+/* default seconds counted before a new top list is made */
+#define HOTKEYS_WINDOW 5
+/* counters each worker keeps per key asked for */
+#define HOTKEYS_SLACK 8
+/* bits in the map of hot key hashes workers check before caching */
+#define HOTKEYS_BITS 65536
+/* -o hotkeys_cache: items each worker can hold, and for how long */
+#define HOTCACHE_SIZE 64
+#define HOTCACHE_TTL 1
+/* largest item a worker copies; bigger ones are fetched as usual */
+#define HOTCACHE_ITEM_MAX (16 * 1024)
+
+struct hotkeys *hotkeys_new(int size);
+void hotkeys_record(struct hotkeys *hk, const char *key, const size_t nkey,
+                    const uint32_t hv, const int bytes);
+item *hotcache_get(struct hotkeys *hk, const char *key, const size_t nkey,
+                   const uint32_t hv);
+void hotcache_fill(struct hotkeys *hk, item *it, const uint32_t hv);
+void hotcache_expire(struct hotkeys *hk);
+void hotcache_release(item *it);
+int start_hotkeys_thread(void);
+void hotkeys_stats(ADD_STAT add_stats, void *c);
+
+#endif
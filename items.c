@@ -2,6 +2,7 @@
 #include "memcached.h"
 #include "bipbuffer.h"
 #include "slab_automove.h"
+#include "lz4_block.h"
 #ifdef EXTSTORE
 #include "storage.h"
 #include "slab_automove_extstore.h"
@@ -115,17 +116,118 @@ uint64_t get_cas_id(void) {
     return next_id;
 }
 
+/*
+ * flush_prefix: every call takes the next generation number and records it
+ * against the prefix (the key up to settings.prefix_delimiter). Items carry
+ * the generation they were created in, so one older than its prefix's entry
+ * counts as flushed and is reclaimed whenever it's next looked at, the same
+ * as after a flush_all.
+ *
+ * Entries are found by the prefix's hash and hold a copy of the prefix, so
+ * two prefixes with the same hash get an entry each. They're never removed;
+ * the table is written under ns_lock and read without it. An entry's prefix
+ * and generation are stored before its hash, and its generation before
+ * ns_gen_current moves on, so a reader that sees the new current generation
+ * also sees the entry.
+ */
+#define NS_TABLE_SIZE (1 << 16)
+#define NS_TABLE_MAX (NS_TABLE_SIZE / 4 * 3)
+
+typedef struct {
+    uint32_t hv;    /* 0 for an empty slot */
+    uint32_t gen;
+    char *prefix;
+    size_t nprefix;
+} ns_entry;
+
+static ns_entry ns_table[NS_TABLE_SIZE];
+static unsigned int ns_count = 0;
+static uint32_t ns_gen_current = 0;
+static pthread_mutex_t ns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t ns_hash(const char *prefix, const size_t nprefix) {
+    uint32_t hv = hash(prefix, nprefix);
+    return hv == 0 ? 1 : hv;
+}
+
+static ns_entry *ns_find(const uint32_t hv, const char *prefix,
+                         const size_t nprefix) {
+    unsigned int i = hv & (NS_TABLE_SIZE - 1);
+    uint32_t ehv;
+    while ((ehv = __atomic_load_n(&ns_table[i].hv, __ATOMIC_ACQUIRE)) != 0) {
+        if (ehv == hv && ns_table[i].nprefix == nprefix &&
+                memcmp(ns_table[i].prefix, prefix, nprefix) == 0)
+            return &ns_table[i];
+        i = (i + 1) & (NS_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+/* Returns 0, -1 if the table is full, or -2 if out of memory. */
+int item_flush_prefix(const char *prefix, const size_t nprefix) {
+    uint32_t hv = ns_hash(prefix, nprefix);
+    uint32_t gen;
+    ns_entry *e;
+
+    pthread_mutex_lock(&ns_lock);
+    gen = ns_gen_current + 1;
+    if ((e = ns_find(hv, prefix, nprefix)) != NULL) {
+        __atomic_store_n(&e->gen, gen, __ATOMIC_RELEASE);
+    } else if (ns_count < NS_TABLE_MAX) {
+        unsigned int i = hv & (NS_TABLE_SIZE - 1);
+        char *copy = malloc(nprefix);
+        if (copy == NULL) {
+            pthread_mutex_unlock(&ns_lock);
+            return -2;
+        }
+        memcpy(copy, prefix, nprefix);
+        while (ns_table[i].hv != 0)
+            i = (i + 1) & (NS_TABLE_SIZE - 1);
+        ns_table[i].prefix = copy;
+        ns_table[i].nprefix = nprefix;
+        ns_table[i].gen = gen;
+        __atomic_store_n(&ns_table[i].hv, hv, __ATOMIC_RELEASE);
+        ns_count++;
+    } else {
+        pthread_mutex_unlock(&ns_lock);
+        return -1;
+    }
+    __atomic_store_n(&ns_gen_current, gen, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ns_lock);
+    return 0;
+}
+
+/* Called with the item locked. An item found still valid is moved up to the
+ * current generation, so it takes the quick way out until the next flush. */
+static int item_is_flushed_prefix(item *it) {
+    uint32_t cur = __atomic_load_n(&ns_gen_current, __ATOMIC_ACQUIRE);
+    const char *key, *end;
+    ns_entry *e;
+
+    if (it->ns_gen == cur)
+        return 0;
+    key = ITEM_key(it);
+    end = memchr(key, settings.prefix_delimiter, it->nkey);
+    if (end != NULL &&
+            (e = ns_find(ns_hash(key, end - key), key, end - key)) != NULL &&
+            it->ns_gen < __atomic_load_n(&e->gen, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    it->ns_gen = cur;
+    return 0;
+}
+
 int item_is_flushed(item *it) {
     rel_time_t oldest_live = settings.oldest_live;
     uint64_t cas = ITEM_get_cas(it);
     uint64_t oldest_cas = settings.oldest_cas;
     if (oldest_live == 0 || oldest_live > current_time)
-        return 0;
+        return item_is_flushed_prefix(it);
     if ((it->time <= oldest_live)
             || (oldest_cas != 0 && cas != 0 && cas < oldest_cas)) {
         return 1;
     }
-    return 0;
+    return item_is_flushed_prefix(it);
 }
 
 static unsigned int temp_lru_size(int slabs_clsid) {
@@ -325,6 +427,7 @@ item *do_item_alloc(char *key, const size_t nkey, const unsigned int flags,
     it->it_flags |= settings.use_cas ? ITEM_CAS : 0;
     it->nkey = nkey;
     it->nbytes = nbytes;
+    it->ns_gen = __atomic_load_n(&ns_gen_current, __ATOMIC_ACQUIRE);
     memcpy(ITEM_key(it), key, nkey);
     it->exptime = exptime;
     if (settings.inline_ascii_response) {
@@ -350,6 +453,87 @@ item *do_item_alloc(char *key, const size_t nkey, const unsigned int flags,
     return it;
 }
 
+/* the client flags an item was stored with */
+uint32_t item_client_flags(item *it) {
+    if (settings.inline_ascii_response) {
+        return (uint32_t) strtoul(ITEM_suffix(it), (char **) NULL, 10);
+    } else if (it->nsuffix > 0) {
+        return *((uint32_t *)ITEM_suffix(it));
+    }
+    return 0;
+}
+
+/*
+ * -o compress_min: returns a copy of it whose value is LZ4 compressed, or
+ * NULL if it didn't come out at least an eighth smaller (or there's no
+ * memory for it). The copy is stored as the original length, then the
+ * compressed block, then the usual \r\n. buf is the caller's scratch space,
+ * grown as needed.
+ */
+item *do_item_compress(item *it, char **buf, int *size) {
+    int raw = it->nbytes - 2;
+    int need = LZ4_COMPRESS_BOUND(raw);
+    int clen;
+    uint32_t len = raw;
+    item *new_it;
+
+    assert((it->it_flags & (ITEM_CHUNKED|ITEM_COMPRESSED)) == 0);
+    if (*size < need) {
+        char *nbuf = realloc(*buf, need);
+        if (nbuf == NULL)
+            return NULL;
+        *buf = nbuf;
+        *size = need;
+    }
+    clen = lz4_compress(ITEM_data(it), raw, *buf, raw - raw / 8 - sizeof(len));
+    if (clen == 0)
+        return NULL;
+
+    new_it = do_item_alloc(ITEM_key(it), it->nkey, item_client_flags(it),
+            it->exptime, sizeof(len) + clen + 2);
+    if (new_it == NULL)
+        return NULL;
+    if (new_it->it_flags & ITEM_CHUNKED) {
+        do_item_remove(new_it);
+        return NULL;
+    }
+    new_it->it_flags |= ITEM_COMPRESSED;
+    new_it->ns_gen = it->ns_gen;
+    ITEM_set_cas(new_it, ITEM_get_cas(it));
+    memcpy(ITEM_data(new_it), &len, sizeof(len));
+    memcpy(ITEM_data(new_it) + sizeof(len), *buf, clen);
+    memcpy(ITEM_data(new_it) + sizeof(len) + clen, "\r\n", 2);
+    return new_it;
+}
+
+/*
+ * Returns an unlinked copy of a compressed item with its value expanded
+ * again, for sending or appending to, or NULL. The copy holds the only
+ * reference to itself; it is left as it was.
+ */
+item *item_decompress(item *it) {
+    uint32_t len;
+    item *raw_it;
+
+    assert(it->it_flags & ITEM_COMPRESSED);
+    memcpy(&len, ITEM_data(it), sizeof(len));
+    raw_it = do_item_alloc(ITEM_key(it), it->nkey, item_client_flags(it),
+            it->exptime, len + 2);
+    if (raw_it == NULL)
+        return NULL;
+    if ((raw_it->it_flags & ITEM_CHUNKED) ||
+            lz4_decompress(ITEM_data(it) + sizeof(len),
+                it->nbytes - 2 - sizeof(len), ITEM_data(raw_it), len) != (int)len) {
+        do_item_remove(raw_it);
+        return NULL;
+    }
+    memcpy(ITEM_data(raw_it) + len, "\r\n", 2);
+    ITEM_set_cas(raw_it, ITEM_get_cas(it));
+    raw_it->time = it->time;
+    raw_it->ns_gen = it->ns_gen;
+    return raw_it;
+}
+
 void item_free(item *it) {
     size_t ntotal = ITEM_ntotal(it);
     unsigned int clsid;
@@ -705,6 +889,8 @@ void item_stats_totals(ADD_STAT add_stats, void *c) {
                 (unsigned long long)totals.crawler_items_checked);
     APPEND_STAT("lrutail_reflocked", "%llu",
                 (unsigned long long)totals.lrutail_reflocked);
+    APPEND_STAT("flushed_prefixes", "%u",
+                __atomic_load_n(&ns_count, __ATOMIC_RELAXED));
     if (settings.lru_maintainer_thread) {
         APPEND_STAT("moves_to_cold", "%llu",
                     (unsigned long long)totals.moves_to_cold);
@@ -943,6 +1129,33 @@ void item_stats_sizes(ADD_STAT add_stats, void *c) {
     mutex_unlock(&stats_sizes_lock);
 }
 
+/* We update the hit markers only during fetches.
+ * An item needs to be hit twice overall to be considered
+ * ACTIVE, but only needs a single hit to maintain activity
+ * afterward.
+ * FETCHED tells if an item has ever been active.
+ */
+void do_item_bump(conn *c, item *it, const uint32_t hv) {
+    if (settings.lru_segmented) {
+        if ((it->it_flags & ITEM_ACTIVE) == 0) {
+            if ((it->it_flags & ITEM_FETCHED) == 0) {
+                it->it_flags |= ITEM_FETCHED;
+            } else {
+                it->it_flags |= ITEM_ACTIVE;
+                if (ITEM_lruid(it) != COLD_LRU) {
+                    do_item_update(it); // bump LA time
+                } else if (!lru_bump_async(c->thread->lru_bump_buf, it, hv)) {
+                    // add flag before async bump to avoid race.
+                    it->it_flags &= ~ITEM_ACTIVE;
+                }
+            }
+        }
+    } else {
+        it->it_flags |= ITEM_FETCHED;
+        do_item_update(it);
+    }
+}
+
 /** wrapper around assoc_find which does the lazy expiration logic */
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update) {
     item *it = assoc_find(key, nkey, hv);
@@ -990,9 +1203,7 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
             STORAGE_delete(c->thread->storage, it);
             do_item_remove(it);
             it = NULL;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.get_flushed++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, get_flushed);
             if (settings.verbose > 2) {
                 fprintf(stderr, " -nuked by flush");
             }
@@ -1002,39 +1213,14 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
             STORAGE_delete(c->thread->storage, it);
             do_item_remove(it);
             it = NULL;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.get_expired++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, get_expired);
             if (settings.verbose > 2) {
                 fprintf(stderr, " -nuked by expire");
             }
             was_found = 3;
         } else {
             if (do_update) {
-                /* We update the hit markers only during fetches.
-                 * An item needs to be hit twice overall to be considered
-                 * ACTIVE, but only needs a single hit to maintain activity
-                 * afterward.
-                 * FETCHED tells if an item has ever been active.
-                 */
-                if (settings.lru_segmented) {
-                    if ((it->it_flags & ITEM_ACTIVE) == 0) {
-                        if ((it->it_flags & ITEM_FETCHED) == 0) {
-                            it->it_flags |= ITEM_FETCHED;
-                        } else {
-                            it->it_flags |= ITEM_ACTIVE;
-                            if (ITEM_lruid(it) != COLD_LRU) {
-                                do_item_update(it); // bump LA time
-                            } else if (!lru_bump_async(c->thread->lru_bump_buf, it, hv)) {
-                                // add flag before async bump to avoid race.
-                                it->it_flags &= ~ITEM_ACTIVE;
-                            }
-                        }
-                    }
-                } else {
-                    it->it_flags |= ITEM_FETCHED;
-                    do_item_update(it);
-                }
+                do_item_bump(c, it, hv);
             }
             DEBUG_REFCNT(it, '+');
         }
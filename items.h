@@ -12,6 +12,9 @@ uint64_t get_cas_id(void);
 /*@null@*/
 item *do_item_alloc(char *key, const size_t nkey, const unsigned int flags, const rel_time_t exptime, const int nbytes);
 item_chunk *do_item_alloc_chunk(item_chunk *ch, const size_t bytes_remain);
+uint32_t item_client_flags(item *it);
+item *do_item_compress(item *it, char **buf, int *size);
+item *item_decompress(item *it);
 item *do_item_alloc_pull(const size_t ntotal, const unsigned int id);
 void item_free(item *it);
 bool item_size_ok(const size_t nkey, const int flags, const int nbytes);
@@ -25,6 +28,7 @@ void do_item_update_nolock(item *it);
 int  do_item_replace(item *it, item *new_it, const uint32_t hv);
 
 int item_is_flushed(item *it);
+int item_flush_prefix(const char *prefix, const size_t nprefix);
 unsigned int do_get_lru_size(uint32_t id);
 
 void do_item_linktail_q(item *it);
@@ -70,6 +74,7 @@ typedef struct {
 void fill_item_stats_automove(item_stats_automove *am);
 
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update);
+void do_item_bump(conn *c, item *it, const uint32_t hv);
 item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv, conn *c);
 void item_stats_reset(void);
 extern pthread_mutex_t lru_locks[POWER_LARGEST];
@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * LZ4 block format. Each sequence is a token byte (literal count in the
+ * high nibble, match length - 4 in the low one, 15 meaning more length
+ * bytes follow), the literals, and a two byte little endian offset back to
+ * the match. The last sequence is literals only.
+ *
+ * The compressor is the greedy single-probe kind: one hash table slot per
+ * 4 byte prefix, no chains. It trades some ratio for being fast enough to
+ * run on every store.
+ */
+#include "lz4_block.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MINMATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+/* the format wants a match to start at least 12 bytes before the end and
+ * the last 5 bytes to be literals */
+#define MFLIMIT 12
+#define LASTLITERALS 5
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(const uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline uint8_t *put_length(uint8_t *op, int len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Room for a sequence with this many literals and length bytes, plus the
+ * literals-only one that has to end the block. */
+static inline int seq_space(const int lits) {
+    return 1 + lits / 255 + 1 + lits + 2 + LASTLITERALS + 1;
+}
+
+int lz4_compress(const char *src, const int n, char *dst, const int cap) {
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *ip = base, *anchor = base;
+    const uint8_t *end = base + n;
+    const uint8_t *mflimit = end - MFLIMIT;
+    const uint8_t *matchlimit = end - LASTLITERALS;
+    uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+    uint8_t *token;
+    int lits;
+
+    if (n > MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = base + table[h];
+            const uint8_t *m, *r;
+            int mlen;
+
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            for (m = ip + MINMATCH, r = ref + MINMATCH; m < matchlimit && *m == *r;
+                    m++, r++);
+
+            lits = ip - anchor;
+            mlen = m - ip - MINMATCH;
+            if (oend - op < seq_space(lits) + mlen / 255 + 1)
+                return 0;
+            token = op++;
+            *token = (lits >= 15 ? 15 : lits) << 4;
+            if (lits >= 15)
+                op = put_length(op, lits - 15);
+            memcpy(op, anchor, lits);
+            op += lits;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= mlen >= 15 ? 15 : mlen;
+            if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+
+            ip = anchor = m;
+            /* the position just behind is the likeliest next match */
+            if (ip < mflimit)
+                table[hash4(read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    lits = end - anchor;
+    if (oend - op < 1 + lits / 255 + 1 + lits)
+        return 0;
+    token = op++;
+    *token = (lits >= 15 ? 15 : lits) << 4;
+    if (lits >= 15)
+        op = put_length(op, lits - 15);
+    memcpy(op, anchor, lits);
+    op += lits;
+    return op - (uint8_t *) dst;
+}
+
+int lz4_decompress(const char *src, const int n, char *dst, const int cap) {
+    const uint8_t *ip = (const uint8_t *) src, *iend = ip + n;
+    uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+    uint8_t b;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lits = token >> 4, mlen, off;
+
+        if (lits == 15) {
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                lits += b;
+            } while (b == 255);
+        }
+        if (lits > (size_t)(iend - ip) || lits > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lits);
+        op += lits;
+        ip += lits;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - (uint8_t *) dst))
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MINMATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            /* overlapping: the match repeats the last off bytes */
+            for (; mlen > 0; mlen--, op++) {
+                *op = *(op - off);
+            }
+        }
+    }
+    return op - (uint8_t *) dst;
+}
@@ -0,0 +1,20 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+/*
+ * A small compressor and decompressor for the LZ4 block format, used for
+ * -o compress_min. Output decodes with any LZ4 implementation's block
+ * decoder (LZ4_decompress_safe() and friends); there is no frame header.
+ */
+
+/* most bytes lz4_compress() can produce from n */
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Returns the compressed length, or 0 if it wouldn't fit in cap bytes. */
+int lz4_compress(const char *src, const int n, char *dst, const int cap);
+
+/* Returns the decompressed length, or -1 if src is corrupt or the result
+ * wouldn't fit in cap bytes. */
+int lz4_decompress(const char *src, const int n, char *dst, const int cap);
+
+#endif
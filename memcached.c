@@ -17,6 +17,20 @@
 #ifdef EXTSTORE
 #include "storage.h"
 #endif
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#include "proxy.h"
+#include "hotkeys.h"
+#ifdef USE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_NUMA
+#include <numa.h>
+#endif
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -83,9 +97,13 @@ enum try_read_result {
 
 static enum try_read_result try_read_network(conn *c);
 static enum try_read_result try_read_udp(conn *c);
+#ifdef USE_UDP_BATCH
+static struct udp_batch *udp_batch_new(const int size);
+static void udp_batch_free(struct udp_batch *u);
+static void udp_batch_flush(conn *c);
+#endif
 
 static void conn_set_state(conn *c, enum conn_states state);
-static int start_conn_timeout_thread();
 
 /* stats */
 static void stats_init(void);
@@ -101,23 +119,37 @@ static void settings_init(void);
 static void event_handler(const int fd, const short which, void *arg);
 static void conn_close(conn *c);
 static void conn_init(void);
+static int conn_event_add(conn *c);
+static int conn_event_del(conn *c);
 static bool update_event(conn *c, const int new_flags);
 static void complete_nread(conn *c);
 static void process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
+static void out_of_memory(conn *c, char *ascii_error);
+static item *get_decompressed(conn *c, item *it);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_chunked_item_iovs(conn *c, item *it, int len);
+static int add_chunked_item_iovs_range(conn *c, item *it, int offset, int len);
 static int add_msghdr(conn *c);
 static void write_bin_error(conn *c, protocol_binary_response_status err,
                             const char *errstr, int swallow);
 static void write_bin_miss_response(conn *c, char *key, size_t nkey);
+static void meta_store_response(conn *c, item *it, enum store_item_type ret);
 
 #ifdef EXTSTORE
 static void _get_extstore_cb(void *e, obj_io *io, int ret);
 static inline int _get_extstore(conn *c, item *it, int iovst, int iovcnt);
+static bool conn_add_io_done(conn *c);
 #endif
 static void conn_free(conn *c);
+static bool conn_get_buffers(conn *c);
+static void conn_put_buffers(conn *c);
+#ifdef USE_ZEROCOPY
+static void zerocopy_hold_items(conn *c);
+static void zerocopy_release_all(conn *c);
+static void conn_release_items(conn *c);
+#endif
 
 /** exported globals **/
 struct stats stats;
@@ -260,6 +292,8 @@ static void settings_init(void) {
     settings.temporary_ttl = 61;
     settings.idle_timeout = 0; /* disabled */
     settings.hashpower_init = 0;
+    settings.hash_buckets = false;
+    settings.hash_shrink = true;
     settings.slab_reassign = true;
     settings.slab_automove = 1;
     settings.slab_automove_ratio = 0.8;
@@ -272,9 +306,24 @@ static void settings_init(void) {
     settings.logger_watcher_buf_size = LOGGER_WATCHER_BUF_SIZE;
     settings.logger_buf_size = LOGGER_BUF_SIZE;
     settings.drop_privileges = true;
+    settings.reuseport = false;
+    settings.udp_batch = 0;
+    settings.zerocopy_size = 0;
+    settings.conn_buffer_pool = false;
+    settings.conn_balance = false;
+    settings.numa = false;
+    settings.proxy = false;
+    settings.proxy_timeout = 5;
+    settings.compress_min = 0;
+    settings.hotkeys = 0;
+    settings.hotkeys_window = HOTKEYS_WINDOW;
+    settings.hotkeys_cache = false;
 #ifdef MEMCACHED_DEBUG
     settings.relaxed_privileges = false;
 #endif
+#ifdef HAVE_IO_URING
+    settings.io_uring = false;
+#endif
 }
 
 /*
@@ -326,87 +375,6 @@ static int add_msghdr(conn *c)
 
 extern pthread_mutex_t conn_lock;
 
-/* Connection timeout thread bits */
-static pthread_t conn_timeout_tid;
-
-#define CONNS_PER_SLICE 100
-#define TIMEOUT_MSG_SIZE (1 + sizeof(int))
-static void *conn_timeout_thread(void *arg) {
-    int i;
-    conn *c;
-    char buf[TIMEOUT_MSG_SIZE];
-    rel_time_t oldest_last_cmd;
-    int sleep_time;
-    useconds_t timeslice = 1000000 / (max_fds / CONNS_PER_SLICE);
-
-    while(1) {
-        if (settings.verbose > 2)
-            fprintf(stderr, "idle timeout thread at top of connection list\n");
-
-        oldest_last_cmd = current_time;
-
-        for (i = 0; i < max_fds; i++) {
-            if ((i % CONNS_PER_SLICE) == 0) {
-                if (settings.verbose > 2)
-                    fprintf(stderr, "idle timeout thread sleeping for %ulus\n",
-                        (unsigned int)timeslice);
-                usleep(timeslice);
-            }
-
-            if (!conns[i])
-                continue;
-
-            c = conns[i];
-
-            if (!IS_TCP(c->transport))
-                continue;
-
-            if (c->state != conn_new_cmd && c->state != conn_read)
-                continue;
-
-            if ((current_time - c->last_cmd_time) > settings.idle_timeout) {
-                buf[0] = 't';
-                memcpy(&buf[1], &i, sizeof(int));
-                if (write(c->thread->notify_send_fd, buf, TIMEOUT_MSG_SIZE)
-                    != TIMEOUT_MSG_SIZE)
-                    perror("Failed to write timeout to notify pipe");
-            } else {
-                if (c->last_cmd_time < oldest_last_cmd)
-                    oldest_last_cmd = c->last_cmd_time;
-            }
-        }
-
-        /* This is the soonest we could have another connection time out */
-        sleep_time = settings.idle_timeout - (current_time - oldest_last_cmd) + 1;
-        if (sleep_time <= 0)
-            sleep_time = 1;
-
-        if (settings.verbose > 2)
-            fprintf(stderr,
-                    "idle timeout thread finished pass, sleeping for %ds\n",
-                    sleep_time);
-        usleep((useconds_t) sleep_time * 1000000);
-    }
-
-    return NULL;
-}
-
-static int start_conn_timeout_thread() {
-    int ret;
-
-    if (settings.idle_timeout == 0)
-        return -1;
-
-    if ((ret = pthread_create(&conn_timeout_tid, NULL,
-        conn_timeout_thread, NULL)) != 0) {
-        fprintf(stderr, "Can't create idle connection timeout thread: %s\n",
-            strerror(ret));
-        return -1;
-    }
-
-    return 0;
-}
-
 /*
  * Initializes the connections array. We don't actually allocate connection
  * structures until they're needed, so as to avoid wasting memory when the
@@ -458,23 +426,121 @@ static const char *prot_text(enum protocol prot) {
     return rv;
 }
 
-void conn_close_idle(conn *c) {
-    if (settings.idle_timeout > 0 &&
-        (current_time - c->last_cmd_time) > settings.idle_timeout) {
-        if (c->state != conn_new_cmd && c->state != conn_read) {
-            if (settings.verbose > 1)
-                fprintf(stderr,
-                    "fd %d wants to timeout, but isn't in read state", c->sfd);
-            return;
-        }
+/*
+ * Idle connection timeouts. Each worker keeps its TCP client connections in
+ * a timer wheel (see struct conn_timer_wheel) and advances it once a second.
+ * Processing a command only updates last_cmd_time; the wheel entry is left
+ * where it is and checked against last_cmd_time when its slot comes up, so
+ * busy connections cost one reschedule per idle_timeout rather than a wheel
+ * operation per command.
+ */
+static void conn_timer_schedule(conn *c, rel_time_t deadline) {
+    struct conn_timer_wheel *w = &c->thread->timers;
+    conn **slot;
+
+    if (deadline <= w->now) {
+        deadline = w->now + 1;
+    }
+    if (deadline - w->now < CONN_TIMER_SLOTS) {
+        slot = &w->inner[deadline & (CONN_TIMER_SLOTS - 1)];
+    } else {
+        rel_time_t max = w->now + (CONN_TIMER_SLOTS * CONN_TIMER_OUTER_SLOTS) - 1;
+        if (deadline > max)
+            deadline = max;
+        slot = &w->outer[(deadline >> CONN_TIMER_BITS) & (CONN_TIMER_OUTER_SLOTS - 1)];
+    }
+
+    c->timer_prev = NULL;
+    c->timer_next = *slot;
+    if (*slot)
+        (*slot)->timer_prev = c;
+    *slot = c;
+    c->timer_slot = slot;
+}
+
+static void conn_timer_del(conn *c) {
+    if (c->timer_slot == NULL)
+        return;
+    if (c->timer_prev)
+        c->timer_prev->timer_next = c->timer_next;
+    else
+        *c->timer_slot = c->timer_next;
+    if (c->timer_next)
+        c->timer_next->timer_prev = c->timer_prev;
+    c->timer_next = c->timer_prev = NULL;
+    c->timer_slot = NULL;
+}
+
+/* Starts idle tracking for a client connection. Must be called from the
+ * connection's own worker thread, once c->thread is set. */
+void conn_timer_add(conn *c) {
+    if (settings.idle_timeout <= 0 || !IS_TCP(c->transport) ||
+            c->state == conn_listening)
+        return;
+    conn_timer_del(c);
+    conn_timer_schedule(c, c->last_cmd_time + settings.idle_timeout + 1);
+}
 
+static void conn_timer_expire(conn *c) {
+    rel_time_t deadline = c->last_cmd_time + settings.idle_timeout + 1;
+
+    if (deadline > c->thread->timers.now) {
+        /* there was activity since this entry was scheduled */
+        conn_timer_schedule(c, deadline);
+        return;
+    }
+
+    if (c->state != conn_new_cmd && c->state != conn_read) {
         if (settings.verbose > 1)
-            fprintf(stderr, "Closing idle fd %d\n", c->sfd);
+            fprintf(stderr,
+                "fd %d wants to timeout, but isn't in read state\n", c->sfd);
+        /* check again next second */
+        conn_timer_schedule(c, deadline);
+        return;
+    }
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Closing idle fd %d\n", c->sfd);
 
-        c->thread->stats.idle_kicks++;
+    THR_STATS_INCR(c->thread, idle_kicks);
 
-        conn_set_state(c, conn_closing);
-        drive_machine(c);
+    conn_set_state(c, conn_closing);
+    drive_machine(c);
+}
+
+/* Detaches a slot's list so entries can be rescheduled or closed while we
+ * walk it. */
+static conn *conn_timer_take(conn **slot) {
+    conn *c, *list = *slot;
+    *slot = NULL;
+    for (c = list; c != NULL; c = c->timer_next) {
+        c->timer_slot = NULL;
+    }
+    return list;
+}
+
+void conn_timer_tick(LIBEVENT_THREAD *me) {
+    struct conn_timer_wheel *w = &me->timers;
+    conn *c, *next;
+
+    while (w->now < current_time) {
+        w->now++;
+        if ((w->now & (CONN_TIMER_SLOTS - 1)) == 0) {
+            /* move the next turn's worth of deadlines to the inner wheel */
+            c = conn_timer_take(&w->outer[(w->now >> CONN_TIMER_BITS) &
+                    (CONN_TIMER_OUTER_SLOTS - 1)]);
+            for (; c != NULL; c = next) {
+                next = c->timer_next;
+                conn_timer_schedule(c,
+                        c->last_cmd_time + settings.idle_timeout + 1);
+            }
+        }
+
+        c = conn_timer_take(&w->inner[w->now & (CONN_TIMER_SLOTS - 1)]);
+        for (; c != NULL; c = next) {
+            next = c->timer_next;
+            conn_timer_expire(c);
+        }
     }
 }
 
@@ -486,7 +552,7 @@ void conn_worker_readd(conn *c) {
     c->state = conn_new_cmd;
 
     // TODO: call conn_cleanup/fail/etc
-    if (event_add(&c->event, 0) == -1) {
+    if (conn_event_add(c) == -1) {
         perror("event_add");
     }
 #ifdef EXTSTORE
@@ -499,6 +565,41 @@ void conn_worker_readd(conn *c) {
 #endif
 }
 
+/* Proxy mode: c's request is out with other servers. Stop reading from c
+ * until conn_proxy_done(). */
+void conn_proxy_wait(conn *c) {
+    conn_event_del(c);
+    conn_set_state(c, conn_watch);
+}
+
+/*
+ * Proxy mode: the answer to c's request is in. Sends buf (malloc'd, len
+ * bytes), or nothing if it's NULL; a negative len means we ran out of
+ * memory. Picks c back up if it was waiting.
+ */
+void conn_proxy_done(conn *c, char *buf, int len) {
+    bool waiting = c->state == conn_watch;
+
+    if (waiting) {
+        c->ev_flags = EV_READ | EV_PERSIST;
+        event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+        event_base_set(c->thread->base, &c->event);
+        if (conn_event_add(c) == -1) {
+            perror("event_add");
+        }
+    }
+    if (len < 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory");
+    } else if (buf) {
+        write_and_free(c, buf, len);
+    } else {
+        conn_set_state(c, conn_new_cmd);
+    }
+    if (waiting) {
+        drive_machine(c);
+    }
+}
+
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
                 const int read_buffer_size, enum network_transport transport,
@@ -578,12 +679,26 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         }
     }
 
+    c->zerocopy = false;
+    c->zc_sent = c->zc_done = 0;
+    c->zc_closing = false;
+#ifdef USE_ZEROCOPY
+    if (settings.zerocopy_size > 0 && IS_TCP(transport)
+            && init_state == conn_new_cmd) {
+        int flags = 1;
+        /* old kernels refuse this; those connections just copy as usual */
+        c->zerocopy = setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY,
+                                 (void *)&flags, sizeof(flags)) == 0;
+    }
+#endif
+
     if (settings.verbose > 1) {
         if (init_state == conn_listening) {
             fprintf(stderr, "<%d server listening (%s)\n", sfd,
                 prot_text(c->protocol));
         } else if (IS_UDP(transport)) {
-            fprintf(stderr, "<%d server listening (udp)\n", sfd);
+            fprintf(stderr, "<%d server listening (udp%s)\n", sfd,
+                settings.udp_batch > 1 ? ", batched" : "");
         } else if (c->protocol == negotiating_prot) {
             fprintf(stderr, "<%d new auto-negotiating client connection\n",
                     sfd);
@@ -598,10 +713,23 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         }
     }
 
+#ifdef USE_UDP_BATCH
+    if (IS_UDP(transport) && settings.udp_batch > 1 && c->udp_batch == NULL) {
+        c->udp_batch = udp_batch_new(settings.udp_batch);
+        if (c->udp_batch == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            fprintf(stderr, "Failed to allocate UDP batch buffers\n");
+            return NULL;
+        }
+    }
+#endif
+
     c->state = init_state;
     c->rlbytes = 0;
     c->cmd = -1;
-    c->rbytes = c->wbytes = 0;
+    c->rbytes = c->wbytes = c->wdefer = 0;
     c->wcurr = c->wbuf;
     c->rcurr = c->rbuf;
     c->ritem = 0;
@@ -617,6 +745,13 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 #ifdef EXTSTORE
     c->io_wraplist = NULL;
     c->io_wrapleft = 0;
+    c->io_pending = 0;
+    c->io_donelist = NULL;
+#endif
+#ifdef HAVE_IO_URING
+    c->uring_busy = 0;
+    c->uring_done = 0;
+    c->uring_poll = false;
 #endif
 
     c->write_and_go = init_state;
@@ -624,12 +759,15 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->item = 0;
 
     c->noreply = false;
+    c->meta_set = false;
+    c->proxy = NULL;
+    c->bin_prefetched = 0;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = event_flags;
 
-    if (event_add(&c->event, 0) == -1) {
+    if (conn_event_add(c) == -1) {
         perror("event_add");
         return NULL;
     }
@@ -654,11 +792,9 @@ static void recache_or_free(conn *c, io_wrap *wrap) {
         size_t ntotal = ITEM_ntotal(wrap->hdr_it);
         item_unlink(wrap->hdr_it);
         slabs_free(it, ntotal, slabs_clsid(ntotal));
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.miss_from_extstore++;
+        THR_STATS_INCR(c->thread, miss_from_extstore);
         if (wrap->badcrc)
-            c->thread->stats.badcrc_from_extstore++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, badcrc_from_extstore);
     } else if (settings.ext_recache_rate) {
         // hashvalue is cuddled during store
         uint32_t hv = (uint32_t)it->time;
@@ -669,19 +805,19 @@ static void recache_or_free(conn *c, io_wrap *wrap) {
             uint8_t flags = ITEM_LINKED|ITEM_FETCHED|ITEM_ACTIVE;
             // Item must be recently hit at least twice to recache.
             if (((h_it->it_flags & flags) == flags) &&
+                    (h_it->it_flags & (ITEM_STALE|ITEM_TOKEN_SENT)) == 0 &&
                     h_it->time > current_time - ITEM_UPDATE_INTERVAL &&
                     c->recache_counter++ % settings.ext_recache_rate == 0) {
                 do_free = false;
                 // In case it's been updated.
                 it->exptime = h_it->exptime;
+                it->ns_gen = h_it->ns_gen;
                 it->it_flags &= ~ITEM_LINKED;
                 it->refcount = 0;
                 it->h_next = NULL; // might not be necessary.
                 STORAGE_delete(c->thread->storage, h_it);
                 item_replace(h_it, it, hv);
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.recache_from_extstore++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_INCR(c->thread, recache_from_extstore);
             }
         }
         if (hold_lock)
@@ -694,14 +830,281 @@ static void recache_or_free(conn *c, io_wrap *wrap) {
     wrap->io.next = NULL;
     wrap->next = NULL;
     wrap->active = false;
+    if (wrap->ooo) {
+        free(wrap->hit_line);
+        free(wrap->io.iov);
+        wrap->io.iov = NULL;
+    }
 
     // TODO: reuse lock and/or hv.
     item_remove(wrap->hdr_it);
 }
 #endif
+#ifdef USE_ZEROCOPY
+/*
+ * The items, suffix buffers and extstore IO buffers behind one response sent
+ * with MSG_ZEROCOPY. The kernel pins and reads the pages directly until the
+ * data is acknowledged, so nothing here may be freed or reused before the
+ * completion for send number (seq - 1) comes back on the error queue.
+ */
+struct zc_hold {
+    struct zc_hold *next;
+    uint32_t seq;       /* c->zc_sent once the response was fully sent */
+    int size;           /* slots in ptrs */
+    int nitems;         /* items at the front of ptrs */
+    int nsuffixes;      /* suffix buffers following them */
+#ifdef EXTSTORE
+    io_wrap *io_wraplist;
+#endif
+    void *ptrs[];
+};
+
+/*
+ * Reserves a hold big enough for everything the current response references.
+ * Allocated before the first zero-copy send so conn_release_items() can't
+ * fail later; if this fails the response is simply copied.
+ */
+static struct zc_hold *zerocopy_hold_new(conn *c) {
+    int size = c->ileft + c->suffixleft + 1;
+    struct zc_hold *h = malloc(sizeof(struct zc_hold) + sizeof(void *) * size);
+    if (h == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return NULL;
+    }
+    h->next = NULL;
+    h->size = size;
+    h->nitems = 0;
+    h->nsuffixes = 0;
+#ifdef EXTSTORE
+    h->io_wraplist = NULL;
+#endif
+    return h;
+}
+
+/* Moves the response's references from the conn into its reserved hold. */
+static void zerocopy_hold_items(conn *c) {
+    struct zc_hold *h = c->zc_hold;
+
+    if (c->item) {
+        h->ptrs[h->nitems++] = c->item;
+        c->item = 0;
+    }
+    for (; c->ileft > 0; c->ileft--, c->icurr++) {
+        h->ptrs[h->nitems++] = *(c->icurr);
+    }
+    for (; c->suffixleft > 0; c->suffixleft--, c->suffixcurr++) {
+        h->ptrs[h->nitems + h->nsuffixes++] = *(c->suffixcurr);
+    }
+    assert(h->nitems + h->nsuffixes <= h->size);
+#ifdef EXTSTORE
+    h->io_wraplist = c->io_wraplist;
+    c->io_wraplist = NULL;
+#endif
+    c->icurr = c->ilist;
+    c->suffixcurr = c->suffixlist;
+
+    h->seq = c->zc_sent;
+    if (c->zc_holds_tail != NULL) {
+        c->zc_holds_tail->next = h;
+    } else {
+        c->zc_holds = h;
+    }
+    c->zc_holds_tail = h;
+    c->zc_hold = NULL;
+}
+
+static void zerocopy_release(conn *c, struct zc_hold *h) {
+    int i;
+
+    for (i = 0; i < h->nitems; i++) {
+        item_remove((item *)h->ptrs[i]);
+    }
+    for (; i < h->nitems + h->nsuffixes; i++) {
+        do_cache_free(c->thread->suffix_cache, h->ptrs[i]);
+    }
+#ifdef EXTSTORE
+    while (h->io_wraplist) {
+        io_wrap *next = h->io_wraplist->next;
+        recache_or_free(c, h->io_wraplist);
+        do_cache_free(c->thread->io_cache, h->io_wraplist);
+        h->io_wraplist = next;
+    }
+#endif
+    free(h);
+}
+
+/*
+ * Drops every hold regardless of completions. Only for connections being
+ * torn down once conn_close() has seen every send complete, or that never
+ * got as far as sending.
+ */
+static void zerocopy_release_all(conn *c) {
+    while (c->zc_holds != NULL) {
+        struct zc_hold *next = c->zc_holds->next;
+        zerocopy_release(c, c->zc_holds);
+        c->zc_holds = next;
+    }
+    c->zc_holds_tail = NULL;
+    if (c->zc_hold != NULL) {
+        free(c->zc_hold);
+        c->zc_hold = NULL;
+    }
+}
+
+/*
+ * Reads zero-copy completions off the socket's error queue and releases
+ * every hold they cover. Completions arrive as EPOLLERR, which wakes the
+ * connection for reading.
+ */
+static void zerocopy_reap(conn *c) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    uint64_t copied = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* ee_info..ee_data is an inclusive range of send numbers */
+            if ((int32_t)(serr->ee_data + 1 - c->zc_done) > 0)
+                c->zc_done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+
+    while (c->zc_holds != NULL &&
+            (int32_t)(c->zc_done - c->zc_holds->seq) >= 0) {
+        struct zc_hold *next = c->zc_holds->next;
+        zerocopy_release(c, c->zc_holds);
+        c->zc_holds = next;
+    }
+    if (c->zc_holds == NULL)
+        c->zc_holds_tail = NULL;
+
+    if (copied) {
+        THR_STATS_ADD(c->thread, zerocopy_copied, copied);
+    }
+}
+
+/*
+ * The kernel carries on sending what's queued after we hang up, reading
+ * straight from the held items, so a connection can't be torn down until
+ * every zero-copy send has completed. Returns false, having hung up and
+ * parked the connection on its worker's zc_closing list, while any are
+ * still out; conn_zerocopy_tick() tries the close again each second.
+ */
+static bool zerocopy_close_ready(conn *c) {
+    if (c->zc_sent == c->zc_done && c->zc_holds == NULL)
+        return true;
+    conn_release_items(c);
+    zerocopy_reap(c);
+    if (c->zc_holds == NULL)
+        return true;
+    if (!c->zc_closing) {
+        shutdown(c->sfd, SHUT_RDWR);
+        conn_timer_del(c);
+        conn_set_state(c, conn_closed);
+        c->zc_closing = true;
+        c->zc_next = c->thread->zc_closing;
+        c->thread->zc_closing = c;
+    }
+    return false;
+}
+
+/* Closes whichever parked connections' sends have now completed. */
+void conn_zerocopy_tick(LIBEVENT_THREAD *me) {
+    conn **cp = &me->zc_closing;
+
+    while (*cp != NULL) {
+        conn *c = *cp;
+        zerocopy_reap(c);
+        if (c->zc_holds != NULL) {
+            cp = &c->zc_next;
+            continue;
+        }
+        *cp = c->zc_next;
+        c->zc_closing = false;
+        conn_close(c);
+    }
+}
+
+static inline bool iov_in_wbuf(conn *c, struct iovec *iov) {
+    return (char *)iov->iov_base >= c->wbuf &&
+        (char *)iov->iov_base < c->wbuf + c->wsize;
+}
+
+/*
+ * Decides how much of the next message to send and with which flags.
+ * Only memory that conn_release_items() owns may go out zero-copy, since
+ * only that can be held. In conn_mwrite that is everything except the
+ * connection's own write buffer, where binary headers are built; a leading
+ * run of those is sent on its own, corked with MSG_MORE. Runs of item data
+ * smaller than zerocopy_size are cheaper to copy.
+ * Trims m->msg_iovlen to the part to send now and returns the send flags.
+ */
+static int zerocopy_prepare(conn *c, struct msghdr *m) {
+    size_t i, end = 0, run = 0, first_run = 0;
+    bool worth = false;
+    bool lead_wbuf = iov_in_wbuf(c, &m->msg_iov[0]);
+
+    for (i = 0; i < m->msg_iovlen; i++) {
+        bool in_wbuf = iov_in_wbuf(c, &m->msg_iov[i]);
+        if (end == 0 && in_wbuf != lead_wbuf) {
+            end = i;
+            first_run = run;
+        }
+        if (in_wbuf) {
+            run = 0;
+            continue;
+        }
+        run += m->msg_iov[i].iov_len;
+        if (run >= settings.zerocopy_size)
+            worth = true;
+    }
+    if (!worth)
+        return 0;
+    if (end == 0) {
+        end = m->msg_iovlen;
+        first_run = run;
+    }
+
+    m->msg_iovlen = end;
+    /* wbuf headers, or a small run ahead of the big one: copy and cork */
+    if (lead_wbuf || first_run < settings.zerocopy_size)
+        return MSG_MORE;
+
+    if (c->zc_hold == NULL && (c->zc_hold = zerocopy_hold_new(c)) == NULL)
+        return 0;
+    return MSG_ZEROCOPY;
+}
+#endif
+
 static void conn_release_items(conn *c) {
     assert(c != NULL);
 
+#ifdef USE_ZEROCOPY
+    /* the kernel may still be reading from these; park them until it's done */
+    if (c->zc_hold != NULL) {
+        zerocopy_hold_items(c);
+        return;
+    }
+#endif
+
     if (c->item) {
         item_remove(c->item);
         c->item = 0;
@@ -739,7 +1142,21 @@ static void conn_release_items(conn *c) {
 static void conn_cleanup(conn *c) {
     assert(c != NULL);
 
+#ifdef EXTSTORE
+    /* out of order reads that came back too late to be sent */
+    assert(c->io_pending == 0);
+    while (c->io_donelist) {
+        io_wrap *next = c->io_donelist->next;
+        c->io_donelist->next = c->io_wraplist;
+        c->io_wraplist = c->io_donelist;
+        c->io_donelist = next;
+    }
+#endif
     conn_release_items(c);
+#ifdef USE_ZEROCOPY
+    zerocopy_release_all(c);
+#endif
+    proxy_conn_cleanup(c);
 
     if (c->write_and_free) {
         free(c->write_and_free);
@@ -769,6 +1186,12 @@ void conn_free(conn *c) {
         conns[c->sfd] = NULL;
         if (c->hdrbuf)
             free(c->hdrbuf);
+        if (c->bufs)
+            free(c->bufs);
+#ifdef USE_UDP_BATCH
+        if (c->udp_batch)
+            udp_batch_free(c->udp_batch);
+#endif
         if (c->msglist)
             free(c->msglist);
         if (c->rbuf)
@@ -789,12 +1212,48 @@ static void conn_close(conn *c) {
     assert(c != NULL);
 
     /* delete the event, the socket and the conn */
-    event_del(&c->event);
+    conn_event_del(c);
+
+#ifdef EXTSTORE
+    /* Out of order reads still point at this conn. Hang up, but keep the fd
+     * (and so conns[sfd]) until the last one is back; conn_io_done() comes
+     * back here to finish. */
+    if (c->io_pending > 0) {
+        if (c->state != conn_closed) {
+            shutdown(c->sfd, SHUT_RDWR);
+            conn_timer_del(c);
+            conn_set_state(c, conn_closed);
+        }
+        return;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    /* Likewise while the kernel may still write into rbuf or read the
+     * msglist; conn_uring_done() comes back once the ops are. */
+    if (c->uring_busy) {
+        if (c->state != conn_closed) {
+            uring_conn_cancel(c);
+            shutdown(c->sfd, SHUT_RDWR);
+            conn_timer_del(c);
+            conn_set_state(c, conn_closed);
+        }
+        return;
+    }
+#endif
+#ifdef USE_ZEROCOPY
+    if (!zerocopy_close_ready(c))
+        return;
+#endif
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
     conn_cleanup(c);
+    conn_timer_del(c);
+    if (settings.conn_buffer_pool)
+        conn_put_buffers(c);
+    if (settings.conn_balance && c->thread != NULL && !IS_UDP(c->transport))
+        THR_ATOMIC_ADD(c->thread->conns, -1);
 
     MEMCACHED_CONN_RELEASE(c->sfd);
     conn_set_state(c, conn_closed);
@@ -824,6 +1283,11 @@ static void conn_shrink(conn *c) {
 
     if (IS_UDP(c->transport))
         return;
+#ifdef HAVE_IO_URING
+    /* a recv is reading into, or has read into, rbuf past rbytes */
+    if (c->uring_busy & URING_RECV || c->uring_done & URING_RECV)
+        return;
+#endif
 
     if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE) {
         char *newbuf;
@@ -869,35 +1333,189 @@ static void conn_shrink(conn *c) {
     }
 }
 
-/**
- * Convert a state name to a human readable form.
+/*
+ * With -o conn_buffer_pool a connection only holds its read/write buffers
+ * and response lists while a request is in flight. Between requests they go
+ * back to a small per-worker pool, so idle connections cost little more than
+ * the conn struct itself. Only the owning worker touches its pool.
  */
-static const char *state_text(enum conn_states state) {
-    const char* const statenames[] = { "conn_listening",
-                                       "conn_new_cmd",
-                                       "conn_waiting",
-                                       "conn_read",
-                                       "conn_parse_cmd",
-                                       "conn_write",
-                                       "conn_nread",
-                                       "conn_swallow",
-                                       "conn_closing",
-                                       "conn_mwrite",
-                                       "conn_closed",
-                                       "conn_watch" };
-    return statenames[state];
+struct conn_bufs {
+    struct conn_bufs *next;
+    char *rbuf;
+    char *wbuf;
+    item **ilist;
+    char **suffixlist;
+    struct iovec *iov;
+    struct msghdr *msglist;
+    int rsize;
+    int wsize;
+    int isize;
+    int suffixsize;
+    int iovsize;
+    int msgsize;
+};
+
+static void conn_bufs_free(struct conn_bufs *b) {
+    free(b->rbuf);
+    free(b->wbuf);
+    free(b->ilist);
+    free(b->suffixlist);
+    free(b->iov);
+    free(b->msglist);
+    free(b);
+}
+
+static struct conn_bufs *conn_bufs_new(void) {
+    struct conn_bufs *b = calloc(1, sizeof(struct conn_bufs));
+    if (b == NULL)
+        return NULL;
+
+    b->rsize = DATA_BUFFER_SIZE;
+    b->wsize = DATA_BUFFER_SIZE;
+    b->isize = ITEM_LIST_INITIAL;
+    b->suffixsize = SUFFIX_LIST_INITIAL;
+    b->iovsize = IOV_LIST_INITIAL;
+    b->msgsize = MSG_LIST_INITIAL;
+
+    b->rbuf = (char *)malloc((size_t)b->rsize);
+    b->wbuf = (char *)malloc((size_t)b->wsize);
+    b->ilist = (item **)malloc(sizeof(item *) * b->isize);
+    b->suffixlist = (char **)malloc(sizeof(char *) * b->suffixsize);
+    b->iov = (struct iovec *)malloc(sizeof(struct iovec) * b->iovsize);
+    b->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * b->msgsize);
+
+    if (b->rbuf == 0 || b->wbuf == 0 || b->ilist == 0 || b->iov == 0 ||
+            b->msglist == 0 || b->suffixlist == 0) {
+        conn_bufs_free(b);
+        return NULL;
+    }
+    return b;
 }
 
 /*
- * Sets a connection's current state in the state machine. Any special
- * processing that needs to happen on certain state transitions can
- * happen here.
+ * Gives a connection a buffer set from its worker's pool, allocating one if
+ * the pool is empty. Returns false if memory is exhausted.
  */
-static void conn_set_state(conn *c, enum conn_states state) {
-    assert(c != NULL);
-    assert(state >= conn_listening && state < conn_max_state);
+static bool conn_get_buffers(conn *c) {
+    LIBEVENT_THREAD *t = c->thread;
+    struct conn_bufs *b = t->conn_bufs_free;
+
+    assert(c->rbuf == NULL);
+    if (b != NULL) {
+        t->conn_bufs_free = b->next;
+        t->conn_bufs_free_count--;
+    } else if ((b = conn_bufs_new()) == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return false;
+    }
 
-    if (state != c->state) {
+    c->bufs = b;
+    c->rbuf = b->rbuf;
+    c->wbuf = b->wbuf;
+    c->ilist = b->ilist;
+    c->suffixlist = b->suffixlist;
+    c->iov = b->iov;
+    c->msglist = b->msglist;
+    c->rsize = b->rsize;
+    c->wsize = b->wsize;
+    c->isize = b->isize;
+    c->suffixsize = b->suffixsize;
+    c->iovsize = b->iovsize;
+    c->msgsize = b->msgsize;
+
+    c->rcurr = c->rbuf;
+    c->rbytes = 0;
+    c->wcurr = c->wbuf;
+    c->wbytes = 0;
+    c->icurr = c->ilist;
+    c->suffixcurr = c->suffixlist;
+    c->iovused = 0;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    return true;
+}
+
+/*
+ * Returns a connection's buffers to its worker's pool, or frees them if the
+ * pool is full. Anything left in them is discarded, so this is only for
+ * connections between requests or being closed.
+ */
+static void conn_put_buffers(conn *c) {
+    LIBEVENT_THREAD *t = c->thread;
+    struct conn_bufs *b = c->bufs;
+
+    if (c->rbuf == NULL)
+        return;
+
+    /* connections start out with buffers of their own */
+    if (b == NULL && (b = malloc(sizeof(struct conn_bufs))) == NULL)
+        return;
+
+    b->rbuf = c->rbuf;
+    b->wbuf = c->wbuf;
+    b->ilist = c->ilist;
+    b->suffixlist = c->suffixlist;
+    b->iov = c->iov;
+    b->msglist = c->msglist;
+    b->rsize = c->rsize;
+    b->wsize = c->wsize;
+    b->isize = c->isize;
+    b->suffixsize = c->suffixsize;
+    b->iovsize = c->iovsize;
+    b->msgsize = c->msgsize;
+
+    c->bufs = NULL;
+    c->rbuf = c->rcurr = NULL;
+    c->wbuf = c->wcurr = NULL;
+    c->ilist = c->icurr = NULL;
+    c->suffixlist = c->suffixcurr = NULL;
+    c->iov = NULL;
+    c->msglist = NULL;
+    c->rsize = c->wsize = c->isize = c->suffixsize = 0;
+    c->iovsize = c->msgsize = 0;
+    c->rbytes = c->wbytes = 0;
+    c->iovused = c->msgcurr = c->msgused = 0;
+
+    if (t->conn_bufs_free_count >= CONN_BUFS_FREE_MAX) {
+        conn_bufs_free(b);
+        return;
+    }
+    b->next = t->conn_bufs_free;
+    t->conn_bufs_free = b;
+    t->conn_bufs_free_count++;
+}
+
+/**
+ * Convert a state name to a human readable form.
+ */
+static const char *state_text(enum conn_states state) {
+    const char* const statenames[] = { "conn_listening",
+                                       "conn_new_cmd",
+                                       "conn_waiting",
+                                       "conn_read",
+                                       "conn_parse_cmd",
+                                       "conn_write",
+                                       "conn_nread",
+                                       "conn_swallow",
+                                       "conn_closing",
+                                       "conn_mwrite",
+                                       "conn_closed",
+                                       "conn_watch" };
+    return statenames[state];
+}
+
+/*
+ * Sets a connection's current state in the state machine. Any special
+ * processing that needs to happen on certain state transitions can
+ * happen here.
+ */
+static void conn_set_state(conn *c, enum conn_states state) {
+    assert(c != NULL);
+    assert(state >= conn_listening && state < conn_max_state);
+
+    if (state != c->state) {
         if (settings.verbose > 2) {
             fprintf(stderr, "%d: going from %s to %s\n",
                     c->sfd, state_text(c->state),
@@ -1032,6 +1650,27 @@ static int add_chunked_item_iovs(conn *c, item *it, int len) {
     return 0;
 }
 
+/* As above for len bytes from offset on. Chunks before offset are only
+ * stepped over. */
+static int add_chunked_item_iovs_range(conn *c, item *it, int offset, int len) {
+    assert(it->it_flags & ITEM_CHUNKED);
+    item_chunk *ch = (item_chunk *) ITEM_data(it);
+    while (ch && offset >= ch->used) {
+        offset -= ch->used;
+        ch = ch->next;
+    }
+    while (ch && len > 0) {
+        int todo = (len > ch->used - offset) ? ch->used - offset : len;
+        if (add_iov(c, ch->data + offset, todo) != 0) {
+            return -1;
+        }
+        ch = ch->next;
+        offset = 0;
+        len -= todo;
+    }
+    return 0;
+}
+
 /*
  * Constructs a set of UDP headers and attaches them to the outgoing messages.
  */
@@ -1107,9 +1746,24 @@ static void out_string(conn *c, const char *str) {
         len = strlen(str);
     }
 
-    memcpy(c->wbuf, str, len);
-    memcpy(c->wbuf + len, "\r\n", 2);
-    c->wbytes = len + 2;
+    if (c->wdefer + len + 2 > c->wsize) {
+        /* no room behind held back responses; they have to stay in order */
+        char *newbuf = realloc(c->wbuf, c->wdefer + len + 2);
+        if (newbuf == NULL) {
+            /* can't keep our place in the stream */
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        c->wbuf = newbuf;
+        c->wsize = c->wdefer + len + 2;
+    }
+
+    /* The response goes after any held back from earlier pipelined
+     * commands, so whether it's sent or held back too, one write covers
+     * them all. */
+    memcpy(c->wbuf + c->wdefer, str, len);
+    memcpy(c->wbuf + c->wdefer + len, "\r\n", 2);
+    c->wbytes = c->wdefer + len + 2;
     c->wcurr = c->wbuf;
 
     conn_set_state(c, conn_write);
@@ -1117,6 +1771,147 @@ static void out_string(conn *c, const char *str) {
     return;
 }
 
+/*
+ * ASCII commands are looked up by first letter and length rather than with a
+ * chain of strcmp()s, so "set" is found after comparing at most a couple of
+ * bytes no matter how many commands are tried before it. Buckets list their
+ * most used commands first.
+ */
+enum ascii_cmd {
+    ACMD_NONE = 0,
+    ACMD_GET, ACMD_BGET, ACMD_GETS, ACMD_GAT, ACMD_GATS, ACMD_GETRANGE,
+    ACMD_SET, ACMD_ADD, ACMD_REPLACE, ACMD_APPEND, ACMD_PREPEND, ACMD_CAS,
+    ACMD_INCR, ACMD_DECR, ACMD_DELETE, ACMD_TOUCH,
+    ACMD_MG, ACMD_MS, ACMD_MD, ACMD_MA, ACMD_MN,
+    ACMD_STATS, ACMD_FLUSH_ALL, ACMD_FLUSH_PREFIX, ACMD_VERSION, ACMD_QUIT, ACMD_SHUTDOWN,
+    ACMD_SLABS, ACMD_LRU_CRAWLER, ACMD_WATCH, ACMD_CACHE_MEMLIMIT,
+    ACMD_VERBOSITY, ACMD_LRU, ACMD_MISBEHAVE, ACMD_DEBUGMIGRATE, ACMD_EXTSTORE
+};
+
+#define ASCII_CMD_BUCKET 6
+
+static const struct {
+    const char *name;
+    unsigned char len;
+    unsigned char cmd;
+} ascii_cmd_table[26][ASCII_CMD_BUCKET] = {
+    ['a' - 'a'] = { { "add", 3, ACMD_ADD }, { "append", 6, ACMD_APPEND } },
+    ['b' - 'a'] = { { "bget", 4, ACMD_BGET } },
+    ['c' - 'a'] = { { "cas", 3, ACMD_CAS },
+                    { "cache_memlimit", 14, ACMD_CACHE_MEMLIMIT } },
+    ['d' - 'a'] = { { "delete", 6, ACMD_DELETE }, { "decr", 4, ACMD_DECR },
+#ifdef MEMCACHED_DEBUG
+                    { "debugmigrate", 12, ACMD_DEBUGMIGRATE },
+#endif
+                  },
+#ifdef EXTSTORE
+    ['e' - 'a'] = { { "extstore", 8, ACMD_EXTSTORE } },
+#endif
+    ['f' - 'a'] = { { "flush_all", 9, ACMD_FLUSH_ALL },
+                    { "flush_prefix", 12, ACMD_FLUSH_PREFIX } },
+    ['g' - 'a'] = { { "get", 3, ACMD_GET }, { "gets", 4, ACMD_GETS },
+                    { "gat", 3, ACMD_GAT }, { "gats", 4, ACMD_GATS },
+                    { "getrange", 8, ACMD_GETRANGE } },
+    ['i' - 'a'] = { { "incr", 4, ACMD_INCR } },
+    ['l' - 'a'] = { { "lru", 3, ACMD_LRU },
+                    { "lru_crawler", 11, ACMD_LRU_CRAWLER } },
+    ['m' - 'a'] = { { "mg", 2, ACMD_MG }, { "ms", 2, ACMD_MS },
+                    { "md", 2, ACMD_MD }, { "ma", 2, ACMD_MA },
+                    { "mn", 2, ACMD_MN },
+#ifdef MEMCACHED_DEBUG
+                    { "misbehave", 9, ACMD_MISBEHAVE },
+#endif
+                  },
+    ['p' - 'a'] = { { "prepend", 7, ACMD_PREPEND } },
+    ['q' - 'a'] = { { "quit", 4, ACMD_QUIT } },
+    ['r' - 'a'] = { { "replace", 7, ACMD_REPLACE } },
+    ['s' - 'a'] = { { "set", 3, ACMD_SET }, { "stats", 5, ACMD_STATS },
+                    { "slabs", 5, ACMD_SLABS },
+                    { "shutdown", 8, ACMD_SHUTDOWN } },
+    ['t' - 'a'] = { { "touch", 5, ACMD_TOUCH } },
+    ['v' - 'a'] = { { "version", 7, ACMD_VERSION },
+                    { "verbosity", 9, ACMD_VERBOSITY } },
+    ['w' - 'a'] = { { "watch", 5, ACMD_WATCH } },
+};
+
+static enum ascii_cmd ascii_cmd_lookup(const char *cmd, const size_t len) {
+    unsigned int b, i;
+
+    if (len == 0 || cmd[0] < 'a' || cmd[0] > 'z')
+        return ACMD_NONE;
+    b = cmd[0] - 'a';
+    for (i = 0; i < ASCII_CMD_BUCKET && ascii_cmd_table[b][i].name; i++) {
+        if (ascii_cmd_table[b][i].len == len &&
+                memcmp(ascii_cmd_table[b][i].name + 1, cmd + 1, len - 1) == 0)
+            return ascii_cmd_table[b][i].cmd;
+    }
+    return ACMD_NONE;
+}
+
+/*
+ * Pipelined ASCII mutations don't each need their own write. When a simple
+ * response is ready and the read buffer already holds more input, the
+ * response is held back at the start of wbuf (c->wdefer bytes) and the next
+ * command runs; its response is appended behind it. Everything held back
+ * goes out in one write as soon as a command produces some other kind of
+ * response, we'd have to wait for more input, or we're about to yield.
+ */
+#define WRITE_DEFER_MAX_FILL 2  /* stop holding back once wbuf is 1/2 full */
+
+static bool ascii_cmd_deferrable(const char *cmd, const size_t len) {
+    const char *sp = memchr(cmd, ' ', len);
+
+    /* only commands that have arguments after them */
+    if (sp == NULL || sp + 1 == cmd + len)
+        return false;
+    switch (ascii_cmd_lookup(cmd, sp - cmd)) {
+    case ACMD_SET:
+    case ACMD_ADD:
+    case ACMD_REPLACE:
+    case ACMD_APPEND:
+    case ACMD_PREPEND:
+    case ACMD_CAS:
+    case ACMD_DELETE:
+    case ACMD_TOUCH:
+    case ACMD_INCR:
+    case ACMD_DECR:
+    case ACMD_MS:
+    case ACMD_MD:
+    case ACMD_MA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Can the simple response in wbuf wait for the next command's? nreqs is
+ * what's left of this event's budget; if the next command would yield
+ * instead of running, send now. */
+static bool conn_defer_response(conn *c, const int nreqs) {
+    return IS_TCP(c->transport) && c->protocol == ascii_prot
+        && nreqs > 0 && c->rbytes > 0
+        && c->iovused == 0 && c->write_and_free == NULL
+        && c->write_and_go == conn_new_cmd
+        && c->wbytes <= c->wsize / WRITE_DEFER_MAX_FILL;
+}
+
+/* Sends the held back responses, then continues in next_state. The iov is
+ * built here so conn_write doesn't hold them back all over again. */
+static void conn_flush_deferred(conn *c, const enum conn_states next_state) {
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0 || add_iov(c, c->wbuf, c->wdefer) != 0) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    c->wcurr = c->wbuf;
+    c->wbytes = c->wdefer;
+    c->wdefer = 0;
+    conn_set_state(c, conn_write);
+    c->write_and_go = next_state;
+}
+
 /*
  * Outputs a protocol-specific "out of memory" error. For ASCII clients,
  * this is equivalent to out_string().
@@ -1148,9 +1943,7 @@ static void complete_nread_ascii(conn *c) {
     enum store_item_type ret;
     bool is_valid = false;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[ITEM_clsid(it)].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].set_cmds);
 
     if ((it->it_flags & ITEM_CHUNKED) == 0) {
         if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) == 0) {
@@ -1215,7 +2008,9 @@ static void complete_nread_ascii(conn *c) {
       }
 #endif
 
-      switch (ret) {
+      if (c->meta_set) {
+          meta_store_response(c, it, ret);
+      } else switch (ret) {
       case STORED:
           out_string(c, "STORED");
           break;
@@ -1234,6 +2029,7 @@ static void complete_nread_ascii(conn *c) {
 
     }
 
+    c->meta_set = false;
     item_remove(c->item);       /* release the c->item reference */
     c->item = 0;
 }
@@ -1462,13 +2258,11 @@ static void complete_incr_bin(conn *c) {
                         "SERVER_ERROR Out of memory allocating new item");
             }
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
             if (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT) {
-                c->thread->stats.incr_misses++;
+                THR_STATS_INCR(c->thread, incr_misses);
             } else {
-                c->thread->stats.decr_misses++;
+                THR_STATS_INCR(c->thread, decr_misses);
             }
-            pthread_mutex_unlock(&c->thread->stats.mutex);
 
             write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
         }
@@ -1486,9 +2280,7 @@ static void complete_update_bin(conn *c) {
 
     item *it = c->item;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[ITEM_clsid(it)].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].set_cmds);
 
     /* We don't actually receive the trailing two characters in the bin
      * protocol, so we're going to just set them here */
@@ -1577,8 +2369,59 @@ static void write_bin_miss_response(conn *c, char *key, size_t nkey) {
     }
 }
 
+/* Most keys a multiget looks up at once; see process_get_command(). */
+#define GET_BATCH 32
+
+/*
+ * A binary multiget is a run of GETQ/GETKQ packets ending in a GET/GETK or
+ * NOOP, and most of it is usually in the read buffer by the time its first
+ * key is looked up. Hash the keys of the gets waiting behind this one and
+ * start fetching their buckets and items, as process_get_command() does
+ * for a batch of keys, so their lookups find them in cache.
+ */
+static void process_bin_prefetch(conn *c) {
+    protocol_binary_request_header req;
+    uint32_t hvs[GET_BATCH];
+    char *p = c->rcurr;
+    int left = c->rbytes;
+    int n = 0;
+
+    if (c->bin_prefetched > 0) {
+        c->bin_prefetched--;
+        return;
+    }
+    while (n < GET_BATCH && left >= (int)sizeof(req)) {
+        uint16_t keylen;
+        uint32_t bodylen;
+
+        memcpy(&req, p, sizeof(req));
+        if (req.request.magic != PROTOCOL_BINARY_REQ ||
+                (req.request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+                 req.request.opcode != PROTOCOL_BINARY_CMD_GETKQ &&
+                 req.request.opcode != PROTOCOL_BINARY_CMD_GET &&
+                 req.request.opcode != PROTOCOL_BINARY_CMD_GETK))
+            break;
+        keylen = ntohs(req.request.keylen);
+        bodylen = ntohl(req.request.bodylen);
+        if (keylen > KEY_MAX_LENGTH || req.request.extlen + keylen > bodylen ||
+                sizeof(req) + req.request.extlen + keylen > (size_t)left)
+            break;
+        hvs[n] = hash(p + sizeof(req) + req.request.extlen, keylen);
+        assoc_prefetch(hvs[n++]);
+        if (sizeof(req) + bodylen > (size_t)left)
+            break;
+        p += sizeof(req) + bodylen;
+        left -= sizeof(req) + bodylen;
+    }
+    if (n > 1) {
+        item_prefetch(c->thread, hvs, n);
+    }
+    c->bin_prefetched = n;
+}
+
 static void process_bin_get_or_touch(conn *c) {
     item *it;
+    uint32_t hv = 0;
 
     protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->wbuf;
     char* key = binary_get_key(c);
@@ -1597,29 +2440,47 @@ static void process_bin_get_or_touch(conn *c) {
         fputc('\n', stderr);
     }
 
+    if (!should_touch) {
+        process_bin_prefetch(c);
+    }
+
     if (should_touch) {
         protocol_binary_request_touch *t = binary_get_request(c);
         time_t exptime = ntohl(t->message.body.expiration);
 
         it = item_touch(key, nkey, realtime(exptime), c);
+    } else if (c->thread->hotkeys) {
+        hv = hash(key, nkey);
+        if ((it = hotcache_get(c->thread->hotkeys, key, nkey, hv)) != NULL) {
+            THR_STATS_INCR(c->thread, hotcache_hits);
+        } else if ((it = item_get(key, nkey, c, DO_UPDATE)) != NULL) {
+            hotcache_fill(c->thread->hotkeys, it, hv);
+        }
     } else {
         it = item_get(key, nkey, c, DO_UPDATE);
     }
+    if (it && (it->it_flags & ITEM_COMPRESSED)) {
+        it = get_decompressed(c, it);
+    }
+    if (c->thread->hotkeys && should_return_value) {
+        if (should_touch)
+            hv = hash(key, nkey);
+        hotkeys_record(c->thread->hotkeys, key, nkey, hv,
+                       it ? it->nbytes - 2 : 0);
+    }
 
     if (it) {
         /* the length has two unnecessary bytes ("\r\n") */
         uint16_t keylen = 0;
         uint32_t bodylen = sizeof(rsp->message.body) + (it->nbytes - 2);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
+            THR_STATS_INCR(c->thread, touch_cmds);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.lru_hits[it->slabs_clsid]++;
+            THR_STATS_INCR(c->thread, get_cmds);
+            THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, ITEM_key(it), it->nkey,
@@ -1703,15 +2564,13 @@ static void process_bin_get_or_touch(conn *c) {
     }
 
     if (failed) {
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.touch_misses++;
+            THR_STATS_INCR(c->thread, touch_cmds);
+            THR_STATS_INCR(c->thread, touch_misses);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.get_misses++;
+            THR_STATS_INCR(c->thread, get_cmds);
+            THR_STATS_INCR(c->thread, get_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, key, nkey, -1, 0);
@@ -2133,9 +2992,7 @@ static void process_bin_complete_sasl_auth(conn *c) {
     case SASL_OK:
         c->authenticated = true;
         write_bin_response(c, "Authenticated", 0, 0, strlen("Authenticated"));
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, auth_cmds);
         break;
     case SASL_CONTINUE:
         add_bin_header(c, PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE, 0, 0, outlen);
@@ -2149,10 +3006,8 @@ static void process_bin_complete_sasl_auth(conn *c) {
         if (settings.verbose)
             fprintf(stderr, "Unknown sasl response:  %d\n", result);
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        c->thread->stats.auth_errors++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, auth_cmds);
+        THR_STATS_INCR(c->thread, auth_errors);
     }
 }
 
@@ -2555,9 +3410,7 @@ static void process_bin_flush(conn *c) {
         settings.oldest_live = new_oldest;
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.flush_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, flush_cmds);
 
     write_bin_response(c, NULL, 0, 0, 0);
 }
@@ -2590,9 +3443,7 @@ static void process_bin_delete(conn *c) {
         uint64_t cas = ntohll(req->message.header.request.cas);
         if (cas == 0 || cas == ITEM_get_cas(it)) {
             MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].delete_hits);
             item_unlink(it);
             STORAGE_delete(c->thread->storage, it);
             write_bin_response(c, NULL, 0, 0, 0);
@@ -2602,9 +3453,7 @@ static void process_bin_delete(conn *c) {
         item_remove(it);      /* release our reference */
     } else {
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, delete_misses);
     }
 }
 
@@ -2660,6 +3509,12 @@ static void reset_cmd_handler(conn *c) {
         c->item = NULL;
     }
     conn_shrink(c);
+#ifdef EXTSTORE
+    /* send whatever out of order reads have come back before the next
+     * command; held back responses go out first, in try_read_command() */
+    if (c->io_donelist != NULL && c->wdefer == 0 && conn_add_io_done(c))
+        return;
+#endif
     if (c->rbytes > 0) {
         conn_set_state(c, conn_parse_cmd);
     } else {
@@ -2672,7 +3527,9 @@ static void complete_nread(conn *c) {
     assert(c->protocol == ascii_prot
            || c->protocol == binary_prot);
 
-    if (c->protocol == ascii_prot) {
+    if (c->proxy != NULL) {
+        proxy_complete_nread(c);
+    } else if (c->protocol == ascii_prot) {
         complete_nread_ascii(c);
     } else if (c->protocol == binary_prot) {
         complete_nread_binary(c);
@@ -2751,6 +3608,88 @@ static int _store_item_copy_chunks(item *d_it, item *s_it, const int len) {
     return 0;
 }
 
+/* Copies len bytes into dch and the chunks after it, which have room. */
+static item_chunk *_store_item_fill_chunks(item_chunk *dch, const char *src, int len) {
+    while (len > 0) {
+        int todo = dch->size - dch->used;
+        if (todo == 0) {
+            dch = dch->next;
+            continue;
+        }
+        if (todo > len)
+            todo = len;
+        memcpy(dch->data + dch->used, src, todo);
+        dch->used += todo;
+        src += todo;
+        len -= todo;
+    }
+    return dch;
+}
+
+/*
+ * Appends to a chunked item without copying its value: new_it, a bare
+ * chunked header, takes over old_it's chunks, gets chunks for the rest, and
+ * only add_it's data is copied, over the old value's \r\n. old_it is left a
+ * header with no chunks, so it has to be one nobody else is reading.
+ * Returns 1, having done nothing, if the chain isn't laid out for this;
+ * -1 with old_it untouched if there's no memory for the new chunks.
+ * This should be part of item.c too.
+ */
+static int _store_item_append_chunks(item *old_it, item *new_it, item *add_it) {
+    item_chunk *ohead = (item_chunk *) ITEM_data(old_it);
+    item_chunk *nhead = (item_chunk *) ITEM_data(new_it);
+    item_chunk *ch, *tail = NULL, *last = NULL, *extra;
+    int room = 2, remain;
+
+    assert(new_it->it_flags & ITEM_CHUNKED);
+    if (old_it->refcount != 2 || ohead->next == NULL)
+        return 1;
+    /* the value fills each chunk before the next one, with maybe some
+     * empty ones at the end */
+    for (ch = ohead->next; ch; ch = ch->next) {
+        if (ch->used > 0) {
+            if (tail != NULL && (tail->used != tail->size || last != tail))
+                return 1;
+            tail = ch;
+        }
+        room += ch->size - ch->used;
+        last = ch;
+    }
+    if (tail == NULL || tail->used < 2)
+        return 1;
+
+    /* get everything we need before touching old_it */
+    ch = nhead;
+    for (remain = add_it->nbytes - room; remain > 0; remain -= ch->size) {
+        if ((ch = do_item_alloc_chunk(ch, remain)) == NULL)
+            return -1;
+    }
+    extra = nhead->next;
+
+    /* slab rebalance finds an item from its chunks' head pointers */
+    slabs_mlock();
+    nhead->next = ohead->next;
+    nhead->next->prev = nhead;
+    for (ch = nhead->next; ch; ch = ch->next) {
+        ch->head = new_it;
+    }
+    last->next = extra;
+    if (extra != NULL)
+        extra->prev = last;
+    ohead->next = NULL;
+    slabs_munlock();
+
+    tail->used -= 2;
+    if (add_it->it_flags & ITEM_CHUNKED) {
+        for (ch = (item_chunk *) ITEM_data(add_it); ch; ch = ch->next) {
+            tail = _store_item_fill_chunks(tail, ch->data, ch->used);
+        }
+    } else {
+        _store_item_fill_chunks(tail, ITEM_data(add_it), add_it->nbytes);
+    }
+    return 0;
+}
+
 static int _store_item_copy_data(int comm, item *old_it, item *new_it, item *add_it) {
     if (comm == NREAD_APPEND) {
         if (new_it->it_flags & ITEM_CHUNKED) {
@@ -2783,12 +3722,32 @@ static int _store_item_copy_data(int comm, item *old_it, item *new_it, item *add
  *
  * Returns the state of storage.
  */
+/*
+ * -o compress_min: the item to link in it's place, which is a compressed
+ * copy if the value is big enough and compressing it pays. The copy is
+ * left in *zit for the caller to release.
+ */
+static item *_store_item_compress(conn *c, item *it, item **zit) {
+    if (settings.compress_min == 0 || it->nbytes - 2 < settings.compress_min
+            || (it->it_flags & (ITEM_CHUNKED|ITEM_COMPRESSED)) != 0)
+        return it;
+    *zit = do_item_compress(it, &c->thread->compress_buf,
+            &c->thread->compress_buf_size);
+    if (*zit == NULL)
+        return it;
+    THR_STATS_INCR(c->thread, compress_sets);
+    THR_STATS_ADD(c->thread, compress_bytes_saved, it->nbytes - (*zit)->nbytes);
+    return *zit;
+}
+
 enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t hv) {
     char *key = ITEM_key(it);
     item *old_it = do_item_get(key, it->nkey, hv, c, DONT_UPDATE);
     enum store_item_type stored = NOT_STORED;
 
     item *new_it = NULL;
+    item *zit = NULL;
+    item *req_it = it;
     uint32_t flags;
 
     if (old_it != NULL && comm == NREAD_ADD) {
@@ -2803,25 +3762,20 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         if(old_it == NULL) {
             // LRU expired
             stored = NOT_FOUND;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.cas_misses++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, cas_misses);
         }
         else if (ITEM_get_cas(it) == ITEM_get_cas(old_it)) {
             // cas validates
             // it and old_it may belong to different classes.
             // I'm updating the stats for the one that's getting pushed out
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[ITEM_clsid(old_it)].cas_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(old_it)].cas_hits);
 
             STORAGE_delete(c->thread->storage, old_it);
+            it = _store_item_compress(c, it, &zit);
             item_replace(old_it, it, hv);
             stored = STORED;
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[ITEM_clsid(old_it)].cas_badval++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(old_it)].cas_badval);
 
             if(settings.verbose > 1) {
                 fprintf(stderr, "CAS:  failure: expected %llu, got %llu\n",
@@ -2858,31 +3812,44 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
             if (stored == NOT_STORED) {
                 /* we have it and old_it here - alloc memory to hold both */
                 /* flags was already lost - so recover them from ITEM_suffix(it) */
+                item *raw_it = old_it;
 
-                if (settings.inline_ascii_response) {
-                    flags = (uint32_t) strtoul(ITEM_suffix(old_it), (char **) NULL, 10);
-                } else if (old_it->nsuffix > 0) {
-                    flags = *((uint32_t *)ITEM_suffix(old_it));
-                } else {
-                    flags = 0;
-                }
-
-                new_it = do_item_alloc(key, it->nkey, flags, old_it->exptime, it->nbytes + old_it->nbytes - 2 /* CRLF */);
-
-                /* copy data from it and old_it to new_it */
-                if (new_it == NULL || _store_item_copy_data(comm, old_it, new_it, it) == -1) {
+                flags = item_client_flags(old_it);
+                /* a compressed value is appended to in the clear */
+                if ((old_it->it_flags & ITEM_COMPRESSED) &&
+                        (raw_it = item_decompress(old_it)) == NULL) {
                     failed_alloc = 1;
-                    stored = NOT_STORED;
-                    // failed data copy, free up.
-                    if (new_it != NULL)
-                        item_remove(new_it);
                 } else {
-                    it = new_it;
+                    int moved = 1;
+                    new_it = do_item_alloc(key, it->nkey, flags, old_it->exptime, it->nbytes + raw_it->nbytes - 2 /* CRLF */);
+
+                    /* a big value is appended to by moving its chunks over */
+                    if (new_it != NULL && comm == NREAD_APPEND &&
+                            (old_it->it_flags & ITEM_CHUNKED)) {
+                        moved = _store_item_append_chunks(old_it, new_it, it);
+                        if (moved == 0)
+                            THR_STATS_INCR(c->thread, append_nocopy);
+                    }
+                    /* copy data from it and old_it to new_it */
+                    if (new_it == NULL || moved == -1 || (moved == 1 &&
+                                _store_item_copy_data(comm, raw_it, new_it, it) == -1)) {
+                        failed_alloc = 1;
+                        stored = NOT_STORED;
+                        // failed data copy, free up.
+                        if (new_it != NULL)
+                            do_item_remove(new_it);
+                        new_it = NULL;
+                    } else {
+                        it = new_it;
+                    }
+                    if (raw_it != old_it)
+                        do_item_remove(raw_it);
                 }
             }
         }
 
         if (stored == NOT_STORED && failed_alloc == 0) {
+            it = _store_item_compress(c, it, &zit);
             if (old_it != NULL) {
                 STORAGE_delete(c->thread->storage, old_it);
                 item_replace(old_it, it, hv);
@@ -2896,14 +3863,20 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         }
     }
 
+    if (stored == STORED) {
+        c->cas = ITEM_get_cas(it);
+        /* a compressed copy went in its place; whoever answers the
+         * request looks at the one it sent */
+        if (zit != NULL)
+            ITEM_set_cas(req_it, c->cas);
+    }
+
     if (old_it != NULL)
         do_item_remove(old_it);         /* release our reference */
     if (new_it != NULL)
         do_item_remove(new_it);
-
-    if (stored == STORED) {
-        c->cas = ITEM_get_cas(it);
-    }
+    if (zit != NULL)
+        do_item_remove(zit);
     LOGGER_LOG(c->thread->l, LOG_MUTATIONS, LOGGER_ITEM_STORE, NULL,
             stored, comm, ITEM_key(it), it->nkey, it->exptime, ITEM_clsid(it));
 
@@ -2938,33 +3911,61 @@ typedef struct token_s {
  *      command  = tokens[ix].value;
  *   }
  */
+/* Records the token ending at the space at e, if there is one. Returns true
+ * once there's no room for more; *s is then where the rest starts. */
+static inline bool tokenize_space(char **s, char *e, token_t *tokens,
+                                  size_t *ntokens, const size_t max_tokens) {
+    if (*s != e) {
+        tokens[*ntokens].value = *s;
+        tokens[*ntokens].length = e - *s;
+        (*ntokens)++;
+        *e = '\0';
+        if (*ntokens == max_tokens - 1) {
+            *s = e + 1; /* so we don't add an extra token */
+            return true;
+        }
+    }
+    *s = e + 1;
+    return false;
+}
+
 static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
     char *s, *e;
     size_t ntokens = 0;
     size_t len = strlen(command);
-    unsigned int i = 0;
+    size_t i = 0;
 
     assert(command != NULL && tokens != NULL && max_tokens > 1);
 
-    s = e = command;
-    for (i = 0; i < len; i++) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-                if (ntokens == max_tokens - 1) {
-                    e++;
-                    s = e; /* so we don't add an extra token */
-                    break;
+    s = command;
+    e = command + len;
+#if defined(__SSE2__) && defined(__GNUC__)
+    /* Find the spaces sixteen bytes at a time. */
+    {
+        const __m128i spaces = _mm_set1_epi8(' ');
+        for (; i + 16 <= len; i += 16) {
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(command + i)), spaces));
+            while (mask != 0) {
+                char *sp = command + i + __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (tokenize_space(&s, sp, tokens, &ntokens, max_tokens)) {
+                    e = s;
+                    goto done;
                 }
             }
-            s = e + 1;
         }
-        e++;
+    }
+#endif
+    for (; i < len; i++) {
+        if (command[i] == ' ' &&
+                tokenize_space(&s, command + i, tokens, &ntokens, max_tokens)) {
+            e = s;
+            goto done;
+        }
     }
 
+done:
     if (s != e) {
         tokens[ntokens].value = s;
         tokens[ntokens].length = e - s;
@@ -3098,6 +4099,8 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("cmd_get", "%llu", (unsigned long long)thread_stats.get_cmds);
     APPEND_STAT("cmd_set", "%llu", (unsigned long long)slab_stats.set_cmds);
     APPEND_STAT("cmd_flush", "%llu", (unsigned long long)thread_stats.flush_cmds);
+    APPEND_STAT("cmd_flush_prefix", "%llu", (unsigned long long)thread_stats.flush_prefix_cmds);
+    APPEND_STAT("cmd_getrange", "%llu", (unsigned long long)thread_stats.getrange_cmds);
     APPEND_STAT("cmd_touch", "%llu", (unsigned long long)thread_stats.touch_cmds);
     APPEND_STAT("get_hits", "%llu", (unsigned long long)slab_stats.get_hits);
     APPEND_STAT("get_misses", "%llu", (unsigned long long)thread_stats.get_misses);
@@ -3106,11 +4109,13 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
 #ifdef EXTSTORE
     if (c->thread->storage) {
         APPEND_STAT("get_extstore", "%llu", (unsigned long long)thread_stats.get_extstore);
+        APPEND_STAT("get_extstore_ooo", "%llu", (unsigned long long)thread_stats.get_extstore_ooo);
         APPEND_STAT("recache_from_extstore", "%llu", (unsigned long long)thread_stats.recache_from_extstore);
         APPEND_STAT("miss_from_extstore", "%llu", (unsigned long long)thread_stats.miss_from_extstore);
         APPEND_STAT("badcrc_from_extstore", "%llu", (unsigned long long)thread_stats.badcrc_from_extstore);
     }
 #endif
+    APPEND_STAT("append_nocopy", "%llu", (unsigned long long)thread_stats.append_nocopy);
     APPEND_STAT("delete_misses", "%llu", (unsigned long long)thread_stats.delete_misses);
     APPEND_STAT("delete_hits", "%llu", (unsigned long long)slab_stats.delete_hits);
     APPEND_STAT("incr_misses", "%llu", (unsigned long long)thread_stats.incr_misses);
@@ -3127,6 +4132,30 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.idle_timeout) {
         APPEND_STAT("idle_kicks", "%llu", (unsigned long long)thread_stats.idle_kicks);
     }
+    if (settings.zerocopy_size) {
+        APPEND_STAT("zerocopy_sends", "%llu", (unsigned long long)thread_stats.zerocopy_sends);
+        APPEND_STAT("zerocopy_copied", "%llu", (unsigned long long)thread_stats.zerocopy_copied);
+    }
+    if (settings.conn_balance) {
+        APPEND_STAT("conn_migrations", "%llu", (unsigned long long)thread_stats.conn_migrations);
+    }
+    if (settings.numa) {
+        APPEND_STAT("numa_local_hits", "%llu", (unsigned long long)thread_stats.numa_local_hits);
+        APPEND_STAT("numa_remote_hits", "%llu", (unsigned long long)thread_stats.numa_remote_hits);
+    }
+    if (settings.proxy) {
+        APPEND_STAT("proxy_cmds", "%llu", (unsigned long long)thread_stats.proxy_cmds);
+        APPEND_STAT("proxy_backend_cmds", "%llu", (unsigned long long)thread_stats.proxy_backend_cmds);
+        APPEND_STAT("proxy_backend_failures", "%llu", (unsigned long long)thread_stats.proxy_backend_failures);
+    }
+    if (settings.compress_min) {
+        APPEND_STAT("compress_sets", "%llu", (unsigned long long)thread_stats.compress_sets);
+        APPEND_STAT("compress_bytes_saved", "%llu", (unsigned long long)thread_stats.compress_bytes_saved);
+        APPEND_STAT("decompress_gets", "%llu", (unsigned long long)thread_stats.decompress_gets);
+    }
+    if (settings.hotkeys_cache) {
+        APPEND_STAT("hotcache_hits", "%llu", (unsigned long long)thread_stats.hotcache_hits);
+    }
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
@@ -3138,6 +4167,9 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("hash_power_level", "%u", stats_state.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats_state.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats_state.hash_is_expanding);
+    APPEND_STAT("hash_load_factor", "%.2f", (double)stats_state.curr_items /
+                ((uint64_t)1 << stats_state.hash_power_level));
+    APPEND_STAT("hash_bytes_reclaimed", "%llu", (unsigned long long)stats.hash_bytes_reclaimed);
     if (settings.slab_reassign) {
         APPEND_STAT("slab_reassign_rescues", "%llu", stats.slab_reassign_rescues);
         APPEND_STAT("slab_reassign_chunk_rescues", "%llu", stats.slab_reassign_chunk_rescues);
@@ -3218,6 +4250,8 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("item_size_max", "%d", settings.item_size_max);
     APPEND_STAT("maxconns_fast", "%s", settings.maxconns_fast ? "yes" : "no");
     APPEND_STAT("hashpower_init", "%d", settings.hashpower_init);
+    APPEND_STAT("hash_buckets", "%s", settings.hash_buckets ? "yes" : "no");
+    APPEND_STAT("hash_shrink", "%s", settings.hash_shrink ? "yes" : "no");
     APPEND_STAT("slab_reassign", "%s", settings.slab_reassign ? "yes" : "no");
     APPEND_STAT("slab_automove", "%d", settings.slab_automove);
     APPEND_STAT("slab_automove_ratio", "%.2f", settings.slab_automove_ratio);
@@ -3243,6 +4277,21 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("worker_logbuf_size", "%u", settings.logger_buf_size);
     APPEND_STAT("track_sizes", "%s", item_stats_sizes_status() ? "yes" : "no");
     APPEND_STAT("inline_ascii_response", "%s", settings.inline_ascii_response ? "yes" : "no");
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "yes" : "no");
+    APPEND_STAT("udp_batch", "%d", settings.udp_batch);
+    APPEND_STAT("zerocopy_size", "%u", settings.zerocopy_size);
+    APPEND_STAT("conn_buffer_pool", "%s", settings.conn_buffer_pool ? "yes" : "no");
+    APPEND_STAT("conn_balance", "%s", settings.conn_balance ? "yes" : "no");
+    APPEND_STAT("numa", "%s", settings.numa ? "yes" : "no");
+    APPEND_STAT("proxy_servers", "%d", proxy_server_count());
+    APPEND_STAT("proxy_timeout", "%d", settings.proxy_timeout);
+    APPEND_STAT("compress_min", "%u", settings.compress_min);
+    APPEND_STAT("hotkeys", "%d", settings.hotkeys);
+    APPEND_STAT("hotkeys_window", "%d", settings.hotkeys_window);
+    APPEND_STAT("hotkeys_cache", "%s", settings.hotkeys_cache ? "yes" : "no");
+#ifdef HAVE_IO_URING
+    APPEND_STAT("io_uring", "%s", settings.io_uring ? "yes" : "no");
+#endif
 #ifdef EXTSTORE
     APPEND_STAT("ext_item_size", "%u", settings.ext_item_size);
     APPEND_STAT("ext_item_age", "%u", settings.ext_item_age);
@@ -3444,6 +4493,14 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return ;
     } else if (strcmp(subcommand, "conns") == 0) {
         process_stats_conns(&append_stats, c);
+    } else if (strcmp(subcommand, "hash") == 0) {
+        assoc_stats(&append_stats, c);
+    } else if (strcmp(subcommand, "hotkeys") == 0) {
+        if (!settings.hotkeys) {
+            out_string(c, "CLIENT_ERROR hotkeys not enabled");
+            return;
+        }
+        hotkeys_stats(&append_stats, c);
 #ifdef EXTSTORE
     } else if (strcmp(subcommand, "extstore") == 0) {
         process_extstore_stats(&append_stats, c);
@@ -3502,18 +4559,33 @@ static inline int make_ascii_get_suffix(char *suffix, item *it, bool return_cas,
     return (p - suffix) + 2;
 }
 
-#define IT_REFCOUNT_LIMIT 60000
-static inline item* limited_get(char *key, size_t nkey, conn *c, uint32_t exptime, bool should_touch) {
+/*
+ * -o compress_min: trades our reference to a compressed item for an
+ * expanded copy of it to send. A copy we can't make reads as a miss.
+ */
+static item *get_decompressed(conn *c, item *it) {
+    item *raw_it = item_decompress(it);
+    item_remove(it);
+    if (raw_it != NULL) {
+        THR_STATS_INCR(c->thread, decompress_gets);
+    }
+    return raw_it;
+}
+
+static inline item* limited_get(char *key, size_t nkey, uint32_t hv, conn *c, uint32_t exptime, bool should_touch) {
     item *it;
     if (should_touch) {
-        it = item_touch(key, nkey, exptime, c);
+        it = item_touch_hv(key, nkey, hv, exptime, c);
     } else {
-        it = item_get(key, nkey, c, DO_UPDATE);
+        it = item_get_hv(key, nkey, hv, c, DO_UPDATE);
     }
     if (it && it->refcount > IT_REFCOUNT_LIMIT) {
         item_remove(it);
         it = NULL;
     }
+    if (it && (it->it_flags & ITEM_COMPRESSED)) {
+        it = get_decompressed(c, it);
+    }
     return it;
 }
 
@@ -3600,6 +4672,15 @@ static void _get_extstore_cb(void *e, obj_io *io, int ret) {
         }
     }
 
+    if (wrap->ooo) {
+        /* c may be busy with other requests; its worker builds the
+         * response once it has a moment, see conn_add_io_done() */
+        wrap->miss = miss;
+        wrap->active = false;
+        redispatch_io(wrap);
+        return;
+    }
+
     if (miss) {
         int i;
         struct iovec *v;
@@ -3619,6 +4700,11 @@ static void _get_extstore_cb(void *e, obj_io *io, int ret) {
                 v->iov_len = 0;
                 v->iov_base = NULL;
             }
+            if (wrap->miss_line != NULL) {
+                v = &c->iov[wrap->iovec_start];
+                v->iov_base = wrap->miss_line;
+                v->iov_len = wrap->miss_len;
+            }
         }
         wrap->miss = true;
     } else {
@@ -3656,13 +4742,12 @@ static void _get_extstore_cb(void *e, obj_io *io, int ret) {
     }
 }
 
-// FIXME: This completely breaks UDP support.
-static inline int _get_extstore(conn *c, item *it, int iovst, int iovcnt) {
-    item_hdr *hdr = (item_hdr *)ITEM_data(it);
+/* Allocates the item an extstore read of header item it lands in. */
+static item *_get_extstore_item(item *it, bool *chunked) {
     size_t ntotal = ITEM_ntotal(it);
     unsigned int clsid = slabs_clsid(ntotal);
     item *new_it;
-    bool chunked = false;
+    *chunked = false;
     if (ntotal > settings.slab_chunk_size_max) {
         // Pull a chunked item header.
         // FIXME: make a func. used in several places.
@@ -3677,20 +4762,48 @@ static inline int _get_extstore(conn *c, item *it, int iovst, int iovcnt) {
 
         new_it = item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, it->nbytes);
         assert(new_it == NULL || (new_it->it_flags & ITEM_CHUNKED));
-        chunked = true;
+        *chunked = true;
     } else {
         new_it = do_item_alloc_pull(ntotal, clsid);
     }
     if (new_it == NULL)
-        return -1;
-    assert(!c->io_queued); // FIXME: debugging.
+        return NULL;
     // so we can free the chunk on a miss
     new_it->slabs_clsid = clsid;
+    return new_it;
+}
+
+/* Fills in where io's object lives, from header item it. */
+static void _get_extstore_io(io_wrap *io, item *it) {
+    item_hdr *hdr = (item_hdr *)ITEM_data(it);
+
+    // reference ourselves for the callback.
+    io->io.data = (void *)io;
+    io->io.page_version = hdr->page_version;
+    io->io.page_id = hdr->page_id;
+    io->io.offset = hdr->offset;
+    io->io.len = ITEM_ntotal(it);
+    io->io.mode = OBJ_IO_READ;
+    io->io.cb = _get_extstore_cb;
+}
+
+// FIXME: This completely breaks UDP support.
+static inline int _get_extstore(conn *c, item *it, int iovst, int iovcnt) {
+    item *new_it;
+    bool chunked;
+
+    new_it = _get_extstore_item(it, &chunked);
+    if (new_it == NULL)
+        return -1;
+    assert(!c->io_queued); // FIXME: debugging.
 
     io_wrap *io = do_cache_alloc(c->thread->io_cache);
     io->active = true;
     io->miss = false;
     io->badcrc = false;
+    io->miss_line = NULL;
+    io->ooo = false;
+    io->hit_line = NULL;
     // io_wrap owns the reference for this object now.
     io->hdr_it = it;
 
@@ -3742,47 +4855,216 @@ static inline int _get_extstore(conn *c, item *it, int iovst, int iovcnt) {
     c->io_wraplist = io;
     assert(c->io_wrapleft >= 0);
     c->io_wrapleft++;
-    // reference ourselves for the callback.
-    io->io.data = (void *)io;
-
     // Now, fill in io->io based on what was in our header.
-    io->io.page_version = hdr->page_version;
-    io->io.page_id = hdr->page_id;
-    io->io.offset = hdr->offset;
-    io->io.len = ntotal;
-    io->io.mode = OBJ_IO_READ;
-    io->io.cb = _get_extstore_cb;
+    _get_extstore_io(io, it);
 
     //fprintf(stderr, "EXTSTORE: IO stacked %u\n", io->iovec_data);
     // FIXME: This stat needs to move to reflect # of flash hits vs misses
     // for now it's a good gauge on how often we request out to flash at
     // least.
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.get_extstore++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, get_extstore);
 
     return 0;
 }
-#endif
-// FIXME: the 'breaks' around memory malloc's should break all the way down,
-// fill ileft/suffixleft, then run conn_releaseitems()
-/* ntokens is overwritten here... shrug.. */
-static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas, bool should_touch) {
-    char *key;
-    size_t nkey;
-    int i = 0;
-    int si = 0;
-    item *it;
-    token_t *key_token = &tokens[KEY_TOKEN];
-    char *suffix;
-    int32_t exptime_int = 0;
-    rel_time_t exptime = 0;
-    assert(c != NULL);
 
-    if (should_touch) {
-        // For get and touch commands, use first token as exptime
-        if (!safe_strtol(tokens[1].value, &exptime_int)) {
-            out_string(c, "CLIENT_ERROR invalid exptime argument");
+/*
+ * Starts reading header item it's value for an mg that may be answered out
+ * of order. Nothing goes into the conn's response; the read is submitted
+ * right away and the response (hit_len bytes of hit_line then the value, or
+ * miss_len bytes of miss_line) is sent by itself once it's back, so requests
+ * behind it needn't wait. Takes over the reference to it on success.
+ */
+static int _get_extstore_ooo(conn *c, item *it, const char *hit_line,
+        const int hit_len, const char *miss_line, const int miss_len) {
+    item *new_it;
+    bool chunked;
+    char *lines;
+    struct iovec *iov = NULL;
+    int iovcnt = 0;
+
+    lines = malloc(hit_len + miss_len);
+    if (lines == NULL)
+        return -1;
+    new_it = _get_extstore_item(it, &chunked);
+    if (new_it == NULL) {
+        free(lines);
+        return -1;
+    }
+    if (chunked) {
+        /* the header, then one per chunk; the conn's iovecs are no good here
+         * as they're reused by the responses sent in the meantime */
+        int size = 8;
+        size_t remain = new_it->nbytes;
+        item_chunk *chunk = (item_chunk *) ITEM_data(new_it);
+        iov = malloc(sizeof(struct iovec) * size);
+        if (iov == NULL)
+            goto fail;
+        iov[0].iov_base = new_it;
+        iov[0].iov_len = ITEM_ntotal(new_it) - new_it->nbytes;
+        iovcnt = 1;
+        while (remain > 0) {
+            chunk = do_item_alloc_chunk(chunk, remain);
+            if (chunk == NULL)
+                goto fail;
+            if (iovcnt == size) {
+                struct iovec *niov = realloc(iov, sizeof(struct iovec) * size * 2);
+                if (niov == NULL)
+                    goto fail;
+                iov = niov;
+                size *= 2;
+            }
+            chunk->used = (remain < chunk->size) ? remain : chunk->size;
+            iov[iovcnt].iov_base = chunk->data;
+            iov[iovcnt].iov_len = chunk->used;
+            iovcnt++;
+            remain -= chunk->used;
+        }
+    }
+
+    io_wrap *io = do_cache_alloc(c->thread->io_cache);
+    if (io == NULL)
+        goto fail;
+    io->active = true;
+    io->miss = false;
+    io->badcrc = false;
+    io->ooo = true;
+    memcpy(lines, hit_line, hit_len);
+    io->hit_line = lines;
+    io->hit_len = hit_len;
+    memcpy(lines + hit_len, miss_line, miss_len);
+    io->miss_line = lines + hit_len;
+    io->miss_len = miss_len;
+    io->hdr_it = it;
+    io->c = c;
+    io->next = NULL;
+    io->io.iov = iov;
+    io->io.iovcnt = iovcnt;
+    io->io.buf = (void *)new_it;
+    io->io.next = NULL;
+    _get_extstore_io(io, it);
+
+    c->io_pending++;
+    THR_STATS_INCR(c->thread, get_extstore);
+    THR_STATS_INCR(c->thread, get_extstore_ooo);
+    extstore_submit(c->thread->storage, &io->io);
+    return 0;
+fail:
+    free(iov);
+    free(lines);
+    item_remove(new_it);
+    return -1;
+}
+
+/*
+ * Builds a response out of every out of order read that's come back and
+ * sets the conn to send it. Returns false, having released them, if all of
+ * them were quiet misses.
+ */
+static bool conn_add_io_done(conn *c) {
+    io_wrap *wrap;
+    int x;
+
+    /* an idle conn may have handed its buffers back to the pool */
+    if (c->rbuf == NULL && !conn_get_buffers(c))
+        goto oom;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0)
+        goto oom;
+    while ((wrap = c->io_donelist) != NULL) {
+        c->io_donelist = wrap->next;
+        /* released along with the response */
+        wrap->next = c->io_wraplist;
+        c->io_wraplist = wrap;
+        if (wrap->miss) {
+            if (wrap->miss_len > 0 &&
+                    add_iov(c, wrap->miss_line, wrap->miss_len) != 0)
+                goto oom;
+            continue;
+        }
+        if (add_iov(c, wrap->hit_line, wrap->hit_len) != 0)
+            goto oom;
+        if (wrap->io.iov == NULL) {
+            if (add_iov(c, ITEM_data((item *)wrap->io.buf),
+                        wrap->hdr_it->nbytes) != 0)
+                goto oom;
+        } else {
+            /* the header's length was zeroed by the callback */
+            for (x = 1; x < wrap->io.iovcnt; x++) {
+                if (add_iov(c, wrap->io.iov[x].iov_base,
+                            wrap->io.iov[x].iov_len) != 0)
+                    goto oom;
+            }
+        }
+    }
+    if (c->iovused == 0) {
+        conn_release_items(c);
+        return false;
+    }
+    conn_set_state(c, conn_mwrite);
+    return true;
+oom:
+    /* can't drop responses a client is waiting on; give up on it */
+    if (settings.verbose > 0)
+        fprintf(stderr, "Couldn't build out of order response\n");
+    conn_set_state(c, conn_closing);
+    return true;
+}
+
+/*
+ * An out of order read is back, on the conn's own worker. Sends it straight
+ * away if the conn is sitting idle, or leaves it for reset_cmd_handler() to
+ * pick up between requests.
+ */
+void conn_io_done(io_wrap *wrap) {
+    conn *c = wrap->c;
+
+    assert(c->io_pending > 0);
+    c->io_pending--;
+    wrap->next = NULL;
+    if (c->io_donelist == NULL) {
+        c->io_donelist = wrap;
+    } else {
+        io_wrap *tail = c->io_donelist;
+        while (tail->next != NULL)
+            tail = tail->next;
+        tail->next = wrap;
+    }
+
+    if (c->state == conn_closed) {
+        /* the client went away while this was out; see conn_close() */
+        if (c->io_pending == 0)
+            conn_close(c);
+    } else if (c->state == conn_read) {
+        /* waiting on the client with nothing to do */
+        conn_set_state(c, conn_new_cmd);
+        drive_machine(c);
+    }
+}
+#endif
+// FIXME: the 'breaks' around memory malloc's should break all the way down,
+// fill ileft/suffixleft, then run conn_releaseitems()
+/* ntokens is overwritten here... shrug.. */
+static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas, bool should_touch) {
+    char *key;
+    size_t nkey;
+    int i = 0;
+    int si = 0;
+    int k, nbatch;
+    item *it;
+    token_t batch[GET_BATCH + 1];
+    uint32_t hvs[GET_BATCH];
+    token_t *key_token = &tokens[KEY_TOKEN];
+    char *suffix;
+    int32_t exptime_int = 0;
+    rel_time_t exptime = 0;
+    assert(c != NULL);
+
+    if (should_touch) {
+        // For get and touch commands, use first token as exptime
+        if (!safe_strtol(tokens[1].value, &exptime_int)) {
+            out_string(c, "CLIENT_ERROR invalid exptime argument");
             return;
         }
         key_token++;
@@ -3790,7 +5072,21 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 
     do {
+        /* Hash the batch's keys and start fetching their buckets, then
+         * the items in them, so the lookups below overlap their memory
+         * misses instead of taking them one after another. */
+        for (k = 0; key_token[k].length != 0; k++) {
+            hvs[k] = hash(key_token[k].value, key_token[k].length);
+            assoc_prefetch(hvs[k]);
+        }
+        nbatch = k;
+        if (nbatch > 1) {
+            item_prefetch(c->thread, hvs, nbatch);
+        }
+        k = 0;
+
         while(key_token->length != 0) {
+            uint32_t hv = hvs[k++];
 
             key = key_token->value;
             nkey = key_token->length;
@@ -3806,7 +5102,20 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 return;
             }
 
-            it = limited_get(key, nkey, c, exptime, should_touch);
+            if (c->thread->hotkeys) {
+                it = should_touch ? NULL :
+                    hotcache_get(c->thread->hotkeys, key, nkey, hv);
+                if (it != NULL) {
+                    THR_STATS_INCR(c->thread, hotcache_hits);
+                } else if ((it = limited_get(key, nkey, hv, c, exptime, should_touch)) != NULL
+                        && !should_touch) {
+                    hotcache_fill(c->thread->hotkeys, it, hv);
+                }
+                hotkeys_record(c->thread->hotkeys, key, nkey, hv,
+                               it ? it->nbytes - 2 : 0);
+            } else {
+                it = limited_get(key, nkey, hv, c, exptime, should_touch);
+            }
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
@@ -3896,15 +5205,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 }
 
                 /* item_get() has incremented it->refcount for us */
-                pthread_mutex_lock(&c->thread->stats.mutex);
                 if (should_touch) {
-                    c->thread->stats.touch_cmds++;
-                    c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
+                    THR_STATS_INCR(c->thread, touch_cmds);
+                    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
                 } else {
-                    c->thread->stats.lru_hits[it->slabs_clsid]++;
-                    c->thread->stats.get_cmds++;
+                    THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
+                    THR_STATS_INCR(c->thread, get_cmds);
                 }
-                pthread_mutex_unlock(&c->thread->stats.mutex);
 #ifdef EXTSTORE
                 /* If ITEM_HDR, an io_wrap owns the reference. */
                 if ((it->it_flags & ITEM_HDR) == 0) {
@@ -3916,16 +5223,14 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 i++;
 #endif
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
                 if (should_touch) {
-                    c->thread->stats.touch_cmds++;
-                    c->thread->stats.touch_misses++;
+                    THR_STATS_INCR(c->thread, touch_cmds);
+                    THR_STATS_INCR(c->thread, touch_misses);
                 } else {
-                    c->thread->stats.get_misses++;
-                    c->thread->stats.get_cmds++;
+                    THR_STATS_INCR(c->thread, get_misses);
+                    THR_STATS_INCR(c->thread, get_cmds);
                 }
                 MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
-                pthread_mutex_unlock(&c->thread->stats.mutex);
             }
 
             key_token++;
@@ -3933,11 +5238,12 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 
         /*
          * If the command string hasn't been fully processed, get the next set
-         * of tokens.
+         * of tokens. Bigger sets than commands are split into, so there's
+         * more to prefetch at a time.
          */
         if(key_token->value != NULL) {
-            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
-            key_token = tokens;
+            ntokens = tokenize_command(key_token->value, batch, GET_BATCH + 1);
+            key_token = batch;
         }
 
     } while(key_token->value != NULL);
@@ -3967,28 +5273,95 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 }
 
+/*
+ * "getrange <key> <offset> <length>" sends part of a value, as a get would
+ * if that were all there was. A length of 0, or one running past the end,
+ * means the rest of it. Only the chunks the range covers are looked at.
+ */
+static void process_getrange_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key = tokens[KEY_TOKEN].value;
+    size_t nkey = tokens[KEY_TOKEN].length;
+    uint32_t offset, len;
+    item *it;
+    int hlen;
+
+    if (nkey > KEY_MAX_LENGTH || !safe_strtoul(tokens[2].value, &offset) ||
+            !safe_strtoul(tokens[3].value, &len)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    THR_STATS_INCR(c->thread, getrange_cmds);
+    it = limited_get(key, nkey, hash(key, nkey), c, 0, false);
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, NULL != it);
+    }
+    if (it == NULL) {
+        MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
+        THR_STATS_INCR(c->thread, get_misses);
+        THR_STATS_INCR(c->thread, get_cmds);
+        out_string(c, "END");
+        return;
+    }
+    MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                          it->nbytes, ITEM_get_cas(it));
+    THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
+    THR_STATS_INCR(c->thread, get_cmds);
+#ifdef EXTSTORE
+    if (it->it_flags & ITEM_HDR) {
+        item_remove(it);
+        out_string(c, "SERVER_ERROR value is in extstore");
+        return;
+    }
+#endif
+
+    if (offset > (uint32_t)it->nbytes - 2)
+        offset = it->nbytes - 2;
+    if (len == 0 || len > it->nbytes - 2 - offset)
+        len = it->nbytes - 2 - offset;
+
+    /* not a response that's held back, so wbuf is free */
+    assert(c->wdefer == 0);
+    hlen = snprintf(c->wbuf, c->wsize, "VALUE %.*s %u %u\r\n", it->nkey,
+            ITEM_key(it), item_client_flags(it), len);
+    if (add_iov(c, c->wbuf, hlen) != 0 ||
+            ((it->it_flags & ITEM_CHUNKED) == 0 ?
+             add_iov(c, ITEM_data(it) + offset, len) :
+             add_chunked_item_iovs_range(c, it, offset, len)) != 0 ||
+            add_iov(c, "\r\nEND\r\n", 7) != 0 ||
+            (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+
+    *(c->ilist) = it;
+    c->icurr = c->ilist;
+    c->ileft = 1;
+    conn_set_state(c, conn_mwrite);
+    c->msgcurr = 0;
+}
+
+static void process_update(conn *c, char *key, size_t nkey, uint32_t flags,
+                           int32_t exptime_int, int vlen, uint64_t req_cas_id,
+                           int comm);
+
 static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm, bool handle_cas) {
-    char *key;
-    size_t nkey;
     unsigned int flags;
     int32_t exptime_int = 0;
-    time_t exptime;
     int vlen;
     uint64_t req_cas_id=0;
-    item *it;
 
     assert(c != NULL);
 
     set_noreply_maybe(c, tokens, ntokens);
+    c->meta_set = false;
 
     if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
 
-    key = tokens[KEY_TOKEN].value;
-    nkey = tokens[KEY_TOKEN].length;
-
     if (! (safe_strtoul(tokens[2].value, (uint32_t *)&flags)
            && safe_strtol(tokens[3].value, &exptime_int)
            && safe_strtol(tokens[4].value, (int32_t *)&vlen))) {
@@ -3996,6 +5369,81 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
+    // does cas value exist?
+    if (handle_cas) {
+        if (!safe_strtoull(tokens[5].value, &req_cas_id)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+    }
+
+    process_update(c, tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length,
+                   flags, exptime_int, vlen, req_cas_id, comm);
+}
+
+/* Reads a run of up to max_digits decimal digits at *p into *val and moves
+ * *p past them. False if there are none or too many. */
+static inline bool fast_parse_u64(char **p, const int max_digits,
+                                  uint64_t *val) {
+    char *s = *p;
+    uint64_t v = 0;
+    int n;
+
+    for (n = 0; n < max_digits && *s >= '0' && *s <= '9'; n++, s++)
+        v = v * 10 + (*s - '0');
+    if (n == 0 || (*s >= '0' && *s <= '9'))
+        return false;
+    *val = v;
+    *p = s;
+    return true;
+}
+
+/*
+ * Fast path for "set <key> <flags> <exptime> <bytes> [noreply]": the
+ * numbers are read in the same pass that finds the spaces, rather than
+ * tokenizing the line and then handing each token to strtol(). Anything
+ * out of the ordinary (a negative exptime, extra spaces, a bad number) is
+ * left to the tokenizer, which knows how to complain about it. Returns
+ * false if the line was left alone.
+ */
+static bool process_set_fast(conn *c, char *command) {
+    char *key = command + 4, *p;
+    uint64_t flags, exptime, vlen;
+    size_t nkey;
+
+    for (p = key; *p != ' ' && *p != '\0'; p++) {
+        if (p - key == KEY_MAX_LENGTH)
+            return false;
+    }
+    if (*p != ' ' || p == key)
+        return false;
+    nkey = p - key;
+    p++;
+    if (!fast_parse_u64(&p, 10, &flags) || flags > UINT32_MAX || *p++ != ' '
+            || !fast_parse_u64(&p, 9, &exptime) || *p++ != ' '
+            || !fast_parse_u64(&p, 9, &vlen))
+        return false;
+    if (*p == ' ' && strcmp(p + 1, "noreply") == 0) {
+        c->noreply = true;
+    } else if (*p != '\0') {
+        return false;
+    }
+
+    key[nkey] = '\0';
+    c->meta_set = false;
+    process_update(c, key, nkey, (uint32_t)flags, (int32_t)exptime,
+                   (int)vlen, 0, NREAD_SET);
+    return true;
+}
+
+/* The part of a set, add, ... shared by the tokenized and fast paths, once
+ * the numbers are read: allocates the item and starts reading the value. */
+static void process_update(conn *c, char *key, size_t nkey, uint32_t flags,
+                           int32_t exptime_int, int vlen, uint64_t req_cas_id,
+                           int comm) {
+    time_t exptime;
+    item *it;
+
     /* Ubuntu 8.04 breaks when I pass exptime to safe_strtol */
     exptime = exptime_int;
 
@@ -4005,14 +5453,6 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     if (exptime < 0)
         exptime = REALTIME_MAXDELTA + 1;
 
-    // does cas value exist?
-    if (handle_cas) {
-        if (!safe_strtoull(tokens[5].value, &req_cas_id)) {
-            out_string(c, "CLIENT_ERROR bad command line format");
-            return;
-        }
-    }
-
     if (vlen < 0 || vlen > (INT_MAX - 2)) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
@@ -4087,18 +5527,14 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
 
     it = item_touch(key, nkey, realtime(exptime_int), c);
     if (it) {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, touch_cmds);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
 
         out_string(c, "TOUCHED");
         item_remove(it);
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.touch_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, touch_cmds);
+        THR_STATS_INCR(c->thread, touch_misses);
 
         out_string(c, "NOT_FOUND");
     }
@@ -4138,13 +5574,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         out_of_memory(c, "SERVER_ERROR out of memory");
         break;
     case DELTA_ITEM_NOT_FOUND:
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (incr) {
-            c->thread->stats.incr_misses++;
+            THR_STATS_INCR(c->thread, incr_misses);
         } else {
-            c->thread->stats.decr_misses++;
+            THR_STATS_INCR(c->thread, decr_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         out_string(c, "NOT_FOUND");
         break;
@@ -4181,10 +5615,11 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
     /* Can't delta zero byte values. 2-byte are the "\r\n" */
     /* Also can't delta for chunked items. Too large to be a number */
 #ifdef EXTSTORE
-    if (it->nbytes <= 2 || (it->it_flags & (ITEM_CHUNKED|ITEM_HDR)) != 0) {
+    if (it->nbytes <= 2 || (it->it_flags & (ITEM_CHUNKED|ITEM_HDR|ITEM_COMPRESSED)) != 0) {
 #else
-    if (it->nbytes <= 2 || (it->it_flags & (ITEM_CHUNKED)) != 0) {
+    if (it->nbytes <= 2 || (it->it_flags & (ITEM_CHUNKED|ITEM_COMPRESSED)) != 0) {
 #endif
+        do_item_remove(it);
         return NON_NUMERIC;
     }
 
@@ -4212,13 +5647,11 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         MEMCACHED_COMMAND_DECR(c->sfd, ITEM_key(it), it->nkey, value);
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
     if (incr) {
-        c->thread->stats.slab_stats[ITEM_clsid(it)].incr_hits++;
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].incr_hits);
     } else {
-        c->thread->stats.slab_stats[ITEM_clsid(it)].decr_hits++;
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].decr_hits);
     }
-    pthread_mutex_unlock(&c->thread->stats.mutex);
 
     snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)value);
     res = strlen(buf);
@@ -4313,66 +5746,790 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].delete_hits);
 
         item_unlink(it);
         STORAGE_delete(c->thread->storage, it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, delete_misses);
 
         out_string(c, "NOT_FOUND");
     }
 }
 
-static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens) {
-    unsigned int level;
+/*
+ * Meta commands. A compact alternative to get/set/delete/incr where the
+ * client picks which fields come back with single letter flags:
+ *
+ *   mg <key> <flags>*\r\n
+ *   ms <key> <datalen> <flags>*\r\n<data>\r\n
+ *   md <key> <flags>*\r\n
+ *   ma <key> <flags>*\r\n
+ *   mn\r\n
+ *
+ * See doc/protocol.txt for the flags and response codes.
+ */
+struct meta_flags {
+    struct meta_ret ret;
+    bool value;          /* v */
+    bool any_order;      /* A */
+    bool has_ttl;        /* T */
+    int32_t ttl;
+    bool has_cas;        /* C */
+    uint64_t cas;
+    bool has_client_flags; /* F */
+    uint32_t client_flags;
+    bool has_delta;      /* D */
+    uint64_t delta;
+    char mode;           /* M, 0 if not given */
+    bool has_vivify;     /* N */
+    int32_t vivify_ttl;
+    bool has_recache;    /* R */
+    int32_t recache_ttl;
+    bool invalidate;     /* I */
+};
 
-    assert(c != NULL);
+/* Parses the flags of a meta command, starting at tok. Tokens past what
+ * process_command() split out are tokenized here as we go, so anything
+ * needed from earlier tokens must be saved before calling. Returns an error
+ * string for the client, or NULL. */
+static const char *meta_parse_flags(token_t *tokens, token_t *tok,
+                                    const char *allowed, struct meta_flags *of) {
+    int nret = 0;
+
+    memset(of, 0, sizeof(*of));
+    for (;;) {
+        for (; tok->length != 0; tok++) {
+            const char flag = tok->value[0];
+            const char *arg = tok->value + 1;
+            if (strchr(allowed, flag) == NULL) {
+                return "CLIENT_ERROR invalid flag";
+            }
+            switch (flag) {
+            case 'q':
+                of->ret.quiet = true;
+                break;
+            case 'v':
+                of->value = true;
+                break;
+            case 'A':
+                of->any_order = true;
+                break;
+            case 'C':
+                if (!safe_strtoull(arg, &of->cas))
+                    return "CLIENT_ERROR bad token in command line format";
+                of->has_cas = true;
+                break;
+            case 'D':
+                if (!safe_strtoull(arg, &of->delta))
+                    return "CLIENT_ERROR invalid numeric delta argument";
+                of->has_delta = true;
+                break;
+            case 'F':
+                if (!safe_strtoul(arg, &of->client_flags))
+                    return "CLIENT_ERROR bad token in command line format";
+                of->has_client_flags = true;
+                break;
+            case 'M':
+                if (tok->length != 2)
+                    return "CLIENT_ERROR invalid mode";
+                of->mode = arg[0];
+                break;
+            case 'N':
+                if (!safe_strtol(arg, &of->vivify_ttl))
+                    return "CLIENT_ERROR bad token in command line format";
+                of->has_vivify = true;
+                break;
+            case 'R':
+                if (!safe_strtol(arg, &of->recache_ttl))
+                    return "CLIENT_ERROR bad token in command line format";
+                of->has_recache = true;
+                break;
+            case 'I':
+                of->invalidate = true;
+                break;
+            case 'T':
+                if (!safe_strtol(arg, &of->ttl))
+                    return "CLIENT_ERROR bad token in command line format";
+                of->has_ttl = true;
+                break;
+            case 'O':
+                if (tok->length - 1 > META_OPAQUE_MAX)
+                    return "CLIENT_ERROR opaque token too long";
+                memcpy(of->ret.opaque, arg, tok->length - 1);
+                of->ret.opaque[tok->length - 1] = '\0';
+                /* fall through */
+            default:
+                /* the rest ask for a field in the response */
+                if (strchr(of->ret.flags, flag) == NULL) {
+                    of->ret.flags[nret++] = flag;
+                }
+                break;
+            }
+        }
+        if (tok->value == NULL)
+            break;
+        tokenize_command(tok->value, tokens, MAX_TOKENS);
+        tok = tokens;
+    }
+    return NULL;
+}
 
-    set_noreply_maybe(c, tokens, ntokens);
+/* Appends the requested return flags to a response line at p and returns
+ * the new end. Without an item (a miss, or a store that didn't happen) only
+ * the key and opaque can be returned. cas is what this request left it
+ * with; a store may have linked a different item than it. fetched and atime
+ * are the item's hit marker and access time from before this request
+ * touched them. */
+static char *meta_add_ret_flags(char *p, const struct meta_ret *r, item *it,
+                                const uint64_t cas,
+                                const char *key, const size_t nkey,
+                                const bool fetched, const rel_time_t atime) {
+    const char *f;
+    size_t len;
+    for (f = r->flags; *f != '\0'; f++) {
+        if (it == NULL && *f != 'k' && *f != 'O')
+            continue;
+        *p++ = ' ';
+        *p++ = *f;
+        switch (*f) {
+        case 'c':
+            p = itoa_u64(cas, p);
+            break;
+        case 'f':
+            p = itoa_u32(item_client_flags(it), p);
+            break;
+        case 'h':
+            *p++ = fetched ? '1' : '0';
+            break;
+        case 'k':
+            memcpy(p, key, nkey);
+            p += nkey;
+            break;
+        case 'l':
+            p = itoa_u32(current_time - atime, p);
+            break;
+        case 'O':
+            len = strlen(r->opaque);
+            memcpy(p, r->opaque, len);
+            p += len;
+            break;
+        case 's':
+            p = itoa_u32(it->nbytes - 2, p);
+            break;
+        case 't':
+            if (it->exptime == 0) {
+                *p++ = '-';
+                *p++ = '1';
+            } else {
+                p = itoa_u32(it->exptime > current_time
+                        ? it->exptime - current_time : 0, p);
+            }
+            break;
+        }
+    }
+    *p = '\0';
+    return p;
+}
 
-    level = strtoul(tokens[1].value, NULL, 10);
-    settings.verbose = level > MAX_VERBOSITY_LEVEL ? MAX_VERBOSITY_LEVEL : level;
-    out_string(c, "OK");
-    return;
+/* T takes exptimes the same way as set; negatives mean already expired. */
+static inline rel_time_t meta_exptime(const int32_t ttl) {
+    return realtime(ttl < 0 ? REALTIME_MAXDELTA + 1 : ttl);
 }
 
-#ifdef MEMCACHED_DEBUG
-static void process_misbehave_command(conn *c) {
-    int allowed = 0;
+/* "VA <size>" + return flags + "\r\n", with room for every flag at once */
+#define META_RESP_MAX (KEY_MAX_LENGTH + META_OPAQUE_MAX + 200)
 
-    // try opening new TCP socket
-    int i = socket(AF_INET, SOCK_STREAM, 0);
-    if (i != -1) {
-        allowed++;
-        close(i);
-    }
+/*
+ * Leases. When a value is missing (with N), stale (after md I), or about to
+ * expire (with R), the first mg to see it is told it won (W) and should
+ * fetch the value and set it, using the CAS it got back so that nobody
+ * else's set gets in first. Everyone after it until then is told the win
+ * has gone (Z) and gets the stale value (X) or the empty placeholder N
+ * left, rather than every one of them going to the backend.
+ */
+#define META_LEASE_WIN 1
+#define META_LEASE_STALE 2
+#define META_LEASE_WON 4
+
+/* Called with the item locked. */
+static int meta_lease(item *it, const struct meta_flags *of) {
+    int lease = 0;
+    bool due = false;
+
+    if (it->it_flags & ITEM_STALE) {
+        lease |= META_LEASE_STALE;
+        due = true;
+    } else if (of->has_recache && it->exptime != 0 &&
+            (int32_t)(it->exptime - current_time) < of->recache_ttl) {
+        due = true;
+    }
+    if (it->it_flags & ITEM_TOKEN_SENT) {
+        lease |= META_LEASE_WON;
+    } else if (due) {
+        it->it_flags |= ITEM_TOKEN_SENT;
+        lease |= META_LEASE_WIN;
+    }
+    return lease;
+}
 
-    // try executing new commands
-    i = system("sleep 0");
-    if (i != -1) {
-        allowed++;
+static char *meta_add_lease_flags(char *p, const int lease) {
+    if (lease & META_LEASE_WIN) {
+        memcpy(p, " W", 2);
+        p += 2;
     }
-
-    if (allowed) {
-        out_string(c, "ERROR");
-    } else {
-        out_string(c, "OK");
+    if (lease & META_LEASE_STALE) {
+        memcpy(p, " X", 2);
+        p += 2;
+    }
+    if (lease & META_LEASE_WON) {
+        memcpy(p, " Z", 2);
+        p += 2;
     }
+    *p = '\0';
+    return p;
 }
-#endif
 
-static void process_slabs_automove_command(conn *c, token_t *tokens, const size_t ntokens) {
-    unsigned int level;
-    double ratio;
+static void process_mget_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char resp[META_RESP_MAX];
+    struct meta_flags of;
+    const char *errstr;
+    char *key, *p;
+    size_t nkey;
+    item *it;
+    uint32_t hv;
+    bool fetched = false, vivified = false;
+    rel_time_t atime = 0;
+    int len, lease = 0;
 
-    assert(c != NULL);
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    if (nkey > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if ((errstr = meta_parse_flags(tokens, &tokens[KEY_TOKEN + 1],
+                    "AcfhklNOqRstTv", &of)) != NULL) {
+        out_string(c, errstr);
+        return;
+    }
+
+    /* Fetch without bumping so h and l report what the item looked like
+     * before this request, then bump it ourselves. */
+    it = item_get_locked(key, nkey, c, DONT_UPDATE, &hv);
+    if (it) {
+        fetched = (it->it_flags & ITEM_FETCHED) != 0;
+        atime = it->time;
+        if (of.has_ttl) {
+            it->exptime = meta_exptime(of.ttl);
+        }
+        lease = meta_lease(it, &of);
+        do_item_bump(c, it, hv);
+    } else if (of.has_vivify) {
+        /* an empty placeholder, which this client wins and the ones after
+         * it find already won */
+        it = do_item_alloc(key, nkey, 0, meta_exptime(of.vivify_ttl), 2);
+        if (it != NULL) {
+            memcpy(ITEM_data(it), "\r\n", 2);
+            it->it_flags |= ITEM_TOKEN_SENT;
+            do_item_link(it, hv);
+            lease = META_LEASE_WIN;
+            vivified = true;
+        }
+    }
+    item_unlock(hv);
+    if (it && it->refcount > IT_REFCOUNT_LIMIT) {
+        item_remove(it);
+        it = NULL;
+    }
+    /* s reports the size the client stored */
+    if (it && (it->it_flags & ITEM_COMPRESSED) &&
+            (of.value || strchr(of.ret.flags, 's') != NULL)) {
+        it = get_decompressed(c, it);
+    }
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, NULL != it);
+    }
+    if (c->thread->hotkeys) {
+        hotkeys_record(c->thread->hotkeys, key, nkey, hash(key, nkey),
+                       it ? it->nbytes - 2 : 0);
+    }
+
+    if (it == NULL) {
+        MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
+        if (of.has_ttl) {
+            THR_STATS_INCR(c->thread, touch_cmds);
+            THR_STATS_INCR(c->thread, touch_misses);
+        } else {
+            THR_STATS_INCR(c->thread, get_misses);
+            THR_STATS_INCR(c->thread, get_cmds);
+        }
+        if (of.ret.quiet) {
+            conn_set_state(c, conn_new_cmd);
+            return;
+        }
+        memcpy(resp, "EN", 2);
+        meta_add_ret_flags(resp + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+        out_string(c, resp);
+        return;
+    }
+
+    MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                          it->nbytes, ITEM_get_cas(it));
+    if (vivified) {
+        THR_STATS_INCR(c->thread, get_misses);
+        THR_STATS_INCR(c->thread, get_cmds);
+    } else if (of.has_ttl) {
+        THR_STATS_INCR(c->thread, touch_cmds);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
+    } else {
+        THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
+        THR_STATS_INCR(c->thread, get_cmds);
+    }
+
+    if (!of.value) {
+        memcpy(resp, "HD", 2);
+        p = meta_add_ret_flags(resp + 2, &of.ret, it, ITEM_get_cas(it),
+                               key, nkey, fetched, atime);
+        meta_add_lease_flags(p, lease);
+        item_remove(it);
+        out_string(c, resp);
+        return;
+    }
+
+    /* The header line goes in wbuf, which no response is using: mg isn't
+     * one whose response can be held back, so wdefer is 0 here. */
+    assert(c->wdefer == 0);
+    memcpy(resp, "VA ", 3);
+    p = itoa_u32(it->nbytes - 2, resp + 3);
+    p = meta_add_ret_flags(p, &of.ret, it, ITEM_get_cas(it),
+                           key, nkey, fetched, atime);
+    p = meta_add_lease_flags(p, lease);
+    memcpy(p, "\r\n", 2);
+    len = p + 2 - resp;
+#ifdef EXTSTORE
+    if ((it->it_flags & ITEM_HDR) && of.any_order && !IS_UDP(c->transport)) {
+        /* answered by itself once the read is back; carry on meanwhile */
+        char miss[META_RESP_MAX];
+        int mlen = 0;
+        if (!of.ret.quiet) {
+            memcpy(miss, "EN", 2);
+            p = meta_add_ret_flags(miss + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+            memcpy(p, "\r\n", 2);
+            mlen = p + 2 - miss;
+        }
+        if (_get_extstore_ooo(c, it, resp, len, miss, mlen) != 0) {
+            item_remove(it);
+            out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+        conn_set_state(c, conn_new_cmd);
+        return;
+    }
+#endif
+    memcpy(c->wbuf, resp, len);
+
+    if (add_iov(c, c->wbuf, len) != 0) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+#ifdef EXTSTORE
+    if (it->it_flags & ITEM_HDR) {
+        if (_get_extstore(c, it, c->iovused-1, 2) != 0) {
+            item_remove(it);
+            out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+        /* If the value turns out to be gone, say so in the header's place.
+         * The io_wrap owns our reference now. */
+        if (!of.ret.quiet) {
+            char *miss = c->wbuf + len;
+            memcpy(miss, "EN", 2);
+            p = meta_add_ret_flags(miss + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+            memcpy(p, "\r\n", 2);
+            c->io_wraplist->miss_line = miss;
+            c->io_wraplist->miss_len = p + 2 - miss;
+        }
+        it = NULL;
+    } else if ((it->it_flags & ITEM_CHUNKED) == 0) {
+#else
+    if ((it->it_flags & ITEM_CHUNKED) == 0) {
+#endif
+        if (add_iov(c, ITEM_data(it), it->nbytes) != 0) {
+            item_remove(it);
+            out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+    } else if (add_chunked_item_iovs(c, it, it->nbytes) != 0) {
+        item_remove(it);
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, ">%d %.*s", c->sfd, len, resp);
+    }
+
+    if (it != NULL) {
+        *(c->ilist) = it;
+        c->icurr = c->ilist;
+        c->ileft = 1;
+    }
+    if (IS_UDP(c->transport) && build_udp_headers(c) != 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+        return;
+    }
+    conn_set_state(c, conn_mwrite);
+    c->msgcurr = 0;
+}
+
+static void process_mset_command(conn *c, token_t *tokens, const size_t ntokens) {
+    struct meta_flags of;
+    const char *errstr;
+    char *key;
+    size_t nkey;
+    int32_t vlen;
+    int comm;
+    item *it;
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    if (!safe_strtol(tokens[2].value, &vlen) || vlen < 0 || vlen > (INT_MAX - 2)) {
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        return;
+    }
+    vlen += 2;
+
+    errstr = meta_parse_flags(tokens, &tokens[3], "cCFkMOqT", &of);
+    if (errstr == NULL && nkey > KEY_MAX_LENGTH) {
+        errstr = "CLIENT_ERROR bad command line format";
+    }
+    switch (of.mode) {
+    case 0:
+    case 'S':
+        comm = of.has_cas ? NREAD_CAS : NREAD_SET;
+        break;
+    case 'E':
+        comm = NREAD_ADD;
+        break;
+    case 'A':
+        comm = NREAD_APPEND;
+        break;
+    case 'P':
+        comm = NREAD_PREPEND;
+        break;
+    case 'R':
+        comm = NREAD_REPLACE;
+        break;
+    default:
+        comm = 0;
+        if (errstr == NULL)
+            errstr = "CLIENT_ERROR invalid mode for ms";
+        break;
+    }
+    if (errstr == NULL && of.has_cas && comm != NREAD_CAS) {
+        errstr = "CLIENT_ERROR C only works with set mode";
+    }
+    if (errstr != NULL) {
+        out_string(c, errstr);
+        /* we know how long the value is, so don't read it as commands */
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+        return;
+    }
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_set(key, nkey);
+    }
+
+    it = item_alloc(key, nkey, of.client_flags, meta_exptime(of.ttl), vlen);
+    if (it == 0) {
+        enum store_item_type status;
+        if (! item_size_ok(nkey, of.client_flags, vlen)) {
+            out_string(c, "SERVER_ERROR object too large for cache");
+            status = TOO_LARGE;
+        } else {
+            out_of_memory(c, "SERVER_ERROR out of memory storing object");
+            status = NO_MEMORY;
+        }
+        LOGGER_LOG(c->thread->l, LOG_MUTATIONS, LOGGER_ITEM_STORE,
+                NULL, status, comm, key, nkey, 0, 0);
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+
+        /* Same as set: don't leave the old value behind */
+        if (comm == NREAD_SET) {
+            it = item_get(key, nkey, c, DONT_UPDATE);
+            if (it) {
+                item_unlink(it);
+                STORAGE_delete(c->thread->storage, it);
+                item_remove(it);
+            }
+        }
+        return;
+    }
+    ITEM_set_cas(it, of.cas);
+
+    c->meta_set = true;
+    c->meta_ret = of.ret;
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = it->nbytes;
+    c->cmd = comm;
+    conn_set_state(c, conn_nread);
+}
+
+/* Answers an ms once complete_nread_ascii() has tried to store it. */
+static void meta_store_response(conn *c, item *it, enum store_item_type ret) {
+    char resp[META_RESP_MAX];
+    const char *code;
+
+    switch (ret) {
+    case STORED:
+        code = "HD";
+        break;
+    case EXISTS:
+        code = "EX";
+        break;
+    case NOT_FOUND:
+        code = "NF";
+        break;
+    case NOT_STORED:
+        code = "NS";
+        break;
+    default:
+        out_string(c, "SERVER_ERROR Unhandled storage type.");
+        return;
+    }
+    if (ret == STORED && c->meta_ret.quiet) {
+        c->noreply = true;
+    }
+    memcpy(resp, code, 2);
+    /* c->item may not be what got linked, for MA/MP or a compressed
+     * value; do_store_item() left the CAS that was in c->cas */
+    meta_add_ret_flags(resp + 2, &c->meta_ret, ret == STORED ? it : NULL,
+                       c->cas, ITEM_key(it), it->nkey, false, 0);
+    out_string(c, resp);
+}
+
+static void process_mdelete_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char resp[META_RESP_MAX];
+    struct meta_flags of;
+    const char *errstr;
+    char *key;
+    size_t nkey;
+    item *it;
+    uint32_t hv;
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    if (nkey > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if ((errstr = meta_parse_flags(tokens, &tokens[KEY_TOKEN + 1],
+                    "CIkOqT", &of)) != NULL) {
+        out_string(c, errstr);
+        return;
+    }
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_delete(key, nkey);
+    }
+
+    it = item_get_locked(key, nkey, c, DONT_UPDATE, &hv);
+    if (it == NULL) {
+        THR_STATS_INCR(c->thread, delete_misses);
+        memcpy(resp, "NF", 2);
+    } else if (of.has_cas && of.cas != ITEM_get_cas(it)) {
+        do_item_remove(it);
+        memcpy(resp, "EX", 2);
+    } else {
+        MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].delete_hits);
+
+        if (of.invalidate) {
+            /* keep serving it, marked stale, until the next mg's winner
+             * replaces it; the new CAS fences off sets from before */
+            it->it_flags |= ITEM_STALE;
+            it->it_flags &= ~ITEM_TOKEN_SENT;
+            ITEM_set_cas(it, settings.use_cas ? get_cas_id() : 0);
+            if (of.has_ttl) {
+                it->exptime = meta_exptime(of.ttl);
+            }
+        } else {
+            do_item_unlink(it, hv);
+            STORAGE_delete(c->thread->storage, it);
+        }
+        do_item_remove(it);
+        memcpy(resp, "HD", 2);
+    }
+    item_unlock(hv);
+    /* quiet deletes only hear about conflicts */
+    if (of.ret.quiet && resp[0] != 'E') {
+        c->noreply = true;
+    }
+    meta_add_ret_flags(resp + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+    out_string(c, resp);
+}
+
+static void process_marithmetic_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char resp[META_RESP_MAX + INCR_MAX_STORAGE_LEN];
+    char temp[INCR_MAX_STORAGE_LEN];
+    struct meta_flags of;
+    const char *errstr, *f;
+    char *key, *p;
+    size_t nkey;
+    bool incr;
+    uint64_t cas;
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+    if (nkey > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if ((errstr = meta_parse_flags(tokens, &tokens[KEY_TOKEN + 1],
+                    "cCDkMOqv", &of)) != NULL) {
+        out_string(c, errstr);
+        return;
+    }
+    switch (of.mode) {
+    case 0:
+    case 'I':
+    case '+':
+        incr = true;
+        break;
+    case 'D':
+    case '-':
+        incr = false;
+        break;
+    default:
+        out_string(c, "CLIENT_ERROR invalid mode for ma");
+        return;
+    }
+    if (!of.has_delta) {
+        of.delta = 1;
+    }
+
+    cas = of.cas;
+    switch(add_delta(c, key, nkey, incr, of.delta, temp, &cas)) {
+    case OK:
+        if (of.value) {
+            memcpy(resp, "VA ", 3);
+            p = itoa_u32(strlen(temp), resp + 3);
+        } else {
+            if (of.ret.quiet)
+                c->noreply = true;
+            memcpy(resp, "HD", 2);
+            p = resp + 2;
+        }
+        /* c is the one item field ma returns, and add_delta() hands us the
+         * new CAS, so no item is needed */
+        for (f = of.ret.flags; *f != '\0'; f++) {
+            *p++ = ' ';
+            *p++ = *f;
+            if (*f == 'c') {
+                p = itoa_u64(cas, p);
+            } else if (*f == 'k') {
+                memcpy(p, key, nkey);
+                p += nkey;
+            } else {
+                memcpy(p, of.ret.opaque, strlen(of.ret.opaque));
+                p += strlen(of.ret.opaque);
+            }
+        }
+        if (of.value) {
+            memcpy(p, "\r\n", 2);
+            memcpy(p + 2, temp, strlen(temp));
+            p += 2 + strlen(temp);
+        }
+        *p = '\0';
+        out_string(c, resp);
+        break;
+    case NON_NUMERIC:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
+        break;
+    case EOM:
+        out_of_memory(c, "SERVER_ERROR out of memory");
+        break;
+    case DELTA_ITEM_NOT_FOUND:
+        if (incr) {
+            THR_STATS_INCR(c->thread, incr_misses);
+        } else {
+            THR_STATS_INCR(c->thread, decr_misses);
+        }
+        if (of.ret.quiet)
+            c->noreply = true;
+        memcpy(resp, "NF", 2);
+        meta_add_ret_flags(resp + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+        out_string(c, resp);
+        break;
+    case DELTA_ITEM_CAS_MISMATCH:
+        memcpy(resp, "EX", 2);
+        meta_add_ret_flags(resp + 2, &of.ret, NULL, 0, key, nkey, false, 0);
+        out_string(c, resp);
+        break;
+    }
+}
+
+static void process_verbosity_command(conn *c, token_t *tokens, const size_t ntokens) {
+    unsigned int level;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    level = strtoul(tokens[1].value, NULL, 10);
+    settings.verbose = level > MAX_VERBOSITY_LEVEL ? MAX_VERBOSITY_LEVEL : level;
+    out_string(c, "OK");
+    return;
+}
+
+#ifdef MEMCACHED_DEBUG
+/* -o conn_balance without waiting for a worker to get busy: this conn's
+ * worker hands a conn, most likely this one, to the next worker. */
+static void process_debugmigrate_command(conn *c) {
+    if (!settings.conn_balance || settings.num_threads < 2) {
+        out_string(c, "CLIENT_ERROR conn_balance disabled");
+        return;
+    }
+    thread_balance_force(c->thread);
+    out_string(c, "OK");
+}
+
+static void process_misbehave_command(conn *c) {
+    int allowed = 0;
+
+    // try opening new TCP socket
+    int i = socket(AF_INET, SOCK_STREAM, 0);
+    if (i != -1) {
+        allowed++;
+        close(i);
+    }
+
+    // try executing new commands
+    i = system("sleep 0");
+    if (i != -1) {
+        allowed++;
+    }
+
+    if (allowed) {
+        out_string(c, "ERROR");
+    } else {
+        out_string(c, "OK");
+    }
+}
+#endif
+
+static void process_slabs_automove_command(conn *c, token_t *tokens, const size_t ntokens) {
+    unsigned int level;
+    double ratio;
+
+    assert(c != NULL);
 
     set_noreply_maybe(c, tokens, ntokens);
 
@@ -4433,8 +6590,10 @@ static void process_watch_command(conn *c, token_t *tokens, const size_t ntokens
             out_string(c, "WATCHER_FAILED failed to add log watcher");
             break;
         case LOGGER_ADD_WATCHER_OK:
+            /* the logger thread owns it now, and closes it */
+            conn_timer_del(c);
             conn_set_state(c, conn_watch);
-            event_del(&c->event);
+            conn_event_del(c);
             break;
     }
 }
@@ -4580,317 +6739,518 @@ static void process_extstore_command(conn *c, token_t *tokens, const size_t ntok
     }
 }
 #endif
-static void process_command(conn *c, char *command) {
-
-    token_t tokens[MAX_TOKENS];
-    size_t ntokens;
-    int comm;
-
-    assert(c != NULL);
-
-    MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
+static void process_flush_all_command(conn *c, token_t *tokens, const size_t ntokens) {
+    time_t exptime = 0;
+    rel_time_t new_oldest = 0;
 
-    if (settings.verbose > 1)
-        fprintf(stderr, "<%d %s\n", c->sfd, command);
+    set_noreply_maybe(c, tokens, ntokens);
 
-    /*
-     * for commands set/add/replace, we build an item and read the data
-     * directly into it, then continue in nread_complete().
-     */
+    THR_STATS_INCR(c->thread, flush_cmds);
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        out_of_memory(c, "SERVER_ERROR out of memory preparing response");
+    if (!settings.flush_enabled) {
+        // flush_all is not allowed but we log it on stats
+        out_string(c, "CLIENT_ERROR flush_all not allowed");
         return;
     }
 
-    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
-    if (ntokens >= 3 &&
-        ((strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
-         (strcmp(tokens[COMMAND_TOKEN].value, "bget") == 0))) {
-
-        process_get_command(c, tokens, ntokens, false, false);
+    if (ntokens != (c->noreply ? 3 : 2)) {
+        exptime = strtol(tokens[1].value, NULL, 10);
+        if(errno == ERANGE) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+    }
 
-    } else if ((ntokens == 6 || ntokens == 7) &&
-               ((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0 && (comm = NREAD_ADD)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "set") == 0 && (comm = NREAD_SET)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0 && (comm = NREAD_REPLACE)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0 && (comm = NREAD_PREPEND)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0 && (comm = NREAD_APPEND)) )) {
+    /*
+      If exptime is zero realtime() would return zero too, and
+      realtime(exptime) - 1 would overflow to the max unsigned
+      value.  So we process exptime == 0 the same way we do when
+      no delay is given at all.
+    */
+    if (exptime > 0) {
+        new_oldest = realtime(exptime);
+    } else { /* exptime == 0 */
+        new_oldest = current_time;
+    }
 
-        process_update_command(c, tokens, ntokens, comm, false);
+    if (settings.use_cas) {
+        settings.oldest_live = new_oldest - 1;
+        if (settings.oldest_live <= current_time)
+            settings.oldest_cas = get_cas_id();
+    } else {
+        settings.oldest_live = new_oldest;
+    }
+    out_string(c, "OK");
+}
 
-    } else if ((ntokens == 7 || ntokens == 8) && (strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0 && (comm = NREAD_CAS))) {
+/*
+ * Invalidates every key starting with a prefix followed by the stats prefix
+ * delimiter; "flush_prefix user1" drops "user1:name", "user1:mail" and so on
+ * without touching each one.
+ */
+static void process_flush_prefix_command(conn *c, token_t *tokens, const size_t ntokens) {
+    set_noreply_maybe(c, tokens, ntokens);
 
-        process_update_command(c, tokens, ntokens, comm, true);
+    THR_STATS_INCR(c->thread, flush_prefix_cmds);
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)) {
+    if (!settings.flush_enabled) {
+        out_string(c, "CLIENT_ERROR flush_prefix not allowed");
+        return;
+    }
 
-        process_arithmetic_command(c, tokens, ntokens, 1);
+    if (tokens[1].length > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
 
-    } else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)) {
+    switch (item_flush_prefix(tokens[1].value, tokens[1].length)) {
+    case 0:
+        out_string(c, "OK");
+        break;
+    case -1:
+        out_string(c, "SERVER_ERROR too many flushed prefixes");
+        break;
+    default:
+        out_of_memory(c, "SERVER_ERROR out of memory");
+        break;
+    }
+}
 
-        process_get_command(c, tokens, ntokens, true, false);
+static void process_slabs_command(conn *c, token_t *tokens, const size_t ntokens) {
+    if (ntokens == 5 && strcmp(tokens[COMMAND_TOKEN + 1].value, "reassign") == 0) {
+        int src, dst, rv;
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
+        if (settings.slab_reassign == false) {
+            out_string(c, "CLIENT_ERROR slab reassignment disabled");
+            return;
+        }
 
-        process_arithmetic_command(c, tokens, ntokens, 0);
+        src = strtol(tokens[2].value, NULL, 10);
+        dst = strtol(tokens[3].value, NULL, 10);
 
-    } else if (ntokens >= 3 && ntokens <= 5 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+        if (errno == ERANGE) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
 
-        process_delete_command(c, tokens, ntokens);
+        rv = slabs_reassign(src, dst);
+        switch (rv) {
+        case REASSIGN_OK:
+            out_string(c, "OK");
+            break;
+        case REASSIGN_RUNNING:
+            out_string(c, "BUSY currently processing reassign request");
+            break;
+        case REASSIGN_BADCLASS:
+            out_string(c, "BADCLASS invalid src or dst class id");
+            break;
+        case REASSIGN_NOSPARE:
+            out_string(c, "NOSPARE source class has no spare pages");
+            break;
+        case REASSIGN_SRC_DST_SAME:
+            out_string(c, "SAME src and dst class are identical");
+            break;
+        }
+        return;
+    } else if (ntokens >= 4 &&
+        (strcmp(tokens[COMMAND_TOKEN + 1].value, "automove") == 0)) {
+        process_slabs_automove_command(c, tokens, ntokens);
+    } else {
+        out_string(c, "ERROR");
+    }
+}
 
-    } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "touch") == 0)) {
+static void process_lru_crawler_command(conn *c, token_t *tokens, const size_t ntokens) {
+    if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "crawl") == 0) {
+        int rv;
+        if (settings.lru_crawler == false) {
+            out_string(c, "CLIENT_ERROR lru crawler disabled");
+            return;
+        }
 
-        process_touch_command(c, tokens, ntokens);
+        rv = lru_crawler_crawl(tokens[2].value, CRAWLER_EXPIRED, NULL, 0,
+                settings.lru_crawler_tocrawl);
+        switch(rv) {
+        case CRAWLER_OK:
+            out_string(c, "OK");
+            break;
+        case CRAWLER_RUNNING:
+            out_string(c, "BUSY currently processing crawler request");
+            break;
+        case CRAWLER_BADCLASS:
+            out_string(c, "BADCLASS invalid class id");
+            break;
+        case CRAWLER_NOTSTARTED:
+            out_string(c, "NOTSTARTED no items to crawl");
+            break;
+        case CRAWLER_ERROR:
+            out_string(c, "ERROR an unknown error happened");
+            break;
+        }
+        return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "metadump") == 0) {
+        if (settings.lru_crawler == false) {
+            out_string(c, "CLIENT_ERROR lru crawler disabled");
+            return;
+        }
+        if (!settings.dump_enabled) {
+            out_string(c, "ERROR metadump not allowed");
+            return;
+        }
 
-    } else if (ntokens >= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "gat") == 0)) {
+        int rv = lru_crawler_crawl(tokens[2].value, CRAWLER_METADUMP,
+                c, c->sfd, LRU_CRAWLER_CAP_REMAINING);
+        switch(rv) {
+            case CRAWLER_OK:
+                out_string(c, "OK");
+                // TODO: Don't reuse conn_watch here.
+                /* the crawler owns it until it's redispatched or closed */
+                conn_timer_del(c);
+                conn_set_state(c, conn_watch);
+                conn_event_del(c);
+                break;
+            case CRAWLER_RUNNING:
+                out_string(c, "BUSY currently processing crawler request");
+                break;
+            case CRAWLER_BADCLASS:
+                out_string(c, "BADCLASS invalid class id");
+                break;
+            case CRAWLER_NOTSTARTED:
+                out_string(c, "NOTSTARTED no items to crawl");
+                break;
+            case CRAWLER_ERROR:
+                out_string(c, "ERROR an unknown error happened");
+                break;
+        }
+        return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "tocrawl") == 0) {
+        uint32_t tocrawl;
+         if (!safe_strtoul(tokens[2].value, &tocrawl)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        settings.lru_crawler_tocrawl = tocrawl;
+        out_string(c, "OK");
+        return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "sleep") == 0) {
+        uint32_t tosleep;
+        if (!safe_strtoul(tokens[2].value, &tosleep)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        if (tosleep > 1000000) {
+            out_string(c, "CLIENT_ERROR sleep must be one second or less");
+            return;
+        }
+        settings.lru_crawler_sleep = tosleep;
+        out_string(c, "OK");
+        return;
+    } else if (ntokens == 3) {
+        if ((strcmp(tokens[COMMAND_TOKEN + 1].value, "enable") == 0)) {
+            if (start_item_crawler_thread() == 0) {
+                out_string(c, "OK");
+            } else {
+                out_string(c, "ERROR failed to start lru crawler thread");
+            }
+        } else if ((strcmp(tokens[COMMAND_TOKEN + 1].value, "disable") == 0)) {
+            if (stop_item_crawler_thread() == 0) {
+                out_string(c, "OK");
+            } else {
+                out_string(c, "ERROR failed to stop lru crawler thread");
+            }
+        } else {
+            out_string(c, "ERROR");
+        }
+        return;
+    } else {
+        out_string(c, "ERROR");
+    }
+}
+static void process_command(conn *c, char *command) {
 
-        process_get_command(c, tokens, ntokens, false, true);
+    token_t tokens[MAX_TOKENS];
+    size_t ntokens;
 
-    } else if (ntokens >= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "gats") == 0)) {
+    assert(c != NULL);
 
-        process_get_command(c, tokens, ntokens, true, true);
+    MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
 
-    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d %s\n", c->sfd, command);
 
-        process_stat(c, tokens, ntokens);
+    /*
+     * for commands set/add/replace, we build an item and read the data
+     * directly into it, then continue in nread_complete().
+     */
 
-    } else if (ntokens >= 2 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
-        time_t exptime = 0;
-        rel_time_t new_oldest = 0;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory preparing response");
+        return;
+    }
 
-        set_noreply_maybe(c, tokens, ntokens);
+    if (settings.proxy && proxy_process_command(c, command, strlen(command))) {
+        if (c->proxy != NULL) {
+            /* the value comes next */
+            conn_set_state(c, conn_nread);
+        }
+        return;
+    }
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.flush_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+    /* Fast path for the most common request there is: a get for one key
+     * needs no tokenizing beyond finding where the key starts. */
+    if (command[0] == 'g' && command[1] == 'e' && command[2] == 't'
+            && command[3] == ' ' && command[4] != ' ' && command[4] != '\0'
+            && strchr(command + 4, ' ') == NULL) {
+        command[3] = '\0';
+        tokens[0].value = command;
+        tokens[0].length = 3;
+        tokens[1].value = command + 4;
+        tokens[1].length = strlen(command + 4);
+        tokens[2].value = NULL;
+        tokens[2].length = 0;
+        process_get_command(c, tokens, 3, false, false);
+        return;
+    }
+    if (command[0] == 's' && command[1] == 'e' && command[2] == 't'
+            && command[3] == ' ' && process_set_fast(c, command))
+        return;
 
-        if (!settings.flush_enabled) {
-            // flush_all is not allowed but we log it on stats
-            out_string(c, "CLIENT_ERROR flush_all not allowed");
+    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    switch (ascii_cmd_lookup(tokens[COMMAND_TOKEN].value,
+                             tokens[COMMAND_TOKEN].length)) {
+    case ACMD_GET:
+    case ACMD_BGET:
+        if (ntokens >= 3) {
+            process_get_command(c, tokens, ntokens, false, false);
+            return;
+        }
+        break;
+    case ACMD_SET:
+        if (ntokens == 6 || ntokens == 7) {
+            process_update_command(c, tokens, ntokens, NREAD_SET, false);
+            return;
+        }
+        break;
+    case ACMD_ADD:
+        if (ntokens == 6 || ntokens == 7) {
+            process_update_command(c, tokens, ntokens, NREAD_ADD, false);
+            return;
+        }
+        break;
+    case ACMD_REPLACE:
+        if (ntokens == 6 || ntokens == 7) {
+            process_update_command(c, tokens, ntokens, NREAD_REPLACE, false);
+            return;
+        }
+        break;
+    case ACMD_PREPEND:
+        if (ntokens == 6 || ntokens == 7) {
+            process_update_command(c, tokens, ntokens, NREAD_PREPEND, false);
+            return;
+        }
+        break;
+    case ACMD_APPEND:
+        if (ntokens == 6 || ntokens == 7) {
+            process_update_command(c, tokens, ntokens, NREAD_APPEND, false);
+            return;
+        }
+        break;
+    case ACMD_CAS:
+        if (ntokens == 7 || ntokens == 8) {
+            process_update_command(c, tokens, ntokens, NREAD_CAS, true);
+            return;
+        }
+        break;
+    case ACMD_INCR:
+        if (ntokens == 4 || ntokens == 5) {
+            process_arithmetic_command(c, tokens, ntokens, 1);
+            return;
+        }
+        break;
+    case ACMD_GETS:
+        if (ntokens >= 3) {
+            process_get_command(c, tokens, ntokens, true, false);
+            return;
+        }
+        break;
+    case ACMD_DECR:
+        if (ntokens == 4 || ntokens == 5) {
+            process_arithmetic_command(c, tokens, ntokens, 0);
             return;
         }
-
-        if (ntokens != (c->noreply ? 3 : 2)) {
-            exptime = strtol(tokens[1].value, NULL, 10);
-            if(errno == ERANGE) {
-                out_string(c, "CLIENT_ERROR bad command line format");
-                return;
-            }
+        break;
+    case ACMD_DELETE:
+        if (ntokens >= 3 && ntokens <= 5) {
+            process_delete_command(c, tokens, ntokens);
+            return;
         }
-
-        /*
-          If exptime is zero realtime() would return zero too, and
-          realtime(exptime) - 1 would overflow to the max unsigned
-          value.  So we process exptime == 0 the same way we do when
-          no delay is given at all.
-        */
-        if (exptime > 0) {
-            new_oldest = realtime(exptime);
-        } else { /* exptime == 0 */
-            new_oldest = current_time;
-        }
-
-        if (settings.use_cas) {
-            settings.oldest_live = new_oldest - 1;
-            if (settings.oldest_live <= current_time)
-                settings.oldest_cas = get_cas_id();
-        } else {
-            settings.oldest_live = new_oldest;
+        break;
+    case ACMD_TOUCH:
+        if (ntokens == 4 || ntokens == 5) {
+            process_touch_command(c, tokens, ntokens);
+            return;
         }
-        out_string(c, "OK");
-        return;
-
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
-
-        out_string(c, "VERSION " VERSION);
-
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
-
-        conn_set_state(c, conn_closing);
-
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "shutdown") == 0)) {
-
-        if (settings.shutdown_command) {
-            conn_set_state(c, conn_closing);
-            raise(SIGINT);
-        } else {
-            out_string(c, "ERROR: shutdown not enabled");
+        break;
+    case ACMD_GAT:
+        if (ntokens >= 4) {
+            process_get_command(c, tokens, ntokens, false, true);
+            return;
         }
-
-    } else if (ntokens > 1 && strcmp(tokens[COMMAND_TOKEN].value, "slabs") == 0) {
-        if (ntokens == 5 && strcmp(tokens[COMMAND_TOKEN + 1].value, "reassign") == 0) {
-            int src, dst, rv;
-
-            if (settings.slab_reassign == false) {
-                out_string(c, "CLIENT_ERROR slab reassignment disabled");
-                return;
-            }
-
-            src = strtol(tokens[2].value, NULL, 10);
-            dst = strtol(tokens[3].value, NULL, 10);
-
-            if (errno == ERANGE) {
-                out_string(c, "CLIENT_ERROR bad command line format");
-                return;
-            }
-
-            rv = slabs_reassign(src, dst);
-            switch (rv) {
-            case REASSIGN_OK:
-                out_string(c, "OK");
-                break;
-            case REASSIGN_RUNNING:
-                out_string(c, "BUSY currently processing reassign request");
-                break;
-            case REASSIGN_BADCLASS:
-                out_string(c, "BADCLASS invalid src or dst class id");
-                break;
-            case REASSIGN_NOSPARE:
-                out_string(c, "NOSPARE source class has no spare pages");
-                break;
-            case REASSIGN_SRC_DST_SAME:
-                out_string(c, "SAME src and dst class are identical");
-                break;
-            }
+        break;
+    case ACMD_GATS:
+        if (ntokens >= 4) {
+            process_get_command(c, tokens, ntokens, true, true);
             return;
-        } else if (ntokens >= 4 &&
-            (strcmp(tokens[COMMAND_TOKEN + 1].value, "automove") == 0)) {
-            process_slabs_automove_command(c, tokens, ntokens);
-        } else {
-            out_string(c, "ERROR");
         }
-    } else if (ntokens > 1 && strcmp(tokens[COMMAND_TOKEN].value, "lru_crawler") == 0) {
-        if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "crawl") == 0) {
-            int rv;
-            if (settings.lru_crawler == false) {
-                out_string(c, "CLIENT_ERROR lru crawler disabled");
-                return;
-            }
-
-            rv = lru_crawler_crawl(tokens[2].value, CRAWLER_EXPIRED, NULL, 0,
-                    settings.lru_crawler_tocrawl);
-            switch(rv) {
-            case CRAWLER_OK:
-                out_string(c, "OK");
-                break;
-            case CRAWLER_RUNNING:
-                out_string(c, "BUSY currently processing crawler request");
-                break;
-            case CRAWLER_BADCLASS:
-                out_string(c, "BADCLASS invalid class id");
-                break;
-            case CRAWLER_NOTSTARTED:
-                out_string(c, "NOTSTARTED no items to crawl");
-                break;
-            case CRAWLER_ERROR:
-                out_string(c, "ERROR an unknown error happened");
-                break;
-            }
+        break;
+    case ACMD_GETRANGE:
+        if (ntokens == 5) {
+            process_getrange_command(c, tokens, ntokens);
             return;
-        } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "metadump") == 0) {
-            if (settings.lru_crawler == false) {
-                out_string(c, "CLIENT_ERROR lru crawler disabled");
-                return;
-            }
-            if (!settings.dump_enabled) {
-                out_string(c, "ERROR metadump not allowed");
-                return;
-            }
-
-            int rv = lru_crawler_crawl(tokens[2].value, CRAWLER_METADUMP,
-                    c, c->sfd, LRU_CRAWLER_CAP_REMAINING);
-            switch(rv) {
-                case CRAWLER_OK:
-                    out_string(c, "OK");
-                    // TODO: Don't reuse conn_watch here.
-                    conn_set_state(c, conn_watch);
-                    event_del(&c->event);
-                    break;
-                case CRAWLER_RUNNING:
-                    out_string(c, "BUSY currently processing crawler request");
-                    break;
-                case CRAWLER_BADCLASS:
-                    out_string(c, "BADCLASS invalid class id");
-                    break;
-                case CRAWLER_NOTSTARTED:
-                    out_string(c, "NOTSTARTED no items to crawl");
-                    break;
-                case CRAWLER_ERROR:
-                    out_string(c, "ERROR an unknown error happened");
-                    break;
-            }
+        }
+        break;
+    case ACMD_MG:
+        if (ntokens >= 3) {
+            process_mget_command(c, tokens, ntokens);
             return;
-        } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "tocrawl") == 0) {
-            uint32_t tocrawl;
-             if (!safe_strtoul(tokens[2].value, &tocrawl)) {
-                out_string(c, "CLIENT_ERROR bad command line format");
-                return;
-            }
-            settings.lru_crawler_tocrawl = tocrawl;
-            out_string(c, "OK");
+        }
+        break;
+    case ACMD_MS:
+        if (ntokens >= 4) {
+            process_mset_command(c, tokens, ntokens);
             return;
-        } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "sleep") == 0) {
-            uint32_t tosleep;
-            if (!safe_strtoul(tokens[2].value, &tosleep)) {
-                out_string(c, "CLIENT_ERROR bad command line format");
-                return;
-            }
-            if (tosleep > 1000000) {
-                out_string(c, "CLIENT_ERROR sleep must be one second or less");
-                return;
-            }
-            settings.lru_crawler_sleep = tosleep;
-            out_string(c, "OK");
+        }
+        break;
+    case ACMD_MD:
+        if (ntokens >= 3) {
+            process_mdelete_command(c, tokens, ntokens);
             return;
-        } else if (ntokens == 3) {
-            if ((strcmp(tokens[COMMAND_TOKEN + 1].value, "enable") == 0)) {
-                if (start_item_crawler_thread() == 0) {
-                    out_string(c, "OK");
-                } else {
-                    out_string(c, "ERROR failed to start lru crawler thread");
-                }
-            } else if ((strcmp(tokens[COMMAND_TOKEN + 1].value, "disable") == 0)) {
-                if (stop_item_crawler_thread() == 0) {
-                    out_string(c, "OK");
-                } else {
-                    out_string(c, "ERROR failed to stop lru crawler thread");
-                }
+        }
+        break;
+    case ACMD_MA:
+        if (ntokens >= 3) {
+            process_marithmetic_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_MN:
+        if (ntokens == 2) {
+            out_string(c, "MN");
+            return;
+        }
+        break;
+    case ACMD_STATS:
+        if (ntokens >= 2) {
+            process_stat(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_FLUSH_ALL:
+        if (ntokens >= 2 && ntokens <= 4) {
+            process_flush_all_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_FLUSH_PREFIX:
+        if (ntokens == 3 || ntokens == 4) {
+            process_flush_prefix_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_VERSION:
+        if (ntokens == 2) {
+            out_string(c, "VERSION " VERSION);
+            return;
+        }
+        break;
+    case ACMD_QUIT:
+        if (ntokens == 2) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        break;
+    case ACMD_SHUTDOWN:
+        if (ntokens == 2) {
+            if (settings.shutdown_command) {
+                conn_set_state(c, conn_closing);
+                raise(SIGINT);
             } else {
-                out_string(c, "ERROR");
+                out_string(c, "ERROR: shutdown not enabled");
             }
             return;
-        } else {
-            out_string(c, "ERROR");
         }
-    } else if (ntokens > 1 && strcmp(tokens[COMMAND_TOKEN].value, "watch") == 0) {
-        process_watch_command(c, tokens, ntokens);
-    } else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "cache_memlimit") == 0)) {
-        process_memlimit_command(c, tokens, ntokens);
-    } else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
-        process_verbosity_command(c, tokens, ntokens);
-    } else if (ntokens >= 3 && strcmp(tokens[COMMAND_TOKEN].value, "lru") == 0) {
-        process_lru_command(c, tokens, ntokens);
+        break;
+    case ACMD_SLABS:
+        if (ntokens > 1) {
+            process_slabs_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_LRU_CRAWLER:
+        if (ntokens > 1) {
+            process_lru_crawler_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_WATCH:
+        if (ntokens > 1) {
+            process_watch_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_CACHE_MEMLIMIT:
+        if (ntokens == 3 || ntokens == 4) {
+            process_memlimit_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_VERBOSITY:
+        if (ntokens == 3 || ntokens == 4) {
+            process_verbosity_command(c, tokens, ntokens);
+            return;
+        }
+        break;
+    case ACMD_LRU:
+        if (ntokens >= 3) {
+            process_lru_command(c, tokens, ntokens);
+            return;
+        }
+        break;
 #ifdef MEMCACHED_DEBUG
     // commands which exist only for testing the memcached's security protection
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "misbehave") == 0)) {
-        process_misbehave_command(c);
+    case ACMD_MISBEHAVE:
+        if (ntokens == 2) {
+            process_misbehave_command(c);
+            return;
+        }
+        break;
+    case ACMD_DEBUGMIGRATE:
+        if (ntokens == 2) {
+            process_debugmigrate_command(c);
+            return;
+        }
+        break;
 #endif
 #ifdef EXTSTORE
-    } else if (ntokens >= 3 && strcmp(tokens[COMMAND_TOKEN].value, "extstore") == 0) {
-        process_extstore_command(c, tokens, ntokens);
+    case ACMD_EXTSTORE:
+        if (ntokens >= 3) {
+            process_extstore_command(c, tokens, ntokens);
+            return;
+        }
+        break;
 #endif
+    default:
+        break;
+    }
+
+    if (ntokens >= 2 && strncmp(tokens[ntokens - 2].value, "HTTP/", 5) == 0) {
+        conn_set_state(c, conn_closing);
     } else {
-        if (ntokens >= 2 && strncmp(tokens[ntokens - 2].value, "HTTP/", 5) == 0) {
-            conn_set_state(c, conn_closing);
-        } else {
-            out_string(c, "ERROR");
-        }
+        out_string(c, "ERROR");
     }
-    return;
 }
 
 /*
@@ -4983,10 +7343,16 @@ static int try_read_command(conn *c) {
     } else {
         char *el, *cont;
 
+        el = c->rbytes ? memchr(c->rcurr, '\n', c->rbytes) : NULL;
+        if (c->wdefer > 0 &&
+                (!el || !ascii_cmd_deferrable(c->rcurr, el - c->rcurr))) {
+            conn_flush_deferred(c, conn_new_cmd);
+            return 1;
+        }
+
         if (c->rbytes == 0)
             return 0;
 
-        el = memchr(c->rcurr, '\n', c->rbytes);
         if (!el) {
             if (c->rbytes > 1024) {
                 /*
@@ -5028,23 +7394,214 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
+#ifdef USE_UDP_BATCH
+/*
+ * Datagrams pulled in by a single recvmmsg(), and response packets waiting
+ * for a single sendmmsg(). Responses are copied out of the connection's
+ * msglist as they are transmitted, so the items and buffers behind them can
+ * be released while the rest of the receive batch is processed.
+ */
+struct udp_batch {
+    int size;       /* number of slots on each side */
+    int rx_count;   /* datagrams returned by the last recvmmsg() */
+    int rx_next;    /* next of those to hand to the parser */
+    int tx_count;   /* packets waiting for sendmmsg() */
+    struct mmsghdr *rx;
+    struct iovec *rx_iov;
+    struct sockaddr_in6 *rx_addr;
+    char *rx_buf;   /* size * UDP_READ_BUFFER_SIZE */
+    struct mmsghdr *tx;
+    struct iovec *tx_iov;
+    struct sockaddr_in6 *tx_addr;
+    char *tx_buf;   /* size * UDP_MAX_PAYLOAD_SIZE */
+};
+
+static void udp_batch_free(struct udp_batch *u) {
+    free(u->rx);
+    free(u->rx_iov);
+    free(u->rx_addr);
+    free(u->rx_buf);
+    free(u->tx);
+    free(u->tx_iov);
+    free(u->tx_addr);
+    free(u->tx_buf);
+    free(u);
+}
+
+static struct udp_batch *udp_batch_new(const int size) {
+    struct udp_batch *u = calloc(1, sizeof(struct udp_batch));
+    int i;
+
+    if (u == NULL)
+        return NULL;
+
+    u->size = size;
+    u->rx = calloc(size, sizeof(struct mmsghdr));
+    u->rx_iov = calloc(size, sizeof(struct iovec));
+    u->rx_addr = calloc(size, sizeof(struct sockaddr_in6));
+    u->rx_buf = malloc((size_t)size * UDP_READ_BUFFER_SIZE);
+    u->tx = calloc(size, sizeof(struct mmsghdr));
+    u->tx_iov = calloc(size, sizeof(struct iovec));
+    u->tx_addr = calloc(size, sizeof(struct sockaddr_in6));
+    u->tx_buf = malloc((size_t)size * UDP_MAX_PAYLOAD_SIZE);
+
+    if (u->rx == NULL || u->rx_iov == NULL || u->rx_addr == NULL ||
+            u->rx_buf == NULL || u->tx == NULL || u->tx_iov == NULL ||
+            u->tx_addr == NULL || u->tx_buf == NULL) {
+        udp_batch_free(u);
+        return NULL;
+    }
+
+    for (i = 0; i < size; i++) {
+        u->rx_iov[i].iov_base = u->rx_buf + (size_t)i * UDP_READ_BUFFER_SIZE;
+        u->rx_iov[i].iov_len = UDP_READ_BUFFER_SIZE;
+        u->rx[i].msg_hdr.msg_iov = &u->rx_iov[i];
+        u->rx[i].msg_hdr.msg_iovlen = 1;
+        u->rx[i].msg_hdr.msg_name = &u->rx_addr[i];
+
+        u->tx_iov[i].iov_base = u->tx_buf + (size_t)i * UDP_MAX_PAYLOAD_SIZE;
+        u->tx[i].msg_hdr.msg_iov = &u->tx_iov[i];
+        u->tx[i].msg_hdr.msg_iovlen = 1;
+        u->tx[i].msg_hdr.msg_name = &u->tx_addr[i];
+    }
+
+    return u;
+}
+
+/* True if datagrams from the last recvmmsg() are still waiting. */
+static inline bool udp_batch_pending(conn *c) {
+    return c->udp_batch != NULL &&
+        c->udp_batch->rx_next < c->udp_batch->rx_count;
+}
+
+/*
+ * Hands out the next received datagram, refilling the batch with one
+ * recvmmsg() call once it has been used up. Sets the request address and
+ * returns the datagram length, or -1 if nothing is available.
+ */
+static int udp_batch_next(conn *c, unsigned char **buf) {
+    struct udp_batch *u = c->udp_batch;
+    struct mmsghdr *m;
+    int i, res;
+
+    if (u->rx_next == u->rx_count) {
+        for (i = 0; i < u->size; i++) {
+            u->rx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        }
+        u->rx_next = u->rx_count = 0;
+        res = recvmmsg(c->sfd, u->rx, u->size, MSG_DONTWAIT, NULL);
+        if (res <= 0)
+            return -1;
+        u->rx_count = res;
+    }
+
+    m = &u->rx[u->rx_next++];
+    memcpy(&c->request_addr, m->msg_hdr.msg_name, m->msg_hdr.msg_namelen);
+    c->request_addr_size = m->msg_hdr.msg_namelen;
+    *buf = (unsigned char *)m->msg_hdr.msg_iov->iov_base;
+    return m->msg_len;
+}
+
+/*
+ * Sends every queued response packet, a batch at a time. Packets that can't
+ * be sent are dropped, as with any other UDP loss.
+ */
+static void udp_batch_flush(conn *c) {
+    struct udp_batch *u = c->udp_batch;
+    uint64_t written = 0;
+    int sent = 0;
+    int i, res;
+
+    while (sent < u->tx_count) {
+        res = sendmmsg(c->sfd, u->tx + sent, u->tx_count - sent, 0);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR)
+                continue;
+            if (settings.verbose > 0)
+                perror("Failed to write UDP batch");
+            break;
+        }
+        for (i = 0; i < res; i++) {
+            written += u->tx[sent + i].msg_len;
+        }
+        sent += res;
+    }
+    u->tx_count = 0;
+
+    if (written > 0) {
+        THR_STATS_ADD(c->thread, bytes_written, written);
+    }
+}
+
+/*
+ * Batched replacement for transmit() on UDP: copies each packet of the
+ * current response, frame header included, into the send batch. The batch
+ * goes out when it fills up and at the end of each drive_machine() pass.
+ */
+static enum transmit_result transmit_udp_batch(conn *c) {
+    struct udp_batch *u = c->udp_batch;
+
+    for (; c->msgcurr < c->msgused; c->msgcurr++) {
+        struct msghdr *m = &c->msglist[c->msgcurr];
+        char *dst;
+        size_t len = 0;
+        size_t i;
+
+        for (i = 0; i < m->msg_iovlen; i++) {
+            len += m->msg_iov[i].iov_len;
+        }
+        /* add_iov() keeps packets within this, so it can't happen */
+        if (len > UDP_MAX_PAYLOAD_SIZE) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "UDP packet too large for batch: %lu\n",
+                        (unsigned long)len);
+            conn_set_state(c, conn_read);
+            return TRANSMIT_HARD_ERROR;
+        }
+
+        if (u->tx_count == u->size)
+            udp_batch_flush(c);
+
+        dst = u->tx_iov[u->tx_count].iov_base;
+        for (i = 0; i < m->msg_iovlen; i++) {
+            memcpy(dst, m->msg_iov[i].iov_base, m->msg_iov[i].iov_len);
+            dst += m->msg_iov[i].iov_len;
+        }
+        u->tx_iov[u->tx_count].iov_len = len;
+        if (m->msg_namelen > 0)
+            memcpy(&u->tx_addr[u->tx_count], m->msg_name, m->msg_namelen);
+        u->tx[u->tx_count].msg_hdr.msg_namelen = m->msg_namelen;
+        u->tx_count++;
+        m->msg_iovlen = 0;
+    }
+
+    return TRANSMIT_COMPLETE;
+}
+#endif
+
 /*
  * read a UDP request.
  */
 static enum try_read_result try_read_udp(conn *c) {
     int res;
+    unsigned char *buf;
 
     assert(c != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, (struct sockaddr *)&c->request_addr,
-                   &c->request_addr_size);
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL) {
+        res = udp_batch_next(c, &buf);
+    } else
+#endif
+    {
+        c->request_addr_size = sizeof(c->request_addr);
+        res = recvfrom(c->sfd, c->rbuf, c->rsize,
+                       0, (struct sockaddr *)&c->request_addr,
+                       &c->request_addr_size);
+        buf = (unsigned char *)c->rbuf;
+    }
     if (res > 8) {
-        unsigned char *buf = (unsigned char *)c->rbuf;
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.bytes_read += res;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_ADD(c->thread, bytes_read, res);
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
@@ -5057,7 +7614,7 @@ static enum try_read_result try_read_udp(conn *c) {
 
         /* Don't care about any of the rest of the header. */
         res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
+        memmove(c->rbuf, buf + 8, res);
 
         c->rbytes = res;
         c->rcurr = c->rbuf;
@@ -5084,6 +7641,26 @@ static enum try_read_result try_read_network(conn *c) {
     int num_allocs = 0;
     assert(c != NULL);
 
+#ifdef HAVE_IO_URING
+    if (c->uring_busy & URING_RECV)
+        return READ_NO_DATA_RECEIVED;
+    if (c->uring_done & URING_RECV) {
+        /* conn_uring_recv() already did the read for us */
+        c->uring_done &= ~URING_RECV;
+        res = c->uring_recv_res;
+        if (res > 0) {
+            THR_STATS_ADD(c->thread, bytes_read, res);
+            c->rbytes += res;
+            return READ_DATA_RECEIVED;
+        }
+        if (res == -EAGAIN || res == -EINTR) {
+            c->uring_poll = true;
+            return READ_NO_DATA_RECEIVED;
+        }
+        return READ_ERROR;
+    }
+#endif
+
     if (c->rcurr != c->rbuf) {
         if (c->rbytes != 0) /* otherwise there's nothing to copy */
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -5116,9 +7693,7 @@ static enum try_read_result try_read_network(conn *c) {
         int avail = c->rsize - c->rbytes;
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_read += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_ADD(c->thread, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->rbytes += res;
             if (res == avail) {
@@ -5140,17 +7715,76 @@ static enum try_read_result try_read_network(conn *c) {
     return gotdata;
 }
 
+/*
+ * Worker threads may be driven by io_uring instead of libevent. The conn's
+ * event is still set up with event_set(), but adding and removing it has to
+ * go through whichever loop owns the calling thread.
+ */
+static int conn_event_add(conn *c) {
+#ifdef HAVE_IO_URING
+    if (uring_thread_active())
+        return uring_event_add(&c->event);
+#endif
+    return event_add(&c->event, 0);
+}
+
+static int conn_event_del(conn *c) {
+#ifdef HAVE_IO_URING
+    if (uring_thread_active())
+        return uring_event_del(&c->event);
+#endif
+    return event_del(&c->event);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Waits for c's next request with an IORING_OP_RECV into the free end of
+ * rbuf instead of a poll. Returns false if c has to wait with a poll, then
+ * read() as usual: UDP, buffers handed back to the pool, a full rbuf (only
+ * try_read_network() grows it), or a recv that came back with EAGAIN last
+ * time.
+ *
+ * Until the recv has come back and try_read_network() has looked at it,
+ * rbuf, rcurr and rbytes stay put: conn_shrink() leaves them alone and
+ * conn_waiting doesn't queue another. A send out from transmit() keeps the
+ * msglist and its iovs in place the same way. Neither lets the conn migrate
+ * or be freed; conn_close() waits for them.
+ */
+static bool conn_uring_recv(conn *c) {
+    if (!uring_thread_active() || IS_UDP(c->transport) || c->rbuf == NULL)
+        return false;
+    if (c->uring_poll) {
+        c->uring_poll = false;
+        return false;
+    }
+
+    if (c->rcurr != c->rbuf) {
+        if (c->rbytes != 0)
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+        c->rcurr = c->rbuf;
+    }
+    if (c->rbytes >= c->rsize)
+        return false;
+
+    /* the recv completing is the event now */
+    if (conn_event_del(c) == -1)
+        return false;
+    c->ev_flags = 0;
+    return uring_conn_recv(c, c->rbuf + c->rbytes, c->rsize - c->rbytes) == 0;
+}
+#endif
+
 static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
     struct event_base *base = c->event.ev_base;
     if (c->ev_flags == new_flags)
         return true;
-    if (event_del(&c->event) == -1) return false;
+    if (conn_event_del(c) == -1) return false;
     event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = new_flags;
-    if (event_add(&c->event, 0) == -1) return false;
+    if (conn_event_add(c) == -1) return false;
     return true;
 }
 
@@ -5197,6 +7831,61 @@ void do_accept_new_conns(const bool do_accept) {
     }
 }
 
+/*
+ * Per-worker listeners (-o reuseport) live on their worker's event base, so
+ * they can only be flipped from that worker. After EMFILE the worker stops
+ * its own listeners; clock_handler() asks it to resume them once a
+ * connection has been closed anywhere. The server counts as not accepting
+ * from the first worker stopping until the last one resumes.
+ */
+static int workers_listen_paused = 0; /* under STATS_LOCK */
+
+void do_accept_new_conns_worker(LIBEVENT_THREAD *me, const bool do_accept) {
+    conn *next;
+
+    for (next = me->listen_conns; next; next = next->next) {
+        if (do_accept) {
+            update_event(next, EV_READ | EV_PERSIST);
+            if (listen(next->sfd, settings.backlog) != 0) {
+                perror("listen");
+            }
+        } else {
+            update_event(next, 0);
+            if (listen(next->sfd, 0) != 0) {
+                perror("listen");
+            }
+        }
+    }
+
+    if (do_accept) {
+        struct timeval maxconns_exited;
+        uint64_t elapsed_us;
+        gettimeofday(&maxconns_exited,NULL);
+        me->listen_paused = false;
+        STATS_LOCK();
+        if (workers_listen_paused > 0 && --workers_listen_paused == 0) {
+            elapsed_us =
+                (maxconns_exited.tv_sec - stats.maxconns_entered.tv_sec) * 1000000
+                + (maxconns_exited.tv_usec - stats.maxconns_entered.tv_usec);
+            stats.time_in_listen_disabled_us += elapsed_us;
+            stats_state.accepting_conns = true;
+        }
+        STATS_UNLOCK();
+    } else {
+        me->listen_paused = true;
+        STATS_LOCK();
+        if (workers_listen_paused++ == 0) {
+            stats_state.accepting_conns = false;
+            gettimeofday(&stats.maxconns_entered,NULL);
+            stats.listen_disabled_num++;
+        }
+        STATS_UNLOCK();
+        pthread_mutex_lock(&conn_lock);
+        allow_new_conns = false;
+        pthread_mutex_unlock(&conn_lock);
+    }
+}
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -5209,6 +7898,15 @@ void do_accept_new_conns(const bool do_accept) {
 static enum transmit_result transmit(conn *c) {
     assert(c != NULL);
 
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL)
+        return transmit_udp_batch(c);
+#endif
+#ifdef HAVE_IO_URING
+    if (c->uring_busy & URING_SENDMSG)
+        return TRANSMIT_SOFT_ERROR;
+#endif
+
     if (c->msgcurr < c->msgused &&
             c->msglist[c->msgcurr].msg_iovlen == 0) {
         /* Finished writing the current msg; advance to the next. */
@@ -5217,12 +7915,44 @@ static enum transmit_result transmit(conn *c) {
     if (c->msgcurr < c->msgused) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
-
+        int flags = 0;
+
+#ifdef USE_ZEROCOPY
+        if (c->zerocopy && c->state == conn_mwrite) {
+            /* may send only part of the message; the rest goes next pass */
+            struct msghdr zm = *m;
+            flags = zerocopy_prepare(c, &zm);
+            res = sendmsg(c->sfd, &zm, flags);
+        } else
+#endif
+#ifdef HAVE_IO_URING
+        if (c->uring_done & URING_SENDMSG) {
+            /* the send queued below is back; take it as sendmsg()'s */
+            c->uring_done &= ~URING_SENDMSG;
+            res = c->uring_send_res;
+            if (res < 0) {
+                errno = -res;
+                res = -1;
+            }
+        } else if (uring_thread_active() && !IS_UDP(c->transport)
+                && conn_event_del(c) != -1) {
+            /* the completion runs the state machine again, see
+             * conn_uring_recv() */
+            c->ev_flags = 0;
+            if (uring_conn_sendmsg(c, m) == 0)
+                return TRANSMIT_SOFT_ERROR;
+            res = sendmsg(c->sfd, m, 0);
+        } else
+#endif
         res = sendmsg(c->sfd, m, 0);
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_written += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_ADD(c->thread, bytes_written, res);
+#ifdef USE_ZEROCOPY
+            if (flags & MSG_ZEROCOPY) {
+                THR_STATS_INCR(c->thread, zerocopy_sends);
+                c->zc_sent++;
+            }
+#endif
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -5317,9 +8047,7 @@ static int read_into_chunked_item(conn *c) {
             res = read(c->sfd, ch->data + ch->used,
                     (unused > c->rlbytes ? c->rlbytes : unused));
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_ADD(c->thread, bytes_read, res);
                 ch->used += res;
                 total += res;
                 c->rlbytes -= res;
@@ -5348,6 +8076,45 @@ static int read_into_chunked_item(conn *c) {
     return total;
 }
 
+/*
+ * -o conn_balance: if the balancer asked this worker to shed a connection,
+ * hand c over while it sits between requests with nothing in flight. Returns
+ * true if c now belongs to another worker.
+ */
+static bool conn_migrate(conn *c) {
+    LIBEVENT_THREAD *t = c->thread;
+    int to = THR_ATOMIC_READ(t->migrate_to);
+
+    if (to < 0 || IS_UDP(c->transport) || c->thread_since == current_time)
+        return false;
+    if (c->rbytes > 0 || c->ileft > 0 || c->suffixleft > 0 || c->item != NULL
+            || c->write_and_free != NULL || c->wdefer > 0)
+        return false;
+#ifdef USE_ZEROCOPY
+    if (c->zc_holds != NULL || c->zc_sent != c->zc_done)
+        return false;
+#endif
+#ifdef EXTSTORE
+    if (c->io_wraplist != NULL || c->io_pending > 0 || c->io_donelist != NULL)
+        return false;
+#endif
+
+    /* one connection per request */
+    THR_ATOMIC_SET(t->migrate_to, -1);
+
+    if (conn_event_del(c) == -1)
+        return false;
+    conn_timer_del(c);
+    if (!dispatch_conn_migrate(c, to)) {
+        /* stay put; conn_waiting's update_event() will re-add the event */
+        c->ev_flags = 0;
+        conn_timer_add(c);
+        return false;
+    }
+    THR_STATS_INCR(t, conn_migrations);
+    return true;
+}
+
 static void drive_machine(conn *c) {
     bool stop = false;
     int sfd;
@@ -5390,7 +8157,11 @@ static void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Too many open connections\n");
-                    accept_new_conns(false);
+                    if (c->thread != NULL) {
+                        do_accept_new_conns_worker(c->thread, false);
+                    } else {
+                        accept_new_conns(false);
+                    }
                     stop = true;
                 } else {
                     perror("accept()");
@@ -5414,6 +8185,25 @@ static void drive_machine(conn *c) {
                 STATS_LOCK();
                 stats.rejected_conns++;
                 STATS_UNLOCK();
+            } else if (c->thread != NULL) {
+                /* Per-worker listener: the connection stays on this thread. */
+                conn *nc = conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                    DATA_BUFFER_SIZE, c->transport,
+                                    c->thread->base);
+                if (nc == NULL) {
+                    if (settings.verbose > 0) {
+                        fprintf(stderr, "Can't listen for events on fd %d\n",
+                            sfd);
+                    }
+                    close(sfd);
+                } else {
+                    nc->thread = c->thread;
+                    if (settings.conn_balance) {
+                        THR_ATOMIC_ADD(nc->thread->conns, 1);
+                        nc->thread_since = current_time;
+                    }
+                    conn_timer_add(nc);
+                }
             } else {
                 dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
                                      DATA_BUFFER_SIZE, c->transport);
@@ -5423,6 +8213,44 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_waiting:
+#ifdef USE_UDP_BATCH
+            /* more datagrams from the last recvmmsg() to get through */
+            if (udp_batch_pending(c)) {
+                conn_set_state(c, conn_read);
+                break;
+            }
+#endif
+#ifdef HAVE_IO_URING
+            /* already waiting, or the wait is over */
+            if (c->uring_busy & URING_RECV) {
+                conn_set_state(c, conn_read);
+                stop = true;
+                break;
+            }
+            if (c->uring_done & URING_RECV) {
+                conn_set_state(c, conn_read);
+                break;
+            }
+#endif
+            if (settings.conn_balance && conn_migrate(c)) {
+                /* c belongs to another worker now */
+                return;
+            }
+
+            /* nothing in flight; don't sit on buffers while idle */
+            if (settings.conn_buffer_pool && !IS_UDP(c->transport)
+                    && c->rbytes == 0 && c->ileft == 0 && c->suffixleft == 0
+                    && c->item == NULL && c->write_and_free == NULL) {
+                conn_put_buffers(c);
+            }
+
+#ifdef HAVE_IO_URING
+            if (conn_uring_recv(c)) {
+                conn_set_state(c, conn_read);
+                stop = true;
+                break;
+            }
+#endif
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -5435,6 +8263,12 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_read:
+            if (c->rbuf == NULL && !conn_get_buffers(c)) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Couldn't get connection buffers\n");
+                conn_set_state(c, conn_closing);
+                break;
+            }
             res = IS_UDP(c->transport) ? try_read_udp(c) : try_read_network(c);
 
             switch (res) {
@@ -5469,10 +8303,12 @@ static void drive_machine(conn *c) {
             if (nreqs >= 0) {
                 reset_cmd_handler(c);
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                THR_STATS_INCR(c->thread, conn_yields);
+                if (c->rbytes > 0
+#ifdef USE_UDP_BATCH
+                        || udp_batch_pending(c)
+#endif
+                        ) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
                        on the socket (unless more data is available. As a
@@ -5486,6 +8322,14 @@ static void drive_machine(conn *c) {
                         break;
                     }
                 }
+#ifdef HAVE_IO_URING
+                else if (c->ev_flags == 0) {
+                    /* a recv or send stood in for the event; wait for the
+                     * next request with another */
+                    conn_set_state(c, conn_waiting);
+                    break;
+                }
+#endif
                 stop = true;
             }
             break;
@@ -5524,9 +8368,7 @@ static void drive_machine(conn *c) {
                 /*  now try reading from the socket */
                 res = read(c->sfd, c->ritem, c->rlbytes);
                 if (res > 0) {
-                    pthread_mutex_lock(&c->thread->stats.mutex);
-                    c->thread->stats.bytes_read += res;
-                    pthread_mutex_unlock(&c->thread->stats.mutex);
+                    THR_STATS_ADD(c->thread, bytes_read, res);
                     if (c->rcurr == c->ritem) {
                         c->rcurr += res;
                     }
@@ -5546,6 +8388,11 @@ static void drive_machine(conn *c) {
             }
 
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (c->wdefer > 0) {
+                    /* don't sit on responses while the value trickles in */
+                    conn_flush_deferred(c, conn_nread);
+                    break;
+                }
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -5594,9 +8441,7 @@ static void drive_machine(conn *c) {
             /*  now try reading from the socket */
             res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_ADD(c->thread, bytes_read, res);
                 c->sbytes -= res;
                 break;
             }
@@ -5621,6 +8466,13 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_write:
+            if (conn_defer_response(c, nreqs)) {
+                c->wdefer = c->wbytes;
+                c->wbytes = 0;
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+            c->wdefer = 0;
             /*
              * We want to write out a simple response. If we haven't already,
              * assemble it into a msgbuf list (this will be a single-entry
@@ -5648,7 +8500,7 @@ static void drive_machine(conn *c) {
                 assert(c->io_wraplist != NULL);
                 // TODO: create proper state for this condition
                 conn_set_state(c, conn_watch);
-                event_del(&c->event);
+                conn_event_del(c);
                 c->io_queued = true;
                 extstore_submit(c->thread->storage, &c->io_wraplist->io);
                 stop = true;
@@ -5717,9 +8569,29 @@ static void drive_machine(conn *c) {
         }
     }
 
+#ifdef USE_UDP_BATCH
+    /* send everything the received batch produced in one go */
+    if (c->udp_batch != NULL && c->udp_batch->tx_count > 0)
+        udp_batch_flush(c);
+#endif
+
     return;
 }
 
+#ifdef HAVE_IO_URING
+/* One of c's recvs or sends is back from the ring; uring.c has stored its
+ * result. */
+void conn_uring_done(conn *c, const short which) {
+    if (c->state == conn_closed) {
+        /* the client went away while it was out; see conn_close() */
+        if (c->uring_busy == 0)
+            conn_close(c);
+        return;
+    }
+    event_handler(c->sfd, which, c);
+}
+#endif
+
 void event_handler(const int fd, const short which, void *arg) {
     conn *c;
 
@@ -5736,6 +8608,23 @@ void event_handler(const int fd, const short which, void *arg) {
         return;
     }
 
+#ifdef USE_ZEROCOPY
+    if (c->zc_holds != NULL || c->zc_sent != c->zc_done)
+        zerocopy_reap(c);
+#endif
+
+    if (settings.conn_balance && c->thread != NULL) {
+        /* c may move to another worker; charge the one doing the work */
+        LIBEVENT_THREAD *t = c->thread;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        drive_machine(c);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        THR_COUNTER_ADD(t->busy_us, (end.tv_sec - start.tv_sec) * 1000000 +
+                (end.tv_nsec - start.tv_nsec) / 1000);
+        return;
+    }
+
     drive_machine(c);
 
     /* wait for next event */
@@ -5794,6 +8683,58 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+#ifdef SO_REUSEPORT
+/*
+ * Open another TCP listener sharing the address of an existing
+ * SO_REUSEPORT listener, for -o reuseport. Binding to the address reported
+ * by getsockname() keeps an ephemeral port (-p 0) the same across sockets.
+ */
+static int new_reuseport_socket(const int orig_sfd, struct addrinfo *ai) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int sfd;
+
+    if (getsockname(orig_sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        perror("getsockname()");
+        return -1;
+    }
+
+    if ((sfd = new_socket(ai)) == -1) {
+        perror("socket()");
+        return -1;
+    }
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+    }
+#endif
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(sfd);
+        return -1;
+    }
+
+    if (bind(sfd, (struct sockaddr *)&addr, addrlen) == -1) {
+        perror("bind()");
+        close(sfd);
+        return -1;
+    }
+    if (listen(sfd, settings.backlog) == -1) {
+        perror("listen()");
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+#endif
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -5859,6 +8800,16 @@ static int server_socket(const char *interface,
 #endif
 
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+        if (settings.reuseport && !IS_UDP(transport)) {
+            error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+            if (error != 0) {
+                perror("setsockopt(SO_REUSEPORT)");
+                close(sfd);
+                continue;
+            }
+        }
+#endif
         if (IS_UDP(transport)) {
             maximize_sndbuf(sfd);
         } else {
@@ -5931,6 +8882,24 @@ static int server_socket(const char *interface,
                                   EV_READ | EV_PERSIST,
                                   UDP_READ_BUFFER_SIZE, transport);
             }
+#ifdef SO_REUSEPORT
+        } else if (settings.reuseport) {
+            int c;
+
+            /* Every worker gets its own listener on this address and
+             * accepts directly, skipping the dispatcher. As with UDP,
+             * round-robin dispatch hands one listener to each thread.
+             */
+            for (c = 0; c < settings.num_threads; c++) {
+                int per_thread_fd = c ? new_reuseport_socket(sfd, next) : sfd;
+                if (per_thread_fd == -1) {
+                    fprintf(stderr, "failed to create listening connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                dispatch_conn_new(per_thread_fd, conn_listening,
+                                  EV_READ | EV_PERSIST, 1, transport);
+            }
+#endif
         } else {
             if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                              EV_READ | EV_PERSIST, 1,
@@ -6130,9 +9099,18 @@ static void clock_handler(const int fd, const short which, void *arg) {
 #endif
     }
 
-    // While we're here, check for hash table expansion.
+    // While we're here, check if the hash table wants resizing.
     // This function should be quick to avoid delaying the timer.
-    assoc_start_expand(stats_state.curr_items);
+    assoc_start_resize(stats_state.curr_items);
+
+    // Per-worker listeners paused on EMFILE resume once fds free up.
+    if (settings.reuseport && allow_new_conns) {
+        resume_worker_listeners();
+    }
+
+    if (settings.conn_balance) {
+        thread_balance();
+    }
 
     evtimer_set(&clockevent, clock_handler, 0);
     event_base_set(main_base, &clockevent);
@@ -6204,6 +9182,10 @@ static void usage(void) {
            "   - hashpower:           an integer multiplier for how large the hash\n"
            "                          table should be. normally grows at runtime.\n"
            "                          set based on \"STAT hash_power_level\"\n"
+           "   - hash_buckets:        index items in 64 byte buckets of six tagged\n"
+           "                          slots, so most lookups touch one cache line\n"
+           "                          of the table. Buckets are 8x the size of the\n"
+           "                          default's pointers, but hold 5 items each.\n"
            "   - tail_repair_time:    time in seconds for how long to wait before\n"
            "                          forcefully killing LRU tail item.\n"
            "                          disabled by default; very dangerous option.\n"
@@ -6233,9 +9215,53 @@ static void usage(void) {
            "                           small perf hit in ASCII, no perf difference in\n"
            "                           binary protocol. speeds up all sets.\n"
            "   - no_hashexpand:       disables hash table expansion (dangerous)\n"
+           "   - no_hashshrink:       never shrink the hash table back down after\n"
+           "                          the item count falls\n"
            "   - modern:              enables options which will be default in future.\n"
            "             currently: nothing\n"
            "   - no_modern:           uses defaults of previous major version (1.4.x)\n"
+           );
+    printf(
+#ifdef SO_REUSEPORT
+           "   - reuseport:           give each worker thread its own SO_REUSEPORT TCP\n"
+           "                          listener instead of accepting on the main thread.\n"
+#endif
+#ifdef USE_UDP_BATCH
+           "   - udp_batch:           read and send up to this many UDP datagrams per\n"
+           "                          system call (2-64, default 0/off). Each UDP\n"
+           "                          worker reserves 64k of buffer per datagram.\n"
+#endif
+           "   - conn_buffer_pool:    connections borrow read/write buffers from their\n"
+           "                          worker only while a request is in flight. Saves\n"
+           "                          ~13k per idle connection.\n"
+           "   - conn_balance:        place new connections on the least busy worker\n"
+           "                          and move busy connections off overloaded ones.\n"
+#ifdef HAVE_NUMA
+           "   - numa:                pin workers to cores and allocate slab pages\n"
+           "                          from each worker's own NUMA node.\n"
+#endif
+           "   - proxy_server:        <host>:<port>[:<weight>] of a server to pass\n"
+           "                          requests on to, by consistent hash of the key.\n"
+           "                          Give once per server. ASCII over TCP only.\n"
+           "   - proxy_timeout:       seconds a proxy server has to answer (default: %d)\n"
+           "   - compress_min:        LZ4 compress stored values of at least this many\n"
+           "                          bytes, if it saves an eighth (default 0/off)\n"
+           "   - hotkeys:             track the most fetched keys, shown by\n"
+           "                          \"stats hotkeys\" (default 0/off, max %d)\n"
+           "   - hotkeys_window:      seconds counted for each hot keys list\n"
+           "                          (default: %d)\n"
+           "   - hotkeys_cache:       workers keep copies of the hot keys' items, so\n"
+           "                          gets of them skip the hash table and its locks\n"
+#ifdef USE_ZEROCOPY
+           "   - zerocopy_size:       send item data of at least this many bytes with\n"
+           "                          MSG_ZEROCOPY (default 0/off, try 32768 or more)\n"
+#endif
+#ifdef HAVE_IO_URING
+           "   - io_uring:            (EXPERIMENTAL) run worker reads, sends and waits\n"
+           "                          on io_uring\n"
+           "                          instead of libevent; reads and writes are still\n"
+           "                          plain syscalls.\n"
+#endif
 #ifdef HAVE_DROP_PRIVILEGES
            "   - no_drop_privileges: Disable drop_privileges in case it causes issues with\n"
            "                          some customisation.\n"
@@ -6258,7 +9284,7 @@ static void usage(void) {
            "   - ext_max_frag:        max page fragmentation to tolerage\n"
            "                          (see doc/storage.txt for more info)\n"
 #endif
-           );
+           , settings.proxy_timeout, HOTKEYS_MAX, settings.hotkeys_window);
     return;
 }
 
@@ -6544,6 +9570,8 @@ int main (int argc, char **argv) {
         MAXCONNS_FAST = 0,
         HASHPOWER_INIT,
         NO_HASHEXPAND,
+        NO_HASHSHRINK,
+        HASH_BUCKETS,
         SLAB_REASSIGN,
         SLAB_AUTOMOVE,
         SLAB_AUTOMOVE_RATIO,
@@ -6576,9 +9604,24 @@ int main (int argc, char **argv) {
         NO_LRU_CRAWLER,
         NO_LRU_MAINTAINER,
         NO_DROP_PRIVILEGES,
+        REUSEPORT,
+        UDP_BATCH,
+        ZEROCOPY_SIZE,
+        CONN_BUFFER_POOL,
+        CONN_BALANCE,
+        NUMA,
+        PROXY_SERVER,
+        PROXY_TIMEOUT,
+        COMPRESS_MIN,
+        HOTKEYS,
+        HOTKEYS_WINDOW_OPT,
+        HOTKEYS_CACHE,
 #ifdef MEMCACHED_DEBUG
         RELAXED_PRIVILEGES,
 #endif
+#ifdef HAVE_IO_URING
+        IO_URING,
+#endif
 #ifdef EXTSTORE
         EXT_PAGE_SIZE,
         EXT_PAGE_COUNT,
@@ -6601,6 +9644,8 @@ int main (int argc, char **argv) {
         [MAXCONNS_FAST] = "maxconns_fast",
         [HASHPOWER_INIT] = "hashpower",
         [NO_HASHEXPAND] = "no_hashexpand",
+        [NO_HASHSHRINK] = "no_hashshrink",
+        [HASH_BUCKETS] = "hash_buckets",
         [SLAB_REASSIGN] = "slab_reassign",
         [SLAB_AUTOMOVE] = "slab_automove",
         [SLAB_AUTOMOVE_RATIO] = "slab_automove_ratio",
@@ -6633,9 +9678,24 @@ int main (int argc, char **argv) {
         [NO_LRU_CRAWLER] = "no_lru_crawler",
         [NO_LRU_MAINTAINER] = "no_lru_maintainer",
         [NO_DROP_PRIVILEGES] = "no_drop_privileges",
+        [REUSEPORT] = "reuseport",
+        [UDP_BATCH] = "udp_batch",
+        [ZEROCOPY_SIZE] = "zerocopy_size",
+        [CONN_BUFFER_POOL] = "conn_buffer_pool",
+        [CONN_BALANCE] = "conn_balance",
+        [NUMA] = "numa",
+        [PROXY_SERVER] = "proxy_server",
+        [PROXY_TIMEOUT] = "proxy_timeout",
+        [COMPRESS_MIN] = "compress_min",
+        [HOTKEYS] = "hotkeys",
+        [HOTKEYS_WINDOW_OPT] = "hotkeys_window",
+        [HOTKEYS_CACHE] = "hotkeys_cache",
 #ifdef MEMCACHED_DEBUG
         [RELAXED_PRIVILEGES] = "relaxed_privileges",
 #endif
+#ifdef HAVE_IO_URING
+        [IO_URING] = "io_uring",
+#endif
 #ifdef EXTSTORE
         [EXT_PAGE_SIZE] = "ext_page_size",
         [EXT_PAGE_COUNT] = "ext_page_count",
@@ -6981,6 +10041,12 @@ int main (int argc, char **argv) {
             case NO_HASHEXPAND:
                 start_assoc_maint = false;
                 break;
+            case NO_HASHSHRINK:
+                settings.hash_shrink = false;
+                break;
+            case HASH_BUCKETS:
+                settings.hash_buckets = true;
+                break;
             case SLAB_REASSIGN:
                 settings.slab_reassign = true;
                 break;
@@ -7352,10 +10418,127 @@ int main (int argc, char **argv) {
             case NO_DROP_PRIVILEGES:
                 settings.drop_privileges = false;
                 break;
+            case REUSEPORT:
+#ifdef SO_REUSEPORT
+                settings.reuseport = true;
+#else
+                fprintf(stderr, "reuseport is not supported on this platform\n");
+                return 1;
+#endif
+                break;
+            case UDP_BATCH:
+#ifdef USE_UDP_BATCH
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for udp_batch\n");
+                    return 1;
+                }
+                settings.udp_batch = atoi(subopts_value);
+                /* a batch of one is no batch; don't let 1 look like it's on */
+                if (settings.udp_batch == 1 || settings.udp_batch < 0 ||
+                        settings.udp_batch > UDP_BATCH_MAX) {
+                    fprintf(stderr, "udp_batch must be 0 (off) or between "
+                            "2 and %d\n", UDP_BATCH_MAX);
+                    return 1;
+                }
+#else
+                fprintf(stderr, "udp_batch is not supported on this platform\n");
+                return 1;
+#endif
+                break;
+            case ZEROCOPY_SIZE:
+#ifdef USE_ZEROCOPY
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing zerocopy_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.zerocopy_size)) {
+                    fprintf(stderr, "could not parse argument to zerocopy_size\n");
+                    return 1;
+                }
+#else
+                fprintf(stderr, "zerocopy_size is not supported on this platform\n");
+                return 1;
+#endif
+                break;
+            case CONN_BUFFER_POOL:
+                settings.conn_buffer_pool = true;
+                break;
+            case CONN_BALANCE:
+                settings.conn_balance = true;
+                break;
+            case NUMA:
+#ifdef HAVE_NUMA
+                settings.numa = true;
+                break;
+#else
+                fprintf(stderr, "This server is not built with NUMA support.\n");
+                return 1;
+#endif
+            case PROXY_SERVER:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing proxy_server argument\n");
+                    return 1;
+                }
+                if (!proxy_add_server(subopts_value)) {
+                    return 1;
+                }
+                settings.proxy = true;
+                break;
+            case PROXY_TIMEOUT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for proxy_timeout\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.proxy_timeout) ||
+                        settings.proxy_timeout < 1) {
+                    fprintf(stderr, "proxy_timeout must be at least 1 second\n");
+                    return 1;
+                }
+                break;
+            case COMPRESS_MIN:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing compress_min argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.compress_min)) {
+                    fprintf(stderr, "could not parse argument to compress_min\n");
+                    return 1;
+                }
+                break;
+            case HOTKEYS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for hotkeys\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.hotkeys) ||
+                        settings.hotkeys < 0 || settings.hotkeys > HOTKEYS_MAX) {
+                    fprintf(stderr, "hotkeys must be between 0 and %d\n", HOTKEYS_MAX);
+                    return 1;
+                }
+                break;
+            case HOTKEYS_WINDOW_OPT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for hotkeys_window\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.hotkeys_window) ||
+                        settings.hotkeys_window < 1) {
+                    fprintf(stderr, "hotkeys_window must be at least 1 second\n");
+                    return 1;
+                }
+                break;
+            case HOTKEYS_CACHE:
+                settings.hotkeys_cache = true;
+                break;
 #ifdef MEMCACHED_DEBUG
             case RELAXED_PRIVILEGES:
                 settings.relaxed_privileges = true;
                 break;
+#endif
+#ifdef HAVE_IO_URING
+            case IO_URING:
+                settings.io_uring = true;
+                break;
 #endif
             default:
                 printf("Illegal suboption \"%s\"\n", subopts_value);
@@ -7454,6 +10637,29 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    if (settings.hotkeys_cache && settings.hotkeys == 0) {
+        fprintf(stderr, "hotkeys_cache requires -o hotkeys\n");
+        exit(EX_USAGE);
+    }
+
+#ifdef HAVE_IO_URING
+    if (settings.io_uring && !uring_probe()) {
+        fprintf(stderr, "io_uring is not available on this system, falling back to libevent\n");
+        settings.io_uring = false;
+    }
+#endif
+
+#ifdef HAVE_NUMA
+    if (settings.numa && numa_available() < 0) {
+        fprintf(stderr, "NUMA is not available on this system\n");
+        exit(EX_USAGE);
+    }
+    if (settings.numa && settings.maxbytes == 0) {
+        fprintf(stderr, "numa requires a memory limit (-m)\n");
+        exit(EX_USAGE);
+    }
+#endif
+
     if (hash_init(hash_type) != 0) {
         fprintf(stderr, "Failed to initialize hash_algorithm!\n");
         exit(EX_USAGE);
@@ -7484,6 +10690,19 @@ int main (int argc, char **argv) {
         settings.port = settings.udpport;
     }
 
+    if (settings.proxy) {
+        if (settings.binding_protocol == binary_prot) {
+            fprintf(stderr, "ERROR: proxy mode only speaks the ASCII protocol.\n");
+            exit(EX_USAGE);
+        }
+        if (settings.udpport != 0) {
+            fprintf(stderr, "ERROR: proxy mode does not serve UDP; use -U 0.\n");
+            exit(EX_USAGE);
+        }
+        settings.binding_protocol = ascii_prot;
+        proxy_init();
+    }
+
     if (maxcore != 0) {
         struct rlimit rlim_new;
         /*
@@ -7668,7 +10887,8 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    if (settings.idle_timeout && start_conn_timeout_thread() == -1) {
+    if (settings.hotkeys && start_hotkeys_thread() != 0) {
+        fprintf(stderr, "Failed to start hot keys thread\n");
         exit(EXIT_FAILURE);
     }
 
@@ -42,6 +42,14 @@
 #define UDP_READ_BUFFER_SIZE 65536
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
+/* Upper bound on datagrams moved per recvmmsg/sendmmsg call (-o udp_batch) */
+#define UDP_BATCH_MAX 64
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_UDP_BATCH 1
+#endif
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define USE_ZEROCOPY 1
+#endif
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
 /* Up to 3 numbers (2 32bit, 1 64bit), spaces, newlines, null 0 */
 #define SUFFIX_SIZE 50
@@ -64,6 +72,9 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/** Spare buffer sets each worker keeps for -o conn_buffer_pool */
+#define CONN_BUFS_FREE_MAX 128
+
 /* Binary protocol stuff */
 #define MIN_BIN_PKT_LENGTH 16
 #define BIN_PKT_HDR_WORDS (MIN_BIN_PKT_LENGTH/sizeof(uint32_t))
@@ -267,24 +278,46 @@ struct slab_stats {
     X(bytes_read) \
     X(bytes_written) \
     X(flush_cmds) \
+    X(flush_prefix_cmds) \
+    X(getrange_cmds) \
+    X(append_nocopy) /* appends that moved a chunked value, not copied it */ \
     X(conn_yields) /* # of yields for connections (-R option)*/ \
     X(auth_cmds) \
     X(auth_errors) \
-    X(idle_kicks) /* idle connections killed */
+    X(idle_kicks) /* idle connections killed */ \
+    X(zerocopy_sends) /* sendmsg() calls made with MSG_ZEROCOPY */ \
+    X(zerocopy_copied) /* of those, ones the kernel copied anyway */ \
+    X(conn_migrations) /* connections handed to a less busy worker */ \
+    X(numa_local_hits) /* -o numa: hits on items in the worker's node */ \
+    X(numa_remote_hits) /* ... and on items in another node */ \
+    X(proxy_cmds) /* proxy mode: client requests passed on */ \
+    X(proxy_backend_cmds) /* ... requests sent to servers, per server */ \
+    X(proxy_backend_failures) /* ... and those a server failed to answer */ \
+    X(compress_sets) /* -o compress_min: values stored compressed */ \
+    X(compress_bytes_saved) /* ... and how much smaller they came out */ \
+    X(decompress_gets) /* compressed values expanded to be sent */ \
+    X(hotcache_hits) /* -o hotkeys_cache: gets served without the hash table */
 
 #ifdef EXTSTORE
 #define EXTSTORE_THREAD_STATS_FIELDS \
     X(get_extstore) \
+    X(get_extstore_ooo) /* mg A: reads answered out of order */ \
     X(recache_from_extstore) \
     X(miss_from_extstore) \
     X(badcrc_from_extstore)
 #endif
 
+/* Avoids false sharing between threads' hot data. */
+#define CACHE_LINE_SIZE 64
+
 /**
  * Stats stored per-thread.
+ * Only the owning worker ever writes its counters, so it bumps them with no
+ * lock held. Other threads read them with relaxed loads when aggregating,
+ * and "stats reset" snapshots them rather than zeroing them underneath the
+ * owner.
  */
 struct thread_stats {
-    pthread_mutex_t   mutex;
 #define X(name) uint64_t    name;
     THREAD_STATS_FIELDS
 #ifdef EXTSTORE
@@ -293,7 +326,29 @@ struct thread_stats {
 #undef X
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
     uint64_t lru_hits[POWER_LARGEST];
-};
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#if defined(__ATOMIC_RELAXED) && defined(HAVE_GCC_64ATOMICS)
+#define THR_STATS_READ(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define THR_COUNTER_ADD(v, n) __atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#else
+#define THR_STATS_READ(v) (v)
+#define THR_COUNTER_ADD(v, n) ((v) += (n))
+#endif
+#define THR_STATS_ADD(t, name, n) THR_COUNTER_ADD((t)->stats.name, n)
+#define THR_STATS_INCR(t, name) THR_STATS_ADD(t, name, 1)
+
+/* Counters more than one thread writes, such as the per-worker connection
+ * counts used by -o conn_balance. */
+#if defined(__ATOMIC_RELAXED)
+#define THR_ATOMIC_READ(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define THR_ATOMIC_SET(v, n) __atomic_store_n(&(v), (n), __ATOMIC_RELAXED)
+#define THR_ATOMIC_ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#else
+#define THR_ATOMIC_READ(v) (v)
+#define THR_ATOMIC_SET(v, n) ((v) = (n))
+#define THR_ATOMIC_ADD(v, n) ((v) += (n))
+#endif
 
 /**
  * Global stats. Only resettable stats should go into this structure.
@@ -318,6 +373,7 @@ struct stats {
     uint64_t      log_worker_written; /* logs written by worker threads */
     uint64_t      log_watcher_skipped; /* logs watchers missed */
     uint64_t      log_watcher_sent; /* logs sent to watcher buffers */
+    uint64_t      hash_bytes_reclaimed; /* freed by shrinking the hash table */
 #ifdef EXTSTORE
     uint64_t      extstore_compact_lost; /* items lost because they were locked */
     uint64_t      extstore_compact_rescues; /* items re-written during compaction */
@@ -386,6 +442,8 @@ struct settings {
     double slab_automove_ratio; /* youngest must be within pct of oldest */
     unsigned int slab_automove_window; /* window mover for algorithm */
     int hashpower_init;     /* Starting hash power level */
+    bool hash_buckets;      /* cache line buckets of tagged slots, not chains */
+    bool hash_shrink;       /* give back hash table memory when items go */
     bool shutdown_command; /* allow shutdown command */
     int tail_repair_time;   /* LRU tail refcount leak repair time */
     bool flush_enabled;     /* flush_all enabled */
@@ -406,6 +464,21 @@ struct settings {
     unsigned int logger_buf_size; /* size of per-thread logger buffer */
     bool drop_privileges;   /* Whether or not to drop unnecessary process privileges */
     bool relaxed_privileges;   /* Relax process restrictions when running testapp */
+    bool reuseport; /* each worker accepts from its own SO_REUSEPORT listener */
+    int udp_batch; /* datagrams per recvmmsg/sendmmsg call, 0 disables */
+    unsigned int zerocopy_size; /* send item data runs this large with MSG_ZEROCOPY, 0 disables */
+    bool conn_buffer_pool; /* idle connections hand their buffers back to the worker */
+    bool conn_balance; /* place and move connections by worker load */
+    bool numa; /* pin workers to cores and split slab memory by NUMA node */
+    bool proxy; /* pass requests on to -o proxy_server servers */
+    int proxy_timeout; /* seconds a proxy server has to answer */
+    unsigned int compress_min; /* LZ4 compress values at least this large, 0 = off */
+    int hotkeys; /* most fetched keys to show in "stats hotkeys", 0 = off */
+    int hotkeys_window; /* seconds counted for each hot keys list */
+    bool hotkeys_cache; /* workers keep references to the hot keys' items */
+#ifdef HAVE_IO_URING
+    bool io_uring; /* drive worker threads from io_uring instead of libevent */
+#endif
 #ifdef EXTSTORE
     unsigned int ext_item_size; /* minimum size of items to store externally */
     unsigned int ext_item_age; /* max age of tail item before storing ext. */
@@ -444,6 +517,14 @@ extern struct settings settings;
 /* ITEM_data bulk is external to item */
 #define ITEM_HDR 128
 #endif
+/* ITEM_data is the value LZ4 compressed, after its uint32_t length */
+#define ITEM_COMPRESSED 256
+/* A client has been given the win token to recache this item (mg N/R) */
+#define ITEM_TOKEN_SENT 512
+/* Invalidated by md I; served, marked X, until it's replaced */
+#define ITEM_STALE 1024
+/* A worker's private copy of a hot item, malloc()ed by hotcache_fill() */
+#define ITEM_HOTCOPY 2048
 
 /**
  * Structure for storing items within memcached.
@@ -458,10 +539,11 @@ typedef struct _stritem {
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
     unsigned short  refcount;
+    uint16_t        it_flags;   /* ITEM_* above */
     uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint32_t        ns_gen;     /* flush_prefix generation when last seen valid */
     /* this odd type prevents type-punning issues when we do
      * the little shuffle to save space when not using CAS. */
     union {
@@ -487,8 +569,8 @@ typedef struct {
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
     unsigned short  refcount;
+    uint16_t        it_flags;   /* ITEM_* above */
     uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
     uint32_t        remaining;  /* Max keys to crawl per slab per invocation */
@@ -506,8 +588,8 @@ typedef struct _strchunk {
     int              used;      /* chunk space used */
     int              nbytes;    /* used. */
     unsigned short   refcount;  /* used? */
+    uint16_t         it_flags;  /* ITEM_* above. */
     uint8_t          orig_clsid; /* For obj hdr chunks slabs_clsid is fake. */
-    uint8_t          it_flags;  /* ITEM_* above. */
     uint8_t          slabs_clsid; /* Same as above. */
     char data[];
 } item_chunk;
@@ -518,21 +600,61 @@ typedef struct {
     unsigned short page_id; /* from IO header */
 } item_hdr;
 #endif
+/*
+ * Idle connection timer wheel, one per worker. The inner wheel has a slot
+ * per second; the outer wheel has a slot per turn of the inner one, and its
+ * entries are moved inward as their turn comes up. Deadlines past the outer
+ * wheel wait in its farthest slot and are rescheduled from there.
+ */
+#define CONN_TIMER_BITS 8
+#define CONN_TIMER_SLOTS (1 << CONN_TIMER_BITS)
+#define CONN_TIMER_OUTER_BITS 6
+#define CONN_TIMER_OUTER_SLOTS (1 << CONN_TIMER_OUTER_BITS)
+struct conn_timer_wheel {
+    rel_time_t now;             /* every deadline up to here has been run */
+    struct conn *inner[CONN_TIMER_SLOTS];
+    struct conn *outer[CONN_TIMER_OUTER_SLOTS];
+};
+
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
-    struct event notify_event;  /* listen event for notify pipe */
-    int notify_receive_fd;      /* receiving end of notify pipe */
-    int notify_send_fd;         /* sending end of notify pipe */
+    struct event notify_event;  /* listen event for notify eventfd/pipe */
+    int notify_receive_fd;      /* receiving end of notify eventfd/pipe */
+    int notify_send_fd;         /* sending end (same fd with eventfd) */
     struct thread_stats stats;  /* Stats generated by this thread */
+    struct thread_stats stats_base; /* stats values at the last reset */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
+    struct conn_bufs *conn_bufs_free; /* spare buffer sets for idle conns */
+    int conn_bufs_free_count;
     cache_t *suffix_cache;      /* suffix cache */
 #ifdef EXTSTORE
     cache_t *io_cache;          /* IO objects */
     void *storage;              /* data object for storage system */
+    pthread_mutex_t io_done_lock;
+    struct _io_wrap *io_done;   /* out of order reads back from extstore */
 #endif
     logger *l;                  /* logger buffer */
     void *lru_bump_buf;         /* async LRU bump buffer */
+    struct conn *listen_conns;  /* per-worker SO_REUSEPORT listeners */
+    volatile bool listen_paused; /* listeners stopped after EMFILE */
+    struct event timer_event;   /* once a second tick for idle_timeout */
+    int timer_fd;               /* timerfd behind timer_event, or -1 */
+    struct conn_timer_wheel timers; /* client conns by idle deadline */
+    /* -o conn_balance, see thread_balance() */
+    uint64_t busy_us;           /* time spent in connection events */
+    uint64_t busy_us_last;      /* busy_us at the last balance pass */
+    unsigned int load;          /* busy usec per second, smoothed */
+    int conns;                  /* client connections owned */
+    int conns_queued;           /* new connections not picked up yet */
+    int migrate_to;             /* worker to hand a connection to, or -1 */
+    int numa_node;              /* -o numa: node this worker is pinned to */
+    void *proxy;                /* proxy mode: connections to the servers */
+    char *compress_buf;         /* -o compress_min: scratch for store_item() */
+    int compress_buf_size;
+    struct hotkeys *hotkeys;    /* -o hotkeys: this worker's get counts */
+    struct conn *zc_closing;    /* closed, waiting on zero-copy sends */
+    volatile bool hash_reading; /* in item_prefetch(), see assoc_resize() */
 } LIBEVENT_THREAD;
 typedef struct conn conn;
 #ifdef EXTSTORE
@@ -547,8 +669,24 @@ typedef struct _io_wrap {
     bool miss;                /* signal a miss to unlink hdr_it */
     bool badcrc;              /* signal a crc failure */
     bool active; // FIXME: canary for test. remove
+    char *miss_line;          /* mg: sent in place of the response on a miss */
+    int miss_len;
+    bool ooo;                 /* mg A: answered on its own once it's back */
+    char *hit_line;           /* ooo: response line, malloc'd with miss_line */
+    int hit_len;
 } io_wrap;
 #endif
+
+/* Meta commands (mg/ms/md/ma): fields the client asked to have echoed back,
+ * kept on the conn while an ms waits for its value. */
+#define META_RET_MAX 8       /* distinct return flags: c f h k l O s t */
+#define META_OPAQUE_MAX 32
+struct meta_ret {
+    char flags[META_RET_MAX + 1]; /* flag letters, in request order */
+    char opaque[META_OPAQUE_MAX + 1];
+    bool quiet;   /* q: leave out the uninteresting responses */
+};
+
 /**
  * The structure representing a connection into memcached.
  */
@@ -572,6 +710,7 @@ struct conn {
     char   *wcurr;
     int    wsize;
     int    wbytes;
+    int    wdefer;  /** bytes of held back responses at the start of wbuf */
     /** which state to go into after finishing current write */
     enum conn_states  write_and_go;
     void   *write_and_free; /** free this memory after finishing writing */
@@ -617,6 +756,8 @@ struct conn {
     unsigned int recache_counter;
     io_wrap *io_wraplist; /* linked list of io_wraps */
     bool io_queued; /* FIXME: debugging flag */
+    int io_pending;       /* out of order reads not back yet */
+    io_wrap *io_donelist; /* ... and those back but not yet sent */
 #endif
     enum protocol protocol;   /* which protocol this connection speaks */
     enum network_transport transport; /* what transport is used by this connection */
@@ -627,8 +768,35 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_batch *udp_batch; /* udp: recvmmsg/sendmmsg state, if enabled */
+    struct conn_bufs *bufs; /* holder for pooled buffers, if conn_buffer_pool */
+    /* idle_timeout: position in the worker's timer wheel */
+    conn   *timer_next;
+    conn   *timer_prev;
+    conn   **timer_slot; /* list head we're on, NULL if not scheduled */
+    rel_time_t thread_since; /* conn_balance: when c->thread took us on */
 
     bool   noreply;   /* True if the reply should not be sent. */
+    bool   meta_set;  /* c->item is for an ms; answer with meta_ret */
+    struct meta_ret meta_ret;
+    void   *proxy;    /* proxy mode: request whose value is being read */
+    /* MSG_ZEROCOPY sends: items stay referenced until the kernel is done */
+    bool   zerocopy;  /* SO_ZEROCOPY is enabled on this socket */
+    uint32_t zc_sent; /* zero-copy sends made */
+    uint32_t zc_done; /* zero-copy sends the kernel has completed */
+    struct zc_hold *zc_hold;  /* reserved for the response being sent */
+    struct zc_hold *zc_holds; /* released responses awaiting completion */
+    struct zc_hold *zc_holds_tail;
+    bool   zc_closing; /* on the thread's zc_closing list */
+    conn   *zc_next;
+#ifdef HAVE_IO_URING
+    /* io_uring: reads and sends handed to the kernel as SQEs */
+    uint8_t uring_busy; /* URING_RECV/URING_SENDMSG in flight */
+    uint8_t uring_done; /* ... come back, result not yet looked at */
+    bool   uring_poll;  /* recv got EAGAIN; wait for the next one with a poll */
+    int    uring_recv_res;
+    int    uring_send_res;
+#endif
     /* current stats command */
     struct {
         char *buffer;
@@ -643,6 +811,7 @@ struct conn {
     short cmd; /* current command being processed */
     int opaque;
     int keylen;
+    int bin_prefetched; /* gets after this one whose keys are prefetched */
     conn   *next;     /* Used for generating a list of conn structures */
     LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
 };
@@ -680,6 +849,7 @@ extern void *ext_storage;
  * Functions
  */
 void do_accept_new_conns(const bool do_accept);
+void do_accept_new_conns_worker(LIBEVENT_THREAD *me, const bool do_accept);
 enum delta_result_type do_add_delta(conn *c, const char *key,
                                     const size_t nkey, const bool incr,
                                     const int64_t delta, char *buf,
@@ -687,6 +857,8 @@ enum delta_result_type do_add_delta(conn *c, const char *key,
 enum store_item_type do_store_item(item *item, int comm, conn* c, const uint32_t hv);
 conn *conn_new(const int sfd, const enum conn_states init_state, const int event_flags, const int read_buffer_size, enum network_transport transport, struct event_base *base);
 void conn_worker_readd(conn *c);
+void conn_proxy_wait(conn *c);
+void conn_proxy_done(conn *c, char *buf, int len);
 extern int daemonize(int nochdir, int noclose);
 
 #define mutex_lock(x) pthread_mutex_lock(x)
@@ -709,7 +881,19 @@ extern int daemonize(int nochdir, int noclose);
  */
 void memcached_thread_init(int nthreads, void *arg);
 void redispatch_conn(conn *c);
+#ifdef EXTSTORE
+void redispatch_io(io_wrap *wrap);
+void conn_io_done(io_wrap *wrap);
+#endif
+#ifdef HAVE_IO_URING
+void conn_uring_done(conn *c, const short which);
+#endif
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size, enum network_transport transport);
+bool dispatch_conn_migrate(conn *c, int tid);
+void thread_balance(void);
+#ifdef MEMCACHED_DEBUG
+void thread_balance_force(LIBEVENT_THREAD *t);
+#endif
 void sidethread_conn_close(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
@@ -718,14 +902,22 @@ enum delta_result_type add_delta(conn *c, const char *key,
                                  const int64_t delta, char *buf,
                                  uint64_t *cas);
 void accept_new_conns(const bool do_accept);
+void resume_worker_listeners(void);
 conn *conn_from_freelist(void);
 bool  conn_add_to_freelist(conn *c);
-void  conn_close_idle(conn *c);
+void  conn_timer_add(conn *c);
+void  conn_timer_tick(LIBEVENT_THREAD *me);
+void  conn_zerocopy_tick(LIBEVENT_THREAD *me);
 item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes);
 #define DO_UPDATE true
 #define DONT_UPDATE false
 item *item_get(const char *key, const size_t nkey, conn *c, const bool do_update);
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update);
+void item_prefetch(LIBEVENT_THREAD *me, const uint32_t *hvs, const int n);
+void item_prefetch_wait(void);
+item *item_get_locked(const char *key, const size_t nkey, conn *c, const bool do_update, uint32_t *hv);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime, conn *c);
+item *item_touch_hv(const char *key, const size_t nkey, const uint32_t hv, uint32_t exptime, conn *c);
 int   item_link(item *it);
 void  item_remove(item *it);
 int   item_replace(item *it, item *new_it, const uint32_t hv);
@@ -736,8 +928,12 @@ void *item_trylock(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
 void pause_threads(enum pause_thread_types type);
-#define refcount_incr(it) ++(it->refcount)
-#define refcount_decr(it) --(it->refcount)
+/* atomic, so a reference that isn't the last can be dropped (or, for a
+ * pinned item, taken) without the item lock; see item_remove() */
+#define refcount_incr(it) __atomic_add_fetch(&(it)->refcount, 1, __ATOMIC_ACQ_REL)
+#define refcount_decr(it) __atomic_sub_fetch(&(it)->refcount, 1, __ATOMIC_ACQ_REL)
+/* gets of an item with this many references already are turned away */
+#define IT_REFCOUNT_LIMIT 60000
 void STATS_LOCK(void);
 void STATS_UNLOCK(void);
 void threadlocal_stats_reset(void);
@@ -0,0 +1,1061 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Proxy mode.
+ *
+ * Given one or more -o proxy_server=<host>:<port>[:<weight>], the server
+ * stops serving keys itself and passes ASCII requests on to those servers,
+ * picking one per key from a hash ring. The ring is ketama style: each
+ * server gets PROXY_POINTS_PER_WEIGHT points per unit of weight, and a key
+ * belongs to the first point at or after its own hash, so adding or removing
+ * a server only moves the keys next to its points. Multigets are split up by
+ * server, sent to all of them at once, and the answers merged into one
+ * response.
+ *
+ * Every worker keeps one connection to each server, shared by all of its
+ * clients and driven by its own event loop, so nothing here takes a lock.
+ * Requests are pipelined on it and answers come back in the same order, so
+ * each backend connection only needs a queue of what it's waiting for. A
+ * client waiting on answers is parked (conn_proxy_wait()) and started up
+ * again once the last one is in.
+ *
+ * A server that can't be reached, or hangs up or stalls for proxy_timeout
+ * seconds with requests outstanding, fails all of them and is skipped for
+ * PROXY_RETRY_SECS. Its keys read as misses; anything else sent its way gets
+ * a SERVER_ERROR.
+ */
+#include "memcached.h"
+#include "proxy.h"
+#include "murmur3_hash.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+/* how long a server that failed is left alone */
+#define PROXY_RETRY_SECS 1
+#define PROXY_BUFFER_INITIAL 4096
+
+struct proxy_server {
+    char name[NI_MAXHOST + NI_MAXSERV + 2]; /* host:port, as given */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned int weight;
+};
+
+struct proxy_point {
+    uint32_t hash;
+    unsigned int server;
+};
+
+static struct proxy_server servers[PROXY_SERVERS_MAX];
+static int nservers = 0;
+static struct proxy_point *continuum = NULL;
+static unsigned int npoints = 0;
+
+/* What a request's answer is made of. */
+enum proxy_cmd {
+    PROXY_GET,      /* VALUE blocks from each server, then one END */
+    PROXY_ONE,      /* the one server's response line (and value) as is */
+    PROXY_ALL,      /* sent to every server; OK if they all say OK */
+};
+
+/* One server's part of a client request. */
+struct proxy_sub {
+    struct proxy_sub *next;     /* in its backend's queue */
+    struct proxy_req *req;
+    bool failed;                /* the server went away */
+    bool error;                 /* a get got an error line, not values */
+    char *buf;                  /* the answer, as received */
+    int len;
+    int size;
+};
+
+/* A client request on its way to one or more servers. */
+struct proxy_req {
+    struct proxy_req *next;     /* in the thread's done list */
+    conn *c;
+    enum proxy_cmd cmd;
+    bool noreply;
+    char quiet;                 /* meta command sent with q, or 0 */
+    int pending;                /* subs still waiting on their server */
+    char *data;                 /* request and value, while reading it */
+    int dlen;
+    int nsubs;
+    struct proxy_sub subs[];
+};
+
+/* A worker's connection to one server. */
+struct proxy_backend {
+    LIBEVENT_THREAD *t;
+    unsigned int server;
+    int fd;                     /* -1 when not connected */
+    bool connecting;
+    short ev_flags;             /* 0 while not watched */
+    struct event ev;
+    char *wbuf;                 /* requests not sent yet: wbuf[wcurr, wlen) */
+    int wcurr;
+    int wlen;
+    int wsize;
+    char *rbuf;                 /* answers not parsed yet: rbuf[rcurr, rlen) */
+    int rcurr;
+    int rlen;
+    int rsize;
+    struct proxy_sub *head;     /* waiting for an answer, oldest first */
+    struct proxy_sub *tail;
+    rel_time_t last_io;         /* last progress with requests outstanding */
+    rel_time_t retry_at;        /* failed; skip until then */
+};
+
+struct proxy_thread {
+    struct proxy_req *done;     /* answered, not sent to the client yet */
+    struct proxy_backend be[];
+};
+
+/*
+ * Adds a backend from "<host>:<port>[:<weight>]"; an IPv6 host goes in
+ * brackets. Called while parsing options, so this resolves the name once,
+ * up front.
+ */
+bool proxy_add_server(const char *spec) {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    const char *p, *h = spec;
+    size_t hlen;
+    unsigned int weight = 1;
+    struct addrinfo hints, *ai;
+    int error;
+
+    if (nservers == PROXY_SERVERS_MAX) {
+        fprintf(stderr, "Too many proxy servers (max %d)\n", PROXY_SERVERS_MAX);
+        return false;
+    }
+    if (*h == '[') {
+        if ((p = strchr(++h, ']')) == NULL || p[1] != ':')
+            goto bad;
+        hlen = p - h;
+        p += 2;
+    } else {
+        if ((p = strchr(h, ':')) == NULL)
+            goto bad;
+        hlen = p - h;
+        p++;
+    }
+    if (hlen == 0 || hlen >= sizeof(host))
+        goto bad;
+    memcpy(host, h, hlen);
+    host[hlen] = '\0';
+    hlen = strcspn(p, ":");
+    if (hlen == 0 || hlen >= sizeof(port))
+        goto bad;
+    memcpy(port, p, hlen);
+    port[hlen] = '\0';
+    if (p[hlen] == ':' && (!safe_strtoul(p + hlen + 1, &weight) ||
+                weight == 0 || weight > 100)) {
+        fprintf(stderr, "Proxy server weight must be from 1 to 100: %s\n", spec);
+        return false;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((error = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        fprintf(stderr, "Can't resolve proxy server %s: %s\n", spec,
+                gai_strerror(error));
+        return false;
+    }
+    struct proxy_server *s = &servers[nservers++];
+    memcpy(&s->addr, ai->ai_addr, ai->ai_addrlen);
+    s->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    snprintf(s->name, sizeof(s->name), "%s:%s", host, port);
+    s->weight = weight;
+    return true;
+bad:
+    fprintf(stderr, "Proxy servers are given as <host>:<port>[:<weight>]: %s\n",
+            spec);
+    return false;
+}
+
+int proxy_server_count(void) {
+    return nservers;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const struct proxy_point *x = a, *y = b;
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/* Builds the hash ring. Called once from main(), after option parsing. */
+void proxy_init(void) {
+    char buf[sizeof(servers[0].name) + 12];
+    unsigned int i, n = 0;
+    int s, len;
+
+    for (s = 0; s < nservers; s++) {
+        npoints += servers[s].weight * PROXY_POINTS_PER_WEIGHT;
+    }
+    continuum = malloc(sizeof(struct proxy_point) * npoints);
+    if (continuum == NULL) {
+        fprintf(stderr, "Failed to allocate proxy hash ring\n");
+        exit(EXIT_FAILURE);
+    }
+    for (s = 0; s < nservers; s++) {
+        for (i = 0; i < servers[s].weight * PROXY_POINTS_PER_WEIGHT; i++) {
+            len = snprintf(buf, sizeof(buf), "%s-%u", servers[s].name, i);
+            continuum[n].hash = MurmurHash3_x86_32(buf, len);
+            continuum[n].server = s;
+            n++;
+        }
+    }
+    qsort(continuum, npoints, sizeof(struct proxy_point), point_cmp);
+}
+
+static unsigned int server_for_key(const char *key, const size_t nkey) {
+    uint32_t hv = MurmurHash3_x86_32(key, nkey);
+    unsigned int lo = 0, hi = npoints;
+
+    /* first point at or after hv, wrapping around to the first one */
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (continuum[mid].hash < hv) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return continuum[lo == npoints ? 0 : lo].server;
+}
+
+void proxy_thread_init(LIBEVENT_THREAD *me) {
+    struct proxy_thread *pt;
+    int i;
+
+    pt = calloc(1, sizeof(*pt) + sizeof(struct proxy_backend) * nservers);
+    if (pt == NULL) {
+        fprintf(stderr, "Failed to allocate proxy backends\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nservers; i++) {
+        pt->be[i].t = me;
+        pt->be[i].server = i;
+        pt->be[i].fd = -1;
+    }
+    me->proxy = pt;
+}
+
+/*
+ * Backend connections.
+ */
+
+static void backend_handler(const int fd, const short which, void *arg);
+
+static int backend_event_add(struct proxy_backend *be) {
+#ifdef HAVE_IO_URING
+    if (uring_thread_active())
+        return uring_event_add(&be->ev);
+#endif
+    return event_add(&be->ev, 0);
+}
+
+static int backend_event_del(struct proxy_backend *be) {
+#ifdef HAVE_IO_URING
+    if (uring_thread_active())
+        return uring_event_del(&be->ev);
+#endif
+    return event_del(&be->ev);
+}
+
+static bool backend_update_event(struct proxy_backend *be) {
+    short flags = EV_READ | EV_PERSIST;
+
+    if (be->connecting || be->wlen > be->wcurr)
+        flags |= EV_WRITE;
+    if (be->ev_flags == flags)
+        return true;
+    if (be->ev_flags != 0 && backend_event_del(be) == -1)
+        return false;
+    event_set(&be->ev, be->fd, flags, backend_handler, be);
+    event_base_set(be->t->base, &be->ev);
+    if (backend_event_add(be) == -1) {
+        be->ev_flags = 0;
+        return false;
+    }
+    be->ev_flags = flags;
+    return true;
+}
+
+static void backend_close(struct proxy_backend *be) {
+    if (be->ev_flags != 0) {
+        backend_event_del(be);
+        be->ev_flags = 0;
+    }
+    if (be->fd != -1) {
+        close(be->fd);
+        be->fd = -1;
+    }
+    be->connecting = false;
+    be->wcurr = be->wlen = 0;
+    be->rcurr = be->rlen = 0;
+}
+
+/* Starts a non-blocking connect; backend_handler() sees it through. */
+static bool backend_connect(struct proxy_backend *be) {
+    struct proxy_server *s = &servers[be->server];
+    int flags = 1;
+    int fd;
+
+    fd = socket(s->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        close(fd);
+        return false;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (connect(fd, (struct sockaddr *)&s->addr, s->addrlen) == -1
+            && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    be->fd = fd;
+    be->connecting = true;
+    if (!backend_update_event(be)) {
+        backend_close(be);
+        return false;
+    }
+    return true;
+}
+
+/* Room for len more bytes of requests to send. NULL if the server's down. */
+static char *backend_reserve(struct proxy_backend *be, const int len) {
+    char *p;
+
+    if (be->fd == -1) {
+        if (be->retry_at > current_time)
+            return NULL;
+        if (!backend_connect(be)) {
+            be->retry_at = current_time + PROXY_RETRY_SECS;
+            return NULL;
+        }
+    }
+    if (be->wcurr == be->wlen) {
+        be->wcurr = be->wlen = 0;
+    }
+    if (be->wlen + len > be->wsize) {
+        int size = be->wsize ? be->wsize : PROXY_BUFFER_INITIAL;
+        if (be->wcurr > 0) {
+            memmove(be->wbuf, be->wbuf + be->wcurr, be->wlen - be->wcurr);
+            be->wlen -= be->wcurr;
+            be->wcurr = 0;
+        }
+        while (be->wlen + len > size)
+            size *= 2;
+        if (size > be->wsize) {
+            p = realloc(be->wbuf, size);
+            if (p == NULL)
+                return NULL;
+            be->wbuf = p;
+            be->wsize = size;
+        }
+    }
+    p = be->wbuf + be->wlen;
+    be->wlen += len;
+    return p;
+}
+
+/* Sends what it can. Returns false if the connection is broken. */
+static bool backend_write(struct proxy_backend *be) {
+    while (be->wcurr < be->wlen) {
+        ssize_t res = write(be->fd, be->wbuf + be->wcurr, be->wlen - be->wcurr);
+        if (res > 0) {
+            be->wcurr += res;
+            be->last_io = current_time;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    if (be->wcurr == be->wlen)
+        be->wcurr = be->wlen = 0;
+    return true;
+}
+
+/*
+ * Waits for sub's answer on be, whose request was just put in the space from
+ * backend_reserve(). This never answers anything itself, even if the
+ * connection turns out to be broken: that's left to backend_handler(), so a
+ * client request being sent out is never finished halfway through.
+ */
+static void backend_queue(struct proxy_backend *be, struct proxy_sub *sub) {
+    sub->next = NULL;
+    if (be->tail) {
+        be->tail->next = sub;
+    } else {
+        be->head = sub;
+        be->last_io = current_time;
+    }
+    be->tail = sub;
+    THR_STATS_INCR(be->t, proxy_backend_cmds);
+
+    if (!be->connecting && !backend_write(be)) {
+        /* leave the rest to the handler */
+        be->wcurr = be->wlen;
+    }
+    backend_update_event(be);
+}
+
+static void req_sub_done(struct proxy_thread *pt, struct proxy_sub *sub) {
+    struct proxy_req *req = sub->req;
+    if (--req->pending == 0) {
+        req->next = pt->done;
+        pt->done = req;
+    }
+}
+
+/* Gives up on everything waiting on be. */
+static void backend_fail(struct proxy_backend *be, bool down) {
+    struct proxy_thread *pt = be->t->proxy;
+    struct proxy_sub *sub, *next;
+
+    if (settings.verbose > 0 && (be->head || be->connecting))
+        fprintf(stderr, "Proxy server %s failed\n", servers[be->server].name);
+    backend_close(be);
+    if (down)
+        be->retry_at = current_time + PROXY_RETRY_SECS;
+    for (sub = be->head; sub != NULL; sub = next) {
+        next = sub->next;
+        sub->failed = true;
+        THR_STATS_INCR(be->t, proxy_backend_failures);
+        req_sub_done(pt, sub);
+    }
+    be->head = be->tail = NULL;
+}
+
+static bool sub_append(struct proxy_sub *sub, const char *buf, const int len) {
+    if (sub->len + len > sub->size) {
+        int size = sub->size ? sub->size : 256;
+        char *nbuf;
+        while (sub->len + len > size)
+            size *= 2;
+        if ((nbuf = realloc(sub->buf, size)) == NULL)
+            return false;
+        sub->buf = nbuf;
+        sub->size = size;
+    }
+    memcpy(sub->buf + sub->len, buf, len);
+    sub->len += len;
+    return true;
+}
+
+/* Size of the value following a "VALUE <key> <flags> <bytes>" or
+ * "VA <bytes>" line, counting its \r\n, or -1. */
+static int value_size(const char *line, const char *end, int word) {
+    char num[12];
+    const char *p = line;
+    size_t n;
+    int32_t size;
+
+    for (; word > 0; word--) {
+        p = memchr(p, ' ', end - p);
+        if (p == NULL)
+            return -1;
+        p++;
+    }
+    n = strcspn(p, " \r");
+    if (n == 0 || n >= sizeof(num) || p + n > end)
+        return -1;
+    memcpy(num, p, n);
+    num[n] = '\0';
+    if (!safe_strtol(num, &size) || size < 0)
+        return -1;
+    return size + 2;
+}
+
+/*
+ * Takes as many whole answers off the front of rbuf as there are. Returns
+ * -1 if the server said something that makes no sense.
+ */
+static int backend_parse(struct proxy_backend *be) {
+    struct proxy_thread *pt = be->t->proxy;
+
+    while (be->rcurr < be->rlen) {
+        struct proxy_sub *sub = be->head;
+        char *line = be->rbuf + be->rcurr;
+        char *end = be->rbuf + be->rlen;
+        char *el;
+        int llen, vlen = 0;
+
+        if (sub == NULL)
+            return -1;
+        el = memchr(line, '\n', end - line);
+        if (el == NULL)
+            return 0;
+        llen = el + 1 - line;
+
+        if (sub->req->cmd == PROXY_GET) {
+            if (llen == 5 && memcmp(line, "END\r\n", 5) == 0) {
+                be->rcurr += llen;
+            } else if (llen > 6 && memcmp(line, "VALUE ", 6) == 0) {
+                if ((vlen = value_size(line, el, 3)) < 0)
+                    return -1;
+                if (end - line < llen + vlen)
+                    return 0;
+                if (!sub_append(sub, line, llen + vlen))
+                    return -1;
+                be->rcurr += llen + vlen;
+                continue;
+            } else {
+                /* an error; it ends the response */
+                sub->len = 0;
+                sub->error = true;
+                if (!sub_append(sub, line, llen))
+                    return -1;
+                be->rcurr += llen;
+            }
+        } else {
+            if (llen > 3 && memcmp(line, "VA ", 3) == 0 &&
+                    (vlen = value_size(line, el, 1)) < 0)
+                return -1;
+            if (end - line < llen + vlen)
+                return 0;
+            if (!sub_append(sub, line, llen + vlen))
+                return -1;
+            be->rcurr += llen + vlen;
+        }
+
+        be->head = sub->next;
+        if (be->head == NULL)
+            be->tail = NULL;
+        req_sub_done(pt, sub);
+    }
+    return 0;
+}
+
+/* Reads and parses what's there. Returns false if the connection's done. */
+static bool backend_read(struct proxy_backend *be) {
+    for (;;) {
+        if (be->rcurr == be->rlen) {
+            be->rcurr = be->rlen = 0;
+        } else if (be->rlen == be->rsize && be->rcurr > 0) {
+            memmove(be->rbuf, be->rbuf + be->rcurr, be->rlen - be->rcurr);
+            be->rlen -= be->rcurr;
+            be->rcurr = 0;
+        }
+        if (be->rlen == be->rsize) {
+            int size = be->rsize ? be->rsize * 2 : PROXY_BUFFER_INITIAL;
+            char *nbuf = realloc(be->rbuf, size);
+            if (nbuf == NULL)
+                return false;
+            be->rbuf = nbuf;
+            be->rsize = size;
+        }
+
+        ssize_t res = read(be->fd, be->rbuf + be->rlen, be->rsize - be->rlen);
+        if (res > 0) {
+            be->rlen += res;
+            be->last_io = current_time;
+            if (backend_parse(be) != 0)
+                return false;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+}
+
+/*
+ * Builds the client's response out of its subs' answers. Returns it in
+ * *resp, malloc'd, or NULL if there's nothing to send. False if out of
+ * memory.
+ */
+static bool req_response(struct proxy_req *req, char **resp, int *rlen) {
+    static const char failed[] = "SERVER_ERROR backend unavailable\r\n";
+    struct proxy_sub *sub = NULL;
+    const char *src = NULL;
+    int i, len = 0;
+    char *p;
+
+    *resp = NULL;
+    *rlen = 0;
+    if (req->noreply)
+        return true;
+
+    switch (req->cmd) {
+    case PROXY_GET:
+        for (i = 0; i < req->nsubs; i++) {
+            if (req->subs[i].error) {
+                sub = &req->subs[i];
+                break;
+            }
+            if (!req->subs[i].failed)
+                len += req->subs[i].len;
+        }
+        if (sub != NULL) {
+            src = sub->buf;
+            len = sub->len;
+            break;
+        }
+        if ((p = malloc(len + 5)) == NULL)
+            return false;
+        *resp = p;
+        for (i = 0; i < req->nsubs; i++) {
+            if (!req->subs[i].failed) {
+                memcpy(p, req->subs[i].buf, req->subs[i].len);
+                p += req->subs[i].len;
+            }
+        }
+        memcpy(p, "END\r\n", 5);
+        *rlen = len + 5;
+        return true;
+    case PROXY_ONE:
+        sub = &req->subs[0];
+        if (sub->failed) {
+            src = failed;
+            len = sizeof(failed) - 1;
+            break;
+        }
+        src = sub->buf;
+        len = sub->len;
+        /* q: the server was asked without it, so drop what it would have */
+        if (req->quiet && len >= 2) {
+            bool hd = memcmp(src, "HD", 2) == 0;
+            bool nf = memcmp(src, "NF", 2) == 0;
+            if ((req->quiet == 'g' && memcmp(src, "EN", 2) == 0) ||
+                    (req->quiet == 's' && hd) ||
+                    ((req->quiet == 'd' || req->quiet == 'a') && (hd || nf)))
+                return true;
+        }
+        break;
+    case PROXY_ALL:
+        src = "OK\r\n";
+        len = 4;
+        for (i = 0; i < req->nsubs; i++) {
+            sub = &req->subs[i];
+            if (sub->failed) {
+                src = failed;
+                len = sizeof(failed) - 1;
+                break;
+            }
+            if (sub->len != 4 || memcmp(sub->buf, "OK\r\n", 4) != 0) {
+                src = sub->buf;
+                len = sub->len;
+                break;
+            }
+        }
+        break;
+    }
+
+    if ((p = malloc(len)) == NULL)
+        return false;
+    memcpy(p, src, len);
+    *resp = p;
+    *rlen = len;
+    return true;
+}
+
+static void req_free(struct proxy_req *req) {
+    int i;
+    for (i = 0; i < req->nsubs; i++) {
+        free(req->subs[i].buf);
+    }
+    free(req->data);
+    free(req);
+}
+
+static void req_finish(struct proxy_req *req) {
+    conn *c = req->c;
+    char *resp;
+    int len;
+
+    if (!req_response(req, &resp, &len))
+        len = -1;
+    req_free(req);
+    conn_proxy_done(c, resp, len);
+}
+
+/* Answers the clients whose requests are done. Only ever called from the
+ * top of an event, where no client connection is being worked on. */
+static void finish_done(struct proxy_thread *pt) {
+    while (pt->done) {
+        struct proxy_req *req = pt->done;
+        pt->done = req->next;
+        req_finish(req);
+    }
+}
+
+static void backend_handler(const int fd, const short which, void *arg) {
+    struct proxy_backend *be = arg;
+    struct proxy_thread *pt = be->t->proxy;
+
+    assert(fd == be->fd);
+    if (be->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1
+                || err != 0) {
+            backend_fail(be, true);
+            goto done;
+        }
+        if (err == 0 && !(which & (EV_WRITE | EV_READ)))
+            goto done;
+        be->connecting = false;
+    }
+    if (!backend_write(be)) {
+        backend_fail(be, true);
+        goto done;
+    }
+    if ((which & EV_READ) && !backend_read(be)) {
+        /* a server closing a connection nobody's waiting on is fine */
+        backend_fail(be, be->head != NULL);
+        goto done;
+    }
+    if (!backend_update_event(be))
+        backend_fail(be, true);
+done:
+    finish_done(pt);
+}
+
+/* Fails requests that have waited too long. Once a second, from the
+ * worker's timer. */
+void proxy_thread_tick(LIBEVENT_THREAD *me) {
+    struct proxy_thread *pt = me->proxy;
+    int i;
+
+    for (i = 0; i < nservers; i++) {
+        struct proxy_backend *be = &pt->be[i];
+        if (be->head != NULL && current_time - be->last_io > settings.proxy_timeout)
+            backend_fail(be, true);
+    }
+    finish_done(pt);
+}
+
+/*
+ * Client requests.
+ */
+
+/* The next space separated word at or after p, or NULL. */
+static const char *next_word(const char *p, const char *end, size_t *len) {
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end)
+        return NULL;
+    *len = strcspn(p, " ");
+    if (p + *len > end)
+        *len = end - p;
+    return p;
+}
+
+static struct proxy_req *req_new(conn *c, enum proxy_cmd cmd, int nsubs) {
+    struct proxy_req *req;
+
+    req = calloc(1, sizeof(*req) + sizeof(struct proxy_sub) * nsubs);
+    if (req == NULL)
+        return NULL;
+    req->c = c;
+    req->cmd = cmd;
+    req->nsubs = nsubs;
+    /* held until everything's sent; see req_sent() */
+    req->pending = nsubs + 1;
+    for (nsubs--; nsubs >= 0; nsubs--) {
+        req->subs[nsubs].req = req;
+    }
+    return req;
+}
+
+/* Everything's on its way: park the client until the answers are in, or
+ * answer now if every server it needed was down. */
+static void req_sent(struct proxy_req *req) {
+    if (--req->pending == 0) {
+        req_finish(req);
+    } else {
+        conn_proxy_wait(req->c);
+    }
+}
+
+static void sub_send(struct proxy_req *req, int i, struct proxy_backend *be,
+                     const char *buf, int len) {
+    char *p = backend_reserve(be, len);
+    if (p == NULL) {
+        req->subs[i].failed = true;
+        THR_STATS_INCR(be->t, proxy_backend_failures);
+        req->pending--;
+        return;
+    }
+    memcpy(p, buf, len);
+    backend_queue(be, &req->subs[i]);
+}
+
+/*
+ * get, gets, gat and gats: one request per server holding its keys. words is
+ * how many words (command, and exptime for gat) come before the keys.
+ */
+static bool proxy_get(conn *c, const char *line, const char *end, int words) {
+    struct proxy_thread *pt = c->thread->proxy;
+    int bytes[PROXY_SERVERS_MAX];
+    int sub_of[PROXY_SERVERS_MAX];
+    char *out[PROXY_SERVERS_MAX];
+    const char *p, *prefix_end = line, *key;
+    size_t len = 0;
+    int i, prefix, nsubs = 0, nkeys = 0;
+    struct proxy_req *req;
+
+    for (i = 0; i < words; i++) {
+        if ((p = next_word(prefix_end, end, &len)) == NULL)
+            return false;
+        prefix_end = p + len;
+    }
+    prefix = prefix_end - line;
+
+    /* count first, so each server's request can be written in one go */
+    memset(bytes, 0, sizeof(bytes));
+    for (p = prefix_end; (key = next_word(p, end, &len)) != NULL; p = key + len) {
+        if (len > KEY_MAX_LENGTH)
+            return false;
+        unsigned int s = server_for_key(key, len);
+        if (bytes[s] == 0) {
+            bytes[s] = prefix + 2;
+            sub_of[s] = nsubs++;
+        }
+        bytes[s] += len + 1;
+        nkeys++;
+    }
+    if (nkeys == 0)
+        return false;
+
+    if ((req = req_new(c, PROXY_GET, nsubs)) == NULL) {
+        conn_proxy_done(c, NULL, -1);
+        return true;
+    }
+    for (i = 0; i < nservers; i++) {
+        if (bytes[i] == 0)
+            continue;
+        out[i] = backend_reserve(&pt->be[i], bytes[i]);
+        if (out[i] == NULL) {
+            req->subs[sub_of[i]].failed = true;
+            THR_STATS_INCR(c->thread, proxy_backend_failures);
+            req->pending--;
+            continue;
+        }
+        memcpy(out[i], line, prefix);
+        out[i] += prefix;
+    }
+    for (p = prefix_end; (key = next_word(p, end, &len)) != NULL; p = key + len) {
+        unsigned int s = server_for_key(key, len);
+        if (req->subs[sub_of[s]].failed)
+            continue;
+        *out[s]++ = ' ';
+        memcpy(out[s], key, len);
+        out[s] += len;
+    }
+    for (i = 0; i < nservers; i++) {
+        if (bytes[i] == 0 || req->subs[sub_of[i]].failed)
+            continue;
+        memcpy(out[i], "\r\n", 2);
+        backend_queue(&pt->be[i], &req->subs[sub_of[i]]);
+    }
+
+    THR_STATS_INCR(c->thread, proxy_cmds);
+    req_sent(req);
+    return true;
+}
+
+/*
+ * Takes a request line the proxy handles, and returns true. Anything else
+ * (stats, version, ...) is left to the server itself. For a command with a
+ * value, c->proxy is set and the caller has the value read into c->ritem.
+ */
+bool proxy_process_command(conn *c, char *command, size_t clen) {
+    struct proxy_thread *pt = c->thread->proxy;
+    const char *end = command + clen;
+    const char *w[8], *p = command, *key = NULL;
+    size_t wl[8], len, nkey = 0;
+    int nw = 0, vword = -1, first_flag = 2, i;
+    enum proxy_cmd cmd = PROXY_ONE;
+    bool meta = false, noreply = false;
+    char quiet = 0;
+    int32_t vlen = 0;
+    struct proxy_req *req;
+    char *buf, *o;
+
+    if (IS_UDP(c->transport))
+        return false;
+    if ((w[0] = next_word(command, end, &wl[0])) == NULL)
+        return false;
+
+#define CMD_IS(s) (wl[0] == sizeof(s) - 1 && memcmp(w[0], s, sizeof(s) - 1) == 0)
+    if (CMD_IS("get") || CMD_IS("gets")) {
+        return proxy_get(c, command, end, 1);
+    } else if (CMD_IS("gat") || CMD_IS("gats")) {
+        return proxy_get(c, command, end, 2);
+    }
+
+    /* the rest are a handful of words; keep them */
+    for (p = w[0] + wl[0]; nw < 7 && (w[nw + 1] = next_word(p, end, &len)) != NULL;
+            p = w[nw] + len) {
+        wl[++nw] = len;
+    }
+    nw++;
+    if (nw == 8)
+        return false;
+
+    if (CMD_IS("set") || CMD_IS("add") || CMD_IS("replace") ||
+            CMD_IS("append") || CMD_IS("prepend")) {
+        if (nw != 5 && nw != 6)
+            return false;
+        vword = 4;
+    } else if (CMD_IS("cas")) {
+        if (nw != 6 && nw != 7)
+            return false;
+        vword = 4;
+    } else if (CMD_IS("delete") || CMD_IS("incr") || CMD_IS("decr") ||
+            CMD_IS("touch")) {
+        if (nw < 2 || nw > 4)
+            return false;
+    } else if (CMD_IS("mg") || CMD_IS("md") || CMD_IS("ma")) {
+        meta = true;
+    } else if (CMD_IS("ms")) {
+        if (nw < 3)
+            return false;
+        meta = true;
+        vword = 2;
+        first_flag = 3;
+    } else if (CMD_IS("flush_all")) {
+        if (nw > 3)
+            return false;
+        cmd = PROXY_ALL;
+    } else if (CMD_IS("getrange")) {
+        if (nw != 4)
+            return false;
+        cmd = PROXY_GET;
+    } else if (CMD_IS("flush_prefix")) {
+        if (nw != 2 && nw != 3)
+            return false;
+        cmd = PROXY_ALL;
+    } else {
+        return false;
+    }
+#undef CMD_IS
+
+    if (cmd != PROXY_ALL) {
+        if (nw < 2 || wl[1] > KEY_MAX_LENGTH)
+            return false;
+        key = w[1];
+        nkey = wl[1];
+    }
+    if (vword != -1) {
+        char num[12];
+        if (wl[vword] >= sizeof(num))
+            return false;
+        memcpy(num, w[vword], wl[vword]);
+        num[wl[vword]] = '\0';
+        if (!safe_strtol(num, &vlen) || vlen < 0 ||
+                vlen > settings.item_size_max)
+            return false;
+        vlen += 2;
+    }
+
+    /* Pass the line on without noreply or q, so the server always answers
+     * and its connection stays in step; the client still hears nothing.
+     * A has no meaning here: answers come back in order anyway. */
+    if (meta) {
+        for (i = first_flag; i < nw; i++) {
+            if (wl[i] == 1 && w[i][0] == 'q')
+                quiet = w[0][1];
+        }
+    } else if (nw >= 2 && wl[nw - 1] == 7 && memcmp(w[nw - 1], "noreply", 7) == 0) {
+        /* as set_noreply_maybe() sees it, even "flush_all noreply" */
+        noreply = true;
+    }
+    buf = malloc(clen + 2 + vlen);
+    if (buf == NULL || (req = req_new(c, cmd,
+                    cmd == PROXY_ALL ? nservers : 1)) == NULL) {
+        free(buf);
+        conn_proxy_done(c, NULL, -1);
+        return true;
+    }
+    o = buf;
+    for (i = 0; i < nw; i++) {
+        if ((noreply && i == nw - 1) || (meta && i >= first_flag &&
+                    wl[i] == 1 && (w[i][0] == 'q' || w[i][0] == 'A')))
+            continue;
+        if (i > 0)
+            *o++ = ' ';
+        memcpy(o, w[i], wl[i]);
+        o += wl[i];
+    }
+    memcpy(o, "\r\n", 2);
+    o += 2;
+    req->noreply = noreply;
+    req->quiet = quiet;
+    req->data = buf;
+    req->dlen = o - buf;
+    THR_STATS_INCR(c->thread, proxy_cmds);
+
+    if (vlen > 0) {
+        /* the value comes next; see proxy_complete_nread() */
+        req->dlen += vlen;
+        c->proxy = req;
+        c->ritem = o;
+        c->rlbytes = vlen;
+        return true;
+    }
+
+    if (cmd == PROXY_ALL) {
+        for (i = 0; i < nservers; i++) {
+            sub_send(req, i, &pt->be[i], req->data, req->dlen);
+        }
+    } else {
+        sub_send(req, 0, &pt->be[server_for_key(key, nkey)], req->data, req->dlen);
+    }
+    req_sent(req);
+    return true;
+}
+
+/* The value of a proxied set (or ms) is in; send it all on. */
+void proxy_complete_nread(conn *c) {
+    struct proxy_thread *pt = c->thread->proxy;
+    struct proxy_req *req = c->proxy;
+    const char *key, *end = req->data + req->dlen;
+    size_t nkey = 0;
+
+    c->proxy = NULL;
+    if (memcmp(end - 2, "\r\n", 2) != 0) {
+        static const char bad[] = "CLIENT_ERROR bad data chunk\r\n";
+        char *resp = malloc(sizeof(bad) - 1);
+        req_free(req);
+        if (resp != NULL)
+            memcpy(resp, bad, sizeof(bad) - 1);
+        conn_proxy_done(c, resp, resp ? (int)sizeof(bad) - 1 : -1);
+        return;
+    }
+    key = next_word(req->data, end, &nkey);
+    key = next_word(key + nkey, end, &nkey);
+    sub_send(req, 0, &pt->be[server_for_key(key, nkey)], req->data, req->dlen);
+    req_sent(req);
+}
+
+/* A client going away while its value was being read. */
+void proxy_conn_cleanup(conn *c) {
+    if (c->proxy != NULL) {
+        req_free(c->proxy);
+        c->proxy = NULL;
+    }
+}
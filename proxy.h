@@ -0,0 +1,18 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+/* most servers -o proxy_server can be given */
+#define PROXY_SERVERS_MAX 64
+/* points on the hash ring per unit of server weight */
+#define PROXY_POINTS_PER_WEIGHT 160
+
+bool proxy_add_server(const char *spec);
+int proxy_server_count(void);
+void proxy_init(void);
+void proxy_thread_init(LIBEVENT_THREAD *me);
+void proxy_thread_tick(LIBEVENT_THREAD *me);
+bool proxy_process_command(conn *c, char *command, size_t len);
+void proxy_complete_nread(conn *c);
+void proxy_conn_cleanup(conn *c);
+
+#endif
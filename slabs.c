@@ -20,6 +20,14 @@
 #include <signal.h>
 #include <assert.h>
 #include <pthread.h>
+#ifdef HAVE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#include <sys/mman.h>
+#define NUMA_NODES_MAX 8
+#else
+#define NUMA_NODES_MAX 1
+#endif
 
 //#define DEBUG_SLAB_MOVER
 /* powers-of-N allocation structures */
@@ -28,8 +36,8 @@ typedef struct {
     unsigned int size;      /* sizes of items */
     unsigned int perslab;   /* how many items per slab */
 
-    void *slots;           /* list of item ptrs */
-    unsigned int sl_curr;   /* total free items in list */
+    void *slots[NUMA_NODES_MAX]; /* lists of item ptrs, by memory node */
+    unsigned int sl_curr;   /* total free items in lists */
 
     unsigned int slabs;     /* how many slabs were allocated for this class */
 
@@ -50,6 +58,24 @@ static int power_largest;
 static void *mem_base = NULL;
 static void *mem_current = NULL;
 static size_t mem_avail = 0;
+
+/* With -o numa, slab pages come from one arena per NUMA node and free chunks
+ * are kept on a list per node, so workers (pinned to a node by thread.c)
+ * hand out memory local to themselves whenever they can. Without it
+ * everything is node 0. */
+static int numa_nodes = 1;
+#ifdef HAVE_NUMA
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} numa_arena_t;
+static numa_arena_t numa_arenas[NUMA_NODES_MAX];
+static unsigned int numa_next_node = 0; /* spreads pages wanted by non-workers */
+static uint64_t numa_remote_pages = 0;  /* pages taken from another node */
+static uint64_t numa_remote_allocs = 0; /* chunks taken from another node */
+static __thread int thread_node = -1;
+#endif
 #ifdef EXTSTORE
 static void *storage  = NULL;
 #endif
@@ -66,6 +92,9 @@ static int grow_slab_list (const unsigned int id);
 static int do_slabs_newslab(const unsigned int id);
 static void *memory_allocate(size_t size);
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
+#ifdef HAVE_NUMA
+static void numa_arenas_init(void);
+#endif
 
 /* Preallocate as many slab pages as possible (called from slabs_init)
    on start-up, so users don't get confused out-of-memory errors when
@@ -108,6 +137,11 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
 
     mem_limit = limit;
 
+#ifdef HAVE_NUMA
+    if (settings.numa) {
+        numa_arenas_init();
+    } else
+#endif
     if (prealloc) {
         /* Allocate everything in a big chunk with malloc */
         mem_base = malloc(mem_limit);
@@ -213,6 +247,62 @@ static int grow_slab_list (const unsigned int id) {
     return 1;
 }
 
+/* Which node's arena a slab chunk lives in. */
+int slabs_node_of(const void *ptr) {
+#ifdef HAVE_NUMA
+    int n;
+    for (n = 1; n < numa_nodes; n++) {
+        if ((const char *)ptr >= numa_arenas[n].base &&
+                (const char *)ptr < numa_arenas[n].base + numa_arenas[n].size)
+            return n;
+    }
+#endif
+    return 0;
+}
+
+int slabs_numa_nodes(void) {
+    return numa_nodes;
+}
+
+/* Called by each worker once it's been pinned to a node. */
+void slabs_set_thread_node(const int node) {
+#ifdef HAVE_NUMA
+    thread_node = node;
+#endif
+}
+
+static void freelist_push(slabclass_t *p, item *it) {
+    void **head = &p->slots[slabs_node_of(it)];
+    it->prev = 0;
+    it->next = *head;
+    if (it->next) it->next->prev = it;
+    *head = it;
+    p->sl_curr++;
+}
+
+/* Takes a free chunk, preferring the calling worker's own node. */
+static item *freelist_pop(slabclass_t *p) {
+    int start = 0, i;
+#ifdef HAVE_NUMA
+    if (thread_node > 0)
+        start = thread_node;
+#endif
+    for (i = 0; i < numa_nodes; i++) {
+        void **head = &p->slots[(start + i) % numa_nodes];
+        item *it = *head;
+        if (it == NULL)
+            continue;
+        *head = it->next;
+        if (it->next) it->next->prev = 0;
+#ifdef HAVE_NUMA
+        if (i > 0 && thread_node >= 0)
+            numa_remote_allocs++;
+#endif
+        return it;
+    }
+    return NULL;
+}
+
 static void split_slab_page_into_freelist(char *ptr, const unsigned int id) {
     slabclass_t *p = &slabclass[id];
     int x;
@@ -277,7 +367,6 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, uint64_t *total_
         return NULL;
     }
     p = &slabclass[id];
-    assert(p->sl_curr == 0 || ((item *)p->slots)->slabs_clsid == 0);
     if (total_bytes != NULL) {
         *total_bytes = p->requested;
     }
@@ -291,9 +380,8 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, uint64_t *total_
 
     if (p->sl_curr != 0) {
         /* return off our freelist */
-        it = (item *)p->slots;
-        p->slots = it->next;
-        if (it->next) it->next->prev = 0;
+        it = freelist_pop(p);
+        assert(it != NULL && it->slabs_clsid == 0);
         /* Kill flag and initialize refcount here for lock safety in slab
          * mover's freeness detection. */
         it->it_flags &= ~ITEM_SLABBED;
@@ -332,12 +420,7 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
     }
 
     // return the header object.
-    // TODO: This is in three places, here and in do_slabs_free().
-    it->prev = 0;
-    it->next = p->slots;
-    if (it->next) it->next->prev = it;
-    p->slots = it;
-    p->sl_curr++;
+    freelist_push(p, it);
     // TODO: macro
     p->requested -= it->nkey + 1 + it->nsuffix + sizeof(item) + sizeof(item_chunk);
     if (settings.use_cas) {
@@ -352,11 +435,7 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
         chunk->slabs_clsid = 0;
         next_chunk = chunk->next;
 
-        chunk->prev = 0;
-        chunk->next = p->slots;
-        if (chunk->next) chunk->next->prev = chunk;
-        p->slots = chunk;
-        p->sl_curr++;
+        freelist_push(p, (item *)chunk);
         p->requested -= chunk->size + sizeof(item_chunk);
 
         chunk = next_chunk;
@@ -384,12 +463,7 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
 #endif
         it->it_flags = ITEM_SLABBED;
         it->slabs_clsid = 0;
-        it->prev = 0;
-        it->next = p->slots;
-        if (it->next) it->next->prev = it;
-        p->slots = it;
-
-        p->sl_curr++;
+        freelist_push(p, it);
 #ifdef EXTSTORE
         if (!is_hdr) {
             p->requested -= size;
@@ -453,6 +527,13 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             STATS_UNLOCK();
             pthread_mutex_lock(&slabs_lock);
             APPEND_STAT("slab_global_page_pool", "%u", slabclass[SLAB_GLOBAL_PAGE_POOL].slabs);
+#ifdef HAVE_NUMA
+            if (settings.numa) {
+                APPEND_STAT("numa_nodes", "%d", numa_nodes);
+                APPEND_STAT("numa_remote_pages", "%llu", (unsigned long long)numa_remote_pages);
+                APPEND_STAT("numa_remote_allocs", "%llu", (unsigned long long)numa_remote_allocs);
+            }
+#endif
             pthread_mutex_unlock(&slabs_lock);
             item_stats_totals(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "items") == 0) {
@@ -532,9 +613,77 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
     add_stats(NULL, 0, NULL, 0, c);
 }
 
+#ifdef HAVE_NUMA
+/* Reserves address space for a full mem_limit on every node, preferring that
+ * node's memory for it. Nothing is committed until pages are touched, and
+ * mem_limit is still enforced across all of them by do_slabs_newslab(). The
+ * extra page per class covers the first page each class may take past the
+ * limit. */
+static void numa_arenas_init(void) {
+    size_t size = mem_limit +
+        (size_t)MAX_NUMBER_OF_SLAB_CLASSES * settings.slab_page_size;
+    unsigned long pagesize = sysconf(_SC_PAGESIZE);
+    int n;
+
+    if (size % pagesize)
+        size += pagesize - (size % pagesize);
+    numa_nodes = numa_max_node() + 1;
+    if (numa_nodes > NUMA_NODES_MAX)
+        numa_nodes = NUMA_NODES_MAX;
+
+    for (n = 0; n < numa_nodes; n++) {
+        unsigned long mask = 1UL << n;
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("Failed to reserve NUMA slab arena");
+            exit(EXIT_FAILURE);
+        }
+        /* preferred rather than bound, so a full node spills over instead
+         * of failing */
+        if (mbind(base, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0
+                && settings.verbose > 0) {
+            perror("mbind");
+        }
+        numa_arenas[n].base = base;
+        numa_arenas[n].size = size;
+        numa_arenas[n].used = 0;
+    }
+}
+
+static void *numa_memory_allocate(size_t size) {
+    int start, i;
+
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+    start = thread_node >= 0 ? thread_node : numa_next_node++ % numa_nodes;
+    for (i = 0; i < numa_nodes; i++) {
+        numa_arena_t *a = &numa_arenas[(start + i) % numa_nodes];
+        if (a->size - a->used >= size) {
+            void *ret = a->base + a->used;
+            a->used += size;
+            if (i > 0)
+                numa_remote_pages++;
+            return ret;
+        }
+    }
+    return NULL;
+}
+#endif
+
 static void *memory_allocate(size_t size) {
     void *ret;
 
+#ifdef HAVE_NUMA
+    if (settings.numa) {
+        ret = numa_memory_allocate(size);
+        if (ret != NULL)
+            mem_malloced += size;
+        return ret;
+    }
+#endif
+
     if (mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = malloc(size);
@@ -565,7 +714,7 @@ static void *memory_allocate(size_t size) {
 /* Must only be used if all pages are item_size_max */
 static void memory_release() {
     void *p = NULL;
-    if (mem_base != NULL)
+    if (mem_base != NULL || settings.numa)
         return;
 
     if (!settings.slab_reassign)
@@ -601,8 +750,9 @@ void slabs_stats(ADD_STAT add_stats, void *c) {
 }
 
 static bool do_slabs_adjust_mem_limit(size_t new_mem_limit) {
-    /* Cannot adjust memory limit at runtime if prealloc'ed */
-    if (mem_base != NULL)
+    /* Cannot adjust memory limit at runtime if prealloc'ed or carved out
+     * of NUMA arenas */
+    if (mem_base != NULL || settings.numa)
         return false;
     settings.maxbytes = new_mem_limit;
     mem_limit = new_mem_limit;
@@ -765,8 +915,9 @@ static void *slab_rebalance_alloc(const size_t size, unsigned int id) {
 static void slab_rebalance_cut_free(slabclass_t *s_cls, item *it) {
     /* Ensure this was on the freelist and nothing else. */
     assert(it->it_flags == ITEM_SLABBED);
-    if (s_cls->slots == it) {
-        s_cls->slots = it->next;
+    void **head = &s_cls->slots[slabs_node_of(it)];
+    if (*head == it) {
+        *head = it->next;
     }
     if (it->next) it->next->prev = it->prev;
     if (it->prev) it->prev->next = it->next;
@@ -27,6 +27,11 @@ void *slabs_alloc(const size_t size, unsigned int id, uint64_t *total_bytes, uns
 /** Free previously allocated object */
 void slabs_free(void *ptr, size_t size, unsigned int id);
 
+/** NUMA placement (-o numa). Without it there's a single node, 0. */
+int slabs_numa_nodes(void);
+int slabs_node_of(const void *ptr);
+void slabs_set_thread_node(const int node);
+
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal);
 
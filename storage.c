@@ -40,7 +40,9 @@ int lru_maintainer_store(void *storage, const int clsid) {
     /* First, storage for the header object */
     size_t orig_ntotal = ITEM_ntotal(it);
     uint32_t flags;
-    if ((it->it_flags & ITEM_HDR) == 0 &&
+    /* compressed values are small already, and flash reads are sent as is;
+     * leases are left where their flags are */
+    if ((it->it_flags & (ITEM_HDR|ITEM_COMPRESSED|ITEM_STALE|ITEM_TOKEN_SENT)) == 0 &&
             (item_age == 0 || current_time - it->time > item_age)) {
         // FIXME: flag conversion again
         if (settings.inline_ascii_response) {
@@ -62,6 +64,7 @@ int lru_maintainer_store(void *storage, const int clsid) {
                 bucket = PAGE_BUCKET_LOWTTL;
             }
             hdr_it->it_flags |= ITEM_HDR;
+            hdr_it->ns_gen = it->ns_gen;
             io.len = orig_ntotal;
             io.mode = OBJ_IO_WRITE;
             // NOTE: when the item is read back in, the slab mover
@@ -0,0 +1,88 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# without segmented LRU, so no async bump of a fetched item is holding a
+# reference to it when it's appended to, making it copy
+my $server = new_memcached('-m 48 -o slab_chunk_max=16384,no_lru_maintainer');
+my $sock = $server->sock;
+
+sub getrange_is {
+    my ($key, $offset, $len, $expect, $msg) = @_;
+    print $sock "getrange $key $offset $len\r\n";
+    if (!defined $expect) {
+        is(scalar <$sock>, "END\r\n", $msg);
+        return;
+    }
+    my $elen = length($expect);
+    is(scalar <$sock>, "VALUE $key 7 $elen\r\n", "$msg: header");
+    my $got;
+    read($sock, $got, $elen + 2);
+    is($got, "$expect\r\n", "$msg: data");
+    is(scalar <$sock>, "END\r\n", "$msg: end");
+}
+
+# non-repeating, so a slice from the wrong place can't look right
+my $pattern = join(':', 1 .. 20000);
+my $plen = length($pattern);
+
+print $sock "set big 7 0 $plen\r\n$pattern\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+print $sock "set small 7 0 10\r\n0123456789\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+
+getrange_is("big", 0, 100, substr($pattern, 0, 100), "head of big");
+getrange_is("big", 16000, 1000, substr($pattern, 16000, 1000), "across a chunk edge");
+getrange_is("big", 50000, 40000, substr($pattern, 50000, 40000), "many chunks");
+getrange_is("big", $plen - 10, 100, substr($pattern, $plen - 10), "past the end");
+getrange_is("big", 100000, 0, substr($pattern, 100000), "0 means the rest");
+getrange_is("big", $plen + 5, 10, "", "starting after the end");
+getrange_is("small", 3, 4, "3456", "small value");
+getrange_is("small", 0, 0, "0123456789", "all of a small value");
+getrange_is("nothere", 0, 10, undef, "miss");
+
+print $sock "getrange big x 10\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "bad offset");
+print $sock "getrange big 10\r\n";
+is(scalar <$sock>, "ERROR\r\n", "missing length");
+
+# appending to a big value moves its chunks rather than copying them
+my $expect = $pattern;
+for my $i (1 .. 20) {
+    my $add = join(',', map { "a$i.$_" } 1 .. ($i * 100));
+    $expect .= $add;
+    print $sock "append big 0 0 " . length($add) . "\r\n$add\r\n";
+    is(scalar <$sock>, "STORED\r\n", "append $i");
+}
+mem_get_is({ sock => $sock, flags => 7 }, "big", $expect);
+getrange_is("big", length($expect) - 500, 0, substr($expect, -500), "tail after appends");
+{
+    my $stats = mem_stats($sock);
+    is($stats->{append_nocopy}, 20, "appends didn't copy");
+    is($stats->{cmd_getrange}, 10, "getrange counted");
+}
+
+# a big append to a big value
+my $add = join(';', 1 .. 8000);
+$expect .= $add;
+print $sock "append big 0 0 " . length($add) . "\r\n$add\r\n";
+is(scalar <$sock>, "STORED\r\n", "big append");
+mem_get_is({ sock => $sock, flags => 7 }, "big", $expect);
+
+# prepend still copies
+$expect = "front" . $expect;
+print $sock "prepend big 0 0 5\r\nfront\r\n";
+is(scalar <$sock>, "STORED\r\n", "prepend");
+mem_get_is({ sock => $sock, flags => 7 }, "big", $expect);
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{append_nocopy}, 21, "prepend copied");
+}
+
+done_testing();
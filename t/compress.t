@@ -0,0 +1,106 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o compress_min=64");
+my $sock = $server->sock;
+
+sub req {
+    my ($cmd, $lines) = @_;
+    print $sock $cmd;
+    return join('', map { scalar <$sock> } 1 .. ($lines || 1));
+}
+
+my $json = join(',', map { qq({"id":$_,"name":"user$_","tags":["a","b"]}) } 1 .. 200);
+my $len = length($json);
+
+{
+    my $stats = mem_stats($sock, ' settings');
+    is($stats->{compress_min}, 64, "compress_min set");
+}
+
+# compressible values are stored compressed and come back the same
+print $sock "set json 5 0 $len\r\n$json\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored json");
+mem_get_is({ sock => $sock, flags => 5 }, "json", $json);
+{
+    my $stats = mem_stats($sock);
+    is($stats->{compress_sets}, 1, "one value compressed");
+    cmp_ok($stats->{compress_bytes_saved}, '>', $len / 2, "by more than half");
+    cmp_ok($stats->{bytes}, '<', $len / 2, "and it uses less memory");
+    is($stats->{decompress_gets}, 1, "expanded once to send");
+}
+
+# small ones and ones that don't compress are left alone
+print $sock "set small 0 0 10\r\n0123456789\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+my $noise = join('', map { chr(33 + int(rand(94))) } 1 .. 2000);
+print $sock "set noise 0 0 2000\r\n$noise\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored random value");
+mem_get_is($sock, "noise", $noise);
+{
+    my $stats = mem_stats($sock);
+    is($stats->{compress_sets}, 1, "neither was compressed");
+}
+
+# cas
+{
+    my ($cas, $val) = mem_gets($sock, "json");
+    is($val, $json, "gets compressed value");
+    print $sock "cas json 0 0 $len $cas\r\n$json\r\n";
+    is(scalar <$sock>, "STORED\r\n", "cas on compressed value");
+    print $sock "cas json 0 0 $len $cas\r\n$json\r\n";
+    is(scalar <$sock>, "EXISTS\r\n", "stale cas refused");
+}
+
+# ms hands back the CAS of the compressed copy it linked
+{
+    my $hd = req("ms mjson $len c\r\n$json\r\n");
+    my ($cas) = $hd =~ /^HD c(\d+)\r\n$/;
+    ok(defined $cas, "ms returned a cas");
+    is(req("mg mjson c\r\n"), "HD c$cas\r\n", "mg sees the same cas");
+}
+
+# append and prepend work on the value in the clear
+print $sock "append json 0 0 4\r\n,END\r\n";
+is(scalar <$sock>, "STORED\r\n", "append");
+print $sock "prepend json 0 0 6\r\nSTART,\r\n";
+is(scalar <$sock>, "STORED\r\n", "prepend");
+mem_get_is($sock, "json", "START,$json,END");
+
+# meta commands see the stored size
+my $full = "START,$json,END";
+my $flen = length($full);
+is(req("mg json s v\r\n", 2), "VA $flen s$flen\r\n$full\r\n", "mg value and size");
+is(req("mg json s\r\n"), "HD s$flen\r\n", "mg size only");
+is(req("mg json\r\n"), "HD\r\n", "mg existence check");
+
+# gets with several keys mixing compressed and not
+print $sock "get json small noise\r\n";
+is(scalar <$sock>, "VALUE json 0 $flen\r\n", "multiget compressed");
+is(scalar <$sock>, "$full\r\n", "value");
+is(scalar <$sock>, "VALUE small 0 10\r\n", "multiget small");
+is(scalar <$sock>, "0123456789\r\n", "value");
+is(scalar <$sock>, "VALUE noise 0 2000\r\n", "multiget random");
+is(scalar <$sock>, "$noise\r\n", "value");
+is(scalar <$sock>, "END\r\n", "end");
+
+# a compressed value is no number
+my $zeros = "0" x 200;
+print $sock "set zeros 0 0 200\r\n$zeros\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored zeros");
+is(req("incr zeros 1\r\n"), "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n",
+   "incr refuses compressed value");
+
+# chunked values aren't compressed
+my $big = "abcdefgh" x (1024 * 100);
+print $sock "set big 0 0 " . length($big) . "\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+mem_get_is($sock, "big", $big);
+
+done_testing();
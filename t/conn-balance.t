@@ -0,0 +1,54 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 8;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-t 2 -o conn_balance,idle_timeout=60");
+my $stats_sock = $server->sock;
+
+my $settings = mem_stats($stats_sock, 'settings');
+is($settings->{conn_balance}, 'yes', "conn_balance enabled");
+
+my $stats = mem_stats($stats_sock);
+is($stats->{conn_migrations}, 0, "no migrations yet");
+
+# With both workers idle, connections alternate between them: the stats
+# socket and the two we close end up on one, $busy and $idle on the other.
+my $busy = $server->new_sock;
+my $gone1 = $server->new_sock;
+my $idle = $server->new_sock;
+my $gone2 = $server->new_sock;
+print $_ "version\r\n" for ($busy, $gone1, $idle, $gone2);
+like(scalar <$_>, qr/^VERSION/, "connection works") for ($busy, $idle);
+<$gone1>; <$gone2>;
+close($gone1);
+close($gone2);
+
+my $size = 500000;
+print $busy "set big 0 0 $size\r\n", "x" x $size, "\r\n";
+is(scalar <$busy>, "STORED\r\n", "stored big value");
+
+# How busy a worker gets depends on what else the machine is doing, so
+# don't wait for the balancer to decide; the debug build's debugmigrate asks
+# $busy's worker to shed a connection as it would. It's only taken by one
+# that's been on its worker since before the last clock tick, and the next
+# tick withdraws the request, so ask until it goes.
+for (1 .. 50) {
+    print $busy "debugmigrate\r\n";
+    last unless scalar <$busy> eq "OK\r\n";
+    last if mem_stats($stats_sock)->{conn_migrations} > 0;
+    select(undef, undef, undef, 0.1);
+}
+
+$stats = mem_stats($stats_sock);
+cmp_ok($stats->{conn_migrations}, '>', 0, "a connection was moved");
+
+# Whichever one moved still works.
+print $_ "set foo 0 0 3\r\nbar\r\n" for ($busy, $idle);
+is(join('', map { scalar <$_> } ($busy, $idle)), "STORED\r\nSTORED\r\n",
+   "connections work after rebalancing");
+mem_get_is($busy, "big", "x" x $size);
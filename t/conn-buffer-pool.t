@@ -0,0 +1,63 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 155;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o conn_buffer_pool -t 2");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, 'settings');
+is($stats->{conn_buffer_pool}, "yes", "conn_buffer_pool setting reported");
+
+# Many connections take turns, so buffers move between them constantly.
+my @socks = map { $server->new_sock } 1 .. 50;
+for my $i (0 .. $#socks) {
+    my $s = $socks[$i];
+    print $s "set key$i 0 0 " . length("value$i") . "\r\nvalue$i\r\n";
+    is(scalar <$s>, "STORED\r\n", "stored key$i");
+}
+for my $i (reverse 0 .. $#socks) {
+    mem_get_is($socks[$i], "key$i", "value$i");
+}
+
+# A command split across writes has to keep its buffer while idle.
+for my $i (0 .. 49) {
+    my $s = $socks[$i];
+    print $s "get ke";
+}
+select(undef, undef, undef, 0.2);
+for my $i (0 .. 49) {
+    my $s = $socks[$i];
+    print $s "y$i\r\n";
+}
+for my $i (0 .. 49) {
+    my $s = $socks[$i];
+    my $line = <$s>;
+    $line .= <$s> . <$s>;
+    is($line, "VALUE key$i 0 " . length("value$i") . "\r\nvalue$i\r\nEND\r\n",
+       "split get key$i");
+}
+
+# A large multiget grows the borrowed buffers; they go back to the pool
+# afterwards and are handed out again.
+my @keys = map { "key$_" } 0 .. 49;
+print $sock "get " . join(" ", (@keys) x 20) . "\r\n";
+my $count = 0;
+while (my $line = <$sock>) {
+    last if $line eq "END\r\n";
+    <$sock>;
+    $count++;
+}
+is($count, 1000, "large multiget returned every value");
+mem_get_is($sock, "key1", "value1");
+
+# A set whose value arrives in pieces.
+print $sock "set split 0 0 10\r\n01234";
+select(undef, undef, undef, 0.2);
+print $sock "56789\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored value sent in pieces");
+mem_get_is($sock, "split", "0123456789");
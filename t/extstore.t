@@ -51,12 +51,31 @@ mem_get_is($sock, "foo", "hi");
     # fetch
     # TODO: Fetch back all values
     mem_get_is($sock, "nfoo1", $value);
+    print $sock "mg nfoo3 s v\r\n";
+    is(scalar <$sock>, "VA 20000 s20000\r\n", "mg header from extstore");
+    is(scalar <$sock>, "$value\r\n", "mg value from extstore");
+    # with A the flash read is answered whenever it's back, the RAM hit and
+    # mn needn't wait for it. Which comes first is up to the disk.
+    print $sock "mg nfoo5 s v A Oa\r\nmg foo v A Ob\r\nmn\r\n";
+    my %ooo;
+    while (keys %ooo < 3) {
+        my $line = <$sock>;
+        if ($line =~ /^VA \d+.* O(\w+)\r\n$/) {
+            $ooo{$1} = $line . <$sock>;
+        } else {
+            $ooo{mn} = $line;
+        }
+    }
+    is($ooo{a}, "VA 20000 s20000 Oa\r\n$value\r\n", "out of order mg from extstore");
+    is($ooo{b}, "VA 2 Ob\r\nhi\r\n", "out of order mg from memory");
+    is($ooo{mn}, "MN\r\n", "mn");
     # check extstore counters
     my $stats = mem_stats($sock);
     cmp_ok($stats->{extstore_page_allocs}, '>', 0, 'at least one page allocated');
     cmp_ok($stats->{extstore_objects_written}, '>', $keycount / 2, 'some objects written');
     cmp_ok($stats->{extstore_bytes_written}, '>', length($value) * 2, 'some bytes written');
     cmp_ok($stats->{get_extstore}, '>', 0, 'one object was fetched');
+    is($stats->{get_extstore_ooo}, 1, 'one fetched out of order');
     cmp_ok($stats->{extstore_objects_read}, '>', 0, 'one object read');
     cmp_ok($stats->{extstore_bytes_read}, '>', length($value), 'some bytes read');
 
@@ -90,6 +109,8 @@ mem_get_is($sock, "foo", "hi");
     sleep 4;
     my $stats = mem_stats($sock);
     is($stats->{miss_from_extstore}, 0, 'no misses');
+    print $sock "mg canary v k\r\n";
+    is(scalar <$sock>, "EN kcanary\r\n", "mg miss from extstore");
     mem_get_is($sock, "canary", undef);
 
     # check counters
@@ -144,6 +165,25 @@ mem_get_is($sock, "foo", "hi");
     is(scalar <$sock>, "NOT_STORED\r\n", 'prepend fails');
 }
 
+# an out of order read coming back to a conn that's given up its buffers
+{
+    my $pool_path = "/tmp/extstore-pool.$$";
+    my $pool = new_memcached("-m 64 -U 0 -o conn_buffer_pool,ext_page_size=8,ext_page_count=8,ext_wbuf_size=2,ext_threads=1,ext_io_depth=2,ext_item_size=512,ext_item_age=2,ext_path=$pool_path,slab_automove=0");
+    my $psock = $pool->sock;
+    for (1 .. 100) {
+        print $psock "set pfoo$_ 0 0 20000 noreply\r\n$value\r\n";
+    }
+    sleep 4;
+    for my $n (1 .. 5) {
+        print $psock "mg pfoo$n s v A Oa\r\n";
+        is(scalar <$psock>, "VA 20000 s20000 Oa\r\n", "ooo mg $n with pooled buffers");
+        is(scalar <$psock>, "$value\r\n", "ooo mg $n value");
+    }
+    my $stats = mem_stats($psock);
+    is($stats->{get_extstore_ooo}, 5, 'all fetched out of order');
+    unlink $pool_path;
+}
+
 done_testing();
 
 END {
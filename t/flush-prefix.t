@@ -0,0 +1,121 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# keep the LRU maintainer from reaping flushed items before the gets do
+my $server = new_memcached("-o no_lru_crawler,no_lru_maintainer");
+my $sock = $server->sock;
+
+sub set_keys {
+    for my $key (@_) {
+        print $sock "set $key 0 0 " . length($key) . "\r\n$key\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored $key");
+    }
+}
+
+set_keys(qw(user1:name user1:mail user1:1:x user10:name user1 other:name nodelim));
+
+print $sock "flush_prefix user1\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed user1");
+mem_get_is($sock, "user1:name", undef);
+mem_get_is($sock, "user1:mail", undef);
+mem_get_is($sock, "user1:1:x", undef);
+mem_get_is($sock, "user10:name", "user10:name");
+mem_get_is($sock, "user1", "user1");
+mem_get_is($sock, "other:name", "other:name");
+mem_get_is($sock, "nodelim", "nodelim");
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{cmd_flush_prefix}, 1, "flush_prefix counted");
+    is($stats->{get_flushed}, 3, "flushed items found on get");
+    is($stats->{flushed_prefixes}, 1, "one prefix flushed");
+}
+
+# items stored afterwards are fine, until the next flush
+set_keys(qw(user1:name));
+mem_get_is($sock, "user1:name", "user1:name");
+print $sock "add user1:mail 0 0 1\r\nx\r\n";
+is(scalar <$sock>, "STORED\r\n", "add sees a flushed key as missing");
+print $sock "flush_prefix other\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed other");
+mem_get_is($sock, "user1:name", "user1:name");
+mem_get_is($sock, "other:name", undef);
+print $sock "flush_prefix user1 noreply\r\n";
+mem_get_is($sock, "user1:name", undef);
+mem_get_is($sock, "user1:mail", undef);
+mem_get_is($sock, "user10:name", "user10:name");
+
+{
+    my $stats = mem_stats($sock);
+    is($stats->{cmd_flush_prefix}, 3, "flush_prefix counted");
+    is($stats->{flushed_prefixes}, 2, "the same prefix again is no new one");
+}
+
+# everything else that looks an item up sees it gone too
+set_keys(qw(ns:a ns:b ns:c ns:d));
+print $sock "set ns:n 0 0 1\r\n5\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored ns:n");
+print $sock "flush_prefix ns\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed ns");
+print $sock "append ns:a 0 0 1\r\nx\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "append to flushed key");
+print $sock "delete ns:b\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "delete flushed key");
+print $sock "incr ns:n 1\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "incr flushed key");
+print $sock "touch ns:c 100\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "touch flushed key");
+print $sock "mg ns:d v\r\n";
+is(scalar <$sock>, "EN\r\n", "mg flushed key");
+
+# bad input
+print $sock "flush_prefix " . ("a" x 251) . "\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "prefix too long");
+print $sock "flush_prefix\r\n";
+is(scalar <$sock>, "ERROR\r\n", "prefix missing");
+
+# the delimiter is the stats one
+{
+    my $server = new_memcached("-D /");
+    my $sock = $server->sock;
+    print $sock "set a/b 0 0 1\r\n1\r\nset a:b 0 0 1\r\n2\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a/b");
+    is(scalar <$sock>, "STORED\r\n", "stored a:b");
+    print $sock "flush_prefix a\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed a");
+    mem_get_is($sock, "a/b", undef);
+    mem_get_is($sock, "a:b", "2");
+}
+
+# prefixes are told apart by more than their hash; these two share one
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    print $sock "set p14010:a 0 0 1\r\n1\r\nset p182781:a 0 0 1\r\n2\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored p14010:a");
+    is(scalar <$sock>, "STORED\r\n", "stored p182781:a");
+    print $sock "flush_prefix p14010\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed p14010");
+    mem_get_is($sock, "p14010:a", undef);
+    mem_get_is($sock, "p182781:a", "2");
+    print $sock "flush_prefix p182781\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed p182781");
+    mem_get_is($sock, "p182781:a", undef);
+    is(mem_stats($sock)->{flushed_prefixes}, 2, "each has its own entry");
+}
+
+# and -F turns it off
+{
+    my $server = new_memcached("-F");
+    my $sock = $server->sock;
+    print $sock "flush_prefix a\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR flush_prefix not allowed\r\n", "disabled by -F");
+}
+
+done_testing();
@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 539;
+use Test::More tests => 551;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -76,6 +76,30 @@ is(scalar <$sock>, "DELETED\r\n", "pipeline delete");
 is(scalar <$sock>, "STORED\r\n",  "pipeline set");
 is(scalar <$sock>, "DELETED\r\n", "pipeline delete");
 
+# set lines off the fast path's beaten track still parse as they always did
+{
+    my $k250 = "k" x 250;
+    print $sock "set $k250 0 0 2\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "longest key");
+    mem_get_is($sock, $k250, "hi");
+    print $sock "set ${k250}k 0 0 2\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "key too long");
+    print $sock "set fast 4294967295 0 2\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "largest flags");
+    mem_get_is({ sock => $sock, flags => 4294967295 }, "fast", "hi");
+    print $sock "set fast 0 -1 2\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "negative exptime");
+    mem_get_is($sock, "fast", undef);
+    print $sock "set fast 00 0000000000 0002\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "leading zeros");
+    mem_get_is($sock, "fast", "hi");
+    print $sock "set fast 0 0 2 noreply\r\nho\r\n";
+    mem_get_is($sock, "fast", "ho");
+    print $sock "set fast 0 0 2 noreplx\r\nhu\r\n";
+    is(scalar <$sock>, "STORED\r\n", "not quite noreply");
+    print $sock "set fast 0 0 2x\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "bad length");
+}
 
 # Test sets up to a large size around 1MB.
 # Everything up to 1MB - 1k should succeed, everything 1MB +1k should fail.
@@ -0,0 +1,96 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# small enough to expand, and to overflow some buckets
+my $server = new_memcached('-m 256 -o hash_buckets,hashpower=13');
+my $sock = $server->sock;
+
+is(mem_stats($sock, 'settings')->{hash_buckets}, "yes", "hash_buckets setting");
+{
+    my $stats = mem_stats($sock);
+    is($stats->{hash_power_level}, 13, "starting hash power");
+    is($stats->{hash_bytes}, 8192 * (64 + 16), "64 bytes per bucket, plus the stripes");
+}
+
+my $count = 60000;
+sub set_range {
+    my ($from, $to, $tag) = @_;
+    my $out = '';
+    for my $i ($from .. $to) {
+        my $v = "$tag$i";
+        $out .= "set key$i 0 0 " . length($v) . " noreply\r\n$v\r\n";
+    }
+    print $sock $out;
+}
+
+sub check_range {
+    my ($from, $to, $tag, $msg) = @_;
+    my $bad = 0;
+    for (my $i = $from; $i <= $to; $i += 100) {
+        my $last = $i + 99 > $to ? $to : $i + 99;
+        print $sock "get " . join(' ', map { "key$_" } $i .. $last) . "\r\n";
+        my %got;
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            my ($key) = $line =~ /^VALUE (\S+)/;
+            my $data = <$sock>;
+            $data =~ s/\r\n$//;
+            $got{$key} = $data;
+        }
+        for my $n ($i .. $last) {
+            my $want = defined $tag ? "$tag$n" : undef;
+            $bad++ if (defined $want xor defined $got{"key$n"})
+                || (defined $want && $got{"key$n"} ne $want);
+        }
+    }
+    is($bad, 0, $msg);
+}
+
+set_range(1, $count, "a");
+check_range(1, $count, "a", "all keys found");
+
+# wait for the expansions to finish
+my $stats;
+for (1 .. 50) {
+    $stats = mem_stats($sock);
+    last if $stats->{hash_power_level} >= 14 && !$stats->{hash_is_expanding};
+    select(undef, undef, undef, 0.1);
+}
+is($stats->{hash_power_level}, 14, "expanded at 5 items a bucket");
+is($stats->{hash_is_expanding}, 0, "and done");
+is($stats->{curr_items}, $count, "item count");
+check_range(1, $count, "a", "all keys found after expanding");
+{
+    my $hash = mem_stats($sock, 'hash');
+    is($hash->{buckets}, 16384, "stats hash: buckets");
+    is($hash->{items}, $count, "stats hash: items in slots and overflow");
+    cmp_ok($hash->{max_chain}, '>', 6, "some buckets overflowed");
+}
+
+# replace, delete and add back across slots and overflow chains
+set_range(1, $count / 2, "b");
+for (my $i = 1; $i <= $count; $i += 3) {
+    print $sock "delete key$i noreply\r\n";
+}
+mem_get_is($sock, "key1", undef);
+check_range(2, 2, "b", "replaced");
+check_range($count - 1, $count - 1, "a", "not replaced");
+{
+    my $bad = 0;
+    for (my $i = 1; $i <= $count; $i += 3) {
+        print $sock "get key$i\r\n";
+        $bad++ if scalar <$sock> ne "END\r\n";
+    }
+    is($bad, 0, "deleted keys are gone");
+}
+is(mem_stats($sock)->{curr_items}, $count - $count / 3, "item count after deletes");
+set_range(1, $count, "c");
+check_range(1, $count, "c", "all keys back");
+
+done_testing();
@@ -0,0 +1,59 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+sub missing {
+    my ($s, $from, $to, $step) = @_;
+    my $missing = 0;
+    my @keys = map { "key" . ($from + $_ * $step) } 0 .. int(($to - $from) / $step);
+    while (my @batch = splice(@keys, 0, 100)) {
+        print $s "get @batch\r\n";
+        my $found = 0;
+        while (my $line = <$s>) {
+            last if $line eq "END\r\n";
+            <$s>;
+            $found++;
+        }
+        $missing += @batch - $found;
+    }
+    return $missing;
+}
+
+# keys stay findable while the table grows under them, several times over
+for my $opts ('', 'hash_buckets,') {
+    my $server = new_memcached("-m 256 -o ${opts}hashpower=13");
+    my $sock = $server->sock;
+    my $sock2 = $server->new_sock;
+    my $mode = $opts ? "buckets" : "chains";
+
+    my $count = 100000;
+    my $lost = 0;
+    for (my $i = 1; $i <= $count; $i += 5000) {
+        my $out = '';
+        $out .= "set key$_ 0 0 1 noreply\r\nx\r\n" for $i .. $i + 4999;
+        print $sock $out . "version\r\n";
+        # on another worker, while this batch goes in
+        $lost += missing($sock2, 1, $i - 1, 37) if $i > 1;
+        <$sock>;
+    }
+    is($lost, 0, "$mode: keys found while growing");
+
+    my $stats;
+    for (1 .. 100) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_power_level} >= ($opts ? 15 : 17)
+            && !$stats->{hash_is_expanding};
+        select(undef, undef, undef, 0.1);
+    }
+    is($stats->{hash_power_level}, $opts ? 15 : 17, "$mode: grew");
+    is($stats->{hash_is_expanding}, 0, "$mode: and finished");
+    is($stats->{curr_items}, $count, "$mode: item count");
+    is(missing($sock, 1, $count, 1), 0, "$mode: every key found after");
+}
+
+done_testing();
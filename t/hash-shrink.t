@@ -0,0 +1,103 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+sub missing {
+    my ($s, $from, $to) = @_;
+    my $missing = 0;
+    my @keys = map { "key$_" } $from .. $to;
+    while (my @batch = splice(@keys, 0, 100)) {
+        print $s "get @batch\r\n";
+        my $found = 0;
+        while (my $line = <$s>) {
+            last if $line eq "END\r\n";
+            <$s>;
+            $found++;
+        }
+        $missing += @batch - $found;
+    }
+    return $missing;
+}
+
+sub wait_for {
+    my ($sock, $tries, $done) = @_;
+    my $stats;
+    for (1 .. $tries) {
+        $stats = mem_stats($sock);
+        last if $done->($stats);
+        select(undef, undef, undef, 0.1);
+    }
+    return $stats;
+}
+
+my $count = 100000;
+my $keep = 1000;
+
+# grow two tables with a backfill, then take most of it away again
+my @servers;
+for my $opts ('', 'no_hashshrink,') {
+    my $mode = $opts ? "no_hashshrink" : "default";
+    my $server = new_memcached("-m 256 -o ${opts}hashpower=13");
+    my $sock = $server->sock;
+    for (my $i = 1; $i <= $count; $i += 5000) {
+        my $out = '';
+        $out .= "set key$_ 0 0 1 noreply\r\nx\r\n" for $i .. $i + 4999;
+        print $sock $out;
+    }
+    my $stats = wait_for($sock, 100, sub {
+        $_[0]->{hash_power_level} >= 17 && !$_[0]->{hash_is_expanding} });
+    is($stats->{hash_power_level}, 17, "$mode: grew");
+    is($stats->{hash_load_factor}, sprintf("%.2f", $count / 2 ** 17),
+       "$mode: load factor");
+    for (my $i = $keep + 1; $i <= $count; $i += 5000) {
+        my $last = $i + 4999 > $count ? $count : $i + 4999;
+        my $out = '';
+        $out .= "delete key$_ noreply\r\n" for $i .. $last;
+        print $sock $out;
+    }
+    push @servers, [$server, $sock];
+}
+
+my ($server, $sock) = @{$servers[0]};
+is(mem_stats($sock, 'settings')->{hash_shrink}, "yes", "shrinks by default");
+my $stats = wait_for($sock, 300, sub {
+    $_[0]->{hash_power_level} == 13 && !$_[0]->{hash_is_expanding} });
+is($stats->{curr_items}, $keep, "items left");
+is($stats->{hash_power_level}, 13, "shrank back to where it started");
+is($stats->{hash_is_expanding}, 0, "and finished");
+is($stats->{hash_bytes}, 8192 * (8 + 16), "table is small again");
+is($stats->{hash_bytes_reclaimed}, (2 ** 17 - 2 ** 13) * 8, "bytes reclaimed");
+is(missing($sock, 1, $keep), 0, "every key left found after");
+is(missing($sock, $keep + 1, $keep + 1000), 1000, "deleted keys still gone");
+
+{
+    my $hash = mem_stats($sock, 'hash');
+    is($hash->{buckets}, 8192, "stats hash: buckets");
+    is($hash->{items}, $keep, "stats hash: items");
+    is($hash->{load_factor}, sprintf("%.2f", $keep / 8192), "stats hash: load factor");
+    my ($buckets, $items, $longest) = (0, 0, 0);
+    for my $k (keys %$hash) {
+        next unless $k =~ /^chain_(\d+)$/;
+        $buckets += $hash->{$k};
+        $items += $1 * $hash->{$k};
+        $longest = $1 if $1 > $longest;
+    }
+    is($longest, $hash->{max_chain}, "longest chain is max_chain");
+    is($buckets, 8192, "chain lengths cover every bucket");
+    is($items, $keep, "and every item");
+}
+
+# the other one has been told to keep its size
+($server, $sock) = @{$servers[1]};
+is(mem_stats($sock, 'settings')->{hash_shrink}, "no", "hash_shrink setting");
+$stats = mem_stats($sock);
+is($stats->{curr_items}, $keep, "no_hashshrink: items left");
+is($stats->{hash_power_level}, 17, "no_hashshrink: kept its size");
+is($stats->{hash_bytes_reclaimed}, 0, "no_hashshrink: nothing reclaimed");
+
+done_testing();
@@ -0,0 +1,151 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-t 2 -o hotkeys=3,hotkeys_window=2');
+my $sock = $server->sock;
+# new connections go round the workers, so this one is on the other
+my $sock2 = $server->new_sock;
+
+{
+    my $stats = mem_stats($sock, 'settings');
+    is($stats->{hotkeys}, 3, "hotkeys setting");
+    is($stats->{hotkeys_window}, 2, "hotkeys_window setting");
+}
+
+for my $key (qw(hot warm cold), map { "k$_" } 1 .. 20) {
+    print $sock "set $key 0 0 10\r\n0123456789\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored $key");
+}
+
+# all sent at once, so they're almost sure to land in one window
+sub gets {
+    my ($s, $cmd, $n) = @_;
+    print $s $cmd x $n;
+    while ($n > 0) {
+        my $line = <$s>;
+        if ($line =~ /^VA /) {
+            <$s>;
+            $n--;
+        } elsif ($line eq "END\r\n") {
+            $n--;
+        }
+    }
+}
+gets($sock, "get hot\r\n", 30);
+gets($sock2, "get hot\r\n", 30);
+gets($sock, "get warm\r\n", 20);
+gets($sock2, "mg warm v\r\n", 10);
+gets($sock, "get nothere\r\n", 15);
+gets($sock, "get k$_\r\n", 1) for 1 .. 20;
+gets($sock, "get cold\r\n", 2);
+
+# wait for the window to close
+my $stats = {};
+for (1 .. 20) {
+    $stats = mem_stats($sock, 'hotkeys');
+    last if defined $stats->{'1:key'};
+    select(undef, undef, undef, 0.25);
+}
+is($stats->{window}, 2, "window");
+is($stats->{gets_per_sec}, 63, "every get counted");
+is($stats->{'1:key'}, "hot", "hottest key, counted on both workers");
+is($stats->{'1:gets_per_sec'}, 30, "its rate");
+is($stats->{'1:bytes_per_sec'}, 300, "its bytes");
+is($stats->{'2:key'}, "warm", "then a key fetched by get and mg");
+is($stats->{'2:gets_per_sec'}, 15, "its rate");
+is($stats->{'3:key'}, "nothere", "misses count too");
+is($stats->{'3:bytes_per_sec'}, 0, "but have no bytes");
+ok(!defined $stats->{'4:key'}, "only as many as asked for");
+
+# the next window starts from nothing
+for (1 .. 20) {
+    $stats = mem_stats($sock, 'hotkeys');
+    last if !defined $stats->{'1:key'};
+    select(undef, undef, undef, 0.25);
+}
+ok(!defined $stats->{'1:key'}, "quiet window has no hot keys");
+is($stats->{gets_per_sec}, 0, "and no gets");
+
+# hotkeys_cache: workers hold on to hot items, but never serve stale ones
+{
+    my $server = new_memcached('-o hotkeys=4,hotkeys_window=1,hotkeys_cache');
+    my $sock = $server->sock;
+    is(mem_stats($sock, 'settings')->{hotkeys_cache}, "yes", "hotkeys_cache setting");
+    print $sock "set hot 0 0 2\r\nv1\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored hot");
+    my $stats = {};
+    for (1 .. 20) {
+        gets($sock, "get hot\r\n", 50);
+        $stats = mem_stats($sock, 'hotkeys');
+        last if defined $stats->{'1:key'};
+        select(undef, undef, undef, 0.25);
+    }
+    is($stats->{'1:key'}, "hot", "hot is hot");
+    gets($sock, "get hot\r\n", 50);
+    cmp_ok(mem_stats($sock)->{hotcache_hits}, '>', 0, "gets served from the cache");
+    # the worker's copy carries the item's CAS
+    print $sock "gets hot\r\n";
+    my ($cas) = <$sock> =~ /^VALUE hot 0 2 (\d+)\r\n$/;
+    is(scalar <$sock> . <$sock>, "v1\r\nEND\r\n", "gets of a cached item");
+    print $sock "cas hot 0 0 2 $cas\r\nv1\r\n";
+    is(scalar <$sock>, "STORED\r\n", "its CAS is the stored one");
+
+    # too big to copy, so always fetched
+    my $big = "x" x 20000;
+    print $sock "set big 0 0 20000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored big");
+    my $found = 0;
+    for (1 .. 20) {
+        gets($sock, "get big\r\n", 50);
+        $stats = mem_stats($sock, 'hotkeys');
+        $found = grep { /:key$/ && $stats->{$_} eq "big" } keys %$stats;
+        last if $found;
+        select(undef, undef, undef, 0.25);
+    }
+    ok($found, "big is hot");
+    my $hits = mem_stats($sock)->{hotcache_hits};
+    mem_get_is($sock, "big", $big, "big fetched");
+    is(mem_stats($sock)->{hotcache_hits}, $hits, "big items aren't cached");
+
+    print $sock "set hot 0 0 2\r\nv2\r\n";
+    is(scalar <$sock>, "STORED\r\n", "replaced hot");
+    mem_get_is($sock, "hot", "v2");
+    gets($sock, "get hot\r\n", 20);
+    print $sock "append hot 0 0 1\r\nx\r\n";
+    is(scalar <$sock>, "STORED\r\n", "appended to hot");
+    mem_get_is($sock, "hot", "v2x");
+    print $sock "set hot 0 0 2\r\n10\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a number");
+    gets($sock, "get hot\r\n", 20);
+    print $sock "incr hot 5\r\n";
+    is(scalar <$sock>, "15\r\n", "incremented hot");
+    mem_get_is($sock, "hot", "15");
+    gets($sock, "get hot\r\n", 20);
+    print $sock "touch hot 100\r\n";
+    is(scalar <$sock>, "TOUCHED\r\n", "touched hot");
+    mem_get_is($sock, "hot", "15");
+    print $sock "delete hot\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "deleted hot");
+    mem_get_is($sock, "hot", undef);
+    print $sock "set hot 0 0 2\r\nv3\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored hot again");
+    gets($sock, "get hot\r\n", 20);
+    print $sock "flush_all\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed");
+    mem_get_is($sock, "hot", undef);
+}
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    print $sock "stats hotkeys\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR hotkeys not enabled\r\n", "off by default");
+}
+
+done_testing();
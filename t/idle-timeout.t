@@ -3,7 +3,7 @@
 use strict;
 use warnings;
 
-use Test::More tests => 11;
+use Test::More tests => 24;
 
 use FindBin qw($Bin);
 use lib "$Bin/lib";
@@ -35,3 +35,64 @@ is($sock->connected(), undef, "check disconnected");
 $sock = $server->sock;
 $stats = mem_stats($sock);
 isnt($stats->{idle_kicks}, 0, "check stats timeout");
+
+# Many connections spread over the workers: the idle ones get kicked, the
+# ones that keep talking survive the deadline their first command set.
+$server = new_memcached("-o idle_timeout=3 -t 4 -l 127.0.0.1");
+my @active = ($server->sock, map { $server->new_sock } 1..9);
+my @idle = map { $server->new_sock } 1..10;
+for my $s (@active, @idle) {
+    print $s "version\r\n";
+    <$s>;
+}
+for (1..5) {
+    sleep(1);
+    for my $s (@active) {
+        print $s "version\r\n";
+        <$s>;
+    }
+}
+my $alive = grep {
+    print $_ "version\r\n";
+    my $line = <$_>;
+    defined $line && $line =~ /^VERSION/;
+} @active;
+is($alive, 10, "active connections stayed open");
+my $kicked = grep {
+    print $_ "version\r\n";
+    !defined(scalar <$_>);
+} @idle;
+is($kicked, 10, "idle connections were closed");
+$stats = mem_stats($active[0]);
+is($stats->{idle_kicks}, 10, "idle kicks counted once per connection");
+
+# A log watcher belongs to the logger thread; the idle timer leaves it be,
+# and whichever connection gets its slot next is timed as usual.
+$server = new_memcached("-o idle_timeout=2 -t 2 -l 127.0.0.1");
+my $watcher = $server->new_sock;
+print $watcher "watch fetchers\r\n";
+is(scalar <$watcher>, "OK\r\n", "watcher started");
+sleep(4);
+$sock = $server->new_sock;
+mem_get_is($sock, "foo", undef);
+like(scalar <$watcher>, qr/ts=.*key=foo/, "watcher outlived the idle timeout");
+close($watcher);
+# the logger notices the watcher's gone when it next writes to it
+for (1..5) {
+    mem_get_is($sock, "foo", undef);
+    select(undef, undef, undef, 0.1);
+}
+my @reused = map { $server->new_sock } 1..4;
+for my $s (@reused) {
+    print $s "version\r\n";
+    <$s>;
+}
+sleep(4);
+$kicked = grep {
+    print $_ "version\r\n";
+    !defined(scalar <$_>);
+} @reused, $sock;
+is($kicked, 5, "new connections timed out");
+$sock = $server->new_sock;
+$stats = mem_stats($sock);
+is($stats->{idle_kicks}, 6, "kicks counted, none for the watcher");
@@ -0,0 +1,127 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_io_uring()) {
+    plan skip_all => 'io_uring not enabled';
+    exit 0;
+}
+
+my $server = new_memcached("-o io_uring,idle_timeout=3 -t 2 -l 127.0.0.1");
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+if ($settings->{io_uring} ne 'yes') {
+    plan skip_all => 'io_uring not available on this system';
+    exit 0;
+}
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "fooval");
+
+# Several connections spread across both workers.
+my @socks = map { $server->new_sock } 1 .. 8;
+for my $i (0 .. $#socks) {
+    my $s = $socks[$i];
+    print $s "set key$i 0 0 4\r\nv$i$i$i\r\n";
+    is(scalar <$s>, "STORED\r\n", "stored key$i");
+}
+for my $i (0 .. $#socks) {
+    mem_get_is($socks[$i], "key$i", "v$i$i$i");
+    mem_get_is($socks[($i + 1) % @socks], "key$i", "v$i$i$i");
+}
+
+# Large values make the worker wait for the socket to become writable.
+my $big = "B" x (512 * 1024);
+print $sock "set big 0 0 " . length($big) . "\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+{
+    my $cmd = "get big\r\n" x 10;
+    print $sock $cmd;
+    my $ok = 0;
+    for (1 .. 10) {
+        my $hdr = <$sock>;
+        my $len = 0;
+        $len = $1 if $hdr =~ /^VALUE big 0 (\d+)/;
+        my $body = '';
+        while (length($body) < $len + 2) {
+            read($sock, $body, $len + 2 - length($body), length($body));
+        }
+        my $end = <$sock>;
+        $ok++ if $len == length($big) && $end eq "END\r\n";
+    }
+    is($ok, 10, "pipelined large gets");
+}
+
+# Pipelined mutations exceed reqs_per_event and have to yield.
+{
+    my $cmd = '';
+    $cmd .= "incr counter 1\r\n" for 1 .. 100;
+    print $sock "set counter 0 0 1\r\n0\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored counter");
+    print $sock $cmd;
+    my $last;
+    $last = <$sock> for 1 .. 100;
+    is($last, "100\r\n", "pipelined incrs");
+}
+
+# More pipelined requests than fit in the read buffer.
+{
+    print $sock "get foo\r\n" x 500;
+    my $ok = 0;
+    for (1 .. 500) {
+        my @lines = map { scalar <$sock> } 1 .. 3;
+        $ok++ if $lines[1] eq "fooval\r\n" && $lines[2] eq "END\r\n";
+    }
+    is($ok, 500, "pipelined gets past the read buffer");
+}
+
+# A conn that yields with nothing left to parse still hears its next request.
+{
+    my $yielder = new_memcached("-o io_uring -R 1 -t 1");
+    my $s = $yielder->sock;
+    print $s "set quiet 0 0 2 noreply\r\nqq\r\n" .
+        "set quiet2 0 0 2 noreply\r\nrr\r\n";
+    sleep(1);
+    print $s "get quiet2\r\n";
+    my $oldalarmt = alarm(5);
+    my $resp = '';
+    eval {
+        local $SIG{'ALRM'} = sub { die "timeout" };
+        $resp .= <$s> while $resp !~ /END\r\n$/;
+    };
+    is($resp, "VALUE quiet2 0 2\r\nrr\r\nEND\r\n", "request after a yield");
+    alarm($oldalarmt);
+}
+
+# Closed connections are cleaned up and fds get reused.
+for (1 .. 20) {
+    my $s = $server->new_sock;
+    print $s "get foo\r\n";
+    <$s>; <$s>; <$s>;
+    close($s);
+}
+{
+    my $s = $server->new_sock;
+    mem_get_is($s, "foo", "fooval", "fetch after connection churn");
+}
+
+# Idle connections still get kicked.
+{
+    my $idle = $server->new_sock;
+    my $stats;
+    for (1 .. 10) {
+        sleep(1);
+        $stats = mem_stats($server->new_sock);
+        last if $stats->{idle_kicks} != 0;
+    }
+    isnt($stats->{idle_kicks}, 0, "idle connection kicked");
+}
+
+done_testing();
@@ -14,7 +14,8 @@ my $builddir = getcwd;
 my @unixsockets = ();
 
 @EXPORT = qw(new_memcached sleep mem_get_is mem_gets mem_gets_is mem_stats
-             supports_sasl free_port supports_drop_priv supports_extstore);
+             supports_sasl free_port supports_drop_priv supports_extstore
+             supports_io_uring supports_numa);
 
 sub sleep {
     my $n = shift;
@@ -155,6 +156,18 @@ sub supports_extstore {
     return 0;
 }
 
+sub supports_io_uring {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /io_uring/i;
+    return 0;
+}
+
+sub supports_numa {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /\bnuma:/;
+    return 0;
+}
+
 sub supports_drop_priv {
     my $output = `$builddir/memcached-debug -h`;
     return 1 if $output =~ /no_drop_privileges/i;
@@ -0,0 +1,64 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub req {
+    my ($cmd, $lines) = @_;
+    print $sock $cmd;
+    return join('', map { scalar <$sock> } 1 .. ($lines || 1));
+}
+
+# a miss with N: the first client wins, the rest are told to wait
+my $resp = req("mg hot v c N30\r\n", 2);
+like($resp, qr/^VA 0 c\d+ W\r\n\r\n$/, "first miss wins");
+my ($cas) = $resp =~ /c(\d+)/;
+like(req("mg hot v c N30\r\n", 2), qr/^VA 0 c$cas Z\r\n\r\n$/, "second is told it's taken");
+is(req("mg hot s N30\r\n"), "HD s0 Z\r\n", "without a value too");
+like(req("mg hot t\r\n"), qr/^HD t(29|30) Z\r\n$/, "placeholder lives for N's ttl");
+
+# only the winner's set gets in
+is(req("ms hot 3 C" . ($cas + 1000) . "\r\nbad\r\n"), "EX\r\n", "set with the wrong cas refused");
+is(req("ms hot 3 C$cas\r\nnew\r\n"), "HD\r\n", "winner's set");
+is(req("mg hot v N30\r\n", 2), "VA 3\r\nnew\r\n", "now an ordinary hit");
+
+# md I leaves a stale value to serve while one client refreshes it
+is(req("md hot I\r\n"), "HD\r\n", "invalidated");
+$resp = req("mg hot v c\r\n", 2);
+like($resp, qr/^VA 3 c(\d+) W X\r\nnew\r\n$/, "first reader wins, gets stale value");
+my ($cas2) = $resp =~ /c(\d+)/;
+isnt($cas2, $cas, "invalidating changed the cas");
+like(req("mg hot v\r\n", 2), qr/^VA 3 X Z\r\nnew\r\n$/, "the rest get it stale");
+is(req("get hot\r\n", 3), "VALUE hot 0 3\r\nnew\r\nEND\r\n", "plain get still sees it");
+is(req("ms hot 3 C$cas\r\nold\r\n"), "EX\r\n", "set from before the invalidation refused");
+is(req("ms hot 3 C$cas2\r\nfsh\r\n"), "HD\r\n", "winner's set");
+is(req("mg hot v\r\n", 2), "VA 3\r\nfsh\r\n", "fresh again");
+
+# md I with T shortens the ttl
+is(req("md hot I T30\r\n"), "HD\r\n", "invalidated with a ttl");
+like(req("mg hot t\r\n"), qr/^HD t(29|30) W X\r\n$/, "ttl set");
+is(req("md hot\r\n"), "HD\r\n", "a plain md still deletes");
+is(req("mg hot v\r\n"), "EN\r\n", "gone");
+
+# R: the first reader in the last seconds of the ttl wins a recache
+is(req("ms warm 2 T100\r\nok\r\n"), "HD\r\n", "stored with a ttl");
+is(req("mg warm v R30\r\n", 2), "VA 2\r\nok\r\n", "plenty of ttl left");
+is(req("mg warm v R120\r\n", 2), "VA 2 W\r\nok\r\n", "inside R: win");
+is(req("mg warm v R120\r\n", 2), "VA 2 Z\r\nok\r\n", "then taken");
+is(req("ms warm 2 T100\r\nok\r\n"), "HD\r\n", "recached");
+is(req("mg warm v R30\r\n", 2), "VA 2\r\nok\r\n", "fresh item has no lease out");
+is(req("ms forever 2 T0\r\nok\r\n"), "HD\r\n", "stored without a ttl");
+is(req("mg forever v R120\r\n", 2), "VA 2\r\nok\r\n", "never due");
+
+# bad flags
+is(req("mg hot NX\r\n"), "CLIENT_ERROR bad token in command line format\r\n", "bad N");
+is(req("mg hot I\r\n"), "CLIENT_ERROR invalid flag\r\n", "I is for md");
+
+done_testing();
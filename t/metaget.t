@@ -0,0 +1,99 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 47;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub req {
+    my ($cmd, $lines) = @_;
+    print $sock $cmd;
+    return join('', map { scalar <$sock> } 1 .. ($lines || 1));
+}
+
+# ms / mg basics
+is(req("ms foo 3 F7 T0\r\nbar\r\n"), "HD\r\n", "ms stored");
+is(req("mg foo v\r\n", 2), "VA 3\r\nbar\r\n", "mg value only");
+is(req("mg foo\r\n"), "HD\r\n", "mg without flags is an existence check");
+is(req("mg foo f s t\r\n"), "HD f7 s3 t-1\r\n", "flags, size, no ttl");
+is(req("mg foo k Oabc v\r\n", 2), "VA 3 kfoo Oabc\r\nbar\r\n",
+   "key and opaque in request order");
+is(req("mg missing v\r\n"), "EN\r\n", "miss");
+is(req("mg missing v k O1\r\n"), "EN kmissing O1\r\n", "miss keeps key and opaque");
+
+# CAS agrees with gets
+my $gets = req("gets foo\r\n", 3);
+my ($cas) = $gets =~ /^VALUE foo 7 3 (\d+)\r\n/;
+ok($cas, "got cas from gets");
+is(req("mg foo c\r\n"), "HD c$cas\r\n", "mg returns the same cas");
+
+# ms with return flags
+like(req("ms foo 3 c k Ox\r\nbaz\r\n"), qr/^HD c(\d+) kfoo Ox\r\n$/, "ms returns cas");
+
+# hit before and last access
+is(req("ms hl 1\r\nx\r\n"), "HD\r\n", "stored hl");
+like(req("mg hl h l\r\n"), qr/^HD h0 l[01]\r\n$/, "not fetched before");
+is(req("mg hl h\r\n"), "HD h1\r\n", "fetched before now");
+
+# ttl and touch
+is(req("ms ttl 1 T100\r\nx\r\n"), "HD\r\n", "stored with ttl");
+like(req("mg ttl t\r\n"), qr/^HD t(99|100)\r\n$/, "ttl reported");
+like(req("mg ttl T500 t\r\n"), qr/^HD t(499|500)\r\n$/, "T touches");
+is(req("mg ttl T0 t\r\n"), "HD t-1\r\n", "T0 makes it immortal");
+
+# quiet mode: misses say nothing, mn marks the end
+print $sock "mg q1 v q Oa\r\nmg foo v q Ob\r\nmg q2 v q Oc\r\nmn\r\n";
+is(scalar <$sock>, "VA 3 Ob\r\n", "only the hit answers");
+is(scalar <$sock>, "baz\r\n", "hit value");
+is(scalar <$sock>, "MN\r\n", "then mn");
+is(req("ms foo 3 q\r\nnew\r\nmn\r\n"), "MN\r\n", "quiet ms sends nothing on success");
+is(req("mg foo v\r\n", 2), "VA 3\r\nnew\r\n", "but did store");
+
+# ms modes
+is(req("ms foo 1 ME\r\nx\r\n"), "NS\r\n", "add fails on existing");
+is(req("ms addme 1 ME\r\nx\r\n"), "HD\r\n", "add works on new");
+is(req("ms foo 2 MA\r\n!!\r\n"), "HD\r\n", "append");
+is(req("ms foo 2 MP\r\n<<\r\n"), "HD\r\n", "prepend");
+is(req("mg foo v\r\n", 2), "VA 7\r\n<<new!!\r\n", "appended and prepended");
+# the CAS returned is that of the combined item that was linked
+for my $mode ('MA', 'MP') {
+    my ($mcas) = req("ms foo 1 $mode c\r\n.\r\n") =~ /^HD c(\d+)\r\n$/;
+    ok($mcas, "$mode returns a cas");
+    is(req("mg foo c\r\n"), "HD c$mcas\r\n", "$mode: mg agrees");
+}
+is(req("ms foo 7 MS\r\n<<new!!\r\n"), "HD\r\n", "put it back");
+is(req("ms nope 1 MR\r\nx\r\n"), "NS\r\n", "replace fails on missing");
+is(req("ms foo 1 MX\r\nx\r\nmn\r\n", 2), "CLIENT_ERROR invalid mode for ms\r\nMN\r\n",
+   "bad mode; value is swallowed");
+
+# compare and swap
+($cas) = req("mg foo c\r\n") =~ /c(\d+)/;
+is(req("ms foo 1 C" . ($cas + 1) . "\r\nx\r\n"), "EX\r\n", "cas mismatch");
+is(req("ms foo 1 C$cas\r\ny\r\n"), "HD\r\n", "cas match");
+
+# md
+is(req("md foo C1\r\n"), "EX\r\n", "md cas mismatch");
+is(req("md foo Oq\r\n"), "HD Oq\r\n", "md deletes");
+is(req("md foo k\r\n"), "NF kfoo\r\n", "md not found");
+is(req("md addme q\r\nmd foo q\r\nmn\r\n"), "MN\r\n", "quiet md");
+
+# ma
+is(req("ma cnt\r\n"), "NF\r\n", "ma not found");
+is(req("ms cnt 1\r\n5\r\n"), "HD\r\n", "stored counter");
+is(req("ma cnt\r\n"), "HD\r\n", "ma increments");
+is(req("ma cnt D10 v\r\n", 2), "VA 2\r\n16\r\n", "ma returns value");
+is(req("ma cnt MD D20 v\r\n", 2), "VA 1\r\n0\r\n", "ma decrements to 0");
+
+# errors
+is(req("mg foo zz\r\n"), "CLIENT_ERROR invalid flag\r\n", "unknown flag");
+
+# big (chunked) values come back whole
+my $big = "x" x (1024 * 1024 - 100);
+req("ms big " . length($big) . "\r\n$big\r\n");
+is(req("mg big v s\r\n", 2), "VA " . length($big) . " s" . length($big) . "\r\n$big\r\n",
+   "large value");
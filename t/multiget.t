@@ -0,0 +1,89 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# a multiget wide enough for several batches, every third key missing
+my @keys = map { "mg$_" } 1 .. 100;
+my @hits = grep { my ($n) = /(\d+)/; $n % 3 } @keys;
+
+sub ascii_get {
+    my ($sock, $cmd) = @_;
+    print $sock "$cmd\r\n";
+    my @got;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        my ($key) = $line =~ /^VALUE (\S+)/;
+        my $data = <$sock>;
+        $data =~ s/\r\n$//;
+        push @got, "$key=$data";
+    }
+    return \@got;
+}
+
+# GETKQ for every key but the last, which is a GETK, all in one write
+sub bin_getk {
+    my ($sock, @keys) = @_;
+    my $out = '';
+    for my $i (0 .. $#keys) {
+        my $op = $i == $#keys ? 0x0C : 0x0D;
+        $out .= pack("CCnCCnNNNN", 0x80, $op, length($keys[$i]), 0, 0, 0,
+                     length($keys[$i]), $i, 0, 0) . $keys[$i];
+    }
+    print $sock $out;
+    my @got;
+    while (1) {
+        my $hdr = '';
+        read($sock, $hdr, 24);
+        my ($magic, $op, $keylen, $extlen, undef, $status, $bodylen, $opaque) =
+            unpack("CCnCCnNN", $hdr);
+        my $body = '';
+        read($sock, $body, $bodylen) if $bodylen;
+        if ($status == 0) {
+            my $key = substr($body, $extlen, $keylen);
+            push @got, "$key=" . substr($body, $extlen + $keylen);
+        }
+        last if $opaque == $#keys;
+    }
+    return \@got;
+}
+
+for my $opts ('', '-o hash_buckets') {
+    my $server = new_memcached($opts);
+    my $sock = $server->sock;
+    my $mode = $opts ? "buckets" : "chains";
+
+    for my $key (@hits) {
+        print $sock "set $key 0 0 " . length("v$key") . "\r\nv$key\r\n";
+        is(scalar <$sock>, "STORED\r\n", "$mode: stored $key") or last;
+    }
+    my @want = map { "$_=v$_" } @hits;
+
+    is_deeply(ascii_get($sock, "get @keys"), \@want, "$mode: get, in order");
+    is_deeply(ascii_get($sock, "gets @keys"), \@want, "$mode: gets");
+    is_deeply(ascii_get($sock, "gat 0 @keys"), \@want, "$mode: gat");
+    is_deeply(ascii_get($sock, "get " . join(' ', (@keys) x 3)),
+              [(@want) x 3], "$mode: the same keys over and over");
+
+    # a bad key past the first batch still fails the lot
+    my $long = "x" x 251;
+    print $sock "get @keys[0 .. 49] $long @keys[50 .. 99]\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n",
+       "$mode: key too long");
+    mem_get_is($sock, "mg1", "vmg1");
+
+    my $bsock = $server->new_sock;
+    is_deeply(bin_getk($bsock, @keys), \@want, "$mode: binary GETKQ run");
+    is_deeply(bin_getk($bsock, "mg1"), ["mg1=vmg1"], "$mode: binary GETK alone");
+    my $stats = mem_stats($sock);
+    # the keys before the bad one were looked up
+    my $before = grep { my ($n) = /(\d+)/; $n % 3 } @keys[0 .. 49];
+    is($stats->{get_hits}, @hits * 6 + 2 + $before, "$mode: hits counted");
+    is($stats->{touch_hits}, @hits, "$mode: touch hits counted");
+}
+
+done_testing();
@@ -0,0 +1,63 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_numa()) {
+    plan skip_all => 'NUMA support not enabled';
+    exit 0;
+}
+
+plan tests => 10;
+
+my $server = new_memcached("-o numa,slab_reassign -t 4 -m 64");
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{numa}, 'yes', "numa enabled");
+
+my $stats = mem_stats($sock);
+cmp_ok($stats->{numa_nodes}, '>=', 1, "at least one node");
+is($stats->{numa_local_hits}, 0, "no local hits yet");
+is($stats->{numa_remote_hits}, 0, "no remote hits yet");
+
+# Spread items over every worker so each node's arena hands out pages.
+my @socks = map { $server->new_sock } 1 .. 8;
+my $n = 0;
+for my $s (@socks) {
+    for my $i (1 .. 50) {
+        print $s "set key$n 0 0 5\r\n", sprintf("%05d", $n), "\r\n";
+        <$s>;
+        $n++;
+    }
+}
+for my $i (0 .. $n - 1) {
+    my $s = $socks[$i % @socks];
+    print $s "get key$i\r\n";
+    my $line = <$s>;
+    last unless $line =~ /^VALUE key$i /;
+    <$s>; <$s>;
+}
+
+$stats = mem_stats($sock);
+is($stats->{numa_local_hits} + $stats->{numa_remote_hits}, $n,
+   "every hit counted once");
+if ($stats->{numa_nodes} == 1) {
+    is($stats->{numa_remote_hits}, 0, "one node: nothing is remote");
+    is($stats->{numa_remote_pages}, 0, "one node: no remote pages");
+    is($stats->{numa_remote_allocs}, 0, "one node: no remote chunks");
+} else {
+    cmp_ok($stats->{numa_local_hits}, '>', 0, "some hits were local");
+    ok(defined $stats->{numa_remote_pages}, "remote page counter reported");
+    ok(defined $stats->{numa_remote_allocs}, "remote chunk counter reported");
+}
+
+# Values survive being freed and reallocated off the per-node lists.
+print $sock "delete key0\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted key0");
+print $sock "set key0 0 0 6\r\nagain!\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored key0 again");
@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 10;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# held back responses are a TCP thing
+my $server = new_memcached("-l 127.0.0.1");
+my $sock = $server->sock;
+
+# Pipelined mutations answer in order, however they end up batched.
+{
+    my $req = '';
+    my $expect = '';
+    for my $i (1..500) {
+        $req .= "set key$i 0 0 " . length($i) . "\r\n$i\r\n";
+        $expect .= "STORED\r\n";
+    }
+    $req .= "incr key1 5\r\ndecr key2 1\r\ntouch key3 100\r\ndelete key4\r\n";
+    $req .= "delete nokey\r\nadd key5 0 0 1\r\nx\r\n";
+    $expect .= "6\r\n1\r\nTOUCHED\r\nDELETED\r\nNOT_FOUND\r\nNOT_STORED\r\n";
+    print $sock $req;
+    my $got = '';
+    while (length($got) < length($expect)) {
+        my $line = <$sock>;
+        last unless defined $line;
+        $got .= $line;
+    }
+    is($got, $expect, "500 pipelined sets and friends answered in order");
+}
+
+# A read command flushes what's held back ahead of its own response,
+# straight away rather than when the conn next yields.
+{
+    my $yields = mem_stats($sock)->{conn_yields};
+    print $sock "set a 0 0 1\r\n1\r\nset b 0 0 1\r\n2\r\nget a b\r\nset c 0 0 1\r\n3\r\n";
+    is(scalar <$sock>, "STORED\r\n", "set a");
+    is(scalar <$sock>, "STORED\r\n", "set b");
+    is(join('', map { scalar <$sock> } 1..5),
+       "VALUE a 0 1\r\n1\r\nVALUE b 0 1\r\n2\r\nEND\r\n", "get after sets");
+    is(scalar <$sock>, "STORED\r\n", "set c");
+    is(mem_stats($sock)->{conn_yields}, $yields, "flushed without yielding");
+}
+
+# Responses aren't held while we wait for the rest of the input.
+{
+    print $sock "set d 0 0 1\r\n4\r\nset e 0 0 5\r\nab";
+    is(scalar <$sock>, "STORED\r\n", "held response sent while value is partial");
+    print $sock "cde\r\nset f 0 0 1\r\n5\r\nget";
+    is(scalar <$sock>, "STORED\r\n", "set e");
+    is(scalar <$sock>, "STORED\r\n", "held response sent while line is partial");
+    print $sock " e\r\n";
+    is(join('', map { scalar <$sock> } 1..3), "VALUE e 0 5\r\nabcde\r\nEND\r\n",
+       "get e");
+}
@@ -0,0 +1,163 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $b1 = new_memcached("-l 127.0.0.1");
+my $b2 = new_memcached("-l 127.0.0.1");
+my $p1 = $b1->port;
+my $p2 = $b2->port;
+my $server = new_memcached("-o proxy_server=127.0.0.1:$p1,proxy_server=127.0.0.1:$p2:2");
+my $sock = $server->sock;
+my $s1 = $b1->sock;
+my $s2 = $b2->sock;
+
+sub req {
+    my ($s, $cmd, $lines) = @_;
+    print $s $cmd;
+    return join('', map { scalar <$s> } 1 .. ($lines || 1));
+}
+
+{
+    my $stats = mem_stats($sock, ' settings');
+    is($stats->{proxy_servers}, 2, "two proxy servers");
+}
+
+# keys land on one server or the other, and come back through the proxy
+my (%on, @keys);
+for my $i (1 .. 40) {
+    my $key = "key$i";
+    push(@keys, $key);
+    print $sock "set $key 0 0 " . length("v$i") . "\r\nv$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored $key");
+}
+for my $i (1 .. 40) {
+    mem_get_is($sock, "key$i", "v$i");
+    my $in1 = req($s1, "get key$i\r\n") ne "END\r\n";
+    my $in2 = req($s2, "get key$i\r\n") ne "END\r\n";
+    <$s1> if $in1; <$s1> if $in1;
+    <$s2> if $in2; <$s2> if $in2;
+    ok($in1 != $in2, "key$i is on exactly one server");
+    $on{"key$i"} = $in1 ? 1 : 2;
+}
+my @on1 = grep { $on{$_} == 1 } @keys;
+my @on2 = grep { $on{$_} == 2 } @keys;
+cmp_ok(scalar @on1, '>', 0, "some keys on the first server");
+cmp_ok(scalar @on2, '>', 0, "and some on the second");
+
+# one multiget across both
+{
+    print $sock "get " . join(' ', @keys, 'nothere') . "\r\n";
+    my %got;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        my ($key, $len) = $line =~ /^VALUE (\S+) 0 (\d+)\r\n$/;
+        ok(defined $key, "value line") or last;
+        my $val = <$sock>;
+        chomp($val);
+        chop($val);
+        $got{$key} = $val;
+    }
+    is(scalar keys %got, 40, "multiget got every key");
+    is(scalar(grep { $got{"key$_"} eq "v$_" } 1 .. 40), 40, "with the right values");
+}
+
+# gets and cas go to the same server
+{
+    my ($cas, $val) = mem_gets($sock, "key1");
+    is($val, "v1", "gets value");
+    print $sock "cas key1 0 0 3 $cas\r\nnew\r\n";
+    is(scalar <$sock>, "STORED\r\n", "cas matched");
+    print $sock "cas key1 0 0 3 $cas\r\nold\r\n";
+    is(scalar <$sock>, "EXISTS\r\n", "cas mismatch");
+    mem_get_is($sock, "key1", "new");
+}
+
+# single line commands
+is(req($sock, "set num 0 0 1\r\n5\r\n"), "STORED\r\n", "stored number");
+is(req($sock, "incr num 10\r\n"), "15\r\n", "incr");
+is(req($sock, "decr num 3\r\n"), "12\r\n", "decr");
+is(req($sock, "touch num 100\r\n"), "TOUCHED\r\n", "touch");
+is(req($sock, "delete num\r\n"), "DELETED\r\n", "delete");
+is(req($sock, "delete num\r\n"), "NOT_FOUND\r\n", "delete miss");
+is(req($sock, "incr num 1\r\n"), "NOT_FOUND\r\n", "incr miss");
+
+# noreply still gets there, and says nothing
+print $sock "set quiet 0 0 2 noreply\r\nhi\r\n";
+print $sock "append quiet 0 0 1 noreply\r\n!\r\n";
+print $sock "delete nosuchkey noreply\r\n";
+mem_get_is($sock, "quiet", "hi!");
+
+# meta commands
+is(req($sock, "ms mkey 3 T0\r\nbar\r\n"), "HD\r\n", "ms");
+is(req($sock, "mg mkey s v\r\n", 2), "VA 3 s3\r\nbar\r\n", "mg");
+is(req($sock, "ma mcnt\r\n"), "NF\r\n", "ma miss");
+print $sock "mg nope1 v q Oa\r\nmg mkey v q Ob\r\nms mkey 1 q\r\nx\r\nmd nope2 q\r\nmn\r\n";
+is(scalar <$sock>, "VA 3 Ob\r\n", "quiet mg: only the hit");
+is(scalar <$sock>, "bar\r\n", "hit value");
+is(scalar <$sock>, "MN\r\n", "then mn");
+is(req($sock, "md mkey\r\n"), "HD\r\n", "md");
+
+# getrange
+is(req($sock, "set rkey 0 0 10\r\n0123456789\r\n"), "STORED\r\n", "stored rkey");
+is(req($sock, "getrange rkey 2 3\r\n", 3), "VALUE rkey 0 3\r\n234\r\nEND\r\n", "getrange");
+is(req($sock, "getrange nope 2 3\r\n"), "END\r\n", "getrange miss");
+
+# local commands still work
+like(req($sock, "version\r\n"), qr/^VERSION /, "version");
+
+{
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{proxy_cmds}, '>=', 100, "proxy_cmds counted");
+    cmp_ok($stats->{proxy_backend_cmds}, '>', $stats->{proxy_cmds}, "one per server for multigets");
+    is($stats->{proxy_backend_failures}, 0, "no failures");
+}
+
+# so does flush_prefix
+for my $i (1 .. 10) {
+    is(req($sock, "set ns:$i 0 0 1\r\nx\r\n"), "STORED\r\n", "stored ns:$i");
+}
+is(req($sock, "flush_prefix ns\r\n"), "OK\r\n", "flush_prefix");
+is(req($sock, "get " . join(' ', map { "ns:$_" } 1 .. 10) . "\r\n"), "END\r\n",
+   "prefix flushed on both servers");
+
+# flush_all goes everywhere
+is(req($sock, "flush_all\r\n"), "OK\r\n", "flush_all");
+mem_get_is($sock, $on1[0], undef);
+mem_get_is($sock, $on2[0], undef);
+is(req($s1, "get $on1[0]\r\n"), "END\r\n", "flushed on the first server");
+is(req($s2, "get $on2[0]\r\n"), "END\r\n", "and on the second");
+
+# a bare flush_all noreply is quiet too, and the servers stay in step
+for my $key ($on1[0], $on2[0]) {
+    is(req($sock, "set $key 0 0 1\r\nx\r\n"), "STORED\r\n", "stored $key");
+}
+print $sock "flush_all noreply\r\n";
+is(req($sock, "incr nosuchkey 1\r\n"), "NOT_FOUND\r\n", "next answer is its own");
+mem_get_is($sock, $on1[0], undef);
+mem_get_is($sock, $on2[0], undef);
+
+# with a server gone its keys are misses and writes to them fail
+for my $key ($on1[0], $on2[0]) {
+    is(req($sock, "set $key 0 0 1\r\nx\r\n"), "STORED\r\n", "stored $key again");
+}
+$b2->stop;
+sleep 0.5;
+mem_get_is($sock, $on2[0], undef);
+mem_get_is($sock, $on1[0], "x");
+print $sock "get $on1[0] $on2[0]\r\n";
+is(scalar <$sock>, "VALUE $on1[0] 0 1\r\n", "multiget still has the live server's key");
+is(scalar <$sock>, "x\r\n", "value");
+is(scalar <$sock>, "END\r\n", "end");
+like(req($sock, "set $on2[0] 0 0 1\r\ny\r\n"), qr/^SERVER_ERROR/, "set to the dead server fails");
+is(req($sock, "set $on1[0] 0 0 1\r\ny\r\n"), "STORED\r\n", "the other still takes sets");
+{
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{proxy_backend_failures}, '>', 0, "failures counted");
+}
+
+done_testing();
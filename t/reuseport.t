@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $output = `$Bin/../memcached-debug -h`;
+if ($output !~ /reuseport/) {
+    plan skip_all => 'SO_REUSEPORT not supported';
+    exit 0;
+}
+
+my $server = new_memcached("-o reuseport -t 4 -l 127.0.0.1");
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{reuseport}, 'yes', "reuseport enabled");
+
+# One listener per worker thread, all on the same port.
+print $sock "stats conns\r\n";
+my $listeners = 0;
+my %addrs;
+my %fds;
+while (<$sock>) {
+    last if /^(\.|END)/;
+    if (/STAT (\d+):addr (\S+)/) {
+        $fds{$1} = $2;
+    } elsif (/STAT (\d+):state conn_listening/ && $fds{$1} =~ /^tcp:/) {
+        $listeners++;
+        $addrs{$fds{$1}} = 1;
+    }
+}
+is($listeners, 4, "four tcp listeners");
+is(scalar keys %addrs, 1, "listeners share an address");
+
+# Connections accepted by the workers serve requests normally.
+my @socks = map { $server->new_sock } 1 .. 32;
+my $ok = 0;
+for my $i (0 .. $#socks) {
+    my $s = $socks[$i];
+    print $s "set key$i 0 0 3\r\n" . sprintf("v%02d", $i) . "\r\n";
+    $ok++ if scalar <$s> eq "STORED\r\n";
+}
+is($ok, 32, "stored through all connections");
+for my $i (0 .. $#socks) {
+    mem_get_is($socks[($i + 5) % @socks], "key$i", sprintf("v%02d", $i));
+}
+
+my $stats = mem_stats($sock);
+cmp_ok($stats->{curr_connections}, '>=', 33, "connections counted");
+is($stats->{accepting_conns}, 1, "accepting connections");
+
+close($_) for @socks;
+
+done_testing();
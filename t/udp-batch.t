@@ -0,0 +1,84 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!MemcachedTest::supports_udp()) {
+    plan skip_all => 'UDP not supported';
+}
+
+my $server = eval { new_memcached("-l 127.0.0.1 -t 1 -o udp_batch=8") };
+if (!$server) {
+    plan skip_all => 'udp_batch not supported on this platform';
+}
+plan tests => 47;
+
+for my $bad (1, 65) {
+    eval { new_memcached("-l 127.0.0.1 -o udp_batch=$bad") };
+    ok($@ && $@ =~ m/^Failed/, "udp_batch=$bad refused");
+}
+
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, 'settings');
+is($stats->{udp_batch}, 8, "udp_batch setting reported");
+
+for my $i (1 .. 20) {
+    print $sock "set key$i 0 0 " . length("val$i") . "\r\nval$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i");
+}
+
+my $usock = $server->new_udp_sock
+    or die "Can't bind : $@\n";
+
+# Fire off more requests than fit in one batch before reading anything.
+for my $i (1 .. 20) {
+    send($usock, pack("nnnn", 1000 + $i, 0, 1, 0) . "get key$i\r\n", 0)
+        or die "send: $!";
+}
+
+my %got;
+while (keys %got < 20) {
+    my $rin = '';
+    vec($rin, fileno($usock), 1) = 1;
+    last unless select(my $rout = $rin, undef, undef, 2);
+    my $res;
+    $usock->recv($res, 1500, 0);
+    my ($resid, $seq, $numpkts, $resv) = unpack("nnnn", substr($res, 0, 8));
+    $got{$resid} = [$seq, $numpkts, substr($res, 8)];
+}
+
+for my $i (1 .. 20) {
+    my $r = $got{1000 + $i};
+    is_deeply($r, [0, 1, "VALUE key$i 0 " . length("val$i") . "\r\nval$i\r\nEND\r\n"],
+              "batched response for request " . (1000 + $i));
+}
+
+# A response spanning several packets keeps its frame headers in order.
+my $big = "x" x 5000;
+print $sock "set big 0 0 5000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+
+send($usock, pack("nnnn", 77, 0, 1, 0) . "get big\r\n", 0) or die "send: $!";
+my %pkts;
+my $total;
+while (!defined $total || keys %pkts < $total) {
+    my $rin = '';
+    vec($rin, fileno($usock), 1) = 1;
+    last unless select(my $rout = $rin, undef, undef, 2);
+    my $res;
+    $usock->recv($res, 1500, 0);
+    my ($resid, $seq, $numpkts) = unpack("nnn", substr($res, 0, 6));
+    next unless $resid == 77;
+    $total = $numpkts;
+    $pkts{$seq} = substr($res, 8);
+}
+ok($total > 1, "big response split into $total packets");
+is(join('', map { $pkts{$_} } sort { $a <=> $b } keys %pkts),
+   "VALUE big 0 5000\r\n$big\r\nEND\r\n", "big response reassembled");
+
+# TCP still works alongside.
+mem_get_is($sock, "key1", "val1");
@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = eval { new_memcached("-l 127.0.0.1 -o zerocopy_size=32768") };
+if (!$server) {
+    plan skip_all => 'zerocopy_size not supported on this platform';
+}
+plan tests => 16;
+
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, 'settings');
+is($stats->{zerocopy_size}, 32768, "zerocopy_size setting reported");
+
+my %vals = (
+    small  => "x" x 100,
+    medium => join('', map { chr(65 + $_ % 26) } 1 .. 200 * 1024),
+    # bigger than slab_chunk_max, so served from a chunked item
+    large  => join('', map { chr(97 + $_ % 26) } 1 .. 700 * 1024),
+);
+
+for my $key (sort keys %vals) {
+    my $len = length($vals{$key});
+    print $sock "set $key 0 0 $len\r\n$vals{$key}\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored $key");
+}
+
+for my $key (sort keys %vals) {
+    print $sock "get $key\r\n";
+    is(read_value($sock), $vals{$key}, "ascii get $key");
+}
+
+# Pipelined multiget mixing small and large values.
+print $sock "get small large medium small\r\n";
+my $ok = 1;
+for my $key (qw(small large medium small)) {
+    $ok = 0 unless read_value($sock, 1) eq $vals{$key};
+}
+is(scalar <$sock>, "END\r\n", "multiget end");
+ok($ok, "multiget values intact");
+
+# Binary get: the response header is built in the connection's write buffer
+# and must not go out zero-copy.
+my $bsock = $server->new_sock;
+my $key = "large";
+print $bsock pack("CCnCCnNNNN", 0x80, 0x00, length($key), 0, 0, 0,
+                 length($key), 0xdeadbeef, 0, 0) . $key;
+my $hdr = '';
+read($bsock, $hdr, 24) == 24 or die "short binary header";
+my ($magic, $op, $keylen, $extlen, $dt, $status, $bodylen, $opaque) =
+    unpack("CCnCCnNN", $hdr);
+is($opaque, 0xdeadbeef, "binary response opaque");
+my $body = '';
+while (length($body) < $bodylen) {
+    read($bsock, my $buf, $bodylen - length($body)) or die "short body";
+    $body .= $buf;
+}
+is(substr($body, $extlen + $keylen), $vals{large}, "binary get large");
+
+$stats = mem_stats($sock);
+ok($stats->{zerocopy_sends} > 0, "zero-copy sends made");
+
+# Close a connection with responses possibly still in flight.
+my $sock2 = $server->new_sock;
+print $sock2 "get large medium\r\n";
+close($sock2);
+mem_get_is($sock, "small", $vals{small});
+
+# The server hangs up while its reply is still queued, unread. The kernel
+# goes on sending it from the item afterwards, so the item's memory mustn't
+# be handed to anything else until it has.
+{
+    my $orig = join('', map { chr(48 + $_ % 10) } 1 .. 40 * 1024);
+    my $len = length($orig);
+    print $sock "set zc 0 0 $len\r\n$orig\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored zc");
+    my $sock3 = $server->new_sock;
+    print $sock3 "get zc\r\nquit\r\n";
+    # let it be answered and hung up on
+    select(undef, undef, undef, 0.5);
+    for my $i (1 .. 20) {
+        my $v = chr(65 + $i) x $len;
+        print $sock "set zc 0 0 $len\r\n$v\r\n";
+        <$sock>;
+    }
+    is(read_value($sock3), $orig, "reply sent after close is intact");
+    is(scalar <$sock3>, undef, "then closed");
+}
+
+sub read_value {
+    my ($sock, $no_end) = @_;
+    my $line = <$sock>;
+    return undef unless $line =~ /^VALUE \S+ \d+ (\d+)\r\n$/;
+    my $len = $1 + 2;
+    my $data = '';
+    while (length($data) < $len) {
+        read($sock, my $buf, $len - length($data)) or return undef;
+        $data .= $buf;
+    }
+    unless ($no_end) {
+        return undef unless <$sock> eq "END\r\n";
+    }
+    return substr($data, 0, -2);
+}
@@ -6,12 +6,27 @@
 #ifdef EXTSTORE
 #include "storage.h"
 #endif
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#include "proxy.h"
+#include "hotkeys.h"
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <limits.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_TIMERFD_CREATE
+#include <sys/timerfd.h>
+#endif
+#ifdef HAVE_NUMA
+#include <numa.h>
+#endif
 
 #ifdef __sun
 #include <atomic.h>
@@ -23,6 +38,9 @@
 enum conn_queue_item_modes {
     queue_new_conn,   /* brand new connection. */
     queue_redispatch, /* redispatching from side thread */
+    queue_pause,      /* pause and report in */
+    queue_listen,     /* paused listeners may accept again */
+    queue_migrate,    /* a connection handed over by a busier worker */
 };
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
@@ -36,12 +54,17 @@ struct conn_queue_item {
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/* A connection queue.
+ * Any thread may push; only the owning worker pops, and it takes everything
+ * at once. With atomics this is a lock-free stack which the worker reverses
+ * back into arrival order.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
     CQ_ITEM *head;
-    CQ_ITEM *tail;
+#ifndef HAVE_GCC_ATOMICS
     pthread_mutex_t lock;
+#endif
 };
 
 /* Locks for cache LRU operations */
@@ -57,6 +80,9 @@ pthread_mutex_t atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Lock for global stats */
 static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Guards each thread's stats_base snapshot */
+static pthread_mutex_t stats_base_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Lock to cause worker threads to hang up after being woken */
 static pthread_mutex_t worker_hang_lock;
 
@@ -72,8 +98,9 @@ unsigned int item_lock_hashpower;
 #define hashmask(n) (hashsize(n)-1)
 
 /*
- * Each libevent instance has a wakeup pipe, which other threads
- * can use to signal that they've put a new connection on its queue.
+ * Each libevent instance has a wakeup eventfd (or a pipe where eventfd is
+ * unavailable), which other threads can use to signal that they've put
+ * something on its queue.
  */
 static LIBEVENT_THREAD *threads;
 
@@ -86,6 +113,9 @@ static pthread_cond_t init_cond;
 
 
 static void thread_libevent_process(int fd, short which, void *arg);
+static CQ_ITEM *cqi_new(void);
+static void thread_notify(LIBEVENT_THREAD *thread, CQ_ITEM *item);
+static void thread_wake(LIBEVENT_THREAD *thread);
 
 /* item_lock() must be held for an item before any modifications to either its
  * associated hash bucket, or the structure itself.
@@ -133,10 +163,9 @@ static void register_thread_initialized(void) {
 
 /* Must not be called with any deeper locks held */
 void pause_threads(enum pause_thread_types type) {
-    char buf[1];
+    bool notify = false;
     int i;
 
-    buf[0] = 0;
     switch (type) {
         case PAUSE_ALL_THREADS:
             lru_maintainer_pause();
@@ -146,7 +175,7 @@ void pause_threads(enum pause_thread_types type) {
             storage_compact_pause();
 #endif
         case PAUSE_WORKER_THREADS:
-            buf[0] = 'p';
+            notify = true;
             pthread_mutex_lock(&worker_hang_lock);
             break;
         case RESUME_ALL_THREADS:
@@ -166,17 +195,21 @@ void pause_threads(enum pause_thread_types type) {
     }
 
     /* Only send a message if we have one. */
-    if (buf[0] == 0) {
+    if (!notify) {
         return;
     }
 
     pthread_mutex_lock(&init_lock);
     init_count = 0;
     for (i = 0; i < settings.num_threads; i++) {
-        if (write(threads[i].notify_send_fd, buf, 1) != 1) {
-            perror("Failed writing to notify pipe");
-            /* TODO: This is a fatal problem. Can it ever happen temporarily? */
+        CQ_ITEM *item = cqi_new();
+        if (item == NULL) {
+            /* The thread would never report in. */
+            fprintf(stderr, "Failed to allocate memory to pause threads\n");
+            exit(EXIT_FAILURE);
         }
+        item->mode = queue_pause;
+        thread_notify(threads + i, item);
     }
     wait_for_thread_registration(settings.num_threads);
     pthread_mutex_unlock(&init_lock);
@@ -186,44 +219,64 @@ void pause_threads(enum pause_thread_types type) {
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
+#ifndef HAVE_GCC_ATOMICS
     pthread_mutex_init(&cq->lock, NULL);
+#endif
     cq->head = NULL;
-    cq->tail = NULL;
 }
 
 /*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Takes every item off a connection queue, but doesn't block if there
+ * isn't one. Must only be called by the thread owning the queue.
+ * Returns the items in the order they were pushed, or NULL if the queue
+ * was empty.
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
+static CQ_ITEM *cq_pop_all(CQ *cq) {
+    CQ_ITEM *item, *next, *list = NULL;
 
+#ifdef HAVE_GCC_ATOMICS
+    do {
+        item = cq->head;
+    } while (!__sync_bool_compare_and_swap(&cq->head, item, NULL));
+#else
     pthread_mutex_lock(&cq->lock);
     item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
+    cq->head = NULL;
     pthread_mutex_unlock(&cq->lock);
+#endif
 
-    return item;
+    /* newest first on the stack; flip it around. */
+    while (item != NULL) {
+        next = item->next;
+        item->next = list;
+        list = item;
+        item = next;
+    }
+
+    return list;
 }
 
 /*
  * Adds an item to a connection queue.
+ * Returns true if the queue was empty, meaning the owner needs a wakeup.
  */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+static bool cq_push(CQ *cq, CQ_ITEM *item) {
+    CQ_ITEM *head;
 
+#ifdef HAVE_GCC_ATOMICS
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!__sync_bool_compare_and_swap(&cq->head, head, item));
+#else
     pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
+    head = cq->head;
+    item->next = head;
+    cq->head = item;
     pthread_mutex_unlock(&cq->lock);
+#endif
+
+    return head == NULL;
 }
 
 /*
@@ -269,15 +322,42 @@ static CQ_ITEM *cqi_new(void) {
 
 
 /*
- * Frees a connection queue item (adds it to the freelist.)
+ * Frees a list of connection queue items from first to last (adds them to
+ * the freelist.)
  */
-static void cqi_free(CQ_ITEM *item) {
+static void cqi_free_list(CQ_ITEM *first, CQ_ITEM *last) {
     pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
+    last->next = cqi_freelist;
+    cqi_freelist = first;
     pthread_mutex_unlock(&cqi_freelist_lock);
 }
 
+/*
+ * Queues an item for a worker thread, waking it up if its queue was empty.
+ * A worker drains its whole queue on every wakeup, so nothing more is needed
+ * if there were already items waiting.
+ */
+static void thread_notify(LIBEVENT_THREAD *thread, CQ_ITEM *item) {
+    if (cq_push(thread->new_conn_queue, item))
+        thread_wake(thread);
+}
+
+/* Makes a worker run thread_libevent_process(). */
+static void thread_wake(LIBEVENT_THREAD *thread) {
+#ifdef HAVE_EVENTFD
+    uint64_t u = 1;
+    if (write(thread->notify_send_fd, &u, sizeof(u)) != sizeof(u)) {
+        perror("Writing to thread notify eventfd");
+    }
+#else
+    char buf[1];
+    buf[0] = 'c';
+    if (write(thread->notify_send_fd, buf, 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
+#endif
+}
+
 
 /*
  * Creates a worker thread.
@@ -305,6 +385,74 @@ void accept_new_conns(const bool do_accept) {
 }
 /****************************** LIBEVENT THREADS *****************************/
 
+/*
+ * Advances the idle connection timer wheel, times out proxy requests, lets
+ * go of hot items that have cooled and finishes closing connections that
+ * were waiting on zero-copy sends. Runs once a second on workers when
+ * idle_timeout, proxy mode, hotkeys_cache or zerocopy_size is set.
+ */
+static void thread_timer_tick(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+#ifdef HAVE_TIMERFD_CREATE
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno != EAGAIN && settings.verbose > 0)
+            perror("Can't read from timer fd");
+    }
+#endif
+    if (settings.idle_timeout > 0)
+        conn_timer_tick(me);
+    if (settings.proxy)
+        proxy_thread_tick(me);
+    if (settings.hotkeys_cache)
+        hotcache_expire(me->hotkeys);
+#ifdef USE_ZEROCOPY
+    if (me->zc_closing != NULL)
+        conn_zerocopy_tick(me);
+#endif
+}
+
+/*
+ * Creates the timer event that drives a worker's idle timeouts. A timerfd
+ * lets the io_uring loop, which has no timers of its own, poll it like any
+ * other fd.
+ */
+static void setup_thread_timer(LIBEVENT_THREAD *me) {
+    me->timers.now = current_time;
+#ifdef HAVE_TIMERFD_CREATE
+    struct itimerspec its = { .it_interval = { 1, 0 }, .it_value = { 1, 0 } };
+    me->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (me->timer_fd == -1 || timerfd_settime(me->timer_fd, 0, &its, NULL) != 0) {
+        perror("Can't create idle timeout timer");
+        exit(1);
+    }
+    event_set(&me->timer_event, me->timer_fd, EV_READ | EV_PERSIST,
+              thread_timer_tick, me);
+    event_base_set(me->base, &me->timer_event);
+#ifdef HAVE_IO_URING
+    if (!settings.io_uring)
+#endif
+    if (event_add(&me->timer_event, 0) == -1) {
+        fprintf(stderr, "Can't monitor idle timeout timer\n");
+        exit(1);
+    }
+#else
+    struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+#ifdef HAVE_IO_URING
+    if (settings.io_uring) {
+        fprintf(stderr, "idle_timeout with io_uring requires timerfd\n");
+        exit(1);
+    }
+#endif
+    event_set(&me->timer_event, -1, EV_PERSIST, thread_timer_tick, me);
+    event_base_set(me->base, &me->timer_event);
+    if (event_add(&me->timer_event, &t) == -1) {
+        fprintf(stderr, "Can't add idle timeout timer\n");
+        exit(1);
+    }
+#endif
+}
+
 /*
  * Set up a thread's information.
  */
@@ -329,6 +477,10 @@ static void setup_thread(LIBEVENT_THREAD *me) {
               EV_READ | EV_PERSIST, thread_libevent_process, me);
     event_base_set(me->base, &me->notify_event);
 
+#ifdef HAVE_IO_URING
+    /* io_uring workers register the pipe from their own thread. */
+    if (!settings.io_uring)
+#endif
     if (event_add(&me->notify_event, 0) == -1) {
         fprintf(stderr, "Can't monitor libevent notify pipe\n");
         exit(1);
@@ -341,9 +493,20 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
     cq_init(me->new_conn_queue);
 
-    if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
-        perror("Failed to initialize mutex");
-        exit(EXIT_FAILURE);
+    me->timer_fd = -1;
+    if (settings.idle_timeout > 0 || settings.proxy || settings.hotkeys_cache ||
+            settings.zerocopy_size > 0) {
+        setup_thread_timer(me);
+    }
+    if (settings.proxy) {
+        proxy_thread_init(me);
+    }
+    if (settings.hotkeys) {
+        me->hotkeys = hotkeys_new(settings.hotkeys);
+        if (me->hotkeys == NULL) {
+            fprintf(stderr, "Failed to allocate hot keys counters\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     me->suffix_cache = cache_create("suffix", SUFFIX_SIZE, sizeof(char*),
@@ -358,9 +521,52 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         fprintf(stderr, "Failed to create IO object cache\n");
         exit(EXIT_FAILURE);
     }
+    pthread_mutex_init(&me->io_done_lock, NULL);
+    me->io_done = NULL;
 #endif
 }
 
+#ifdef HAVE_NUMA
+/*
+ * -o numa: pin the calling worker to one CPU of its node, taking the node's
+ * CPUs in turn so workers sharing a node don't share a core until they have
+ * to. CPUs outside the process's existing affinity (taskset, cgroups) are
+ * never used.
+ */
+static void numa_pin_thread(LIBEVENT_THREAD *me) {
+    int nth = (me - threads) / slabs_numa_nodes();
+    struct bitmask *node_cpus = numa_allocate_cpumask();
+    struct bitmask *allowed = numa_allocate_cpumask();
+    unsigned int cpu, usable = 0;
+
+    if (numa_node_to_cpus(me->numa_node, node_cpus) == 0 &&
+            numa_sched_getaffinity(0, allowed) >= 0) {
+        for (cpu = 0; cpu < node_cpus->size; cpu++) {
+            if (numa_bitmask_isbitset(node_cpus, cpu) &&
+                    numa_bitmask_isbitset(allowed, cpu))
+                usable++;
+        }
+    }
+    if (usable > 0) {
+        unsigned int want = nth % usable;
+        for (cpu = 0; cpu < node_cpus->size; cpu++) {
+            if (numa_bitmask_isbitset(node_cpus, cpu) &&
+                    numa_bitmask_isbitset(allowed, cpu) && want-- == 0)
+                break;
+        }
+        numa_bitmask_clearall(allowed);
+        numa_bitmask_setbit(allowed, cpu);
+        if (numa_sched_setaffinity(0, allowed) != 0 && settings.verbose > 0) {
+            perror("Can't pin worker thread");
+        }
+    }
+    numa_free_cpumask(allowed);
+    numa_free_cpumask(node_cpus);
+
+    slabs_set_thread_node(me->numa_node);
+}
+#endif
+
 /*
  * Worker thread: main event loop
  */
@@ -376,12 +582,37 @@ static void *worker_libevent(void *arg) {
         abort();
     }
 
+#ifdef HAVE_NUMA
+    if (settings.numa) {
+        numa_pin_thread(me);
+    }
+#endif
+
+#ifdef HAVE_IO_URING
+    if (settings.io_uring) {
+        if (uring_thread_init() != 0 ||
+                uring_event_add(&me->notify_event) != 0) {
+            fprintf(stderr, "Can't set up io_uring for worker thread\n");
+            exit(1);
+        }
+        if (me->timer_fd != -1 && uring_event_add(&me->timer_event) != 0) {
+            fprintf(stderr, "Can't monitor idle timeout timer\n");
+            exit(1);
+        }
+    }
+#endif
+
     if (settings.drop_privileges) {
         drop_worker_privileges();
     }
 
     register_thread_initialized();
 
+#ifdef HAVE_IO_URING
+    if (settings.io_uring) {
+        uring_event_loop();
+    } else
+#endif
     event_base_loop(me->base, 0);
 
     event_base_free(me->base);
@@ -390,31 +621,40 @@ static void *worker_libevent(void *arg) {
 
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Processes everything queued for this thread. This is called when the
+ * libevent wakeup eventfd (or pipe) becomes readable.
  */
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
-    CQ_ITEM *item;
-    char buf[1];
+    CQ_ITEM *item, *last = NULL;
+    CQ_ITEM *list;
     conn *c;
-    unsigned int timeout_fd;
 
+#ifdef HAVE_EVENTFD
+    uint64_t u;
+    /* Resets the counter. EAGAIN just means another wakeup raced us here. */
+    if (read(fd, &u, sizeof(u)) != sizeof(u) && errno != EAGAIN) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Can't read from libevent eventfd\n");
+        return;
+    }
+#else
+    char buf[1];
     if (read(fd, buf, 1) != 1) {
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
         return;
     }
+#endif
 
-    switch (buf[0]) {
-    case 'c':
-        item = cq_pop(me->new_conn_queue);
+    list = cq_pop_all(me->new_conn_queue);
 
-        if (NULL == item) {
-            break;
-        }
+    for (item = list; item != NULL; item = item->next) {
+        last = item;
         switch (item->mode) {
             case queue_new_conn:
+                if (settings.conn_balance && item->init_state == conn_new_cmd)
+                    THR_ATOMIC_ADD(me->conns_queued, -1);
                 c = conn_new(item->sfd, item->init_state, item->event_flags,
                                    item->read_buffer_size, item->transport,
                                    me->base);
@@ -422,6 +662,9 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                     if (IS_UDP(item->transport)) {
                         fprintf(stderr, "Can't listen for events on UDP socket\n");
                         exit(1);
+                    } else if (item->init_state == conn_listening) {
+                        fprintf(stderr, "Can't listen for events on TCP socket\n");
+                        exit(1);
                     } else {
                         if (settings.verbose > 0) {
                             fprintf(stderr, "Can't listen for events on fd %d\n",
@@ -431,34 +674,180 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                     }
                 } else {
                     c->thread = me;
+                    if (item->init_state == conn_listening) {
+                        c->next = me->listen_conns;
+                        me->listen_conns = c;
+                    } else {
+                        if (settings.conn_balance && !IS_UDP(c->transport)) {
+                            THR_ATOMIC_ADD(me->conns, 1);
+                            c->thread_since = current_time;
+                        }
+                        conn_timer_add(c);
+                    }
                 }
                 break;
 
             case queue_redispatch:
                 conn_worker_readd(item->c);
+                conn_timer_add(item->c);
+                break;
+            /* we were told to pause and report in */
+            case queue_pause:
+                register_thread_initialized();
+                break;
+            /* our listeners were paused and may accept again */
+            case queue_listen:
+                do_accept_new_conns_worker(me, true);
+                break;
+            case queue_migrate:
+                c = item->c;
+                c->thread = me;
+                c->thread_since = current_time;
+                THR_ATOMIC_ADD(me->conns, 1);
+                conn_worker_readd(c);
+                conn_timer_add(c);
                 break;
         }
-        cqi_free(item);
-        break;
-    /* we were told to pause and report in */
-    case 'p':
-        register_thread_initialized();
-        break;
-    /* a client socket timed out */
-    case 't':
-        if (read(fd, &timeout_fd, sizeof(timeout_fd)) != sizeof(timeout_fd)) {
-            if (settings.verbose > 0)
-                fprintf(stderr, "Can't read timeout fd from libevent pipe\n");
-            return;
-        }
-        conn_close_idle(conns[timeout_fd]);
-        break;
+    }
+
+    if (list != NULL) {
+        cqi_free_list(list, last);
+    }
+
+#ifdef EXTSTORE
+    io_wrap *wrap, *next, *done = NULL;
+    pthread_mutex_lock(&me->io_done_lock);
+    wrap = me->io_done;
+    me->io_done = NULL;
+    pthread_mutex_unlock(&me->io_done_lock);
+    /* back into the order they finished in */
+    for (; wrap != NULL; wrap = next) {
+        next = wrap->next;
+        wrap->next = done;
+        done = wrap;
+    }
+    for (wrap = done; wrap != NULL; wrap = next) {
+        next = wrap->next;
+        conn_io_done(wrap);
+    }
+#endif
+}
+
+/*
+ * Wakes up workers whose SO_REUSEPORT listeners were paused after EMFILE.
+ * Called from the main thread.
+ */
+void resume_worker_listeners(void) {
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        LIBEVENT_THREAD *thread = threads + i;
+        if (!thread->listen_paused)
+            continue;
+        CQ_ITEM *item = cqi_new();
+        if (item == NULL)
+            continue; /* try again next tick */
+        /* clear now so we don't queue one per tick while it's pending */
+        thread->listen_paused = false;
+        item->mode = queue_listen;
+        thread_notify(thread, item);
     }
 }
 
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
+/*
+ * -o conn_balance. Workers add up the time they spend handling connection
+ * events; once a second the main thread turns that into a per-worker load.
+ * New connections go to the least busy workers, spread by connection count
+ * among those within BALANCE_SLACK_US of the least busy one. A worker much
+ * busier than the least busy one is asked to hand over one long-lived
+ * connection, which it does the next time one sits between requests (see
+ * conn_migrate()). Busy connections get there most often, so they're the
+ * ones that tend to move.
+ */
+#define BALANCE_SLACK_US 50000      /* 5% of a second */
+#define BALANCE_MIN_BUSY_US 250000  /* don't move anything below 25% busy */
+
+static int select_thread_by_load(void) {
+    unsigned int min_load = UINT_MAX;
+    int i, n, best = -1, best_conns = 0;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (threads[i].load < min_load)
+            min_load = threads[i].load;
+    }
+
+    /* start after the last pick so ties still rotate */
+    for (n = 1; n <= settings.num_threads; n++) {
+        LIBEVENT_THREAD *t = threads + (last_thread + n) % settings.num_threads;
+        if (t->load > min_load + BALANCE_SLACK_US)
+            continue;
+        int conns = THR_ATOMIC_READ(t->conns) + THR_ATOMIC_READ(t->conns_queued);
+        if (best == -1 || conns < best_conns) {
+            best = t - threads;
+            best_conns = conns;
+        }
+    }
+    return best;
+}
+
+/* Called once a second from the main thread's clock handler. */
+void thread_balance(void) {
+    int i, busiest = 0, idlest = 0;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        LIBEVENT_THREAD *t = threads + i;
+        uint64_t busy = THR_STATS_READ(t->busy_us);
+        uint64_t delta = busy - t->busy_us_last;
+        t->busy_us_last = busy;
+        if (delta > 1000000)
+            delta = 1000000;
+        t->load = (t->load + (unsigned int)delta) / 2;
+
+        if (t->load > threads[busiest].load)
+            busiest = i;
+        if (t->load < threads[idlest].load)
+            idlest = i;
+        /* an unclaimed request from last time may no longer be right */
+        THR_ATOMIC_SET(t->migrate_to, -1);
+    }
+
+    if (busiest != idlest && threads[busiest].load >= BALANCE_MIN_BUSY_US &&
+            threads[busiest].load > threads[idlest].load * 2 + BALANCE_SLACK_US &&
+            THR_ATOMIC_READ(threads[busiest].conns) > 1) {
+        THR_ATOMIC_SET(threads[busiest].migrate_to, idlest);
+    }
+}
+
+#ifdef MEMCACHED_DEBUG
+/* For tests: ask t to hand a connection to the next worker, as
+ * thread_balance() would if t were busy enough. It's cleared again by the
+ * next thread_balance() if nothing claims it first. */
+void thread_balance_force(LIBEVENT_THREAD *t) {
+    THR_ATOMIC_SET(t->migrate_to,
+            (int)((t - threads + 1) % settings.num_threads));
+}
+#endif
+
+/*
+ * Hands a connection over to another worker. Called by the connection's
+ * worker, which has already stopped watching it, and must not touch it
+ * again if this succeeds.
+ */
+bool dispatch_conn_migrate(conn *c, int tid) {
+    CQ_ITEM *item = cqi_new();
+    if (item == NULL)
+        return false;
+    THR_ATOMIC_ADD(c->thread->conns, -1);
+    item->sfd = c->sfd;
+    item->c = c;
+    item->mode = queue_migrate;
+    thread_notify(threads + tid, item);
+    return true;
+}
+
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, either during initialization (for UDP) or because
@@ -467,7 +856,6 @@ static int last_thread = -1;
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport) {
     CQ_ITEM *item = cqi_new();
-    char buf[1];
     if (item == NULL) {
         close(sfd);
         /* given that malloc failed this may also fail, but let's try */
@@ -475,7 +863,13 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
         return ;
     }
 
-    int tid = (last_thread + 1) % settings.num_threads;
+    int tid;
+    if (settings.conn_balance && init_state == conn_new_cmd) {
+        tid = select_thread_by_load();
+        THR_ATOMIC_ADD(threads[tid].conns_queued, 1);
+    } else {
+        tid = (last_thread + 1) % settings.num_threads;
+    }
 
     LIBEVENT_THREAD *thread = threads + tid;
 
@@ -488,13 +882,8 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
     item->transport = transport;
     item->mode = queue_new_conn;
 
-    cq_push(thread->new_conn_queue, item);
-
     MEMCACHED_CONN_DISPATCH(sfd, thread->thread_id);
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1) {
-        perror("Writing to thread notify pipe");
-    }
+    thread_notify(thread, item);
 }
 
 /*
@@ -503,7 +892,6 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
  */
 void redispatch_conn(conn *c) {
     CQ_ITEM *item = cqi_new();
-    char buf[1];
     if (item == NULL) {
         /* Can't cleanly redispatch connection. close it forcefully. */
         c->state = conn_closed;
@@ -516,13 +904,30 @@ void redispatch_conn(conn *c) {
     item->c = c;
     item->mode = queue_redispatch;
 
-    cq_push(thread->new_conn_queue, item);
+    thread_notify(thread, item);
+}
 
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1) {
-        perror("Writing to thread notify pipe");
-    }
+#ifdef EXTSTORE
+/*
+ * Hands an out of order read back to the worker that owns its connection.
+ * Unlike redispatch_conn() this can't fail: the connection never left its
+ * worker and may be busy with other requests, so there's nothing sane to do
+ * with it from here.
+ */
+void redispatch_io(io_wrap *wrap) {
+    LIBEVENT_THREAD *thread = wrap->c->thread;
+    bool wake;
+
+    pthread_mutex_lock(&thread->io_done_lock);
+    wake = thread->io_done == NULL;
+    wrap->next = thread->io_done;
+    thread->io_done = wrap;
+    pthread_mutex_unlock(&thread->io_done_lock);
+
+    if (wake)
+        thread_wake(thread);
 }
+#endif
 
 /* This misses the allow_new_conns flag :( */
 void sidethread_conn_close(conn *c) {
@@ -555,19 +960,73 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
  * lazy-expiring as needed.
  */
 item *item_get(const char *key, const size_t nkey, conn *c, const bool do_update) {
+    return item_get_hv(key, nkey, hash(key, nkey), c, do_update);
+}
+
+/* As item_get(), for a caller that has already hashed the key. */
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv,
+                  conn *c, const bool do_update) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_get(key, nkey, hv, c, do_update);
     item_unlock(hv);
+    if (settings.numa && it != NULL && c != NULL && c->thread != NULL) {
+        if (slabs_node_of(it) == c->thread->numa_node) {
+            THR_STATS_INCR(c->thread, numa_local_hits);
+        } else {
+            THR_STATS_INCR(c->thread, numa_remote_hits);
+        }
+    }
     return it;
 }
 
+/* Starts pulling in the items lookups of hvs will look at first, once
+ * assoc_prefetch() has had time to bring in their buckets. The buckets are
+ * read without the item locks; hash_reading keeps a resize from freeing
+ * the table we might be reading until we're done. */
+void item_prefetch(LIBEVENT_THREAD *me, const uint32_t *hvs, const int n) {
+    int i;
+
+    __atomic_store_n(&me->hash_reading, true, __ATOMIC_RELAXED);
+    /* pairs with the fence in item_prefetch_wait() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < n; i++) {
+        assoc_prefetch_item(hvs[i]);
+    }
+    __atomic_store_n(&me->hash_reading, false, __ATOMIC_RELEASE);
+}
+
+/* Waits out any item_prefetch() that may have started before the stripes
+ * were moved to a new table, so the old one can be freed. */
+void item_prefetch_wait(void) {
+    int i;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < settings.num_threads; i++) {
+        while (__atomic_load_n(&threads[i].hash_reading, __ATOMIC_ACQUIRE)) {
+            usleep(10);
+        }
+    }
+}
+
+/*
+ * Like item_get(), but returns with the item lock still held so the caller
+ * can look at or change the item before anyone else does. Release it with
+ * item_unlock(*hv).
+ */
+item *item_get_locked(const char *key, const size_t nkey, conn *c, const bool do_update, uint32_t *hv) {
+    *hv = hash(key, nkey);
+    item_lock(*hv);
+    return do_item_get(key, nkey, *hv, c, do_update);
+}
+
 item *item_touch(const char *key, size_t nkey, uint32_t exptime, conn *c) {
+    return item_touch_hv(key, nkey, hash(key, nkey), exptime, c);
+}
+
+item *item_touch_hv(const char *key, size_t nkey, const uint32_t hv,
+                    uint32_t exptime, conn *c) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_touch(key, nkey, exptime, hv, c);
     item_unlock(hv);
@@ -594,6 +1053,22 @@ int item_link(item *item) {
  */
 void item_remove(item *item) {
     uint32_t hv;
+    unsigned short refcount;
+
+    if (item->it_flags & ITEM_HOTCOPY) {
+        hotcache_release(item);
+        return;
+    }
+
+    /* Only the last reference frees the item and needs the lock. Hot items
+     * held by -o hotkeys_cache are released here without ever taking it. */
+    refcount = __atomic_load_n(&item->refcount, __ATOMIC_ACQUIRE);
+    while (refcount > 1) {
+        if (__atomic_compare_exchange_n(&item->refcount, &refcount, refcount - 1,
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+    }
+
     hv = hash(ITEM_key(item), item->nkey);
 
     item_lock(hv);
@@ -662,36 +1137,50 @@ void STATS_UNLOCK() {
     pthread_mutex_unlock(&stats_lock);
 }
 
+/*
+ * Workers write their own counters without locking, so instead of zeroing
+ * them out from under their owners a reset records where each one stands.
+ * stats_base_lock only serializes resets against aggregation.
+ */
 void threadlocal_stats_reset(void) {
-    int ii;
+    int ii, sid;
+
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-#define X(name) threads[ii].stats.name = 0;
+        struct thread_stats *cur = &threads[ii].stats;
+        struct thread_stats *base = &threads[ii].stats_base;
+#define X(name) base->name = THR_STATS_READ(cur->name);
         THREAD_STATS_FIELDS
 #ifdef EXTSTORE
         EXTSTORE_THREAD_STATS_FIELDS
 #endif
 #undef X
 
-        memset(&threads[ii].stats.slab_stats, 0,
-                sizeof(threads[ii].stats.slab_stats));
-        memset(&threads[ii].stats.lru_hits, 0,
-                sizeof(uint64_t) * POWER_LARGEST);
+        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+#define X(name) base->slab_stats[sid].name = \
+            THR_STATS_READ(cur->slab_stats[sid].name);
+            SLAB_STATS_FIELDS
+#undef X
+        }
 
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
+        for (sid = 0; sid < POWER_LARGEST; sid++) {
+            base->lru_hits[sid] = THR_STATS_READ(cur->lru_hits[sid]);
+        }
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *stats) {
     int ii, sid;
+    uint64_t hits;
 
-    /* The struct has a mutex, but we can safely set the whole thing
-     * to zero since it is unused when aggregating. */
     memset(stats, 0, sizeof(*stats));
 
+    pthread_mutex_lock(&stats_base_lock);
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-#define X(name) stats->name += threads[ii].stats.name;
+        struct thread_stats *cur = &threads[ii].stats;
+        struct thread_stats *base = &threads[ii].stats_base;
+#define X(name) stats->name += THR_STATS_READ(cur->name) - base->name;
         THREAD_STATS_FIELDS
 #ifdef EXTSTORE
         EXTSTORE_THREAD_STATS_FIELDS
@@ -700,20 +1189,19 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
 #define X(name) stats->slab_stats[sid].name += \
-            threads[ii].stats.slab_stats[sid].name;
+            THR_STATS_READ(cur->slab_stats[sid].name) - \
+            base->slab_stats[sid].name;
             SLAB_STATS_FIELDS
 #undef X
         }
 
         for (sid = 0; sid < POWER_LARGEST; sid++) {
-            stats->lru_hits[sid] +=
-                threads[ii].stats.lru_hits[sid];
-            stats->slab_stats[CLEAR_LRU(sid)].get_hits +=
-                threads[ii].stats.lru_hits[sid];
+            hits = THR_STATS_READ(cur->lru_hits[sid]) - base->lru_hits[sid];
+            stats->lru_hits[sid] += hits;
+            stats->slab_stats[CLEAR_LRU(sid)].get_hits += hits;
         }
-
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
     }
+    pthread_mutex_unlock(&stats_base_lock);
 }
 
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
@@ -783,13 +1271,27 @@ void memcached_thread_init(int nthreads, void *arg) {
         pthread_mutex_init(&item_locks[i], NULL);
     }
 
-    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
-    if (! threads) {
+    /* keep each thread's stats on cache lines of their own */
+    if (posix_memalign((void **)&threads, CACHE_LINE_SIZE,
+                       nthreads * sizeof(LIBEVENT_THREAD)) != 0) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+    memset(threads, 0, nthreads * sizeof(LIBEVENT_THREAD));
 
     for (i = 0; i < nthreads; i++) {
+        threads[i].migrate_to = -1;
+        threads[i].numa_node = i % slabs_numa_nodes();
+#ifdef HAVE_EVENTFD
+        int efd = eventfd(0, EFD_NONBLOCK);
+        if (efd == -1) {
+            perror("Can't create notify eventfd");
+            exit(1);
+        }
+
+        threads[i].notify_receive_fd = efd;
+        threads[i].notify_send_fd = efd;
+#else
         int fds[2];
         if (pipe(fds)) {
             perror("Can't create notify pipe");
@@ -798,12 +1300,18 @@ void memcached_thread_init(int nthreads, void *arg) {
 
         threads[i].notify_receive_fd = fds[0];
         threads[i].notify_send_fd = fds[1];
+#endif
 #ifdef EXTSTORE
         threads[i].storage = arg;
 #endif
         setup_thread(&threads[i]);
+#ifdef HAVE_EVENTFD
+        /* Reserve three fds for the libevent base, and one for the eventfd */
+        stats_state.reserved_fds += 4;
+#else
         /* Reserve three fds for the libevent base, and two for the pipe */
         stats_state.reserved_fds += 5;
+#endif
     }
 
     /* Create threads after we've done all the libevent setup. */
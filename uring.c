@@ -0,0 +1,471 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring event loop for worker threads.
+ *
+ * A worker started with -o io_uring runs this loop instead of
+ * event_base_loop(). Everything queued while handling one batch of
+ * completions is submitted by the same io_uring_enter() call that waits for
+ * the next batch, so a busy worker makes one syscall per loop instead of one
+ * per read, send and event change.
+ *
+ * A TCP or unix socket client's reads and sends are SQEs themselves. Once a
+ * conn has nothing left to parse, drive_machine() queues an IORING_OP_RECV
+ * into its read buffer, and transmit() queues an IORING_OP_SENDMSG for the
+ * msghdr it would have passed to sendmsg(). The kernel waits for the socket
+ * on its own, so neither needs a poll first. The completion is stored in the
+ * conn and event_handler() runs as if the socket had become readable or
+ * writable; try_read_network() and transmit() then pick the result up
+ * instead of making the call. See conn_uring_recv() and conn_close() for the
+ * rules while one is out.
+ *
+ * Everything else still waits on readiness: listeners, UDP, the notify pipe
+ * and timerfd, conns part way through a value (conn_nread and conn_swallow
+ * read straight into the item) and MSG_ZEROCOPY sends. A struct event filled
+ * in by event_set() becomes a POLL_ADD on the ring instead of an
+ * epoll_ctl(). Polls are oneshot and re-armed after each callback: the re-arm
+ * rides along with the next io_uring_enter(), and it keeps epoll's level
+ * triggered behaviour, which a listener accepting one conn per event or a UDP
+ * conn reading one datagram per event depends on. A multishot poll only fires
+ * on new wakeups and would strand them.
+ *
+ * liburing is not required; the ring is set up with the raw syscalls.
+ */
+#include "memcached.h"
+#include "uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#if !defined(LIBEVENT_VERSION_NUMBER) || LIBEVENT_VERSION_NUMBER < 0x02000101
+#error "io_uring support requires libevent 2.0.1 or newer"
+#endif
+
+/* user_data for submissions whose completions we don't care about. */
+#define URING_IGNORE UINT64_MAX
+/* user_data for a conn's own recv or send: the conn pointer, tagged with the
+ * op in its low bits. Poll user_data never has the top bit set. */
+#define URING_CONN_OP (1ULL << 63)
+#define URING_GEN_MASK 0x7fffffff
+
+struct uring_sq {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    unsigned *ring_entries;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+};
+
+struct uring_cq {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/* One registration per fd. gen is bumped every time the registration
+ * changes so completions for a poll that was already removed or replaced are
+ * recognized as stale and dropped. */
+typedef struct {
+    struct event *ev;
+    uint32_t gen;
+    bool armed;
+} uring_slot;
+
+typedef struct {
+    int fd;
+    struct uring_sq sq;
+    struct uring_cq cq;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned pending; /* SQEs queued but not yet submitted */
+    uring_slot *slots;
+    int nslots;
+} uring_t;
+
+/* Only worker threads running in io_uring mode have a ring; the main thread
+ * and side threads keep using libevent. */
+static __thread uring_t *thread_ring = NULL;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+        unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+/* Check that the kernel will let us create a ring at all. Called once from
+ * the main thread so we can fall back to libevent up front. */
+bool uring_probe(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(4, &p);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    /* NODROP keeps completions from being lost if the CQ ever overflows.
+     * FAST_POLL kernels have IORING_OP_RECV, and wait for a socket
+     * internally rather than failing a recv or send with EAGAIN. */
+    return (p.features & IORING_FEAT_NODROP) != 0 &&
+        (p.features & IORING_FEAT_FAST_POLL) != 0;
+}
+
+int uring_thread_init(void) {
+    struct io_uring_params p;
+    uring_t *r = calloc(1, sizeof(uring_t));
+    if (r == NULL)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        perror("io_uring_setup");
+        free(r);
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        perror("mmap io_uring sq");
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            perror("mmap io_uring cq");
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq.sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq.sqes == MAP_FAILED) {
+        perror("mmap io_uring sqes");
+        goto fail;
+    }
+
+    r->sq.head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq.tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq.ring_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq.ring_entries = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_entries);
+    r->sq.array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq.head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq.tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq.ring_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cq.cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    thread_ring = r;
+    return 0;
+fail:
+    /* process is going to exit; don't bother unmapping */
+    close(r->fd);
+    free(r);
+    return -1;
+}
+
+bool uring_thread_active(void) {
+    return thread_ring != NULL;
+}
+
+static int uring_submit(uring_t *r, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret = sys_io_uring_enter(r->fd, r->pending, min_complete, flags);
+    if (ret > 0) {
+        r->pending -= ret;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    unsigned tail = *r->sq.tail;
+    unsigned head = __atomic_load_n(r->sq.head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= *r->sq.ring_entries) {
+        /* SQ is full: push what we have to the kernel without waiting. */
+        if (uring_submit(r, 0) < 0 && errno != EBUSY && errno != EAGAIN) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq.head, __ATOMIC_ACQUIRE);
+        if (tail - head >= *r->sq.ring_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = tail & *r->sq.ring_mask;
+    struct io_uring_sqe *sqe = &r->sq.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq.array[idx] = idx;
+    return sqe;
+}
+
+static void uring_commit_sqe(uring_t *r) {
+    __atomic_store_n(r->sq.tail, *r->sq.tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+static uring_slot *uring_slot_get(uring_t *r, int fd) {
+    if (fd >= r->nslots) {
+        int n = r->nslots ? r->nslots : 1024;
+        while (n <= fd)
+            n *= 2;
+        uring_slot *s = realloc(r->slots, sizeof(uring_slot) * n);
+        if (s == NULL)
+            return NULL;
+        memset(s + r->nslots, 0, sizeof(uring_slot) * (n - r->nslots));
+        r->slots = s;
+        r->nslots = n;
+    }
+    return &r->slots[fd];
+}
+
+static inline uint64_t uring_slot_data(int fd, uring_slot *s) {
+    return ((uint64_t)(s->gen & URING_GEN_MASK) << 32) | (uint32_t)fd;
+}
+
+static int uring_arm(uring_t *r, int fd, uring_slot *s) {
+    short events = event_get_events(s->ev);
+    uint32_t mask = 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL)
+        return -1;
+
+    if (events & EV_READ)
+        mask |= POLLIN;
+    if (events & EV_WRITE)
+        mask |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = uring_slot_data(fd, s);
+    uring_commit_sqe(r);
+    s->armed = true;
+    return 0;
+}
+
+static int uring_disarm(uring_t *r, int fd, uring_slot *s) {
+    if (s->armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        if (sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_slot_data(fd, s);
+        sqe->user_data = URING_IGNORE;
+        uring_commit_sqe(r);
+        s->armed = false;
+    }
+    return 0;
+}
+
+/* Counterparts to event_add()/event_del() for an event already set up with
+ * event_set(). Timeouts are not supported; worker events don't use them. */
+int uring_event_add(struct event *ev) {
+    uring_t *r = thread_ring;
+    int fd = event_get_fd(ev);
+    uring_slot *s = uring_slot_get(r, fd);
+    if (s == NULL)
+        return -1;
+
+    if (uring_disarm(r, fd, s) != 0)
+        return -1;
+    s->ev = ev;
+    s->gen++;
+    return uring_arm(r, fd, s);
+}
+
+int uring_event_del(struct event *ev) {
+    uring_t *r = thread_ring;
+    int fd = event_get_fd(ev);
+    if (fd >= r->nslots)
+        return 0;
+    uring_slot *s = &r->slots[fd];
+    if (s->ev != ev)
+        return 0;
+
+    if (uring_disarm(r, fd, s) != 0)
+        return -1;
+    s->ev = NULL;
+    s->gen++;
+    return 0;
+}
+
+static inline uint64_t uring_conn_data(conn *c, int op) {
+    return URING_CONN_OP | (uint64_t)(uintptr_t)c | op;
+}
+
+/* The buffer has to stay put until the completion; the conn keeps track of
+ * that through c->uring_busy. */
+int uring_conn_recv(conn *c, void *buf, size_t len) {
+    uring_t *r = thread_ring;
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sfd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = uring_conn_data(c, URING_RECV);
+    uring_commit_sqe(r);
+    c->uring_busy |= URING_RECV;
+    return 0;
+}
+
+/* As above, for m and the iovecs it points to. */
+int uring_conn_sendmsg(conn *c, struct msghdr *m) {
+    uring_t *r = thread_ring;
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sfd;
+    sqe->addr = (uint64_t)(uintptr_t)m;
+    sqe->len = 1;
+    sqe->user_data = uring_conn_data(c, URING_SENDMSG);
+    uring_commit_sqe(r);
+    c->uring_busy |= URING_SENDMSG;
+    return 0;
+}
+
+/* Asks the kernel to give up on whatever c has out. The ops still complete,
+ * usually with -ECANCELED, so the caller waits for them as before. */
+void uring_conn_cancel(conn *c) {
+    uring_t *r = thread_ring;
+    int op;
+
+    for (op = URING_RECV; op <= URING_SENDMSG; op <<= 1) {
+        if (!(c->uring_busy & op))
+            continue;
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        if (sqe == NULL)
+            return; /* shutdown() in conn_close() ends them anyway */
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uring_conn_data(c, op);
+        sqe->user_data = URING_IGNORE;
+        uring_commit_sqe(r);
+    }
+}
+
+static void uring_conn_complete(uint64_t data, int res) {
+    conn *c = (conn *)(uintptr_t)(data & ~(URING_CONN_OP | 3));
+    int op = data & 3;
+
+    c->uring_busy &= ~op;
+    c->uring_done |= op;
+    if (op == URING_RECV) {
+        c->uring_recv_res = res;
+        conn_uring_done(c, EV_READ);
+    } else {
+        c->uring_send_res = res;
+        conn_uring_done(c, EV_WRITE);
+    }
+}
+
+static void uring_dispatch(uring_t *r, uint64_t data, int res) {
+    int fd = (int)(uint32_t)data;
+    uint32_t gen = (data >> 32) & URING_GEN_MASK;
+    if (data == URING_IGNORE)
+        return;
+    if (data & URING_CONN_OP) {
+        uring_conn_complete(data, res);
+        return;
+    }
+    if (fd >= r->nslots)
+        return;
+
+    uring_slot *s = &r->slots[fd];
+    if (s->ev == NULL || (s->gen & URING_GEN_MASK) != gen)
+        return;
+    s->armed = false;
+    gen = s->gen;
+
+    struct event *ev = s->ev;
+    short events = event_get_events(ev);
+    short which = 0;
+    if (res < 0) {
+        /* Let the handler find the error on its own read/write. */
+        which = events & (EV_READ | EV_WRITE);
+    } else {
+        if (res & (POLLIN | POLLERR | POLLHUP))
+            which |= EV_READ;
+        if (res & (POLLOUT | POLLERR | POLLHUP))
+            which |= EV_WRITE;
+        which &= events;
+    }
+
+    if (!(events & EV_PERSIST)) {
+        s->ev = NULL;
+        s->gen++;
+    }
+
+    event_callback_fn cb = event_get_callback(ev);
+    cb(fd, which, event_get_callback_arg(ev));
+
+    /* The handler may have changed or removed the registration; only re-arm
+     * a persistent event it left alone. slots may have been reallocated. */
+    s = &r->slots[fd];
+    if (s->ev == ev && s->gen == gen && !s->armed) {
+        if (uring_arm(r, fd, s) != 0) {
+            fprintf(stderr, "Failed to re-arm io_uring poll for fd %d\n", fd);
+        }
+    }
+}
+
+void uring_event_loop(void) {
+    uring_t *r = thread_ring;
+    assert(r != NULL);
+
+    while (1) {
+        if (uring_submit(r, 1) < 0) {
+            if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                perror("io_uring_enter");
+                abort();
+            }
+        }
+
+        unsigned head = *r->cq.head;
+        unsigned tail = __atomic_load_n(r->cq.tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            while (head != tail) {
+                struct io_uring_cqe *cqe = &r->cq.cqes[head & *r->cq.ring_mask];
+                uint64_t data = cqe->user_data;
+                int res = cqe->res;
+                head++;
+                __atomic_store_n(r->cq.head, head, __ATOMIC_RELEASE);
+                uring_dispatch(r, data, res);
+            }
+            tail = __atomic_load_n(r->cq.tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
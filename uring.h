@@ -0,0 +1,23 @@
+#ifndef URING_H
+#define URING_H
+
+/* Submission queue depth for each worker's ring. The completion queue is
+ * sized by the kernel at twice this. */
+#define URING_ENTRIES 1024
+
+bool uring_probe(void);
+int uring_thread_init(void);
+bool uring_thread_active(void);
+int uring_event_add(struct event *ev);
+int uring_event_del(struct event *ev);
+void uring_event_loop(void);
+
+/* conn->uring_busy/uring_done bits: a conn's own reads and sends */
+#define URING_RECV 1
+#define URING_SENDMSG 2
+
+int uring_conn_recv(conn *c, void *buf, size_t len);
+int uring_conn_sendmsg(conn *c, struct msghdr *m);
+void uring_conn_cancel(conn *c);
+
+#endif